@@ -0,0 +1,230 @@
+/*! \file bench/bench_backends.c
+ * \brief Client request throughput and server syscalls per request for each event loop backend.
+ *
+ * A forked client keeps WINDOW GET_MESSAGES requests in flight against a loopback UDP socket
+ * served with the msgserv handlers. Server syscalls are the ones made by the loop
+ * (select, epoll_wait, io_uring_enter) plus the recvmmsg and sendmmsg of the batch.
+ *
+ * Then a forked server streams PEER_MESSAGES messages in SMESSAGES frames over a socket pair,
+ * parsed with the msgserv server handlers and drained like the client thread does.
+ * Server syscalls are the ones made by the loop plus the recv of the handler (none on io_uring).
+ */
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../utils/struct_message.h"
+#include "../msgserv/event_loop.h"
+#include "../msgserv/message.h"
+#include "../msgserv/replication.h"
+
+#define REQUESTS 200000
+#define WINDOW   32
+#define PEER_MESSAGES 2000000
+
+static bool done = false;
+static matrix msg_matrix = NULL;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void udp_ready(int fd, uint32_t events, item obj, void *arg) {
+    (void)events; (void)obj;
+    handle_client_comms(fd, (udp_batch)arg, msg_matrix);
+}
+
+static void udp_datagrams_ready(int fd, struct ev_datagram *dgrams, int count, item obj, void *arg) {
+    (void)obj;
+    handle_client_datagrams(fd, (udp_batch)arg, dgrams, count, msg_matrix);
+}
+
+static void done_ready(int fd, uint32_t events, item obj, void *arg) {
+    (void)fd; (void)events; (void)obj; (void)arg;
+    done = true;
+}
+
+// run_client keeps WINDOW requests in flight until REQUESTS replies arrived, lost ones are resent
+static void run_client(struct sockaddr_in *server_addr, int done_fd) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct timeval tv = {.tv_sec = 0, .tv_usec = 100000};
+    char reply[RESPONSE_SIZE];
+    const char *request = "GET_MESSAGES 3";
+    int received = 0, in_flight = 0;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    connect(fd, (struct sockaddr *)server_addr, sizeof(*server_addr));
+    while (received < REQUESTS) {
+        while (in_flight < WINDOW && received + in_flight < REQUESTS) {
+            send(fd, request, strlen(request), 0);
+            in_flight++;
+        }
+        if (0 < recv(fd, reply, sizeof(reply), 0)) {
+            received++;
+            in_flight--;
+        } else {
+            in_flight = 0; //Timeout, the rest of the window was lost
+        }
+    }
+
+    if (1 != write(done_fd, "x", 1)) {
+        _exit(EXIT_FAILURE);
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+static void run_backend(int backend, const char *name) {
+    event_loop loop = create_event_loop(backend);
+    if (!loop) {
+        printf("%-8s unavailable\n", name);
+        return;
+    }
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = 0};
+    socklen_t addrlen = sizeof(addr);
+    int rcvbuf = 4 << 20;
+    int done_pipe[2];
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (0 > fd || 0 != bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || 0 != pipe(done_pipe)) {
+        fprintf(stderr, KRED "Unable to create the server socket\n" KNRM);
+        exit(EXIT_FAILURE);
+    }
+    getsockname(fd, (struct sockaddr *)&addr, &addrlen);
+
+    udp_batch batch = create_udp_batch();
+    if (0 != loop_add_datagrams(loop, fd, udp_datagrams_ready, NULL, batch)) {
+        loop_add_fd(loop, fd, EV_READ, udp_ready, NULL, batch);
+    }
+    loop_add_fd(loop, done_pipe[0], EV_READ, done_ready, NULL, NULL);
+
+    done = false;
+    fflush(stdout);
+    pid_t client = fork();
+    if (0 == client) {
+        run_client(&addr, done_pipe[1]);
+    }
+
+    uint64_t start = now_ns(), start_syscalls = get_loop_syscalls(loop);
+    while (!done && 0 <= loop_run_once(loop, -1)) {
+    }
+    double seconds = (double)(now_ns() - start) / 1e9;
+    uint64_t syscalls = get_loop_syscalls(loop) - start_syscalls + get_batch_syscalls(batch);
+    uint64_t requests = get_batch_datagrams(batch);
+    waitpid(client, NULL, 0);
+
+    printf("%-8s %12.0f %14.3f %10lu\n", name, requests / seconds,
+            requests ? (double)syscalls / requests : 0.0, (unsigned long)requests);
+
+    loop_del_fd(loop, fd);
+    loop_del_fd(loop, done_pipe[0]);
+    free_event_loop(loop);
+    free_udp_batch(batch);
+    close(fd);
+    close(done_pipe[0]);
+    close(done_pipe[1]);
+}
+
+// run_peer sends PEER_MESSAGES messages in frames like the replication thread, then waits for the reader to close
+static void run_peer(int fd) {
+    char *frame = (char *)malloc(FRAME_SIZE);
+    int sent = 0;
+
+    while (frame && sent < PEER_MESSAGES) {
+        size_t len = snprintf(frame, FRAME_SIZE, "%s\n", SMESSAGE_CODE);
+        while (sent < PEER_MESSAGES && len + WIRE_RECORD_SIZE <= FRAME_SIZE) {
+            len += snprintf(frame + len, FRAME_SIZE - len, "%d;peer message %d\n", sent + 1, sent);
+            sent++;
+        }
+        for (size_t done = 0; done < len; ) {
+            ssize_t n = write(fd, frame + done, len - done);
+            if (0 >= n) {
+                _exit(EXIT_FAILURE);
+            }
+            done += n;
+        }
+    }
+    while (0 < read(fd, frame, 1)) {
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+static void run_peer_stream(int backend, const char *name) {
+    event_loop loop = create_event_loop(backend);
+    int fds[2];
+    if (!loop) {
+        printf("%-8s unavailable\n", name);
+        return;
+    }
+    if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+        fprintf(stderr, KRED "Unable to create the server socket pair\n" KNRM);
+        exit(EXIT_FAILURE);
+    }
+
+    struct server_state state = {.loop = loop, .ingest_fd = -1,
+        .ingest_queue = create_spsc_queue(REPLICATION_QUEUE_SIZE, sizeof(struct replicated_message))};
+    struct replicated_message record;
+    server peer = new_server("Bench", "127.0.0.1", 0, 0);
+    uint64_t received = 0;
+
+    ilist_init(&state.connected);
+    ilist_push_back(&state.connected, get_server_link(peer));
+    set_fd(peer, fds[0]);
+    watch_server(&state, peer);
+
+    fflush(stdout);
+    pid_t sender = fork();
+    if (0 == sender) {
+        close(fds[0]);
+        run_peer(fds[1]);
+    }
+    close(fds[1]);
+
+    uint64_t start = now_ns(), start_syscalls = get_loop_syscalls(loop);
+    while (received < PEER_MESSAGES && 0 <= loop_run_once(loop, 1000)) {
+        while (spsc_pop(state.ingest_queue, &record)) { //As the client thread, then wake the stalled server
+            received++;
+        }
+        if (state.ingest_paused) {
+            resume_ingest(&state);
+        }
+    }
+    double seconds = (double)(now_ns() - start) / 1e9;
+    uint64_t syscalls = get_loop_syscalls(loop) - start_syscalls + (EV_BACKEND_URING == backend ? 0 : state.peer_reads);
+    double mib = (double)state.peer_bytes / (1024 * 1024);
+
+    printf("%-8s %12.0f %14.1f %10.1f\n", name, received / seconds, mib ? syscalls / mib : 0.0, mib / seconds);
+
+    loop_del_fd(loop, fds[0]);
+    shutdown(fds[0], SHUT_RDWR); //The sender sees it and exits, its copy of the ring still holds the socket
+    close_communication(peer);
+    waitpid(sender, NULL, 0);
+    free_server(peer);
+    free_spsc_queue(state.ingest_queue);
+    free_event_loop(loop);
+}
+
+int main() {
+    msg_matrix = create_matrix(200);
+    for (int i = 0; i < 200; i++) {
+        char content[STRING_SIZE];
+        snprintf(content, STRING_SIZE, "benchmark message %d", i);
+        store_message(msg_matrix, content);
+    }
+
+    printf("%-8s %12s %14s %10s\n", "backend", "requests/s", "syscalls/req", "requests");
+    run_backend(EV_BACKEND_SELECT, "select");
+    run_backend(EV_BACKEND_EPOLL, "epoll");
+    run_backend(EV_BACKEND_URING, "uring");
+
+    printf("\n%-8s %12s %14s %10s\n", "backend", "peer msgs/s", "syscalls/MiB", "MiB/s");
+    run_peer_stream(EV_BACKEND_SELECT, "select");
+    run_peer_stream(EV_BACKEND_EPOLL, "epoll");
+    run_peer_stream(EV_BACKEND_URING, "uring");
+
+    free_matrix(msg_matrix);
+    return EXIT_SUCCESS;
+}
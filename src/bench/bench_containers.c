@@ -0,0 +1,159 @@
+/*! \file bench/bench_containers.c
+ * \brief Server containers: the node list msgserv used, the registry and the intrusive list.
+ *
+ * The node list is the former util_list: one malloc'd node per server holding an untyped
+ * item, walked with for_each_element and a callback. For 10 to 1000 servers, prints the
+ * heap bytes and mallocs each container takes per server, and the nanoseconds per server
+ * of adding them all and of one pass over them.
+ */
+#include <time.h>
+#include <malloc.h>
+#include "../utils/struct_server.h"
+
+#define PASSES_ELEMENTS 20000000 //Servers visited per size, split in passes
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t heap_used() {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd; //Big blocks are mmap'd
+}
+
+/* Node list, as util_list did it */
+struct node_list_node {
+    item                  obj;
+    struct node_list_node *next;
+};
+
+struct node_list {
+    struct node_list_node *head;
+    size_t                size;
+};
+
+static uint64_t node_mallocs = 0;
+
+static void node_list_push(struct node_list *this, item obj) {
+    struct node_list_node *new_node = (struct node_list_node *)malloc(sizeof(struct node_list_node));
+    if (!new_node) {
+        memory_error("Unable to reserve node memory");
+    }
+    node_mallocs++;
+    new_node->obj = obj;
+    new_node->next = this->head;
+    this->head = new_node;
+    this->size++;
+}
+
+static void __attribute__((noinline)) for_each_element(struct node_list *this,
+        void (*action)(item obj, void *cnt_array[]), void *cnt_array[]) {
+    for (struct node_list_node *aux_node = this->head; aux_node != NULL; aux_node = aux_node->next) {
+        action(aux_node->obj, cnt_array);
+    }
+}
+
+static void node_list_free(struct node_list *this) {
+    while (this->head) {
+        struct node_list_node *next = this->head->next;
+        free(this->head);
+        this->head = next;
+    }
+}
+
+static void add_fd(item obj, void *cnt_array[]) {
+    *(uint64_t *)cnt_array[0] += get_fd((server)obj);
+}
+
+/* Runs */
+static void run_size(size_t n) {
+    server *servers = (server *)malloc(n * sizeof(server));
+    char ip[STRING_SIZE];
+    size_t passes = PASSES_ELEMENTS / n;
+    uint64_t sum = 0, start;
+
+    for (size_t i = 0; i < n; i++) {
+        snprintf(ip, STRING_SIZE, "10.%zu.%zu.%zu", i >> 16 & 255, i >> 8 & 255, i & 255);
+        servers[i] = new_server("bench", ip, 5000, 6000);
+        set_fd(servers[i], (int)(i % 1000) + 1000); //Not open, set back to -1 before free_server
+    }
+
+    //Node list
+    struct node_list nodes = {NULL, 0};
+    size_t heap = heap_used();
+    node_mallocs = 0;
+    start = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        node_list_push(&nodes, servers[i]);
+    }
+    double node_add = (double)(now_ns() - start) / n;
+    double node_bytes = (double)(heap_used() - heap) / n;
+    start = now_ns();
+    for (size_t pass = 0; pass < passes; pass++) {
+        for_each_element(&nodes, add_fd, (void *[]){&sum});
+    }
+    double node_walk = (double)(now_ns() - start) / (passes * n);
+
+    //Registry
+    heap = heap_used();
+    registry peers = create_registry();
+    start = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        add_to_registry(peers, get_server_key(servers[i]), servers[i], -1);
+    }
+    double registry_add = (double)(now_ns() - start) / n;
+    double registry_bytes = (double)(heap_used() - heap) / n;
+    start = now_ns();
+    for (size_t pass = 0; pass < passes; pass++) {
+        for (size_t entry = 0; entry < get_registry_size(peers); entry++) {
+            sum += get_fd((server)get_registry_item(peers, entry));
+        }
+    }
+    double registry_walk = (double)(now_ns() - start) / (passes * n);
+
+    //Intrusive list
+    struct ilink connected;
+    server cur_server;
+    heap = heap_used();
+    start = now_ns();
+    ilist_init(&connected);
+    for (size_t i = 0; i < n; i++) {
+        ilist_push_back(&connected, get_server_link(servers[i]));
+    }
+    double intrusive_add = (double)(now_ns() - start) / n;
+    double intrusive_bytes = (double)(heap_used() - heap) / n;
+    start = now_ns();
+    for (size_t pass = 0; pass < passes; pass++) {
+        for_each_server(cur_server, &connected) {
+            sum += get_fd(cur_server);
+        }
+    }
+    double intrusive_walk = (double)(now_ns() - start) / (passes * n);
+
+    printf("%-8zu %-10s %8.1f %8.2f %8.1f %8.2f\n", n, "node list", node_bytes, (double)node_mallocs / n, node_add, node_walk);
+    printf("%-8s %-10s %8.1f %8s %8.1f %8.2f\n", "", "registry", registry_bytes, "amort.", registry_add, registry_walk);
+    printf("%-8s %-10s %8.1f %8.2f %8.1f %8.2f\n", "", "intrusive", intrusive_bytes, 0.0, intrusive_add, intrusive_walk);
+    if (0 == sum) {
+        printf("\n"); //Keeps the passes
+    }
+
+    node_list_free(&nodes);
+    free_registry(peers, NULL);
+    for (size_t i = 0; i < n; i++) {
+        set_fd(servers[i], -1);
+        free_server(servers[i]);
+    }
+    free(servers);
+}
+
+int main() {
+    size_t sizes[] = {10, 100, 1000};
+
+    printf("%-8s %-10s %8s %8s %8s %8s\n", "servers", "container", "heap B", "mallocs", "add ns", "walk ns");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        run_size(sizes[s]);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,141 @@
+/*! \file bench/bench_event_loop.c
+ * \brief Compares the legacy select loop with the event loop backends at 10, 100 and 1000 peers.
+ *
+ * Every peer is a loopback UDP socket. Each iteration one random peer receives a datagram
+ * and the loop must find and serve it. The legacy loop rebuilds the fd_set from the
+ * server list and walks every peer, as msgserv did before the event loop.
+ */
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "../utils/struct_server.h"
+#include "../msgserv/event_loop.h"
+
+#define ITERATIONS 20000
+
+static int sender_fd = -1;
+static uint64_t served = 0;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void drain(int fd) {
+    char buffer[64];
+    while (0 < recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT)) {
+        served++;
+    }
+}
+
+static void peer_ready(int fd, uint32_t events, item obj, void *arg) {
+    (void)events; (void)obj; (void)arg;
+    drain(fd);
+}
+
+static void create_peers(struct ilink *peers, int n, struct sockaddr_in *addresses) {
+    ilist_init(peers);
+    for (int i = 0; i < n; i++) {
+        int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = 0};
+        socklen_t addrlen = sizeof(addr);
+
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (0 > fd || 0 != bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+            fprintf(stderr, KRED "Unable to create peer %d\n" KNRM, i);
+            exit(EXIT_FAILURE);
+        }
+        getsockname(fd, (struct sockaddr *)&addresses[i], &addrlen);
+
+        server peer = new_server("Bench", "127.0.0.1", 0, 0);
+        set_fd(peer, fd);
+        ilist_push_back(peers, get_server_link(peer));
+    }
+}
+
+static void poke(struct sockaddr_in *addresses, int n) {
+    struct sockaddr_in *to = &addresses[rand() % n];
+    sendto(sender_fd, "x", 1, 0, (struct sockaddr *)to, sizeof(*to));
+}
+
+static double run_legacy(struct ilink *peers, struct sockaddr_in *addresses, int n) {
+    fd_set rfds;
+    server peer;
+    uint64_t start = now_ns();
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        poke(addresses, n);
+
+        int max_fd = -1;
+        FD_ZERO(&rfds);
+        for_each_server(peer, peers) {
+            int fd = get_fd(peer);
+            FD_SET(fd, &rfds);
+            max_fd = fd > max_fd ? fd : max_fd;
+        }
+        select(max_fd + 1, &rfds, NULL, NULL, NULL);
+        for_each_server(peer, peers) { //Every peer, ready or not
+            if (FD_ISSET(get_fd(peer), &rfds)) {
+                drain(get_fd(peer));
+            }
+        }
+    }
+
+    return (double)(now_ns() - start) / ITERATIONS;
+}
+
+static double run_loop(int backend, struct ilink *peers, struct sockaddr_in *addresses, int n) {
+    event_loop loop = create_event_loop(backend);
+    server peer;
+    if (!loop) {
+        return -1;
+    }
+    for_each_server(peer, peers) {
+        if (0 != loop_add_fd(loop, get_fd(peer), EV_READ, peer_ready, (item)peer, NULL)) {
+            free_event_loop(loop);
+            return -1;
+        }
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        poke(addresses, n);
+        loop_run_once(loop, -1);
+    }
+    double result = (double)(now_ns() - start) / ITERATIONS;
+
+    free_event_loop(loop);
+    return result;
+}
+
+int main() {
+    int sizes[] = {10, 100, 1000};
+
+    srand(42);
+    sender_fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    printf("%-8s %16s %16s %16s\n", "peers", "legacy ns/ev", "select ns/ev", "epoll ns/ev");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+        struct sockaddr_in *addresses = (struct sockaddr_in *)calloc(n, sizeof(struct sockaddr_in));
+        struct ilink peers, *link;
+        create_peers(&peers, n, addresses);
+
+        double legacy = run_legacy(&peers, addresses, n);
+        double selected = run_loop(EV_BACKEND_SELECT, &peers, addresses, n);
+        double epolled = run_loop(EV_BACKEND_EPOLL, &peers, addresses, n);
+
+        printf("%-8d %16.0f %16.0f %16.0f\n", n, legacy, selected, epolled);
+
+        while (NULL != (link = ilist_pop_front(&peers))) {
+            free_server(server_of_link(link));
+        }
+        free(addresses);
+    }
+    printf("served %lu datagrams\n", (unsigned long)served);
+
+    close_fd(sender_fd);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,101 @@
+/*! \file bench/bench_large.c
+ * \brief Boards of 1M, 10M and 50M messages, with and without huge pages, see util_slab.h.
+ *
+ * Every size is filled once with chat length messages, then prints the nanoseconds per
+ * store, per find_first_after of a random clock (a binary search over the whole board)
+ * and per read of the last 100 messages, with the resident and transparent huge page
+ * megabytes. A size whose pages do not fit in the available memory is skipped.
+ */
+#include <time.h>
+#include <string.h>
+#include "../utils/struct_message.h"
+#include "../utils/util_slab.h"
+
+#define LOOKUPS 2000000
+#define READS 200000
+#define TOUCHED_PER_MESSAGE 260 //Chat records of every form, start slots and dedup slots, rounded up
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// read_kib returns the value of the field in a /proc file of "Name: value kB" lines, 0 if missing
+static size_t read_kib(const char *path, const char *field) {
+    FILE *file = fopen(path, "r");
+    char line[256];
+    size_t kib = 0;
+
+    while (file && fgets(line, sizeof(line), file)) {
+        if (0 == strncmp(line, field, strlen(field))) {
+            sscanf(line + strlen(field), "%zu", &kib);
+            break;
+        }
+    }
+    if (file) {
+        fclose(file);
+    }
+    return kib;
+}
+
+static void run_size(size_t n, bool huge) {
+    size_t available = read_kib("/proc/meminfo", "MemAvailable:") * 1024;
+    if (n * TOUCHED_PER_MESSAGE > available) {
+        printf("%5zuM %-6s skipped, needs about %.1f GiB and %.1f GiB are available\n", n / 1000000,
+                huge ? "huge" : "4 KiB", (double)n * TOUCHED_PER_MESSAGE / (1 << 30), (double)available / (1 << 30));
+        return;
+    }
+
+    set_slab_huge(huge);
+    g_lc = 0;
+    matrix msg_matrix = create_matrix(n);
+    char content[STRING_SIZE];
+    uint64_t sum = 0;
+
+    srand(1);
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        size_t len = 5 + rand() % 20 + (0 == rand() % 8 ? rand() % 100 : 0);
+        for (size_t c = 0; c < len; c++) {
+            content[c] = (char)('a' + (i + c) % 26);
+        }
+        content[len] = '\0';
+        store_message(msg_matrix, content);
+    }
+    double store_ns = (double)(now_ns() - start) / n;
+
+    start = now_ns();
+    for (size_t i = 0; i < LOOKUPS; i++) {
+        sum += find_first_after(msg_matrix, ((uint64_t)rand() << 31 ^ rand()) % n);
+    }
+    double find_ns = (double)(now_ns() - start) / LOOKUPS;
+
+    start = now_ns();
+    for (size_t i = 0; i < READS; i++) {
+        char *messages = get_first_n_messages(msg_matrix, 100, MSG_WO_LC, NULL);
+        sum += messages[0];
+        free(messages);
+    }
+    double read_ns = (double)(now_ns() - start) / READS;
+
+    printf("%5zuM %-6s %10.1f %10.1f %10.1f %10zu %10zu\n", n / 1000000, huge ? "huge" : "4 KiB", store_ns,
+            find_ns, read_ns, read_kib("/proc/self/status", "VmRSS:") / 1024,
+            read_kib("/proc/self/smaps_rollup", "AnonHugePages:") / 1024);
+    if (0 == sum) {
+        printf("\n"); //Keeps the lookups
+    }
+    free_matrix(msg_matrix);
+}
+
+int main() {
+    size_t sizes[] = {1000000, 10000000, 50000000};
+
+    printf("%-6s %-6s %10s %10s %10s %10s %10s\n", "size", "pages", "store ns", "find ns", "last100 ns", "RSS MiB",
+            "THP MiB");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        run_size(sizes[s], false);
+        run_size(sizes[s], true);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,113 @@
+/*! \file bench/bench_lz.c
+ * \brief Compression ratio and speed of the snapshot compression, see util_lz.h.
+ *
+ * Each corpus is a BINARY_MESSAGES snapshot of SNAPSHOT_MESSAGES messages, compressed in
+ * COMPRESS_BLOCK blocks like handle_sget_messages does, then decompressed ROUNDS times.
+ */
+#include <time.h>
+#include <string.h>
+#include "../utils/util_lz.h"
+#include "../utils/util_binary.h"
+
+#define SNAPSHOT_MESSAGES 100000
+#define ROUNDS 10
+
+static const char *words[] = {"the", "server", "is", "down", "again", "can", "someone", "check", "link", "to",
+    "site", "b", "join", "took", "too", "long", "yes", "no", "thanks", "meeting", "at", "noon", "lunch",
+    "deploy", "done", "please", "review", "my", "patch", "ok", "see", "you", "tomorrow", "board", "message"};
+
+static const char *lorem[] = {"Lorem ipsum dolor sit amet, consectetur adipiscing elit",
+    "Duo Reges: constructio interrete.",
+    "Atqui pugnantibus et contrariis studiis consiliisque semper utens nihil quieti videre, nihil tranquilli potest.",
+    "Estne, quaeso, inquam, sitienti in bibendo voluptas? Facit igitur Lucius noster prudenter"};
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// make_content fills one message of the corpus, returns its length
+static size_t make_content(int corpus, int i, char *content) {
+    size_t len = 0;
+
+    switch (corpus) {
+        case 0: //Chat, short sentences from a small vocabulary
+            len = snprintf(content, STRING_SIZE, "%s", words[rand() % (sizeof(words) / sizeof(words[0]))]);
+            for (int n = rand() % 12; 0 < n; n--) {
+                len += snprintf(content + len, STRING_SIZE - len, " %s", words[rand() % (sizeof(words) / sizeof(words[0]))]);
+            }
+            return len;
+        case 1: //Long sentences, numbered
+            return snprintf(content, STRING_SIZE, "%d %s", i, lorem[rand() % (sizeof(lorem) / sizeof(lorem[0]))]);
+        default: //Random printable bytes, the worst case
+            len = 20 + rand() % (STRING_SIZE - 21);
+            for (size_t n = 0; n < len; n++) {
+                content[n] = (char)(' ' + rand() % 95);
+            }
+            return len;
+    }
+}
+
+static void run_corpus(int corpus, const char *name) {
+    size_t blocks = SNAPSHOT_MESSAGES * BINARY_RECORD_MAX / COMPRESS_BLOCK + 1;
+    char *raw = (char *)malloc(SNAPSHOT_MESSAGES * BINARY_RECORD_MAX);
+    char *compressed = (char *)malloc(blocks * lz_bound(COMPRESS_BLOCK));
+    size_t *block_len = (size_t *)malloc(blocks * sizeof(size_t));
+    char *inflated = (char *)malloc(COMPRESS_BLOCK);
+    size_t raw_len = 0, compressed_len = 0, nblocks = 0;
+
+    if (!raw || !compressed || !block_len || !inflated) {
+        memory_error("Unable to reserve benchmark memory");
+    }
+    srand(corpus + 1);
+    for (int i = 0; i < SNAPSHOT_MESSAGES; i++) {
+        char content[STRING_SIZE];
+        size_t len = make_content(corpus, i, content);
+        raw_len += put_binary_record(raw + raw_len, 1000000 + i, content, len);
+    }
+
+    uint64_t start = now_ns();
+    for (size_t done = 0; done < raw_len; done += COMPRESS_BLOCK, nblocks++) {
+        size_t block = raw_len - done < COMPRESS_BLOCK ? raw_len - done : COMPRESS_BLOCK;
+        block_len[nblocks] = lz_compress(raw + done, block, compressed + compressed_len, lz_bound(COMPRESS_BLOCK));
+        compressed_len += block_len[nblocks];
+    }
+    double compress_s = (double)(now_ns() - start) / 1e9;
+
+    size_t checked = 0;
+    start = now_ns();
+    for (int round = 0; round < ROUNDS; round++) {
+        size_t offset = 0;
+        checked = 0;
+        for (size_t b = 0; b < nblocks; b++) {
+            checked += lz_decompress(compressed + offset, block_len[b], inflated, COMPRESS_BLOCK);
+            offset += block_len[b];
+        }
+    }
+    double decompress_s = (double)(now_ns() - start) / 1e9 / ROUNDS;
+
+    //Out of the timing, every block must give back the bytes it was made from
+    bool same = checked == raw_len;
+    for (size_t b = 0, offset = 0, done = 0; b < nblocks && same; offset += block_len[b], done += COMPRESS_BLOCK, b++) {
+        size_t block = raw_len - done < COMPRESS_BLOCK ? raw_len - done : COMPRESS_BLOCK;
+        same = block == lz_decompress(compressed + offset, block_len[b], inflated, COMPRESS_BLOCK)
+            && 0 == memcmp(inflated, raw + done, block);
+    }
+
+    printf("%-8s %10zu %10zu %8.2f %12.0f %12.0f %s\n", name, raw_len, compressed_len, (double)raw_len / compressed_len,
+            raw_len / compress_s / 1e6, raw_len / decompress_s / 1e6, same ? "" : KRED "mismatch" KNRM);
+
+    free(raw);
+    free(compressed);
+    free(block_len);
+    free(inflated);
+}
+
+int main() {
+    printf("%-8s %10s %10s %8s %12s %12s\n", "corpus", "raw", "compressed", "ratio", "comp MB/s", "decomp MB/s");
+    run_corpus(0, "chat");
+    run_corpus(1, "lorem");
+    run_corpus(2, "random");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,69 @@
+/*! \file bench/bench_memory.c
+ * \brief Memory per stored message for a few message length distributions, see util_matrix.h.
+ *
+ * The matrix is filled twice over, so every ring has wrapped, then the bytes the stored messages
+ * take are divided by how many are kept, and the bytes reserved by the capacity. The rings are
+ * sized by bytes, so messages longer than MATRIX_AVERAGE_CONTENT are kept fewer than the capacity.
+ */
+#include <time.h>
+#include "../utils/struct_message.h"
+
+#define CAPACITY 100000
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// make_length returns a message length of the distribution
+static size_t make_length(int distribution) {
+    switch (distribution) {
+        case 0: //Chat, mostly short
+            return 5 + rand() % 20 + (0 == rand() % 8 ? rand() % 100 : 0);
+        case 1: //Anything up to the longest message
+            return 1 + rand() % (STRING_SIZE - 1);
+        default: //Every message as long as possible
+            return STRING_SIZE - 1;
+    }
+}
+
+static void run_distribution(int distribution, const char *name) {
+    matrix msg_matrix = create_matrix(CAPACITY);
+    char content[STRING_SIZE];
+    size_t total_len = 0, kept;
+
+    srand(distribution + 1);
+    uint64_t start = now_ns();
+    for (int i = 0; i < 2 * CAPACITY; i++) {
+        size_t len = make_length(distribution);
+        for (size_t n = 0; n < len; n++) {
+            content[n] = (char)('a' + (i + n) % 26);
+        }
+        content[len] = '\0';
+        store_message(msg_matrix, content);
+    }
+    double store_ns = (double)(now_ns() - start) / (2 * CAPACITY);
+
+    kept = get_size(msg_matrix) - get_first(msg_matrix);
+    for (uint64_t i = get_first(msg_matrix); i < get_size(msg_matrix); i++) {
+        total_len += strlen(get_string((message)get_element(msg_matrix, i)));
+    }
+    size_t used = get_wire_used(get_wire(msg_matrix, MSG_RECORD), kept), replies = 0;
+    for (int form = 0; form < WIRE_FORMS; form++) {
+        replies += form == MSG_RECORD ? 0 : get_wire_used(get_wire(msg_matrix, form), kept);
+    }
+    printf("%-8s %8zu %10.1f %12.1f %12.1f %12.1f %10.1f\n", name, kept, (double)total_len / kept,
+            (double)used / kept, (double)replies / kept,
+            (double)get_matrix_memory(msg_matrix) / CAPACITY, store_ns);
+
+    free_matrix(msg_matrix);
+}
+
+int main() {
+    printf("%-8s %8s %10s %12s %12s %12s %10s\n", "lengths", "kept", "content", "record B", "replies B", "reserved B", "store ns");
+    run_distribution(0, "chat");
+    run_distribution(1, "uniform");
+    run_distribution(2, "longest");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,73 @@
+/*! \file bench/bench_parse.c
+ * \brief Cost per replicated message of parsing a server stream, text and binary protocol.
+ *
+ * The same block of messages is copied into the receive buffer of a server and parsed
+ * with parse_stream, then the ingest ring is drained, as the client thread would.
+ */
+#include <time.h>
+#include "../utils/struct_message.h"
+#include "../msgserv/message.h"
+
+#define MESSAGES 400 //Per block, a block fits in one RX_BUFFER_SIZE read
+#define ROUNDS   5000
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// run_parser parses block ROUNDS times and returns the nanoseconds per message
+static double run_parser(const char *block, size_t len, uint_fast8_t stream_state) {
+    struct server_state state = {.ingest_queue = create_spsc_queue(MESSAGES, sizeof(struct replicated_message)),
+        .ingest_fd = -1};
+    server peer = new_server("Bench", "127.0.0.1", 0, 0);
+    struct stream_parser *parser = get_parser(peer);
+    struct replicated_message record;
+    uint64_t parsed = 0;
+
+    uint64_t start = now_ns();
+    for (int round = 0; round < ROUNDS; round++) {
+        parser->state = stream_state;
+        memcpy(parser->buffer, block, len);
+        parser->len = len;
+        parsed += parse_stream(&state, peer);
+        while (spsc_pop(state.ingest_queue, &record)) {
+        }
+    }
+    double ns = (double)(now_ns() - start) / parsed;
+
+    free_server(peer);
+    free_spsc_queue(state.ingest_queue);
+    return ns;
+}
+
+int main() {
+    char *text = (char *)malloc(MESSAGES * WIRE_RECORD_SIZE + STRING_SIZE);
+    char *binary = (char *)malloc(BINARY_HEADER_MAX + MESSAGES * BINARY_RECORD_MAX);
+    size_t text_len = snprintf(text, STRING_SIZE, "%s\n", SMESSAGE_CODE), binary_len = 0;
+    char *records = binary + BINARY_HEADER_MAX;
+
+    if (!text || !binary) {
+        memory_error("Unable to reserve benchmark memory");
+    }
+    for (int i = 0; i < MESSAGES; i++) {
+        char content[STRING_SIZE];
+        int len = snprintf(content, STRING_SIZE, "benchmark message %d, replicated between servers", i);
+        uint_fast32_t lc = 1000000 + i; //Clocks past five digits
+
+        text_len += snprintf(text + text_len, WIRE_RECORD_SIZE, "%lu;%s\n", (unsigned long)lc, content);
+        binary_len += put_binary_record(records + binary_len, lc, content, len);
+    }
+    text[text_len++] = '\n';
+    size_t header_len = put_binary_header(records, BINARY_MESSAGES, MESSAGES);
+
+    printf("%-8s %12s %12s\n", "protocol", "ns/message", "bytes/block");
+    printf("%-8s %12.1f %12zu\n", "text", run_parser(text, text_len, STREAM_COMMAND), text_len);
+    printf("%-8s %12.1f %12zu\n", "binary", run_parser(records - header_len, header_len + binary_len, STREAM_BINARY),
+            header_len + binary_len);
+
+    free(text);
+    free(binary);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,86 @@
+/*! \file bench/bench_wal.c
+ * \brief PUBLISH throughput with no log, a sync per message and group commit, see util_wal.h.
+ *
+ * Every mode publishes chat length messages through handle_publish for about a second,
+ * calling commit_wal after every group of messages: one for a sync per message, UDP_BATCH
+ * for a recvmmsg batch and UDP_BATCH * UDP_BATCH_ROUNDS for a whole loop iteration.
+ * Prints the messages per second, the nanoseconds per publish and the syncs. The log is
+ * made in a new directory under the one given as argument, the current one by default,
+ * so the syncs go to the disk measured and not to a tmpfs.
+ */
+#include <time.h>
+#include <string.h>
+#include <limits.h>
+#include <inttypes.h>
+#include "../msgserv/message.h"
+
+#define RUN_NS 1000000000ull //Each mode publishes for about this long
+#define CAPACITY 100000
+#define WAL_NAME_LEN 20 //Segment names, as util_wal.c makes them
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// remove_log deletes the segments left in the directory and the directory
+static void remove_log(const char *dir) {
+    char path[PATH_MAX + 1 + WAL_NAME_LEN + 1];
+    for (uint64_t seq = 0; seq < 1024; seq++) {
+        snprintf(path, sizeof(path), "%s/%016" PRIx64 ".wal", dir, seq);
+        unlink(path);
+    }
+    rmdir(dir);
+}
+
+static void run_mode(const char *name, const char *base, size_t group) {
+    char dir[PATH_MAX], content[STRING_SIZE];
+    uint64_t published = 0, syncs = 0;
+
+    snprintf(dir, sizeof(dir), "%s/bench_wal_XXXXXX", base);
+    if (group && !mkdtemp(dir)) {
+        fprintf(stderr, KRED "Unable to make a directory in %s\n" KNRM, base);
+        return;
+    }
+    g_lc = 0;
+    matrix msg_matrix = create_matrix(CAPACITY);
+    wal log = group ? create_wal(dir, WAL_SEGMENT_SIZE, CAPACITY, 0) : NULL;
+
+    srand(1);
+    uint64_t start = now_ns(), elapsed;
+    do {
+        for (size_t i = 0; i < (group ? group : UDP_BATCH); i++, published++) {
+            size_t len = 5 + rand() % 20 + (0 == rand() % 8 ? rand() % 100 : 0);
+            for (size_t c = 0; c < len; c++) {
+                content[c] = (char)('a' + (published + c) % 26);
+            }
+            content[len] = '\0';
+            handle_publish(msg_matrix, log, content);
+        }
+        if (log) {
+            commit_wal(log);
+            syncs++;
+        }
+        elapsed = now_ns() - start;
+    } while (elapsed < RUN_NS);
+
+    printf("%-22s %12.0f %10.1f %10lu %10lu\n", name, published * 1e9 / elapsed, (double)elapsed / published,
+            (unsigned long)published, (unsigned long)syncs);
+    free_wal(log);
+    free_matrix(msg_matrix);
+    if (group) {
+        remove_log(dir);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *base = 1 < argc ? argv[1] : ".";
+
+    printf("%-22s %12s %10s %10s %10s\n", "durability", "messages/s", "ns each", "messages", "syncs");
+    run_mode("none", base, 0);
+    run_mode("sync per message", base, 1);
+    run_mode("group of a batch", base, UDP_BATCH);
+    run_mode("group of an iteration", base, UDP_BATCH * UDP_BATCH_ROUNDS);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,773 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "event_loop.h"
+#include "uring.h"
+
+#define URING_ENTRIES  256
+#define DGRAM_BUFFERS  256 //Provided buffers for datagram receive, power of two
+#define DGRAM_BGID     0
+#define STREAM_BUFFERS 64 //Provided buffers for the server streams, power of two
+#define STREAM_BUFFER_SIZE (16 * 1024)
+#define STREAM_BGID    1
+#define STREAM_NONE    0xffff //End of a list of held chunks
+
+// Request armed for a watched fd (io_uring backend)
+enum uring_kind {
+    URING_NONE = 0,
+    URING_POLL,    //One shot poll, re-armed after the handler runs
+    URING_ACCEPT,  //Multishot accept
+    URING_RECVMSG, //Multishot recvmsg into provided buffers
+    URING_STREAM,  //Multishot recv into provided buffers while EV_READ, one shot poll while EV_WRITE
+    URING_RECV,    //Request of a stream: the multishot recv
+    URING_RESUME,  //Request of a stream: nop, its held bytes are handed to the handler on completion
+};
+
+struct _watch {
+    fd_handler       handler;
+    datagram_handler on_datagrams;
+    stream_handler   on_bytes;
+    item             obj;
+    void             *arg;
+    uint32_t         events;
+    uint32_t         gen;   //io_uring: bumped on every change, stale completions are ignored
+    uint8_t          kind;  //io_uring: one of uring_kind
+    //io_uring streams: bytes received but not taken by the handler yet, in order
+    uint32_t         reg_gen;   //gen when registered, the recv completions since then are of this stream
+    uint16_t         held_head; //Buffer ids, linked by stream_next, STREAM_NONE if empty
+    uint16_t         held_tail;
+    uint32_t         held_off;  //Bytes of the head already taken
+    bool             eof;       //Closed or failed, told after the held bytes
+    bool             starved;   //The recv ran out of buffers, armed again once some are given back
+};
+
+struct _event_loop {
+    int           backend;
+    int           epoll_fd;
+    struct _watch *table;   //Dispatch table indexed by fd
+    int           table_size;
+    int           max_fd;   //Highest registered fd (select backend)
+    fd_set        rfds;     //Persistent sets (select backend)
+    fd_set        wfds;
+    uint64_t      syscalls; //epoll and select calls, io_uring_enter is counted by the ring
+    //io_uring backend
+    struct uring  ring;
+    struct io_uring_buf_ring *buf_ring;
+    char          *buf_mem;
+    struct msghdr dgram_msg;   //Layout of every received datagram, read by the kernel on arm
+    struct ev_datagram pending[DGRAM_BUFFERS];
+    uint16_t      pending_bid[DGRAM_BUFFERS];
+    int           pending_count;
+    int           pending_fd;
+    struct io_uring_buf_ring *stream_ring;
+    char          *stream_mem;
+    uint16_t      stream_next[STREAM_BUFFERS];
+    uint32_t      stream_len[STREAM_BUFFERS];
+    unsigned      stream_held; //Buffers held for a handler, the kernel has the others
+    bool          starved;     //Some stream waits for buffers
+};
+
+static inline bool is_watched(struct _watch *w) {
+    return w->handler || w->on_datagrams;
+}
+
+static int grow_table(event_loop this, int fd) {
+    if (fd < this->table_size) {
+        return 0;
+    }
+
+    int new_size = this->table_size ? this->table_size : 64;
+    while (new_size <= fd) {
+        new_size *= 2;
+    }
+
+    struct _watch *new_table = (struct _watch *)realloc(this->table, new_size * sizeof(struct _watch));
+    if (!new_table) {
+        memory_error("Unable to grow dispatch table");
+        return -1;
+    }
+    memset(new_table + this->table_size, 0, (new_size - this->table_size) * sizeof(struct _watch));
+
+    this->table = new_table;
+    this->table_size = new_size;
+    return 0;
+}
+
+event_loop create_event_loop(int backend) {
+    event_loop new_loop = (event_loop)calloc(1, sizeof(struct _event_loop));
+    if (!new_loop) {
+        memory_error("Unable to reserve event loop memory");
+    }
+
+    new_loop->backend = backend;
+    new_loop->epoll_fd = -1;
+    new_loop->ring.fd = -1;
+    new_loop->max_fd = -1;
+    new_loop->pending_fd = -1;
+    FD_ZERO(&new_loop->rfds);
+    FD_ZERO(&new_loop->wfds);
+
+    if (EV_BACKEND_EPOLL == backend) {
+        new_loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (-1 == new_loop->epoll_fd) {
+            if (_VERBOSE_TEST) printf(KRED "error creating epoll instance\n" KNRM);
+            free(new_loop);
+            return NULL;
+        }
+    } else if (EV_BACKEND_URING == backend) {
+        if (0 != uring_init(&new_loop->ring, URING_ENTRIES)) {
+            if (_VERBOSE_TEST) printf(KRED "io_uring is not available\n" KNRM);
+            free(new_loop);
+            return NULL;
+        }
+    } else if (EV_BACKEND_SELECT != backend) {
+        free(new_loop);
+        return NULL;
+    }
+
+    if (0 != grow_table(new_loop, 63)) {
+        free_event_loop(new_loop);
+        return NULL;
+    }
+
+    return new_loop;
+}
+
+int get_backend(event_loop this) {
+    return this->backend;
+}
+
+int parse_backend(char *name) {
+    if (0 == strcasecmp("select", name)) {
+        return EV_BACKEND_SELECT;
+    } else if (0 == strcasecmp("epoll", name)) {
+        return EV_BACKEND_EPOLL;
+    } else if (0 == strcasecmp("uring", name)) {
+        return EV_BACKEND_URING;
+    }
+    return -1;
+}
+
+uint64_t get_loop_syscalls(event_loop this) {
+    return this->syscalls + this->ring.enters;
+}
+
+// dispatch runs the handler of fd, unless it was removed by an earlier handler of the same wakeup.
+static inline void dispatch(event_loop this, int fd, uint32_t events) {
+    struct _watch *w = &this->table[fd];
+    if (w->handler) {
+        w->handler(fd, events, w->obj, w->arg);
+    }
+}
+
+/* IO_URING */
+static inline uint64_t uring_user_data(int fd, struct _watch *w, uint8_t request) {
+    return ((uint64_t)(uint32_t)fd << 32) | ((uint64_t)(w->gen & 0xffffff) << 8) | request;
+}
+
+// is_current is false for completions of a request that was cancelled or replaced
+static inline bool is_current(event_loop this, int fd, uint64_t user_data) {
+    if (fd >= this->table_size || !is_watched(&this->table[fd])) {
+        return false;
+    }
+    struct _watch *w = &this->table[fd];
+    uint8_t request = user_data & 0xff;
+    bool owned = request == w->kind
+        || (URING_STREAM == w->kind && (URING_POLL == request || URING_RECV == request || URING_RESUME == request));
+    return owned && user_data == uring_user_data(fd, w, request);
+}
+
+// is_same_stream is true for the completions of every request armed since the stream was registered,
+// its bytes are kept even if the recv was cancelled meanwhile
+static inline bool is_same_stream(event_loop this, int fd, uint64_t user_data) {
+    if (fd >= this->table_size || URING_STREAM != this->table[fd].kind) {
+        return false;
+    }
+    struct _watch *w = &this->table[fd];
+    uint32_t gen = (uint32_t)(user_data >> 8);
+    return ((gen - w->reg_gen) & 0xffffff) <= ((w->gen - w->reg_gen) & 0xffffff);
+}
+
+// uring_arm queues one request of fd, it is submitted by the next io_uring_enter
+static int uring_arm(event_loop this, int fd, uint8_t request) {
+    struct _watch *w = &this->table[fd];
+    struct io_uring_sqe *sqe = uring_get_sqe(&this->ring);
+    if (!sqe) {
+        return -1;
+    }
+
+    sqe->fd = fd;
+    sqe->user_data = uring_user_data(fd, w, request);
+    switch (request) {
+        case URING_POLL: //A stream only polls for writability, its bytes come with the recv
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->poll32_events = URING_STREAM == w->kind ? EV_WRITE : w->events;
+            break;
+        case URING_ACCEPT:
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            break;
+        case URING_RECVMSG:
+            sqe->opcode = IORING_OP_RECVMSG;
+            sqe->addr = (uint64_t)(uintptr_t)&this->dgram_msg;
+            sqe->len = 1;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = DGRAM_BGID;
+            break;
+        case URING_RECV:
+            sqe->opcode = IORING_OP_RECV;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = STREAM_BGID;
+            break;
+        case URING_RESUME:
+            sqe->opcode = IORING_OP_NOP;
+            sqe->fd = -1;
+            break;
+    }
+    return 0;
+}
+
+// uring_arm_watch queues the requests of the watch of fd
+static int uring_arm_watch(event_loop this, int fd) {
+    struct _watch *w = &this->table[fd];
+    if (URING_STREAM != w->kind) {
+        return uring_arm(this, fd, w->kind);
+    }
+
+    int exit_code = 0;
+    w->starved = false;
+    if (w->events & EV_WRITE) {
+        exit_code |= uring_arm(this, fd, URING_POLL);
+    }
+    if (w->events & EV_READ) {
+        exit_code |= uring_arm(this, fd, URING_RECV);
+        if (STREAM_NONE != w->held_head || w->eof) { //Read again, what was held goes first
+            exit_code |= uring_arm(this, fd, URING_RESUME);
+        }
+    }
+    return exit_code;
+}
+
+// uring_cancel queues the removal of one armed request of fd
+static void uring_cancel(event_loop this, int fd, uint8_t request) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&this->ring);
+    if (sqe) {
+        sqe->opcode = URING_POLL == request ? IORING_OP_POLL_REMOVE : IORING_OP_ASYNC_CANCEL;
+        sqe->addr = uring_user_data(fd, &this->table[fd], request);
+        sqe->user_data = 0; //Result ignored
+    }
+}
+
+// uring_disarm cancels the armed requests and makes their late completions stale
+static void uring_disarm(event_loop this, int fd) {
+    struct _watch *w = &this->table[fd];
+    if (URING_NONE == w->kind) {
+        return;
+    }
+
+    if (URING_STREAM != w->kind) {
+        uring_cancel(this, fd, w->kind);
+    } else {
+        if (w->events & EV_WRITE) uring_cancel(this, fd, URING_POLL);
+        if (w->events & EV_READ) uring_cancel(this, fd, URING_RECV);
+    }
+    w->gen++;
+}
+
+static int setup_datagram_buffers(event_loop this) {
+    if (this->buf_ring) {
+        return 0;
+    }
+
+    this->buf_ring = uring_setup_buf_ring(&this->ring, DGRAM_BUFFERS, DGRAM_BGID);
+    if (!this->buf_ring) {
+        return -1;
+    }
+    this->buf_mem = (char *)malloc((size_t)DGRAM_BUFFERS * EV_DGRAM_BUFFER_SIZE);
+    if (!this->buf_mem) {
+        memory_error("Unable to reserve datagram buffers");
+    }
+    for (unsigned i = 0; i < DGRAM_BUFFERS; i++) {
+        uring_buf_ring_add(this->buf_ring, DGRAM_BUFFERS - 1, i,
+                this->buf_mem + (size_t)i * EV_DGRAM_BUFFER_SIZE, EV_DGRAM_BUFFER_SIZE, i);
+    }
+    uring_buf_ring_advance(this->buf_ring, DGRAM_BUFFERS);
+
+    //Each buffer holds io_uring_recvmsg_out, the source address and the payload
+    memset(&this->dgram_msg, 0, sizeof(struct msghdr));
+    this->dgram_msg.msg_namelen = sizeof(struct sockaddr_in);
+    return 0;
+}
+
+// flush_datagrams hands the datagrams collected in this wakeup to their handler, then recycles the buffers
+static void flush_datagrams(event_loop this) {
+    if (0 == this->pending_count) {
+        return;
+    }
+
+    struct _watch *w = &this->table[this->pending_fd];
+    if (w->on_datagrams) {
+        w->on_datagrams(this->pending_fd, this->pending, this->pending_count, w->obj, w->arg);
+    }
+
+    for (int i = 0; i < this->pending_count; i++) {
+        uint16_t bid = this->pending_bid[i];
+        uring_buf_ring_add(this->buf_ring, DGRAM_BUFFERS - 1, i,
+                this->buf_mem + (size_t)bid * EV_DGRAM_BUFFER_SIZE, EV_DGRAM_BUFFER_SIZE, bid);
+    }
+    uring_buf_ring_advance(this->buf_ring, this->pending_count);
+    this->pending_count = 0;
+}
+
+static void collect_datagram(event_loop this, int fd, uint32_t flags) {
+    uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    char *buffer = this->buf_mem + (size_t)bid * EV_DGRAM_BUFFER_SIZE;
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buffer;
+
+    if (fd != this->pending_fd || DGRAM_BUFFERS == this->pending_count) {
+        flush_datagrams(this);
+        this->pending_fd = fd;
+    }
+
+    struct ev_datagram *dgram = &this->pending[this->pending_count];
+    dgram->from = (struct sockaddr_in *)(buffer + sizeof(struct io_uring_recvmsg_out));
+    dgram->fromlen = out->namelen;
+    dgram->data = buffer + sizeof(struct io_uring_recvmsg_out) + this->dgram_msg.msg_namelen;
+    dgram->len = out->payloadlen;
+    this->pending_bid[this->pending_count++] = bid;
+}
+
+static int setup_stream_buffers(event_loop this) {
+    if (this->stream_ring) {
+        return 0;
+    }
+
+    this->stream_ring = uring_setup_buf_ring(&this->ring, STREAM_BUFFERS, STREAM_BGID);
+    if (!this->stream_ring) {
+        return -1;
+    }
+    this->stream_mem = (char *)malloc((size_t)STREAM_BUFFERS * STREAM_BUFFER_SIZE);
+    if (!this->stream_mem) {
+        memory_error("Unable to reserve stream buffers");
+    }
+    for (unsigned i = 0; i < STREAM_BUFFERS; i++) {
+        uring_buf_ring_add(this->stream_ring, STREAM_BUFFERS - 1, i,
+                this->stream_mem + (size_t)i * STREAM_BUFFER_SIZE, STREAM_BUFFER_SIZE, i);
+    }
+    uring_buf_ring_advance(this->stream_ring, STREAM_BUFFERS);
+    return 0;
+}
+
+static void give_back_stream_buffer(event_loop this, uint16_t bid) {
+    uring_buf_ring_add(this->stream_ring, STREAM_BUFFERS - 1, 0,
+            this->stream_mem + (size_t)bid * STREAM_BUFFER_SIZE, STREAM_BUFFER_SIZE, bid);
+    uring_buf_ring_advance(this->stream_ring, 1);
+}
+
+// release_held gives back the buffers of the bytes held for fd, which is no longer read
+static void release_held(event_loop this, struct _watch *w) {
+    while (STREAM_NONE != w->held_head) {
+        uint16_t bid = w->held_head;
+        w->held_head = this->stream_next[bid];
+        give_back_stream_buffer(this, bid);
+        this->stream_held--;
+    }
+    w->held_tail = STREAM_NONE;
+    w->held_off = 0;
+}
+
+// deliver_stream hands the held bytes of fd to its handler, in order, while it reads them
+static void deliver_stream(event_loop this, int fd) {
+    uint32_t reg_gen = this->table[fd].reg_gen;
+
+    while (true) {
+        struct _watch *w = &this->table[fd]; //A handler may grow the table
+        if (URING_STREAM != w->kind || reg_gen != w->reg_gen || !(w->events & EV_READ)) {
+            return; //Removed, or paused by its handler
+        }
+        if (STREAM_NONE == w->held_head) {
+            if (w->eof) { //Told once, the handler removes the fd
+                w->eof = false;
+                w->on_bytes(fd, NULL, 0, w->obj, w->arg);
+            }
+            return;
+        }
+
+        uint16_t bid = w->held_head;
+        size_t left = this->stream_len[bid] - w->held_off;
+        size_t taken = w->on_bytes(fd, this->stream_mem + (size_t)bid * STREAM_BUFFER_SIZE + w->held_off, left,
+                w->obj, w->arg);
+
+        w = &this->table[fd];
+        if (URING_STREAM != w->kind || reg_gen != w->reg_gen) {
+            return; //Removed by its handler, the buffers were given back
+        }
+        if (taken < left) { //Kept for when the handler reads again
+            w->held_off += taken;
+            if (0 == taken) {
+                return;
+            }
+            continue;
+        }
+        w->held_head = this->stream_next[bid];
+        if (STREAM_NONE == w->held_head) {
+            w->held_tail = STREAM_NONE;
+        }
+        w->held_off = 0;
+        give_back_stream_buffer(this, bid);
+        this->stream_held--;
+    }
+}
+
+// stream_received queues the bytes of a recv completion behind the ones held for fd, then delivers them
+static void stream_received(event_loop this, int fd, uint64_t user_data, int res, uint32_t flags) {
+    bool same = is_same_stream(this, fd, user_data);
+    bool current = is_current(this, fd, user_data);
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (same && 0 < res) {
+            struct _watch *w = &this->table[fd];
+            this->stream_len[bid] = (uint32_t)res;
+            this->stream_next[bid] = STREAM_NONE;
+            if (STREAM_NONE == w->held_tail) {
+                w->held_head = bid;
+            } else {
+                this->stream_next[w->held_tail] = bid;
+            }
+            w->held_tail = bid;
+            this->stream_held++;
+        } else { //Closed meanwhile
+            give_back_stream_buffer(this, bid);
+        }
+    }
+    if (!same) {
+        return;
+    }
+
+    struct _watch *w = &this->table[fd];
+    if (0 == res || (0 > res && -ENOBUFS != res && -ECANCELED != res)) {
+        w->eof = true;
+    } else if (current && !(flags & IORING_CQE_F_MORE)) {
+        if (-ENOBUFS == res) { //Armed again once a handler gives buffers back
+            w->starved = true;
+            this->starved = true;
+        } else {
+            uring_arm(this, fd, URING_RECV);
+        }
+    }
+    deliver_stream(this, fd);
+}
+
+// rearm_starved arms again the recv of the streams that ran out of buffers, once some are free
+static void rearm_starved(event_loop this) {
+    if (!this->starved || STREAM_BUFFERS == this->stream_held) {
+        return;
+    }
+
+    this->starved = false;
+    for (int fd = 0; fd < this->table_size; fd++) {
+        struct _watch *w = &this->table[fd];
+        if (URING_STREAM == w->kind && w->starved) {
+            w->starved = false;
+            if (w->events & EV_READ) {
+                uring_arm(this, fd, URING_RECV);
+            }
+        }
+    }
+}
+
+static int run_uring(event_loop this, int timeout_ms) {
+    int dispatched = 0;
+
+    if (0 != uring_enter(&this->ring, 1, timeout_ms)) {
+        return -1;
+    }
+
+    struct io_uring_cqe *cqe;
+    while (NULL != (cqe = uring_peek_cqe(&this->ring))) {
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        uint32_t flags = cqe->flags;
+        uring_cqe_seen(&this->ring);
+
+        if (0 == user_data) {
+            continue; //Cancel or remove result
+        }
+        int fd = (int)(user_data >> 32);
+        bool current = is_current(this, fd, user_data);
+
+        switch (user_data & 0xff) {
+            case URING_POLL:
+                if (current && 0 <= res) { //A stream is only read by its recv, an error shows on the next write
+                    dispatch(this, fd, URING_STREAM == this->table[fd].kind ? EV_WRITE : (uint32_t)res);
+                    dispatched++;
+                }
+                //One shot, armed again unless the handler removed or changed it
+                if (is_current(this, fd, user_data)) {
+                    uring_arm(this, fd, URING_POLL);
+                }
+                break;
+            case URING_ACCEPT:
+                if (0 <= res) {
+                    if (current) {
+                        struct _watch *w = &this->table[fd]; //The new connection is handed to the listener handler
+                        w->handler(res, EV_ACCEPTED, w->obj, w->arg);
+                        dispatched++;
+                    } else {
+                        close(res); //Accepted after the listener was removed
+                    }
+                }
+                if (!(flags & IORING_CQE_F_MORE) && is_current(this, fd, user_data)) {
+                    uring_arm(this, fd, URING_ACCEPT);
+                }
+                break;
+            case URING_RECVMSG:
+                if (0 <= res && (flags & IORING_CQE_F_BUFFER)) {
+                    if (current) {
+                        collect_datagram(this, fd, flags);
+                        dispatched++;
+                    } else { //Give the buffer straight back
+                        uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                        uring_buf_ring_add(this->buf_ring, DGRAM_BUFFERS - 1, 0,
+                                this->buf_mem + (size_t)bid * EV_DGRAM_BUFFER_SIZE, EV_DGRAM_BUFFER_SIZE, bid);
+                        uring_buf_ring_advance(this->buf_ring, 1);
+                    }
+                }
+                if (!(flags & IORING_CQE_F_MORE) && current) { //Out of buffers, armed after the flush
+                    flush_datagrams(this);
+                    uring_arm(this, fd, URING_RECVMSG);
+                }
+                break;
+            case URING_RECV:
+                stream_received(this, fd, user_data, res, flags);
+                dispatched++;
+                break;
+            case URING_RESUME:
+                if (is_same_stream(this, fd, user_data)) {
+                    deliver_stream(this, fd);
+                }
+                break;
+        }
+    }
+
+    flush_datagrams(this);
+    rearm_starved(this);
+    return dispatched;
+}
+
+static int run_epoll(event_loop this, int timeout_ms) {
+    struct epoll_event events[EV_MAX_EVENTS];
+
+    this->syscalls++;
+    int n = epoll_wait(this->epoll_fd, events, EV_MAX_EVENTS, timeout_ms);
+    if (0 > n) {
+        return EINTR == errno ? 0 : -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        dispatch(this, events[i].data.fd, events[i].events);
+    }
+    return n;
+}
+
+static int run_select(event_loop this, int timeout_ms) {
+    fd_set rfds = this->rfds, wfds = this->wfds;
+    struct timeval tv = {.tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000};
+
+    this->syscalls++;
+    int n = select(this->max_fd + 1, &rfds, &wfds, NULL, 0 > timeout_ms ? NULL : &tv);
+    if (0 > n) {
+        return EINTR == errno ? 0 : -1;
+    }
+
+    int dispatched = 0;
+    int max_fd = this->max_fd;
+    for (int fd = 0; fd <= max_fd && dispatched < n; fd++) {
+        uint32_t events = 0;
+        if (FD_ISSET(fd, &rfds)) events |= EV_READ;
+        if (FD_ISSET(fd, &wfds)) events |= EV_WRITE;
+        if (events) {
+            dispatch(this, fd, events);
+            dispatched++;
+        }
+    }
+    return dispatched;
+}
+
+static void select_set(event_loop this, int fd, uint32_t events) {
+    FD_CLR(fd, &this->rfds);
+    FD_CLR(fd, &this->wfds);
+    if (events & EV_READ) FD_SET(fd, &this->rfds);
+    if (events & EV_WRITE) FD_SET(fd, &this->wfds);
+}
+
+// set_watch stores the watch and arms it on the backend
+static int set_watch(event_loop this, int fd, uint32_t events, uint8_t kind) {
+    if (EV_BACKEND_EPOLL == this->backend) {
+        struct epoll_event ev = {.events = events, .data.fd = fd};
+        this->syscalls++;
+        if (-1 == epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+            this->syscalls++;
+            if (EEXIST != errno || -1 == epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, fd, &ev)) {
+                if (_VERBOSE_TEST) printf(KRED "error adding fd %d to epoll\n" KNRM, fd);
+                return -1;
+            }
+        }
+    } else if (EV_BACKEND_URING == this->backend) {
+        uring_disarm(this, fd); //Registered again, the old request is replaced
+        this->table[fd].events = events;
+        this->table[fd].kind = kind;
+        return uring_arm_watch(this, fd);
+    } else {
+        select_set(this, fd, events);
+    }
+    this->table[fd].events = events;
+    return 0;
+}
+
+static int check_fd(event_loop this, int fd) {
+    if (0 > fd) {
+        return -1;
+    }
+    if (EV_BACKEND_SELECT == this->backend && FD_SETSIZE <= fd) {
+        if (_VERBOSE_TEST) printf(KYEL "fd %d is above FD_SETSIZE\n" KNRM, fd);
+        return -1;
+    }
+    return grow_table(this, fd);
+}
+
+int loop_add_fd(event_loop this, int fd, uint32_t events, fd_handler handler, item obj, void *arg) {
+    if (!handler || 0 != check_fd(this, fd)) {
+        return -1;
+    }
+
+    if (0 != set_watch(this, fd, events, URING_POLL)) {
+        return -1;
+    }
+    this->max_fd = fd > this->max_fd ? fd : this->max_fd;
+    this->table[fd].handler = handler;
+    this->table[fd].on_datagrams = NULL;
+    this->table[fd].obj = obj;
+    this->table[fd].arg = arg;
+    return 0;
+}
+
+int loop_add_acceptor(event_loop this, int fd, fd_handler handler, item obj, void *arg) {
+    if (EV_BACKEND_URING != this->backend) {
+        return loop_add_fd(this, fd, EV_READ, handler, obj, arg);
+    }
+    if (!handler || 0 != check_fd(this, fd) || 0 != set_watch(this, fd, EV_READ, URING_ACCEPT)) {
+        return -1;
+    }
+    this->table[fd].handler = handler;
+    this->table[fd].on_datagrams = NULL;
+    this->table[fd].obj = obj;
+    this->table[fd].arg = arg;
+    return 0;
+}
+
+int loop_add_stream(event_loop this, int fd, uint32_t events, fd_handler handler, stream_handler on_bytes,
+        item obj, void *arg) {
+    if (!handler || !on_bytes || EV_BACKEND_URING != this->backend || 0 != check_fd(this, fd)
+            || 0 != setup_stream_buffers(this)) {
+        return loop_add_fd(this, fd, events, handler, obj, arg);
+    }
+
+    struct _watch *w = &this->table[fd];
+    uring_disarm(this, fd); //A connecting fd was polled for writability
+    w->kind = URING_NONE;
+    w->reg_gen = w->gen;
+    w->held_head = w->held_tail = STREAM_NONE;
+    w->held_off = 0;
+    w->eof = false;
+    if (0 != set_watch(this, fd, events, URING_STREAM)) {
+        return -1;
+    }
+    this->max_fd = fd > this->max_fd ? fd : this->max_fd;
+    w->handler = handler;
+    w->on_datagrams = NULL;
+    w->on_bytes = on_bytes;
+    w->obj = obj;
+    w->arg = arg;
+    return 0;
+}
+
+int loop_add_datagrams(event_loop this, int fd, datagram_handler handler, item obj, void *arg) {
+    if (EV_BACKEND_URING != this->backend || !handler || 0 != check_fd(this, fd)
+            || 0 != setup_datagram_buffers(this)) {
+        return -1;
+    }
+    if (0 != set_watch(this, fd, EV_READ, URING_RECVMSG)) {
+        return -1;
+    }
+    this->table[fd].handler = NULL;
+    this->table[fd].on_datagrams = handler;
+    this->table[fd].obj = obj;
+    this->table[fd].arg = arg;
+    return 0;
+}
+
+int loop_mod_fd(event_loop this, int fd, uint32_t events) {
+    if (0 > fd || fd >= this->table_size || !this->table[fd].handler) {
+        return -1;
+    }
+    if (events == this->table[fd].events) {
+        return 0;
+    }
+    return set_watch(this, fd, events, this->table[fd].kind);
+}
+
+int loop_del_fd(event_loop this, int fd) {
+    if (0 > fd || fd >= this->table_size || !is_watched(&this->table[fd])) {
+        return -1;
+    }
+
+    if (EV_BACKEND_EPOLL == this->backend) {
+        this->syscalls++;
+        epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    } else if (EV_BACKEND_URING == this->backend) {
+        uring_disarm(this, fd);
+        if (URING_STREAM == this->table[fd].kind) {
+            release_held(this, &this->table[fd]);
+        }
+    } else {
+        FD_CLR(fd, &this->rfds);
+        FD_CLR(fd, &this->wfds);
+    }
+
+    uint32_t gen = this->table[fd].gen; //Kept, so late completions stay stale
+    memset(&this->table[fd], 0, sizeof(struct _watch));
+    this->table[fd].gen = gen;
+    while (0 <= this->max_fd && !is_watched(&this->table[this->max_fd])) {
+        this->max_fd--;
+    }
+    return 0;
+}
+
+int loop_run_once(event_loop this, int timeout_ms) {
+    if (EV_BACKEND_EPOLL == this->backend) {
+        return run_epoll(this, timeout_ms);
+    } else if (EV_BACKEND_URING == this->backend) {
+        return run_uring(this, timeout_ms);
+    }
+    return run_select(this, timeout_ms);
+}
+
+void free_event_loop(event_loop this) {
+    if (!this) {
+        return;
+    }
+    close_fd(this->epoll_fd);
+    if (EV_BACKEND_URING == this->backend) {
+        if (this->buf_ring) uring_free_buf_ring(&this->ring, this->buf_ring, DGRAM_BUFFERS, DGRAM_BGID);
+        if (this->stream_ring) uring_free_buf_ring(&this->ring, this->stream_ring, STREAM_BUFFERS, STREAM_BGID);
+        uring_exit(&this->ring);
+    }
+    free(this->buf_mem);
+    free(this->stream_mem);
+    free(this->table);
+    free(this);
+}
@@ -0,0 +1,167 @@
+#pragma once
+/*! \file msgserv/event_loop.h
+ * \brief Persistent event loop with an fd indexed dispatch table.
+ */
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "../utils/utils.h"
+
+#define EV_READ  EPOLLIN
+#define EV_WRITE EPOLLOUT
+#define EV_ERROR (EPOLLERR | EPOLLHUP)
+#define EV_ACCEPTED (1u << 26) //fd is a connection accepted by the loop, see loop_add_acceptor
+
+#define EV_MAX_EVENTS 256
+#define EV_DGRAM_BUFFER_SIZE 1024 //Source address and payload of one received datagram
+
+/*! \enum ev_backend
+    \brief Readiness backends the loop can be built on.
+*/
+enum ev_backend {
+    EV_BACKEND_SELECT = 0,
+    EV_BACKEND_EPOLL  = 1,
+    EV_BACKEND_URING  = 2, //!< io_uring, completion based accept, datagram and stream receive
+};
+
+/*! \var typedef struct _event_loop *event_loop
+    \brief Describes a pointer to struct _event_loop.
+    Every watched fd is registered once and kept until it is removed.
+*/
+typedef struct _event_loop *event_loop;
+
+/*! \var typedef void (*fd_handler)(int fd, uint32_t events, item obj, void *arg)
+    \brief Callback run when fd is ready. obj and arg are the values given on registration.
+*/
+typedef void (*fd_handler)(int fd, uint32_t events, item obj, void *arg);
+
+/*! \struct ev_datagram
+    \brief Datagram received by the loop. Only valid during the handler call.
+*/
+struct ev_datagram {
+    char               *data;
+    size_t             len;
+    struct sockaddr_in *from;
+    socklen_t          fromlen;
+};
+
+/*! \var typedef void (*datagram_handler)(int fd, struct ev_datagram *dgrams, int count, item obj, void *arg)
+    \brief Callback run once per wakeup with every datagram received on fd.
+*/
+typedef void (*datagram_handler)(int fd, struct ev_datagram *dgrams, int count, item obj, void *arg);
+
+/*! \var typedef size_t (*stream_handler)(int fd, char *data, size_t len, item obj, void *arg)
+    \brief Callback run with the bytes received on a stream, in order. Returns the bytes it took,
+    the rest is handed again once the fd is read again (EV_READ). len 0: the stream was closed or failed.
+*/
+typedef size_t (*stream_handler)(int fd, char *data, size_t len, item obj, void *arg);
+
+/*! \fn event_loop create_event_loop(int backend)
+    \brief Initializes the loop on the selected backend.
+    Returns NULL if the backend is not available.
+    \param backend One of ev_backend.
+*/
+event_loop create_event_loop(int backend);
+
+/*! \fn int get_backend(event_loop this)
+    \brief Returns the backend the loop runs on.
+    \param this Loop selected.
+*/
+int get_backend(event_loop this);
+
+/*! \fn int parse_backend(char *name)
+    \brief Converts a backend name (select, epoll, uring) to ev_backend. Returns -1 if unknown.
+    \param name Backend name.
+*/
+int parse_backend(char *name);
+
+/*! \fn int loop_add_fd(event_loop this, int fd, uint32_t events, fd_handler handler, item obj, void *arg)
+    \brief Registers fd with its handler in the dispatch table.
+    Returns 0 on success, -1 on failure.
+    \param this Loop selected.
+    \param fd File descriptor to watch.
+    \param events EV_READ and/or EV_WRITE.
+    \param handler Function called when fd is ready.
+    \param obj Item handed to the handler (ex: the peer server).
+    \param arg Shared argument handed to the handler.
+*/
+int loop_add_fd(event_loop this, int fd, uint32_t events, fd_handler handler, item obj, void *arg);
+
+/*! \fn int loop_add_acceptor(event_loop this, int fd, fd_handler handler, item obj, void *arg)
+    \brief Registers a listening socket.
+    On io_uring the loop accepts (multishot accept) and calls handler with the new
+    connection as fd and EV_ACCEPTED in events. On the other backends handler is
+    called with the listening fd when it is readable, like loop_add_fd.
+    \param this Loop selected.
+    \param fd Listening socket.
+    \param handler Function called for new connections.
+    \param obj Item handed to the handler.
+    \param arg Shared argument handed to the handler.
+*/
+int loop_add_acceptor(event_loop this, int fd, fd_handler handler, item obj, void *arg);
+
+/*! \fn int loop_add_stream(event_loop this, int fd, uint32_t events, fd_handler handler, stream_handler on_bytes, item obj, void *arg)
+    \brief Registers a connected TCP socket.
+    On io_uring the loop receives the stream (multishot recv into provided buffers) while
+    EV_READ is watched and hands the bytes to on_bytes; handler is only called with EV_WRITE.
+    The bytes received after EV_READ is removed are held, not lost. On the other backends,
+    or if the buffers could not be registered, this is loop_add_fd and handler reads the fd.
+    Returns 0 on success, -1 on failure.
+    \param this Loop selected.
+    \param fd Connected socket.
+    \param events EV_READ and/or EV_WRITE.
+    \param handler Function called when fd is ready.
+    \param on_bytes Function called with the received bytes (io_uring).
+    \param obj Item handed to the handlers.
+    \param arg Shared argument handed to the handlers.
+*/
+int loop_add_stream(event_loop this, int fd, uint32_t events, fd_handler handler, stream_handler on_bytes,
+        item obj, void *arg);
+
+/*! \fn int loop_add_datagrams(event_loop this, int fd, datagram_handler handler, item obj, void *arg)
+    \brief Registers a UDP socket whose datagrams are received by the loop (io_uring multishot
+    recvmsg into provided buffers) and handed in one batch per wakeup.
+    Returns -1 on the backends without completions, register the fd with loop_add_fd instead.
+    \param this Loop selected.
+    \param fd UDP socket.
+    \param handler Function called with the received datagrams.
+    \param obj Item handed to the handler.
+    \param arg Shared argument handed to the handler.
+*/
+int loop_add_datagrams(event_loop this, int fd, datagram_handler handler, item obj, void *arg);
+
+/*! \fn uint64_t get_loop_syscalls(event_loop this)
+    \brief Returns the syscalls made by the loop itself (epoll_wait, epoll_ctl, select, io_uring_enter).
+    \param this Loop selected.
+*/
+uint64_t get_loop_syscalls(event_loop this);
+
+/*! \fn int loop_mod_fd(event_loop this, int fd, uint32_t events)
+    \brief Changes the events watched on an already registered fd.
+    \param this Loop selected.
+    \param fd Registered file descriptor.
+    \param events New event mask.
+*/
+int loop_mod_fd(event_loop this, int fd, uint32_t events);
+
+/*! \fn int loop_del_fd(event_loop this, int fd)
+    \brief Removes fd from the loop. Must be called before closing fd.
+    \param this Loop selected.
+    \param fd Registered file descriptor.
+*/
+int loop_del_fd(event_loop this, int fd);
+
+/*! \fn int loop_run_once(event_loop this, int timeout_ms)
+    \brief Waits for ready fds and dispatches each one straight to its handler.
+    Returns the number of dispatched fds or -1 on error.
+    \param this Loop selected.
+    \param timeout_ms Maximum wait, -1 blocks.
+*/
+int loop_run_once(event_loop this, int timeout_ms);
+
+/*! \fn void free_event_loop(event_loop this)
+    \brief Frees the loop. Registered fds are not closed.
+    \param this Loop selected.
+*/
+void free_event_loop(event_loop this);
@@ -1,3 +1,4 @@
+#include <errno.h>
 #include "identity.h"
 
 #define REQUEST "GET_SERVERS"
@@ -6,7 +7,7 @@ struct addrinfo *id_server = NULL;
 
 int init_tcp(server host) {
     int master_fd;
-    struct sockaddr_in tcpaddr = {0, .sin_port = 0};
+    struct sockaddr_in tcpaddr = *get_tcp_sockaddr(host);
     struct timeval tv = {.tv_sec = 30, .tv_usec= 0};
     void (*old_handler)(int);   //interrupt handler
 
@@ -17,10 +18,6 @@ int init_tcp(server host) {
     }
     setsockopt(master_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv,sizeof(struct timeval));
 
-    tcpaddr.sin_family = AF_INET;
-    tcpaddr.sin_addr.s_addr = inet_addr(get_ip_address(host));
-    tcpaddr.sin_port = htons(get_tcp_port(host));
-
     if (0 != bind(master_fd, (struct sockaddr*)&tcpaddr,
                 sizeof(tcpaddr))) { //Bind socket to the PORT_TCP defined
 
@@ -33,6 +30,12 @@ int init_tcp(server host) {
         return -1;
     }
 
+    //Non blocking so the whole backlog can be drained until EAGAIN
+    if (-1 == fcntl(master_fd, F_SETFL, fcntl(master_fd, F_GETFL) | O_NONBLOCK)) {
+        if (_VERBOSE_TEST) printf(KRED "error setting listen socket non blocking\n" KNRM);
+        return -1;
+    }
+
     if ((old_handler = signal(SIGPIPE,SIG_IGN)) == SIG_ERR) {
         if (_VERBOSE_TEST) printf(KRED "error protecting from SIGPIPE\n" KNRM);
         return -1;
@@ -43,8 +46,12 @@ int init_tcp(server host) {
 }
 
 int init_udp(server host) {
-    int u_fd;
-    struct sockaddr_in udpaddr = {0 , .sin_port = 0};
+    return init_udp_shared(host, false);
+}
+
+int init_udp_shared(server host, bool reuse_port) {
+    int u_fd, one = 1;
+    struct sockaddr_in udpaddr = *get_udp_sockaddr(host);
     struct timeval tv = {.tv_sec = 30, .tv_usec= 0};
 
     u_fd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -54,10 +61,11 @@ int init_udp(server host) {
     }
 
     setsockopt(u_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv,sizeof(struct timeval));
-
-    udpaddr.sin_family = AF_INET;
-    udpaddr.sin_addr.s_addr = inet_addr(get_ip_address(host));
-    udpaddr.sin_port = htons(get_udp_port(host));
+    if (reuse_port && 0 != setsockopt(u_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) {
+        if (_VERBOSE_TEST) printf( KRED "error setting SO_REUSEPORT\n" KNRM);
+        close(u_fd);
+        return -1;
+    }
 
     if (0 != bind(u_fd, (struct sockaddr*)&udpaddr,
             sizeof(udpaddr))) {
@@ -69,24 +77,21 @@ int init_udp(server host) {
     return u_fd;
 }
 
-struct addrinfo *reg_server(int_fast16_t *fd, server host ,char *ip_name, char *udp_port) {
+struct addrinfo *reg_server(int *fd, server host ,char *ip_name, char *udp_port) {
     struct addrinfo *id_server_info = get_server_address(ip_name, udp_port);
     if (!id_server_info) {
             return NULL;
     }
-    struct timeval tv = {.tv_sec = 3, .tv_usec= 0};
 
     int nwritten;
 
-    if (!id_server_info) return NULL;
-
-    *fd = socket(AF_INET, SOCK_DGRAM, 0);
+    //Non blocking, the SERVERS reply is read by the event loop
+    *fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
     if (*fd <= 0) {
         if (_VERBOSE_TEST) printf(KRED "error creating udp socket for registry\n" KNRM);
+        freeaddrinfo(id_server_info);
         return NULL;
     }
-    //Put timeout on socket
-    setsockopt(*fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv,sizeof(struct timeval));
 
     if (0 > sprintf( REG_MESSAGE, "%s %s;%s;%d;%d", JOIN_STRING, get_name(host),
                 get_ip_address(host), get_udp_port(host), get_tcp_port(host))) return NULL;
@@ -113,220 +118,285 @@ int update_reg(int fd, struct addrinfo* id_server_info) {
 
 }
 
-int send_initial_comm(int processing_fd) {
-    int status = 1;
-    char to_send[STRING_SIZE];
-    sprintf(to_send, "SGET_MESSAGES\n");
-    if((unsigned int)send(processing_fd, to_send, strlen(to_send), 0) != strlen("SGET_MESSAGES\n")) {
-        if (_VERBOSE_TEST) printf("error sending initial communication\n");
-        status = 0;
-    }
+// ask_servers sends GET_SERVERS, the answer is handled by id_server_ready.
+int ask_servers(int fd) {
+    ssize_t n = sendto(fd, REQUEST, strlen(REQUEST) + 1, 0,
+            id_server->ai_addr, id_server->ai_addrlen);
 
-    return ((1 == status) ? processing_fd : (-1));
+    if (0 > n) {
+        if (_VERBOSE_TEST) fprintf(stderr, KYEL "unable to send\n" KNRM);
+        return 1;
+    }
+    return 0;
 }
 
-int connect_to_old_server(server old_server, bool is_comm_sent) {
-    int processing_fd;
-    int status = 1; //false
-    struct timeval tv = {.tv_sec = 30, .tv_usec= 0};
+// known_server is a server synced before, kept after it drops so it can resume
+struct known_server {
+    server       peer;  //Address and last clock received
+    uint_fast8_t tries; //Reconnects left
+};
 
-    if (-2 == get_fd(old_server)) {
-        // create new comunication
-        processing_fd = socket(AF_INET, SOCK_STREAM, 0);
-        if (-1 == processing_fd) {
-            if (_VERBOSE_TEST) printf(KRED "error creating socket\n" KNRM);
-            status = -1; //fatal error
-            return status;
-        }
-        setsockopt(processing_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv,sizeof(struct timeval));
-        tv.tv_sec = 5;
-        tv.tv_usec= 0;
-        setsockopt(processing_fd, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv,sizeof(struct timeval));
-
-        char portitoa[STRING_SIZE];
-        if (0 > sprintf(portitoa, "%hu", get_tcp_port(old_server))) {
-            if (_VERBOSE_TEST) printf(KRED "error converting u_short to string\n" KNRM);
-            status = -1; //fatal error
-            return status;
-        }
-        
-        struct addrinfo *res = get_server_address_tcp( get_ip_address(old_server),
-            portitoa);
-        if (!res) {
-            processing_fd = -1;
-            status = 1; //false
-        }
-        else if (-1 == connect(processing_fd, res->ai_addr, res->ai_addrlen)) {
-
-            if (_VERBOSE_TEST) printf( KYEL "cant connect to:%s:[%s]\n" KNRM, get_ip_address(old_server),
-                portitoa); //Connect return Failure
-            close(processing_fd);
-            processing_fd = -1;
-            status = 1; //false
-
-        }                                       //Sends only a request for one of the initial servers
-        else if (!is_comm_sent) {                            //Connect returns success
-            //Send message like SGET_MESSAGES to request messages
-            /* printf(KGRN "Sending new connection to:"KNRM"%s\n", get_name(old_server)); */
-            processing_fd = send_initial_comm( processing_fd);
-            if ( processing_fd == -1) status = 1; //false
-            else{
-                status = 0; //true
-            }
-        }
-
-        freeaddrinfo(res);
-        set_fd(old_server, processing_fd);
+void free_known_server(item got_item) {
+    struct known_server *known = (struct known_server *)got_item;
+    if (!known) {
+        return;
     }
+    free_server(known->peer);
+    free(known);
+}
 
-    if(1 == status && true == is_comm_sent) status = 0; //if comm is already sent to one is good
-
-    return status;
+static struct known_server *find_known_server(struct server_state *state, server cur_server) {
+    return (struct known_server *)find_in_registry(state->known_servers, get_server_key(cur_server));
 }
 
-int join_to_old_servers(list msgservers_list , server host) {
-    bool is_comm_sent = false;
-    node aux_node = NULL;
-
-    for (aux_node = get_head(msgservers_list); //Initialize comms with one new server
-    aux_node != NULL;
-    aux_node = get_next_node(aux_node)) {
-        if (different_servers((server )get_node_item(aux_node), host)) {
-            int status_check = connect_to_old_server((server)get_node_item(aux_node), is_comm_sent);
-            if (0 == status_check) is_comm_sent = true;
-            else if (1 == status_check) is_comm_sent = false;
-            else return -1; //Fatal error
+void remember_server(struct server_state *state, server cur_server) {
+    if (!get_synced(cur_server) || 0 == get_udp_port(cur_server)) {
+        return; //Inbound servers that did not give their ports have no address to go back to
+    }
+
+    struct known_server *known = find_known_server(state, cur_server);
+    if (!known) {
+        known = (struct known_server *)malloc(sizeof(struct known_server));
+        if (!known) {
+            memory_error("Unable to reserve known server memory");
         }
+        known->peer = copy_server(NULL, cur_server);
+        add_to_registry(state->known_servers, get_server_key(known->peer), known, -1);
     }
+    set_synced(known->peer, true);
+    set_next_lc(known->peer, get_next_lc(cur_server));
+    known->tries = RECONNECT_TRIES;
+}
 
-    if (!is_comm_sent) {
-        printf(KYEL "\nNo connectable servers present: " KGRN "Wait mode\n" KNRM );    }
+// recall_server gives the server the clock it had when it dropped, returns false if unknown
+static bool recall_server(struct server_state *state, server cur_server) {
+    struct known_server *known = find_known_server(state, cur_server);
+    if (!known) {
+        return false;
+    }
+    set_synced(cur_server, true);
+    set_next_lc(cur_server, get_next_lc(known->peer));
+    known->tries = 0; //Back
+    return true;
+}
 
-    return 0; //Success
+// connected_to returns true if a connection to the server is open, either way
+static bool connected_to(struct server_state *state, server cur_server) {
+    server other = (server)find_in_registry(state->peers, get_server_key(cur_server));
+    return other && 0 < get_fd(other);
 }
 
+void identify_server(struct server_state *state, server cur_server, u_short udp_port, u_short tcp_port) {
+    struct peer_key inbound_key = get_server_key(cur_server);
 
-int remove_bad_servers(list servers_list, server host, int max_fd, fd_set *rfds, void (*SET_FD)(int, fd_set *)) {
-    if(servers_list != NULL) { //Add child sockets to the socket set
-        node aux_node;
-        if (NULL != (aux_node = get_head( servers_list ))) {
+    set_listen_ports(cur_server, udp_port, tcp_port);
+    rekey_registry(state->peers, inbound_key, cur_server, get_server_key(cur_server));
+    if (!recall_server(state, cur_server)) {
+        set_synced(cur_server, true); //Everything it publishes from now on comes in this stream
+    }
+}
 
-            if (-1 == get_fd((server )get_node_item(aux_node))) { //1 node erasement
-                remove_head(servers_list, free_server);
-            } else if (!different_servers((server )get_node_item(aux_node),host)) {
-                remove_head(servers_list, free_server);
-            }
+void reconnect_servers(struct server_state *state) {
+    for (size_t n = 0; n < get_registry_size(state->known_servers); n++) {
+        struct known_server *known = (struct known_server *)get_registry_item(state->known_servers, n);
+        if (0 == known->tries || connected_to(state, known->peer)) {
+            continue; //Given up, or it came back by itself
+        }
+        known->tries--;
 
-            for (aux_node = get_head(servers_list);
-            aux_node != NULL ;
-            aux_node = get_next_node(aux_node)) {
+        server old_server = copy_server(NULL, known->peer);
+        add_to_registry(state->peers, get_server_key(old_server), old_server, -1);
+        if (0 != connect_to_old_server(state, old_server)) {
+            drop_server(state, old_server);
+        }
+    }
+}
 
-                int processing_fd;
-                node next_node;
+// request_snapshot sends SGET_MESSAGES to the first connected server, if the snapshot is still wanted.
+void request_snapshot(struct server_state *state) {
+    if (!state->snapshot_wanted || NULL != state->snapshot_server) {
+        return;
+    }
 
-                if (NULL != (next_node = get_next_node(aux_node))) {
-                    if (-1 == get_fd((server )get_node_item(next_node))) {
-                        //Delete next node
-                        remove_next_node(servers_list, aux_node, free_server);
-                    } else if ( 0 == different_servers((server )get_node_item(next_node),host)) {
-                        remove_next_node(servers_list, aux_node, free_server);
-                    }
-                }
+    server cur_server;
+    for_each_server(cur_server, &state->connected) {
+        if (0 >= get_fd(cur_server)) {
+            continue;
+        }
+        if (send_sget_messages(state, cur_server)) {
+            continue; //Dropped
+        }
+        state->snapshot_server = cur_server;
+        return;
+    }
+}
 
-                processing_fd = get_fd((server )get_node_item(aux_node)); //file descriptor/socket
+// finish_join runs once every connect has either succeeded or failed
+static void finish_join(struct server_state *state) {
+    state->join_status = JOIN_COMPLETE;
+    if (NULL == state->snapshot_server) {
+        state->snapshot_wanted = false;
+        printf(KYEL "\nNo connectable servers present: " KGRN "Wait mode\n" KNRM );
+        fflush(stdout);
+    }
+}
 
-                //if the socket is valid then add to the read list
-                if(0 < processing_fd) (*SET_FD)(processing_fd, rfds);
+static void connect_done(struct server_state *state) {
+    if (JOIN_CONNECTING == state->join_status && 0 == --state->pending_connects) {
+        finish_join(state);
+    }
+}
 
-                //The highest file descriptor is saved for the select fnc
-                max_fd = processing_fd > max_fd ? processing_fd: max_fd;
-            }
-        }
+// connect_ready runs when a non blocking connect finishes, with success or not
+static void connect_ready(int fd, uint32_t events, item obj, void *arg) {
+    struct server_state *state = (struct server_state *)arg;
+    server old_server = (server)obj;
+    int so_error = 0;
+    socklen_t len = sizeof(so_error);
+    (void)events;
+
+    if (0 != getsockopt(fd, SOL_SOCKET, SO_ERROR, &so_error, &len) || 0 != so_error) {
+        if (_VERBOSE_TEST) printf( KYEL "cant connect to:%s:[%hu]\n" KNRM, get_ip_address(old_server),
+                get_tcp_port(old_server));
+        drop_server(state, old_server);
+        connect_done(state);
+        return;
     }
 
-    return max_fd;
+    set_connected(old_server, 1);
+    bool resumed = recall_server(state, old_server);
+    if (0 != watch_server(state, old_server)) {
+        drop_server(state, old_server);
+        connect_done(state);
+        return;
+    }
+    ilist_push_back(&state->connected, get_server_link(old_server));
+    if (send_hello(state, old_server)) { //Dropped by the send
+        if (_VERBOSE_TEST) printf(KYEL "lost %s:[%hu] after the connect\n" KNRM, get_ip_address(old_server),
+                get_tcp_port(old_server));
+    } else if (state->snapshot_wanted) {
+        request_snapshot(state); //Only the first server to connect is asked
+    } else if (resumed) { //Reconnected, ask for what was missed
+        send_sget_messages(state, old_server);
+    } else {
+        set_synced(old_server, true); //Already up to date, its stream keeps it so
+    }
+    connect_done(state);
 }
 
-int tcp_new_comm(list servers_list, int listen_fd, fd_set *rfds, int (*STAT_FD)(int, fd_set *)) {
-    if ((*STAT_FD)(listen_fd, rfds)) { //if something happens on tcp_listen_fd create and allocate new socket
-        struct timeval tv = {.tv_sec = 30, .tv_usec= 0};
-        struct sockaddr_in newserv_info;
-        int newserv_fd;
+// connect_to_old_server starts a non blocking connect. Returns 0 if started, 1 on failure, -1 on fatal error.
+int connect_to_old_server(struct server_state *state, server old_server) {
+    int processing_fd;
+    struct timeval tv = {.tv_sec = 30, .tv_usec= 0};
 
-        int addrlen = sizeof(newserv_info);
+    // create new comunication
+    processing_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (-1 == processing_fd) {
+        if (_VERBOSE_TEST) printf(KRED "error creating socket\n" KNRM);
+        return -1; //fatal error
+    }
+    setsockopt(processing_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv,sizeof(struct timeval));
+
+    //The address was resolved when the server was created
+    int err = connect(processing_fd, (const struct sockaddr *)get_tcp_sockaddr(old_server), sizeof(struct sockaddr_in));
+    if (-1 == err && EINPROGRESS != errno) {
+        if (_VERBOSE_TEST) printf( KYEL "cant connect to:%s:[%hu]\n" KNRM, get_ip_address(old_server),
+            get_tcp_port(old_server)); //Connect return Failure
+        close(processing_fd);
+        set_fd(old_server, -1);
+        return 1; //false
+    }
 
-        //Create new socket, new_fd
-        if ((newserv_fd = accept(listen_fd, (struct sockaddr *)&newserv_info,
-            (socklen_t*)&addrlen))<0 ) {
+    //Finished (or failed) connects show up as writable
+    set_fd(old_server, processing_fd);
+    set_registry_fd(state->peers, get_server_key(old_server), old_server, processing_fd);
+    if (0 != loop_add_fd(state->loop, processing_fd, EV_WRITE, connect_ready, (item)old_server, (void *)state)) {
+        close(processing_fd);
+        set_fd(old_server, -1);
+        return 1;
+    }
+
+    return 0;
+}
 
-            if (_VERBOSE_TEST) printf("error accepting communication\n");
-            return -1; //Fatal error
+// connect_to_old_servers connects to every server at once, without waiting for any of them.
+int connect_to_old_servers(struct server_state *state) {
+    state->pending_connects = 0;
+    for (size_t n = 0; n < get_registry_size(state->peers); n++) {
+        server old_server = (server)get_registry_item(state->peers, n);
+        if (-2 != get_fd(old_server)) {
+            continue; //Already connected or inbound
+        }
+        if (!different_servers(old_server, state->host)) {
+            drop_server(state, old_server); //This server
+            continue;
         }
-        setsockopt(newserv_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv,sizeof(struct timeval));
 
-        //add new socket to list of sockets
-        server newserv = new_server("Inbound Server",inet_ntoa(newserv_info.sin_addr),0 , ntohs( newserv_info.sin_port ) );
-        set_fd(newserv, newserv_fd);
-        set_connected(newserv, 1);
-        push_item_to_list(servers_list, newserv);
+        int status_check = connect_to_old_server(state, old_server);
+        if (0 == status_check) state->pending_connects++;
+        else if (-1 == status_check) return -1; //Fatal error
+        else drop_server(state, old_server);
     }
 
-    return 0;//everthing is good
+    return 0; //Success
 }
 
-// get_servers asks the identity server for the server list.
-// Returns raw data.
-char *get_servers(int fd) {
-    ssize_t n = 0;
-    char *return_string = NULL;
-    char response[RESPONSE_SIZE] = {'\0'};
+// add_inbound_server saves an accepted connection in the list and watches it
+static void add_inbound_server(struct server_state *state, int newserv_fd, struct sockaddr_in *newserv_info) {
+    struct timeval tv = {.tv_sec = 30, .tv_usec= 0};
+    setsockopt(newserv_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv,sizeof(struct timeval));
+    fcntl(newserv_fd, F_SETFL, fcntl(newserv_fd, F_GETFL) | O_NONBLOCK); //Writes never block the loop
+
+    //add new socket to list of sockets
+    server newserv = new_server_from_addr("Inbound Server", newserv_info->sin_addr, 0, ntohs(newserv_info->sin_port));
+    set_fd(newserv, newserv_fd);
+    set_connected(newserv, 1);
+    add_to_registry(state->peers, get_server_key(newserv), newserv, newserv_fd);
+    if (0 != watch_server(state, newserv)) {
+        drop_server(state, newserv);
+        return;
+    }
+    ilist_push_back(&state->connected, get_server_link(newserv));
+}
 
-    n = sendto(fd, REQUEST, strlen(REQUEST) + 1, 0,
-            id_server->ai_addr, id_server->ai_addrlen);
+// tcp_new_comm accepts the whole pending backlog in one go. arg is the shared state.
+// With EV_ACCEPTED the loop already accepted the connection and fd is the new socket.
+void tcp_new_comm(int fd, uint32_t events, item obj, void *arg) {
+    struct server_state *state = (struct server_state *)arg;
+    (void)obj;
 
-    if (0 > n) {
-        if (_VERBOSE_TEST) fprintf(stderr, KYEL "unable to send\n" KNRM);
-        return NULL;
+    if (events & EV_ACCEPTED) {
+        struct sockaddr_in newserv_info;
+        socklen_t addrlen = sizeof(newserv_info);
+        if (0 != getpeername(fd, (struct sockaddr *)&newserv_info, &addrlen)) {
+            close(fd);
+            return;
+        }
+        add_inbound_server(state, fd, &newserv_info);
+        return;
+    }
+    if (!(events & EV_READ)) {
+        return;
     }
 
-    time_t control_time = time(NULL);
-    time_t request_time = time(NULL);
-    
-    while(true){
-        n = recvfrom(fd, response, RESPONSE_SIZE, 0,
-                id_server->ai_addr,
-                &id_server->ai_addrlen);
-    
-        if (0 > n) {
-            
-            if (difftime(time(NULL), control_time) > 10){ //After ten seconds quit
-                fprintf(stderr, KYEL "Identity Server doesn't answer\n" KNRM);
-            } else if (difftime(time(NULL), request_time) > 2){ //Each three seconds send a new request
-                request_time = time(NULL);
-                if (0 != update_reg(fd, id_server)){
-                    return NULL;
-                }
-                continue;
-            } else if (_VERBOSE_TEST){ 
-                fprintf(stderr, KYEL "unable to receive\n" KNRM);
+    while (true) {
+        struct sockaddr_in newserv_info;
+        socklen_t addrlen = sizeof(newserv_info);
+
+        //Create new socket, new_fd
+        int newserv_fd = accept(fd, (struct sockaddr *)&newserv_info, &addrlen);
+        if (0 > newserv_fd) {
+            if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno) {
+                if (_VERBOSE_TEST) printf("error accepting communication\n");
             }
-            return NULL;
-        } else {
-            return_string = (char *)malloc((n+1) * sizeof(char));
-            strncpy(return_string, response, strlen(response) + 1);
-            return return_string; //Dirty Pointer
+            break; //Backlog is empty
         }
+        add_inbound_server(state, newserv_fd, &newserv_info);
     }
 }
 
-uint_fast8_t parse_servers(int_fast16_t udp_register_fd, list msgsrv_list) {
-	char *response;
-
-	response = get_servers(udp_register_fd); //Show server will return NULL on disconnection
-    if (!response) {
-        return EXIT_FAILURE;
-    }
-
+// parse_servers saves the servers on the SERVERS reply in the registry.
+uint_fast8_t parse_servers(char *response, registry peers) {
     char *separated_info;
     char step_mem_name[STRING_SIZE]; //To define later
     char step_mem_ip_addr[STRING_SIZE];
@@ -335,18 +405,18 @@ uint_fast8_t parse_servers(int_fast16_t udp_register_fd, list msgsrv_list) {
     u_short step_mem_tcp_port;
 
     separated_info = strtok(response, "\n"); //Gets the first info, stoping at newline
-    if (0 != strcmp(separated_info, "SERVERS")){
-        free(response);
+    if (NULL == separated_info || 0 != strcmp(separated_info, "SERVERS")){
         return EXIT_FAILURE;
     }
     separated_info = strtok(NULL, "\n");
 
     while (NULL != separated_info) { //Proceeds getting info and treating
-        sscanf_state = sscanf(separated_info, "%[^;];%[^;];%hu;%hu",step_mem_name, step_mem_ip_addr,
+        sscanf_state = sscanf(separated_info, "%140[^;];%140[^;];%hu;%hu",step_mem_name, step_mem_ip_addr,
             &step_mem_udp_port, &step_mem_tcp_port);//Separates info and saves it in variables
 
         if (4 != sscanf_state) {
              if (true == is_verbose()) fprintf(stdout, KRED "error processing id server data. data is invalid or corrupt\n" KNRM);
+             separated_info = strtok(NULL, "\n");
              continue;
         }
 
@@ -355,31 +425,120 @@ uint_fast8_t parse_servers(int_fast16_t udp_register_fd, list msgsrv_list) {
 
         set_fd(alloc_server, -2);
         set_connected(alloc_server, 0);
-        push_item_to_list(msgsrv_list, alloc_server); //Pushes to list
+        add_to_registry(peers, get_server_key(alloc_server), alloc_server, -2);
 
         separated_info = strtok(NULL, "\n");//Gets new info
     }
 
-    free(response);
     return EXIT_SUCCESS;
 }
 
-uint_fast8_t handle_join(list msgsrv_list, int_fast16_t *udp_register_fd, server host, char *id_server_ip, char *id_server_port) {
-    uint_fast8_t err = 0;
+static void stop_timer(struct server_state *state, int timer_fd) {
+    struct itimerspec stop = {{0, 0}, {0, 0}};
+    loop_del_fd(state->loop, timer_fd);
+    timerfd_settime(timer_fd, 0, &stop, NULL);
+}
+
+static void fail_join(struct server_state *state) {
+    fprintf(stderr, KYEL "Identity Server doesn't answer\n" KNRM);
+    fprintf(stderr, KRED "Unable to join. Error code %d\n" KNRM, 2);
+
+    stop_timer(state, state->retry_fd);
+    stop_timer(state, state->refresh_fd);
+    loop_del_fd(state->loop, state->register_fd);
+    close_fd(state->register_fd);
+    state->register_fd = -1;
+    state->snapshot_wanted = false;
+    state->join_status = JOIN_IDLE;
+}
+
+// id_server_ready reads the SERVERS reply and starts connecting to every server in it.
+static void id_server_ready(int fd, uint32_t events, item obj, void *arg) {
+    struct server_state *state = (struct server_state *)arg;
+    char response[RESPONSE_SIZE];
+    (void)events; (void)obj;
+
+    ssize_t n;
+    while (0 < (n = recvfrom(fd, response, RESPONSE_SIZE - 1, MSG_DONTWAIT, NULL, NULL))) {
+        response[n] = '\0';
+        if (JOIN_ASK_SERVERS != state->join_status) {
+            continue; //Late answer to a retry
+        }
+        if (0 != parse_servers(response, state->peers)) {
+            continue;
+        }
+
+        stop_timer(state, state->retry_fd);
+        state->join_status = JOIN_CONNECTING;
+        if (0 != connect_to_old_servers(state)) {
+            fprintf(stderr, KRED "Unable to join. Error code %d\n" KNRM, 3);
+        }
+        if (0 == state->pending_connects) {
+            finish_join(state);
+        }
+    }
+}
+
+// join_retry_ready repeats the registration and GET_SERVERS until the identity server answers
+static void join_retry_ready(int fd, uint32_t events, item obj, void *arg) {
+    struct server_state *state = (struct server_state *)arg;
+    uint64_t expirations;
+    (void)events; (void)obj;
 
-    id_server = reg_server(udp_register_fd, host, id_server_ip, id_server_port);
+    if (sizeof(expirations) != read(fd, &expirations, sizeof(expirations))
+            || JOIN_ASK_SERVERS != state->join_status) {
+        return;
+    }
+
+    if (difftime(time(NULL), state->join_started) >= JOIN_TIMEOUT_SEC) { //After ten seconds quit
+        fail_join(state);
+        return;
+    }
+    update_reg(state->register_fd, id_server);
+    ask_servers(state->register_fd);
+}
+
+static void refresh_ready(int fd, uint32_t events, item obj, void *arg) {
+    struct server_state *state = (struct server_state *)arg;
+    uint64_t expirations;
+    (void)events; (void)obj;
+
+    if (sizeof(expirations) == read(fd, &expirations, sizeof(expirations))) { //if the timer is triggered
+        update_reg(state->register_fd, id_server);
+        if (JOIN_COMPLETE == state->join_status) {
+            reconnect_servers(state);
+        }
+    }
+}
+
+uint_fast8_t handle_join(struct server_state *state, char *id_server_ip, char *id_server_port) {
+    struct itimerspec retry_timer = {{JOIN_RETRY_SEC, 0}, {JOIN_RETRY_SEC, 0}};
+
+    if (id_server) {
+        freeaddrinfo(id_server);
+    }
+    id_server = reg_server(&state->register_fd, state->host, id_server_ip, id_server_port);
     if (id_server == NULL) {
         if (_VERBOSE_TEST) printf( KYEL "error registering on id_server\n" KNRM);
-        return err = 1;
+        return 1;
     }
 
-    if (0 != parse_servers(*udp_register_fd, msgsrv_list)) {
-        return err = 2;
+    if (0 != ask_servers(state->register_fd)
+            || 0 != loop_add_fd(state->loop, state->register_fd, EV_READ, id_server_ready, NULL, (void *)state)) {
+        close_fd(state->register_fd);
+        state->register_fd = -1;
+        return 2;
     }
 
-    if (0 != join_to_old_servers(msgsrv_list, host)) {
-        return err = 3;
-    }
+    state->join_status = JOIN_ASK_SERVERS;
+    state->join_started = time(NULL);
+    state->snapshot_wanted = true;
+    state->snapshot_server = NULL;
+
+    timerfd_settime(state->retry_fd, 0, &retry_timer, NULL);
+    loop_add_fd(state->loop, state->retry_fd, EV_READ, join_retry_ready, NULL, (void *)state);
+    timerfd_settime(state->refresh_fd, 0, &state->refresh_timer, NULL);
+    loop_add_fd(state->loop, state->refresh_fd, EV_READ, refresh_ready, NULL, (void *)state);
 
     return EXIT_SUCCESS;
 }
@@ -1,23 +1,79 @@
+#pragma once
 #include <signal.h>
 #include <time.h>
+#include <fcntl.h>
 #include "../utils/struct_server.h"
 #include "../utils/struct_message.h"
+#include "message.h"
 
 #define JOIN_STRING "REG"
-#define MAX_PENDING 5
+#define MAX_PENDING 128
+#define JOIN_RETRY_SEC 2    //GET_SERVERS is repeated at this interval
+#define JOIN_TIMEOUT_SEC 10 //Gives up if the identity server doesn't answer
+#define RECONNECT_TRIES 3   //Reconnects to a dropped server, one per registration refresh
+
+/*! \enum join_status
+    \brief Steps of the join, driven by the event loop.
+*/
+enum join_status {
+    JOIN_IDLE = 0,    //!< Not joined
+    JOIN_ASK_SERVERS, //!< Registered, waiting for the SERVERS reply
+    JOIN_CONNECTING,  //!< Non blocking connects to the old servers in progress
+    JOIN_COMPLETE,    //!< Every connect finished
+};
 
 extern struct addrinfo *id_server;
-struct addrinfo *reg_server(int_fast16_t *fd, server host, char *ip_name, char *udp_port);
+struct addrinfo *reg_server(int *fd, server host, char *ip_name, char *udp_port);
 // INIT
 int init_tcp(server host);
 int init_udp(server host);
-int send_initial_comm(int processing_fd);
+/*! \fn int init_udp_shared(server host, bool reuse_port)
+    \brief Same as init_udp. With reuse_port several sockets bind the same port
+    and the kernel spreads the clients between them (SO_REUSEPORT).
+*/
+int init_udp_shared(server host, bool reuse_port);
 
 // METHODS
 int update_reg(int fd, struct addrinfo* id_server_info);
-int connect_to_old_server(server old_server, bool is_comm_sent);
-int join_to_old_servers(list servers_list, server host);
+int connect_to_old_server(struct server_state *state, server old_server);
+int connect_to_old_servers(struct server_state *state);
+void request_snapshot(struct server_state *state);
+
+/*! \fn void remember_server(struct server_state *state, server cur_server)
+    \brief Keeps the address and the last clock of a synced server that is being dropped,
+    so a new connection to it only asks for the messages after that clock.
+    \param state Shared server state
+    \param cur_server Server being dropped
+*/
+void remember_server(struct server_state *state, server cur_server);
+
+/*! \fn void reconnect_servers(struct server_state *state)
+    \brief Connects again to the remembered servers, at most RECONNECT_TRIES times each.
+    A server is skipped while a connection under its address is open, either way: one that
+    came back and connected to us gave its listening ports in HELLO, see identify_server.
+    \param state Shared server state
+*/
+void reconnect_servers(struct server_state *state);
+
+/*! \fn void identify_server(struct server_state *state, server cur_server, u_short udp_port, u_short tcp_port)
+    \brief Keys an inbound server by the ports it listens on, given in its HELLO, so it is found
+    as connected and remembered like a server connected to. Its stream is synced from then on.
+    \param state Shared server state
+    \param cur_server Inbound server
+    \param udp_port Its UDP port
+    \param tcp_port Its TCP port
+*/
+void identify_server(struct server_state *state, server cur_server, u_short udp_port, u_short tcp_port);
+void free_known_server(item got_item);
+
+void tcp_new_comm(int fd, uint32_t events, item obj, void *arg);
 
-int  remove_bad_servers(list servers_list, server host, int max_fd, fd_set *rfds, void (*SET_FD)(int, fd_set *));
-int  tcp_new_comm(list servers_list, int listen_fd, fd_set *rfds, int (*STAT_FD)(int, fd_set *));
-uint_fast8_t handle_join(list msgsrv_list, int_fast16_t *udp_register_fd, server host, char *id_server_ip, char *id_server_port);
+/*! \fn uint_fast8_t handle_join(struct server_state *state, char *id_server_ip, char *id_server_port)
+    \brief Starts the join. Registers on the identity server and asks for the servers.
+    The rest of the join (SERVERS reply, retries, connects, SGET_MESSAGES) runs from the event loop.
+    Returns 0 if the join started.
+    \param state Shared server state
+    \param id_server_ip Identity server address
+    \param id_server_port Identity server port
+*/
+uint_fast8_t handle_join(struct server_state *state, char *id_server_ip, char *id_server_port);
@@ -1,12 +1,27 @@
 #include <errno.h>
+#include <inttypes.h>
+#include <ctype.h>
 #include <sys/timerfd.h>
 #include "identity.h"
 #include "message.h"
+#include "workers.h"
+#include "replication.h"
 
 bool g_exit = false;
 
+// Everything the client thread handlers need from main
+struct main_ctx {
+    event_loop          loop;
+    matrix              msg_matrix;
+    udp_batch           batch;
+    worker_pool         workers;  //!< NULL unless -w, then the workers own the UDP port
+    replication         repl;     //!< Thread that owns the other servers
+    wal                 log;      //!< Write-ahead log of the publishes, NULL unless -l
+    bool                print_prompt;
+};
+
 void usage(char* name) {
-    fprintf(stdout, "Example Usage: %s –n name –j ip -u upt –t tpt [-i siip] [-p sipt] [–m m] [–r r] %s \n", name, _VERBOSE_OPT_SHOW );
+    fprintf(stdout, "Example Usage: %s –n name –j ip -u upt –t tpt [-i siip] [-p sipt] [–m m] [–r r] [-b backend] [-w workers] [-q low:high] [-c us] [-x] [-f file] [-l dir] [-g us] [-s MiB] %s \n", name, _VERBOSE_OPT_SHOW );
     fprintf(stdout, "Arguments:\n"
             "\t-n\t\tserver name\n"
             "\t-j\t\tserver ip\n"
@@ -16,18 +31,19 @@ void usage(char* name) {
             "\t-p\t\t[identity server port (default:59000)]\n"
             "\t-m\t\t[max server storage (default:200)]\n"
             "\t-r\t\t[register interval (default:10)]\n"
+            "\t-b\t\t[event loop backend: select, epoll, uring (default:epoll)]\n"
+            "\t-w\t\t[udp worker threads sharing the udp port (default:0, served by the main thread)]\n"
+            "\t-q\t\t[server send queue watermarks in KiB (default:1024:4096)]\n"
+            "\t-c\t\t[longest wait in microseconds to send publishes together to the servers (default:500, 0 disables it)]\n"
+            "\t-x\t\t[text protocol only with the servers, the binary one is not offered or accepted]\n"
+            "\t-f\t\t[file the messages are kept in across restarts, an existing one keeps its capacity]\n"
+            "\t-l\t\t[directory of a write-ahead log, every publish is synced to it before the next wait]\n"
+            "\t-g\t\t[longest wait in microseconds to sync publishes together to the log (default:0, every loop iteration)]\n"
+            "\t-s\t\t[size in MiB a log segment is closed at (default:64)]\n"
             "%s", _VERBOSE_OPT_INFO);
     fprintf(stdout, "To force exit send ^C[CTRL+C] twice\n");
 }
 
-void put_fd_set(int fd, fd_set *rfds) {
-    FD_SET(fd, rfds);
-    return;
-}
-int is_fd_set(int fd, fd_set *rfds) {
-    return FD_ISSET(fd, rfds);
-}
-
 void ignore_sigpipe()
 {
     struct sigaction act;
@@ -47,11 +63,146 @@ void handle_intsignal(int sig) {
     fprintf(stderr, KCYN "\nuser requested exit\n" KNRM);
 }
 
+// Datagrams received by the io_uring loop
+void udp_datagrams_ready(int fd, struct ev_datagram *dgrams, int count, item obj, void *arg) {
+    struct main_ctx *ctx = (struct main_ctx *)arg;
+    (void)obj;
+
+    uint_fast32_t published = handle_client_datagrams(fd, ctx->batch, dgrams, count, ctx->msg_matrix);
+    if (0 < published) {
+        replicate_messages(ctx->repl, ctx->msg_matrix, published);
+    }
+}
+
+void udp_ready(int fd, uint32_t events, item obj, void *arg) {
+    struct main_ctx *ctx = (struct main_ctx *)arg;
+    (void)events; (void)obj;
+
+    uint_fast32_t published = handle_client_comms(fd, ctx->batch, ctx->msg_matrix); //UDP communications handling
+    if (0 < published) {
+        replicate_messages(ctx->repl, ctx->msg_matrix, published);
+    }
+}
+
+// Workers queued PUBLISH, this thread is the only one storing messages
+void publish_ready(int fd, uint32_t events, item obj, void *arg) {
+    struct main_ctx *ctx = (struct main_ctx *)arg;
+    (void)fd; (void)events; (void)obj;
+
+    uint_fast32_t published = drain_publishes(ctx->workers, ctx->msg_matrix, ctx->log);
+    if (0 < published) {
+        replicate_messages(ctx->repl, ctx->msg_matrix, published);
+    }
+}
+
+// Messages received by the replication thread from the other servers
+void ingest_ready(int fd, uint32_t events, item obj, void *arg) {
+    struct main_ctx *ctx = (struct main_ctx *)arg;
+    (void)fd; (void)events; (void)obj;
+
+    drain_ingested(ctx->repl, ctx->msg_matrix);
+}
+
+// Messages of the log, stored again with the clock they were published with
+void replay_publish(uint64_t lc, char *content, void *arg) {
+    store_replicated_message((matrix)arg, lc, content);
+}
+
+// loop_wait returns the shortest of two event loop timeouts, -1 waits forever
+int loop_wait(int a, int b) {
+    return 0 > a ? b : 0 > b ? a : a < b ? a : b;
+}
+
+void join(struct main_ctx *ctx) {
+    uint_fast8_t err = replication_command(ctx->repl, REPL_JOIN);
+    if (err && 1 != g_exit) {
+        fprintf(stderr, KRED "Unable to join. Error code %d\n" KNRM, err);
+    }
+}
+
+// resize starts changing the capacity of the matrix, the copy is done by the client loop
+void resize(struct main_ctx *ctx, size_t capacity) {
+    if (capacity == get_capacity(ctx->msg_matrix)) {
+        printf(KGRN "Already %zu messages\n" KNRM, capacity);
+        return;
+    }
+    uint_fast8_t err = start_matrix_resize(ctx->msg_matrix, capacity, get_message_key);
+    if (1 == err) {
+        fprintf(stderr, KRED "The last resize has not ended yet\n" KNRM);
+    } else if (3 == err) {
+        fprintf(stderr, KRED "The messages are kept in a file, its capacity is fixed\n" KNRM);
+    } else if (err) {
+        fprintf(stderr, KRED "Not even one message fits\n" KNRM);
+    } else {
+        printf(KGRN "Resizing from %zu to %zu messages, %zu bytes\n" KNRM, get_capacity(ctx->msg_matrix), capacity,
+                matrix_memory_for(capacity));
+    }
+}
+
+void stdin_ready(int fd, uint32_t events, item obj, void *arg) {
+    struct main_ctx *ctx = (struct main_ctx *)arg;
+    char buffer[STRING_SIZE];
+    (void)events; (void)obj;
+
+    ctx->print_prompt = true;
+    int_fast32_t read_size = read(fd, buffer, STRING_SIZE - 1);
+    if (0 > read_size) {
+        if (_VERBOSE_TEST) printf("error reading from stdio\n");
+        g_exit = true;
+        return;
+    } else if (0 == read_size || (1 == read_size && '\n' == buffer[0])){
+        fprintf(stderr, KRED"please input something\n" KNRM);
+        if (0 == read_size) loop_del_fd(ctx->loop, fd); //EOF, stop watching
+        return;
+    }
+
+    buffer[read_size] = '\0';
+    if ('\n' == buffer[read_size - 1]) buffer[read_size - 1] = '\0'; //switches \n to \0
+    //User options input: show_servers, exit, publish message, show_latest_messages n;
+    if (strcasecmp("join", buffer) == 0 || 0 == strcmp("1", buffer)) {
+        if (JOIN_IDLE == get_join_status(ctx->repl)) { //Register on idServer
+            join(ctx);
+        }
+        else {
+            printf(KGRN "Already joined!\n" KNRM);
+        }
+    } else if (0 == strcasecmp("show_servers", buffer) || 0 == strcmp("2", buffer)) {
+        replication_command(ctx->repl, REPL_SHOW_SERVERS);
+    } else if (0 == strcasecmp("show_messages", buffer) || 0 == strcmp("3", buffer)) {
+        if (0 == get_size(ctx->msg_matrix) && false == get_overflow(ctx->msg_matrix)) {
+            printf("0 messages received\n");
+        } else {
+            print_matrix(ctx->msg_matrix, print_message);
+        }
+    } else if (0 == strcasecmp("exit", buffer) || 0 == strcmp("4", buffer)) {
+        g_exit = true;
+        ctx->print_prompt = false;
+    } else if (0 == strcasecmp("show_stats", buffer) || 0 == strcmp("5", buffer)) {
+        if (ctx->workers) print_worker_stats(ctx->workers);
+        else print_batch_stats(ctx->batch);
+        print_replication_stats(ctx->repl);
+        if (ctx->log) print_wal_stats(ctx->log);
+    } else if (0 == strncasecmp("resize ", buffer, strlen("resize "))) {
+        resize(ctx, strtoul(buffer + strlen("resize "), NULL, 10));
+    } else if (0 == strncasecmp("resize_memory ", buffer, strlen("resize_memory "))) {
+        char *unit;
+        size_t bytes = strtoul(buffer + strlen("resize_memory "), &unit, 10);
+        switch (tolower(*unit)) {
+            case 'g': bytes *= 1024; //fall through
+            case 'm': bytes *= 1024; //fall through
+            case 'k': bytes *= 1024;
+        }
+        resize(ctx, capacity_for_memory(bytes));
+    } else {
+        fprintf(stderr, KRED "%s is an unknown operation\n" KNRM, buffer);
+    }
+}
+
 int main(int argc, char *argv[]) {
     signal(SIGINT, handle_intsignal);
     ignore_sigpipe();
 
-    int_fast8_t oc, err = 1;
+    int_fast8_t oc;
     char *name = NULL;
     char *ip = NULL;
     u_short udp_port = 0;
@@ -60,22 +211,28 @@ int main(int argc, char *argv[]) {
 
     char id_server_ip[STRING_SIZE] = "tejo.tecnico.ulisboa.pt";
     char id_server_port[STRING_SIZE] = "59000";
-    char buffer[STRING_SIZE];
+    char *storage_file = NULL;
+    char *log_dir = NULL;
+    size_t segment_mib = WAL_SEGMENT_SIZE >> 20;
+    uint64_t group_us = 0;
 
     int_fast16_t m = 200, r = 10;
-    bool is_join_complete = false;
-    bool print_prompt = true;
-    fd_set rfds;
-
-    int_fast16_t tcp_listen_fd = -1, udp_global_fd = -1, udp_register_fd = -1, timer_fd = -1, max_fd = -1;
+    int backend = EV_BACKEND_EPOLL;
+    int_fast16_t w = 0;
+    struct replication_limits limits = {
+        .send_low = SEND_LOW_WATERMARK,
+        .send_high = SEND_HIGH_WATERMARK,
+        .max_window_us = WINDOW_MAX_US,
+    };
+
+    int_fast16_t tcp_listen_fd = -1, udp_global_fd = -1;
     uint_fast8_t exit_code = EXIT_SUCCESS;
 
-    int_fast32_t read_size = 0;
     bool daemon_mode = false;
 
     srand(time(NULL));
     // Treat options
-    while ((oc = getopt(argc, argv, "n:j:u:t:i:p:m:r:hvd")) != -1) { //Command-line args parsing, 'i' and 'p' args required for both
+    while ((oc = getopt(argc, argv, "n:j:u:t:i:p:m:r:b:w:q:c:f:l:g:s:xhvd")) != -1) { //Command-line args parsing, 'i' and 'p' args required for both
         switch (oc) {
             case 'd':
                 daemon_mode = true;
@@ -106,6 +263,62 @@ int main(int argc, char *argv[]) {
             case 'r':
                 r = atoi(optarg);
                 break;
+            case 'b':
+                backend = parse_backend(optarg);
+                if (0 > backend) {
+                    fprintf(stderr, KRED "%s is an unknown backend\n" KNRM, optarg);
+                    usage(argv[0]);
+                    exit_code = EXIT_FAILURE;
+                    goto PROGRAM_EXIT;
+                }
+                break;
+            case 'w':
+                w = atoi(optarg);
+                if (0 > w) {
+                    usage(argv[0]);
+                    exit_code = EXIT_FAILURE;
+                    goto PROGRAM_EXIT;
+                }
+                break;
+            case 'q': {
+                unsigned long low_kib = 0, high_kib = 0;
+                if (2 != sscanf(optarg, "%lu:%lu", &low_kib, &high_kib) || 0 == high_kib || low_kib > high_kib) {
+                    fprintf(stderr, KRED "%s are not valid watermarks\n" KNRM, optarg);
+                    usage(argv[0]);
+                    exit_code = EXIT_FAILURE;
+                    goto PROGRAM_EXIT;
+                }
+                limits.send_low = low_kib * 1024;
+                limits.send_high = high_kib * 1024;
+                break;
+            }
+            case 'c':
+                if (0 > atoi(optarg)) {
+                    usage(argv[0]);
+                    exit_code = EXIT_FAILURE;
+                    goto PROGRAM_EXIT;
+                }
+                limits.max_window_us = atoi(optarg);
+                break;
+            case 'x':
+                limits.text_only = true;
+                break;
+            case 'f':
+                storage_file = optarg;
+                break;
+            case 'l':
+                log_dir = optarg;
+                break;
+            case 'g':
+            case 's':
+                if (0 > atoi(optarg) || ('s' == oc && 0 == atoi(optarg))) {
+                    usage(argv[0]);
+                    exit_code = EXIT_FAILURE;
+                    goto PROGRAM_EXIT;
+                }
+                if ('g' == oc) group_us = atoi(optarg);
+                else segment_mib = atoi(optarg);
+                break;
             case 'h':
                 usage(argv[0]);
                 exit_code = EXIT_FAILURE;
@@ -134,16 +347,42 @@ int main(int argc, char *argv[]) {
     }
 
 
+    matrix msg_matrix = storage_file ? create_matrix_file(m, storage_file) : create_matrix(m);
+    if (!msg_matrix) {
+        fprintf(stderr, KRED "%s is not a message storage file, or cannot be mapped\n" KNRM, storage_file);
+        exit_code = EXIT_FAILURE;
+        goto PROGRAM_EXIT;
+    }
+    if (storage_file) { //Served at once, the servers are only asked for what is newer
+        uint64_t restored = load_messages(msg_matrix);
+        fprintf(stdout, KBLU "Restored:" KNRM " %lu of %zu messages from %s\n", (unsigned long)restored,
+                get_capacity(msg_matrix), storage_file);
+    }
+    wal log = NULL;
+    if (log_dir) { //After the storage file, the messages it kept are not stored twice
+        log = create_wal(log_dir, segment_mib << 20, get_capacity(msg_matrix), group_us);
+        if (!log) {
+            fprintf(stderr, KRED "%s cannot be used as a log directory, or holds a file that is not a log segment\n" KNRM,
+                    log_dir);
+            free_matrix(msg_matrix);
+            exit_code = EXIT_FAILURE;
+            goto PROGRAM_EXIT;
+        }
+        uint64_t replayed = replay_wal(log, replay_publish, msg_matrix);
+        fprintf(stdout, KBLU "Replayed:" KNRM " %lu messages from %s, next clock %" PRIu64 "\n", (unsigned long)replayed,
+                log_dir, g_lc);
+    }
+
     struct itimerspec new_timer = {{r,0}, {r,0}};
     server host = new_server(name, ip, udp_port, tcp_port); //host parameters
 
-    /* Start Timer */
-    timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK);
-    if (timer_fd == -1) {
-        printf(KRED "Unable to create timer.\n" KNRM);
+    worker_pool workers = NULL;
+    if (0 < w) { //Client traffic is served by the workers
+        workers = create_worker_pool(w, host, msg_matrix);
+        udp_global_fd = workers ? get_wake_fd(workers) : -1;
+    } else {
+        udp_global_fd = init_udp(host); //Initiates UDP connection
     }
-
-    udp_global_fd = init_udp(host); //Initiates UDP connection
     tcp_listen_fd = init_tcp(host); //Initiates TCP connection
 
     if ( 0 >= udp_global_fd || 0 >= tcp_listen_fd){
@@ -153,8 +392,34 @@ int main(int argc, char *argv[]) {
         exit_code = EXIT_FAILURE;
     }
 
-    matrix msg_matrix = create_matrix(m);
-    list msgsrv_list = create_list();
+    event_loop loop = create_event_loop(backend);
+    if (!loop) {
+        fprintf(stderr, KRED "Unable to create event loop\n" KNRM);
+        g_exit = 1;
+        exit_code = EXIT_FAILURE;
+    }
+
+    /* The replication thread owns the tcp socket, the join and the other servers */
+    replication repl = NULL;
+    if (!g_exit) {
+        repl = create_replication(backend, host, msg_matrix, tcp_listen_fd, new_timer, id_server_ip, id_server_port,
+                limits);
+        if (!repl) {
+            g_exit = 1;
+            exit_code = EXIT_FAILURE;
+        }
+    }
+
+    struct main_ctx ctx = {
+        .loop = loop,
+        .msg_matrix = msg_matrix,
+        .batch = create_udp_batch(),
+        .workers = workers,
+        .repl = repl,
+        .log = log,
+        .print_prompt = false,
+    };
+    set_batch_wal(ctx.batch, log);
 
     fprintf(stdout, KBLU "Server Parameters:" KNRM " %s:%s:%d:%d\n"
             KBLU "Identity Server:" KNRM " %s:%s\n"
@@ -162,120 +427,63 @@ int main(int argc, char *argv[]) {
             ,name, ip, udp_port, tcp_port, id_server_ip, id_server_port);
     fflush(stdout);
 
-    if (daemon_mode && !g_exit) {
-        err = handle_join(msgsrv_list, &udp_register_fd, host, id_server_ip, id_server_port);
-        if (err) {
-            fprintf(stderr, KRED "Unable to join. Error code %d\n" KNRM, err);
-        } else {
-            is_join_complete = true;
-            timerfd_settime (timer_fd, 0, &new_timer, NULL);
+    if (!g_exit) { //Clients and servers are served from the start, also while joining
+        loop_add_fd(loop, STDIN_FILENO, EV_READ, stdin_ready, NULL, &ctx);
+        if (workers) {
+            loop_add_fd(loop, udp_global_fd, EV_READ, publish_ready, NULL, &ctx);
+        } else if (0 != loop_add_datagrams(loop, udp_global_fd, udp_datagrams_ready, NULL, &ctx)) {
+            loop_add_fd(loop, udp_global_fd, EV_READ, udp_ready, NULL, &ctx); //No completion path on this backend
         }
+        loop_add_fd(loop, get_ingest_fd(repl), EV_READ, ingest_ready, NULL, &ctx);
     }
-    // Processing Loop
-    while(!g_exit) {
-        print_prompt = false;
-        //Clear the set
-        FD_ZERO(&rfds);
-
-        //Add tcp_listen_fd, udp_global_fd and stdio to the socket set
-        FD_SET(STDIN_FILENO, &rfds);
-        if (is_join_complete) {
-            FD_SET(timer_fd, &rfds);
-            FD_SET(udp_global_fd, &rfds);
-            FD_SET(tcp_listen_fd, &rfds);
-            max_fd = tcp_listen_fd > udp_global_fd ? tcp_listen_fd : udp_global_fd;
-            max_fd = timer_fd > max_fd ? timer_fd : max_fd;
-        } else {
-            max_fd = STDIN_FILENO;
-        }
 
-        //Removes the bad servers and sets the good in fd_set rfds.
-        max_fd = remove_bad_servers(msgsrv_list, host, max_fd, &rfds, put_fd_set);
+    if (daemon_mode && !g_exit) {
+        join(&ctx);
+    }
+    // Client loop, every fd is registered once and dispatched straight to its handler
+    while(!g_exit) {
+        ctx.print_prompt = false;
 
         //wait for one of the descriptors is ready
-        int activity = select(max_fd + 1 , &rfds, NULL, NULL, NULL); //Select, threading function
-        if(0 > activity){
-            if (_VERBOSE_TEST) printf("error on select\n%d\n", errno);
+        //No wait while a resize copies, nor past the group commit window of the log, and a short one
+        //while the replaced rings wait for the readers or published messages for room in the ring
+        int wait = loop_wait(get_resize_wait(msg_matrix), get_replication_wait(repl));
+        if (0 > loop_run_once(loop, loop_wait(wait, log ? get_wal_wait(log) : -1))) {
+            if (_VERBOSE_TEST) printf("error on event loop\n%d\n", errno);
             break;
         }
-
-        if (FD_ISSET(timer_fd, &rfds)) { //if the timer is triggered
-            update_reg(udp_register_fd, id_server);
-            timerfd_settime (timer_fd, 0, &new_timer, NULL);
+        if (0 <= get_replication_wait(repl)) {
+            replicate_messages(repl, msg_matrix, 0);
         }
-
-
-        if ( 0 != tcp_new_comm(msgsrv_list, tcp_listen_fd, &rfds, is_fd_set)) { //Starts connection for incoming requests
-            break;
+        if (step_matrix_resize(msg_matrix, RESIZE_STEP)) {
+            wake_replication(repl); //Its next iteration leaves the replaced rings
+            printf(KGRN "\nResized to %zu messages, %lu kept\n" KNRM, get_capacity(msg_matrix),
+                    (unsigned long)(get_size(msg_matrix) - get_first(msg_matrix)));
+            if (log) set_wal_keep(log, get_capacity(msg_matrix));
+            ctx.print_prompt = true;
         }
-
-        //if something happened on other socket we must process it
-        if (FD_ISSET(STDIN_FILENO, &rfds)) { //Stdio input
-            print_prompt = true;
-            read_size = read(0, buffer, STRING_SIZE);
-            if (0 > read_size) {
-                if (_VERBOSE_TEST) printf("error reading from stdio\n");
-                break;
-            } else if (0 == read_size || (1 == read_size && '\n' == buffer[0])){
-                fprintf(stderr, KRED"please input something\n" KNRM);
-            } else {       
-                if ('\n' == buffer[read_size - 1]) buffer[read_size - 1] = '\0'; //switches \n to \0
-                //User options input: show_servers, exit, publish message, show_latest_messages n;
-                if (strcasecmp("join", buffer) == 0 || 0 == strcmp("1", buffer)) {
-                    if (!is_join_complete) { //Register on idServer
-                        err = handle_join(msgsrv_list, &udp_register_fd, host, id_server_ip, id_server_port);
-                        if (err && 1 != g_exit) {
-                            fprintf(stderr, KRED "Unable to join. Error code %d\n" KNRM, err);
-                        } else {
-                            is_join_complete = true;
-                            timerfd_settime (timer_fd, 0, &new_timer, NULL);
-                        }
-                    }
-                    else {
-                        printf(KGRN "Already joined!\n" KNRM);
-                    }
-                } else if (0 == strcasecmp("show_servers", buffer) || 0 == strcmp("2", buffer)) {
-                    if (msgsrv_list != NULL && 0 != get_list_size(msgsrv_list)) print_list(msgsrv_list, print_server);
-                    else printf("No registered servers\n");
-                } else if (0 == strcasecmp("show_messages", buffer) || 0 == strcmp("3", buffer)) {
-                    if (0 == get_size(msg_matrix) && false == get_overflow(msg_matrix)) {
-                        printf("0 messages received\n");
-                    } else {
-                        print_matrix(msg_matrix, print_message);
-                    }
-                } else if (0 == strcasecmp("exit", buffer) || 0 == strcmp("4", buffer)) {
-                    g_exit = true;
-                    print_prompt = false;
-                } else {
-                    fprintf(stderr, KRED "%s is an unknown operation\n" KNRM, buffer);
-                }
-            }
+        if (log && commit_wal(log)) { //Once for every publish of the iteration
+            fprintf(stderr, KRED "\nUnable to write the log, the last messages are not durable\n" KNRM);
+            ctx.print_prompt = true;
         }
 
-        if (FD_ISSET(udp_global_fd, &rfds)){ //UDP communications handling
-            err = handle_client_comms(udp_global_fd, msg_matrix);
-            if (2 == err) {
-                share_last_message(msgsrv_list, msg_matrix);
-            }
-        }
-
-        for_each_element(msgsrv_list, server_treat_communications, (void*[]){(void *)msg_matrix, (void *)&rfds});
-
-        if (print_prompt && 1 != g_exit) {
-            if (is_join_complete) fprintf(stdout, KGRN "\nPrompt@%s > " KNRM, get_name(host));
+        if (ctx.print_prompt && 1 != g_exit) {
+            if (JOIN_IDLE != get_join_status(repl)) fprintf(stdout, KGRN "\nPrompt@%s > " KNRM, get_name(host));
             else fprintf(stdout, KGRN "Prompt@NotConnected > " KNRM);
             fflush(stdout);
         }
     }
 
-    close_fd(tcp_listen_fd);
-    close_fd(udp_global_fd);
-    close_fd(udp_register_fd);
-    close_fd(timer_fd);
+    //Threads are joined before the matrix is freed
+    if (repl) free_replication(repl); //Also closes the tcp socket
+    else close_fd(tcp_listen_fd);
+    if (workers) free_worker_pool(workers);
+    else close_fd(udp_global_fd);
+    if (loop) free_event_loop(loop);
+    free_udp_batch(ctx.batch);
+    free_wal(log); //Syncs what the window still held
     free_server(host);
-    free_list(msgsrv_list, free_server);
-    free_matrix(msg_matrix, free_message);
-    freeaddrinfo(id_server);
+    free_matrix(msg_matrix);
 PROGRAM_EXIT:
     return exit_code;
 }
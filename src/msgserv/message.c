@@ -1,272 +1,940 @@
+#define _GNU_SOURCE //recvmmsg, sendmmsg
 #include "message.h"
+#include "identity.h"
+#include <errno.h>
+#include <inttypes.h>
+
+// count_newer_messages returns how many stored messages have a clock above since.
+// Stored in clock order, so they are a suffix found by binary search. Inside a matrix read.
+static uint64_t count_newer_messages(matrix msg_matrix, uint64_t since) {
+    uint64_t size = get_size(msg_matrix);
+    uint64_t total = size - get_first(msg_matrix);
+
+    message newest = (message)get_element(msg_matrix, size - 1);
+    if (0 == total || !newest || since > get_lc(newest)) {
+        return total; //A clock from before this server restarted, send everything
+    }
+    return size - find_first_after(msg_matrix, since);
+}
 
-uint_fast8_t handle_sget_messages(int fd, matrix msg_matrix) {
-    uint_fast8_t exit_code = 0;
-    int_fast32_t nwritten = 0;
+// read_window formats the next window of stored messages to the chunk buffer, in the form of the reply.
+// The reply follows the stored messages until it reaches the newest one. Returns the chunk and its length
+static char *read_window(struct server_state *state, struct snapshot_stream *stream, size_t *len) {
+    matrix msg_matrix = state->msg_matrix;
+    bool binary = SNAPSHOT_TEXT != stream->form;
+    char *records = state->chunk + BINARY_HEADER_MAX;
+    uint_fast32_t seq;
+    uint64_t next, size;
+    size_t n;
+
+    do {
+        seq = begin_matrix_read(msg_matrix);
+        size = get_size(msg_matrix);
+        next = get_first(msg_matrix);
+        next = stream->next > next ? stream->next : next; //Skips what was evicted meanwhile
+        n = size - next < SNAPSHOT_WINDOW ? size - next : SNAPSHOT_WINDOW;
+
+        *len = format_messages(msg_matrix, next, n, binary ? MSG_BINARY : MSG_W_LC, records);
+    } while (retry_matrix_read(msg_matrix, seq));
+
+    stream->next = next + n;
+    stream->active = (stream->next < size);
+    if (binary) {
+        if (!stream->active && n) {
+            records[(*len)++] = BINARY_MESSAGES; //Frame of no messages ends the reply
+            *len += put_varint(records + *len, 0);
+        }
+        size_t header_len = put_binary_header(records, BINARY_MESSAGES, n);
+        *len += header_len;
+        return records - header_len;
+    }
+    if (!stream->active) {
+        records[(*len)++] = '\n'; //Empty line ends the block
+    }
+    return records;
+}
+
+// pack_chunk puts a binary chunk in a BINARY_COMPRESSED frame, returns the frame and its length
+static char *pack_chunk(struct server_state *state, const char *chunk, size_t *len) {
+    char *frame = state->packed;
+    size_t header_len = 1 + put_varint(frame + 1, *len);
+    char *data = frame + header_len + VARINT_MAX; //Moved next to the header once its length is known
+
+    frame[0] = BINARY_COMPRESSED;
+    size_t compressed = lz_compress(chunk, *len, data, lz_bound(COMPRESS_BLOCK));
+    header_len += put_varint(frame + header_len, compressed);
+    memmove(frame + header_len, data, compressed);
+    *len = header_len + compressed;
+    return frame;
+}
+
+// pump_snapshot queues windows of the SGET_MESSAGES reply while the queue of the server is short.
+// Called again once the queue drains. Returns 1 if the server was dropped
+static uint_fast8_t pump_snapshot(struct server_state *state, server cur_server) {
+    struct snapshot_stream *stream = get_snapshot_stream(cur_server);
+    struct send_queue *queue = get_send_queue(cur_server);
+
+    while (stream->active && queue->len < SNAPSHOT_QUEUED) {
+        size_t len;
+        char *chunk = read_window(state, stream, &len);
+        if (SNAPSHOT_COMPRESSED == stream->form && COMPRESS_MIN <= len) {
+            chunk = pack_chunk(state, chunk, &len);
+        }
+        if (queue_to_server(state, cur_server, chunk, len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    char *response_buffer = (char *)malloc(STRING_SIZE * (get_capacity(msg_matrix) + 1));
-    if (!response_buffer) {
-        memory_error("unable to allocate response while sharing last message");
+uint_fast8_t handle_sget_messages(struct server_state *state, server cur_server, bool delta, uint64_t since) {
+    struct snapshot_stream *stream = get_snapshot_stream(cur_server);
+    struct send_queue *queue = get_send_queue(cur_server);
+    matrix msg_matrix = state->msg_matrix;
+    uint_fast32_t seq;
+
+    if (!state->chunk) { //Shared by every reply, only one window is read at a time
+        state->chunk = (char *)malloc(2 * BINARY_HEADER_MAX + SNAPSHOT_WINDOW * WIRE_RECORD_SIZE);
+        state->packed = (char *)malloc(1 + 2 * VARINT_MAX + lz_bound(COMPRESS_BLOCK));
+        if (!state->chunk || !state->packed) {
+            memory_error("unable to allocate response while sharing last message");
+        }
+    }
+
+    do {
+        seq = begin_matrix_read(msg_matrix);
+        uint64_t count = get_size(msg_matrix) - get_first(msg_matrix);
+        if (delta) {
+            count = count_newer_messages(msg_matrix, since);
+        }
+        stream->next = get_size(msg_matrix) - count;
+    } while (retry_matrix_read(msg_matrix, seq));
+
+    stream->form = !queue->binary ? SNAPSHOT_TEXT : queue->compress ? SNAPSHOT_COMPRESSED : SNAPSHOT_BINARY;
+    stream->active = true;
+    if (SNAPSHOT_TEXT == stream->form && queue_to_server(state, cur_server, SMESSAGE_CODE "\n", strlen(SMESSAGE_CODE "\n"))) {
+        return 1;
     }
+    return pump_snapshot(state, cur_server);
+}
+
+uint_fast8_t send_sget_messages(struct server_state *state, server cur_server) {
+    char request[STRING_SIZE];
+    bool resume = get_synced(cur_server) && 0 < get_next_lc(cur_server); //Only after the last message received
+    uint64_t next_lc = resume ? get_next_lc(cur_server) : state->restored_lc; //Else after the storage file
+    int len;
 
-    char* to_append = get_first_n_messages(msg_matrix, get_capacity(msg_matrix), MSG_W_LC);
-    int_fast32_t nbytes = 0;
-    if (!to_append) {
-        nbytes = snprintf(response_buffer, STRING_SIZE * (get_capacity(msg_matrix) + 1), "%s\n\n", SMESSAGE_CODE);
+    if (get_send_queue(cur_server)->binary) { //The clock is sent plus one, 0 asks for everything
+        len = put_binary_header(request + BINARY_HEADER_MAX, BINARY_GET, next_lc);
+        return queue_to_server(state, cur_server, request + BINARY_HEADER_MAX - len, len);
+    }
+    if (0 < next_lc) {
+        len = snprintf(request, STRING_SIZE, "SGET_MESSAGES %" PRIu64 "\n", next_lc - 1);
     } else {
-        nbytes = snprintf(response_buffer, STRING_SIZE * (get_capacity(msg_matrix) + 1), "%s\n%s\n", SMESSAGE_CODE, to_append);
+        len = snprintf(request, STRING_SIZE, "SGET_MESSAGES\n");
     }
-    free(to_append);
+    return queue_to_server(state, cur_server, request, len);
+}
 
-    char *ptr = response_buffer;
-    int_fast32_t nleft = nbytes;
-    while (0 < nleft) {
-        nwritten = write(fd,ptr + nwritten, nleft - nwritten);
-        nleft = nleft - nwritten;
-        if (0 >= nwritten) {//error
-            exit_code = 1;
-            break;
+uint_fast8_t send_hello(struct server_state *state, server cur_server) {
+    char hello[STRING_SIZE];
+
+    int len = snprintf(hello, STRING_SIZE, "%s %d %hu %hu\n", HELLO_CODE, state->text_only ? 0 : BINARY_VERSION,
+            get_udp_port(state->host), get_tcp_port(state->host));
+    return queue_to_server(state, cur_server, hello, len);
+}
+
+// switch_to_binary sends BINARY, every frame queued after it is binary. Returns 1 if the server was dropped
+static uint_fast8_t switch_to_binary(struct server_state *state, server cur_server, int version) {
+    struct send_queue *queue = get_send_queue(cur_server);
+    char marker[STRING_SIZE];
+
+    if (queue->binary) {
+        return 0;
+    }
+    version = version < BINARY_VERSION ? version : BINARY_VERSION; //The highest both servers know
+    int len = snprintf(marker, STRING_SIZE, "%s %d\n", BINARY_CODE, version);
+    if (queue_to_server(state, cur_server, marker, len)) {
+        return 1;
+    }
+    queue->binary = true;
+    queue->compress = COMPRESSED_VERSION <= version;
+    return 0;
+}
+
+int watch_server(struct server_state *state, server cur_server) {
+    return loop_add_stream(state->loop, get_fd(cur_server), EV_READ,
+            server_treat_communications, server_receive_stream, (item)cur_server, (void *)state);
+}
+
+void drop_server(struct server_state *state, server cur_server) {
+    retire_from_registry(state->peers, get_server_key(cur_server), cur_server);
+    remember_server(state, cur_server);
+    if (0 < get_fd(cur_server)) {
+        loop_del_fd(state->loop, get_fd(cur_server));
+    }
+    close_communication(cur_server);
+    state->prune = true;
+
+    if (cur_server == state->snapshot_server) { //Ask the next connected server
+        state->snapshot_server = NULL;
+        request_snapshot(state);
+    }
+}
+
+// update_watch reads the server unless it is throttled or stalled, and waits for writability while bytes are queued
+static void update_watch(struct server_state *state, server cur_server) {
+    struct send_queue *queue = get_send_queue(cur_server);
+    bool paused = queue->throttled || get_parser(cur_server)->stalled;
+    uint32_t events = (paused ? 0 : EV_READ) | (queue->len ? EV_WRITE : 0);
+
+    loop_mod_fd(state->loop, get_fd(cur_server), events);
+}
+
+// append_to_queue copies bytes after the queued ones, the buffer grows if needed
+static void append_to_queue(struct send_queue *queue, const char *data, size_t len) {
+    if (queue->head + queue->len + len > queue->size) {
+        memmove(queue->buffer, queue->buffer + queue->head, queue->len);
+        queue->head = 0;
+    }
+    if (queue->len + len > queue->size) {
+        size_t new_size = queue->size ? queue->size : RX_BUFFER_SIZE;
+        while (new_size < queue->len + len) {
+            new_size *= 2;
+        }
+        queue->buffer = (char *)realloc(queue->buffer, new_size);
+        if (!queue->buffer) {
+            memory_error("Unable to reserve server send queue memory");
         }
+        queue->size = new_size;
     }
+    memcpy(queue->buffer + queue->head + queue->len, data, len);
+    queue->len += len;
+}
 
-    free(response_buffer);
-    return exit_code;
+// flush_server sends what the socket takes from the queue, returns 1 if the server was dropped
+static uint_fast8_t flush_server(struct server_state *state, server cur_server) {
+    struct send_queue *queue = get_send_queue(cur_server);
+
+    while (0 < queue->len) {
+        ssize_t nwritten = send(get_fd(cur_server), queue->buffer + queue->head, queue->len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (0 > nwritten) {
+            if (EINTR == errno) continue;
+            if (EAGAIN == errno || EWOULDBLOCK == errno) break;
+            if (_VERBOSE_TEST) printf("\nerror sending communication TCP\n");
+            drop_server(state, cur_server);
+            return 1;
+        }
+        queue->head += nwritten;
+        queue->len -= nwritten;
+    }
+    if (0 == queue->len) {
+        queue->head = 0;
+    }
+
+    if (queue->throttled && queue->len <= state->send_low) { //Caught up, read it again
+        queue->throttled = false;
+    }
+    if (get_snapshot_stream(cur_server)->active && pump_snapshot(state, cur_server)) {
+        return 1;
+    }
+    update_watch(state, cur_server);
+    return 0;
 }
 
-// cnt_array[0] must be of type char*
-void send_to_server(item obj, void *cnt_array[]) {
-    int_fast16_t nleft, nwritten = 0;
-    server cur_server = (server) obj;
-    int fd = get_fd(cur_server); //file descriptor/socket
-    char *ptr = NULL;
-    char *msg = (char *)cnt_array[0];
-
-    ptr = msg;
-    nleft = strlen(ptr);
-    while (0 < nleft) {
-        nwritten = write(fd,ptr + nwritten, nleft - nwritten);
-        nleft = nleft - nwritten;
-        if (-1 == nwritten) {
+uint_fast8_t queue_to_server(struct server_state *state, server cur_server, const char *data, size_t len) {
+    struct send_queue *queue = get_send_queue(cur_server);
+    bool was_empty = (0 == queue->len);
+
+    if (0 >= get_fd(cur_server) || !get_connected(cur_server)) { //Still connecting
+        return 1;
+    }
+
+    if (was_empty) { //Straight to the socket, only the rest is copied
+        ssize_t nwritten = send(get_fd(cur_server), data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (0 > nwritten && EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno) {
             if (_VERBOSE_TEST) printf("\nerror sending communication TCP\n");
-            close_fd(fd);
-            set_fd(cur_server, -1);
-            set_connected(cur_server, 0);
-            return;
-        } //error
+            drop_server(state, cur_server);
+            return 1;
+        }
+        if (0 < nwritten) {
+            data += nwritten;
+            len -= nwritten;
+        }
+        if (0 == len) {
+            return 0;
+        }
+    } else if (queue->len + len > state->send_high * SEND_LIMIT_FACTOR) { //Too far behind
+        if (_VERBOSE_TEST) printf(KYEL "\nserver %s is too slow, disconnected\n" KNRM, get_ip_address(cur_server));
+        drop_server(state, cur_server);
+        return 1;
+    }
+
+    append_to_queue(queue, data, len);
+    if (queue->len > state->send_high) {
+        queue->throttled = true;
+    }
+    if (was_empty || queue->throttled) {
+        update_watch(state, cur_server);
     }
+    return 0;
 }
 
-uint_fast8_t share_last_message(list servers_list, matrix msg_matrix) {
-    uint_fast8_t exit_code = 0;
-    char *response_buffer = NULL;
+void share_messages(struct server_state *state, const char *frame, size_t len, const char *binary, size_t binary_len) {
+    if (_VERBOSE_TEST) printf(KCYN "\nSharing messages %.*s\n" KNRM, (int)len, frame);
+
+    server cur_server;
+    for_each_server(cur_server, &state->connected) {
+        if (get_snapshot_stream(cur_server)->active) {
+            continue; //Its reply reads these messages from the matrix, in order
+        } else if (get_send_queue(cur_server)->binary) {
+            queue_to_server(state, cur_server, binary, binary_len);
+        } else {
+            queue_to_server(state, cur_server, frame, len);
+        }
+    }
+}
 
-    if (_VERBOSE_TEST) printf(KCYN "\nSharing last message %s\n" KNRM, get_string(get_element(msg_matrix, get_size(msg_matrix) - 1)));
+struct _udp_batch {
+    //Ingress, filled by one recvmmsg
+    struct mmsghdr     in_msgs[UDP_BATCH];
+    struct iovec       in_iov[UDP_BATCH];
+    struct sockaddr_in in_addr[UDP_BATCH];
+    char               in_buf[UDP_BATCH][RESPONSE_SIZE + 1];
+    //Egress, flushed by one sendmmsg
+    struct mmsghdr     out_msgs[UDP_BATCH];
+    struct iovec       out_iov[UDP_BATCH][3]; //Header and at most two slices of the wire ring
+    arena              scratch;  //Reply bodies, reset after the flush
+    uint_fast16_t      nout;
+    //Worker mode, PUBLISH goes to the writer thread
+    mpsc_queue         publish_queue;
+    int                wake_fd;
+    wal                log;      //Durable PUBLISH, NULL if none
+    //Stats
+    uint64_t           batches;
+    uint64_t           datagrams;
+    uint64_t           syscalls; //recvmmsg and sendmmsg
+    uint64_t           stalls;   //Times the queue was full, see is_batch_stalled
+    //Datagrams not handled yet, from the PUBLISH that did not fit the queue
+    int                pending;
+    int                pending_count;
+};
+
+udp_batch create_udp_batch() {
+    udp_batch new_batch = (udp_batch)calloc(1, sizeof(struct _udp_batch));
+    if (!new_batch) {
+        memory_error("Unable to reserve udp batch memory");
+    }
 
-    response_buffer = (char *)alloca(2 * STRING_SIZE);
-    if (NULL == response_buffer) {
-        memory_error("unable to allocate response while sharing last message");
-        return EXIT_FAILURE;
+    for (int i = 0; i < UDP_BATCH; i++) {
+        new_batch->in_iov[i].iov_base = new_batch->in_buf[i];
+        new_batch->in_iov[i].iov_len = RESPONSE_SIZE;
+        new_batch->in_msgs[i].msg_hdr.msg_iov = &new_batch->in_iov[i];
+        new_batch->in_msgs[i].msg_hdr.msg_iovlen = 1;
+        new_batch->in_msgs[i].msg_hdr.msg_name = &new_batch->in_addr[i];
     }
-    snprintf(response_buffer, STRING_SIZE * 2, "%s\n%d;%s\n",
-            SMESSAGE_CODE, get_lc(get_element(msg_matrix, get_size(msg_matrix) - 1)), get_string(get_element(msg_matrix, get_size(msg_matrix) - 1)));
+    new_batch->wake_fd = -1;
+    new_batch->scratch = create_arena(BATCH_SCRATCH_SIZE);
+    return new_batch;
+}
 
-    for_each_element(servers_list, send_to_server, (void*[]){(void *)response_buffer});
-    return exit_code;
+void set_publish_queue(udp_batch this, mpsc_queue publish_queue, int wake_fd) {
+    this->publish_queue = publish_queue;
+    this->wake_fd = wake_fd;
 }
 
+void set_batch_wal(udp_batch this, wal log) {
+    this->log = log;
+}
 
-uint_fast8_t handle_get_messages(int fd, struct sockaddr *address, int addrlen, matrix msg_matrix, char *input_buffer) {
+void free_udp_batch(udp_batch this) {
+    if (!this) {
+        return;
+    }
+    free_arena(this->scratch);
+    free(this);
+}
+
+void print_batch_stats(udp_batch this) {
+    printf(KBLU "UDP batches:" KNRM " %lu " KBLU "Datagrams:" KNRM " %lu " KBLU "Average batch:" KNRM " %.2f "
+            KBLU "UDP syscalls:" KNRM " %lu\n",
+            (unsigned long)this->batches, (unsigned long)this->datagrams,
+            this->batches ? (double)this->datagrams / this->batches : 0.0, (unsigned long)this->syscalls);
+    if (this->publish_queue) {
+        printf(KBLU "Queue full stalls:" KNRM " %lu " KBLU "Scratch mallocs:" KNRM " %lu\n",
+                (unsigned long)this->stalls, (unsigned long)get_arena_mallocs(this->scratch));
+    }
+}
+
+// queue_reply adds a reply to the sendmmsg batch. slices point at the wire ring,
+// or at a copy in the batch arena, and are sent as they are.
+static void queue_reply(udp_batch batch, int i, struct iovec *slices, int count) {
+    uint_fast16_t o = batch->nout++;
+    struct msghdr *hdr = &batch->out_msgs[o].msg_hdr;
+
+    batch->out_iov[o][0].iov_base = (void *)(MESSAGE_CODE "\n");
+    batch->out_iov[o][0].iov_len = strlen(MESSAGE_CODE "\n");
+    for (int s = 0; s < count; s++) {
+        batch->out_iov[o][s + 1] = slices[s];
+    }
+
+    memset(hdr, 0, sizeof(struct msghdr));
+    hdr->msg_name = &batch->in_addr[i];
+    hdr->msg_namelen = batch->in_msgs[i].msg_hdr.msg_namelen;
+    hdr->msg_iov = batch->out_iov[o];
+    hdr->msg_iovlen = count + 1;
+}
+
+// flush_replies sends every queued reply with as few sendmmsg calls as possible
+static uint_fast8_t flush_replies(int fd, udp_batch batch) {
     uint_fast8_t exit_code = 0;
-    char *response_buffer;
-    char *to_append;
+    uint_fast16_t sent = 0;
+
+    while (sent < batch->nout) {
+        batch->syscalls++;
+        int n = sendmmsg(fd, &batch->out_msgs[sent], batch->nout - sent, 0);
+        if (0 > n) {
+            if (EINTR == errno) continue;
+            if (_VERBOSE_TEST) printf("\nerror sending communication UDP\n");
+            exit_code = 1;
+            sent++; //Skip the reply that failed
+        } else {
+            sent += n;
+        }
+    }
+
+    reset_arena(batch->scratch);
+    batch->nout = 0;
+    return exit_code;
+}
+
+uint_fast8_t handle_get_messages(udp_batch batch, int i, matrix msg_matrix, char *input_buffer) {
+    struct iovec slices[2];
 
     uint_fast32_t num = atoi(input_buffer);
     if (1 > num) {
         return 1;
     }
 
-    num = get_capacity(msg_matrix) < num ? get_capacity(msg_matrix) : num;
-    num = get_size(msg_matrix) < num ? get_size(msg_matrix) : num;
+    num = get_size(msg_matrix) - get_first(msg_matrix) < num ? get_size(msg_matrix) - get_first(msg_matrix) : num;
 
-    to_append = get_first_n_messages(msg_matrix, num, MSG_WO_LC);
+    if (batch->publish_queue) { //Worker thread, the writer may change the ring while sending
+        char *to_append = get_first_n_messages(msg_matrix, num, MSG_WO_LC, batch->scratch);
+        slices[0].iov_base = to_append;
+        slices[0].iov_len = to_append ? strlen(to_append) : 0;
+        queue_reply(batch, i, slices, to_append ? 1 : 0);
+    } else { //Writer thread, the ring keeps the bytes until the flush
+        queue_reply(batch, i, slices, get_last_n_wire(msg_matrix, num, MSG_WO_LC, slices));
+    }
 
-    if (NULL != to_append) {
-        response_buffer = (char *)malloc(sizeof(char) * STRING_SIZE * (num + 1));
-        snprintf(response_buffer, STRING_SIZE * (num + 1), "%s\n%s", "MESSAGES", to_append);
+    return 0;
+}
 
-        int read_size = sendto(fd, response_buffer, strlen(response_buffer), 0,
-                address, addrlen);
+uint_fast8_t handle_publish(matrix msg_matrix, wal log, char *input_buffer) {
+    message stored = store_message(msg_matrix, input_buffer);
+    if (log) { //Synced with the rest of the loop iteration, see commit_wal
+        append_wal(log, get_lc(stored), get_string(stored));
+    }
+    return 2;
+}
 
-        free(to_append);
-        if (-1 == read_size) {
-            if (_VERBOSE_TEST) printf("\nerror sending communication UDP\n");
-            exit_code = 1;
+// queue_publish hands the message to the writer thread, returns false if the queue is full
+static bool queue_publish(udp_batch batch, char *input_buffer) {
+    struct publish_record record;
+
+    strncpy(record.content, input_buffer, STRING_SIZE - 1);
+    record.content[STRING_SIZE - 1] = '\0';
+    return mpsc_push(batch->publish_queue, &record);
+}
+
+// process_client_batch handles the datagrams of the batch from first on, replies are only queued.
+// A PUBLISH the queue has no room for stops it, that datagram and the next ones are kept for later
+static uint_fast32_t process_client_batch(udp_batch batch, int first, int count, matrix msg_matrix) {
+    uint_fast32_t published = 0, queued = 0;
+
+    batch->pending_count = 0;
+    for (int i = first; i < count; i++) {
+        char op[STRING_SIZE] = {'\0'};
+        char input_buffer[STRING_SIZE] = {'\0'};
+        char *buffer = batch->in_buf[i];
+
+        buffer[batch->in_msgs[i].msg_len] = '\0';
+        sscanf(buffer, "%140s%*[ ]%140[^\n]" , op, input_buffer); // Grab word, then throw away space and finally grab until \n
+
+        if (_VERBOSE_TEST) puts(buffer);
+
+        if (0 == strcmp("PUBLISH", op)) {
+            if (batch->publish_queue) {
+                if (!queue_publish(batch, input_buffer)) {
+                    batch->stalls++;
+                    batch->pending = i;
+                    batch->pending_count = count;
+                    break;
+                }
+                queued++;
+            } else if (2 == handle_publish(msg_matrix, batch->log, input_buffer)) {
+                published++;
+            }
+        } else if (0 == strcmp("GET_MESSAGES", op)) {
+            handle_get_messages(batch, i, msg_matrix, input_buffer);
         }
-        free(response_buffer);
-    } else {
-        int_fast8_t nwritten = sendto(fd, "MESSAGES\n", strlen("MESSAGES\n"), 0,
-                address, addrlen);
+    }
 
-        if (-1 == nwritten) {
-            if (_VERBOSE_TEST) printf("\nerror sending communication UDP\n");
-            exit_code = 1;
+    if (0 < queued) { //One wakeup per batch
+        uint64_t one = 1;
+        if ((ssize_t)sizeof(one) != write(batch->wake_fd, &one, sizeof(one)) && _VERBOSE_TEST) {
+            printf("\nerror waking the writer thread\n");
         }
     }
+    return published;
+}
 
-    return exit_code;
+uint_fast32_t handle_client_comms(int fd, udp_batch batch, matrix msg_matrix) {
+    uint_fast32_t published = 0;
+
+    if (batch->pending_count) { //The rest of a stalled batch goes first, the socket is read only after it
+        process_client_batch(batch, batch->pending, batch->pending_count, msg_matrix);
+        flush_replies(fd, batch);
+        if (batch->pending_count) {
+            return 0;
+        }
+    }
+
+    for (int round = 0; round < UDP_BATCH_ROUNDS; round++) {
+        for (int i = 0; i < UDP_BATCH; i++) {
+            batch->in_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+
+        batch->syscalls++;
+        int count = recvmmsg(fd, batch->in_msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+        if (0 >= count) {
+            if (0 > count && EAGAIN != errno && EWOULDBLOCK != errno) {
+                if (_VERBOSE_TEST) printf("\nUDP receive error\n");
+            }
+            break;
+        }
+        batch->batches++;
+        batch->datagrams += count;
+
+        published += process_client_batch(batch, 0, count, msg_matrix);
+        flush_replies(fd, batch);
+
+        if (batch->pending_count || UDP_BATCH > count) { //Queue full or socket drained
+            break;
+        }
+    }
+    return published;
 }
 
-uint_fast8_t handle_publish(matrix msg_matrix, char *input_buffer) {
-    add_element(msg_matrix, get_size(msg_matrix),
-            (item)new_message(input_buffer), free_message);
-    return 2;
+// handle_client_datagrams copies the datagrams into the batch, a recvmmsg batch at a time
+uint_fast32_t handle_client_datagrams(int fd, udp_batch batch, struct ev_datagram *dgrams, int count, matrix msg_matrix) {
+    uint_fast32_t published = 0;
+
+    for (int first = 0; first < count; first += UDP_BATCH) {
+        int n = UDP_BATCH < count - first ? UDP_BATCH : count - first;
+
+        for (int i = 0; i < n; i++) { //Same layout as a recvmmsg batch
+            struct ev_datagram *dgram = &dgrams[first + i];
+            size_t len = dgram->len < RESPONSE_SIZE ? dgram->len : RESPONSE_SIZE;
+
+            memcpy(batch->in_buf[i], dgram->data, len);
+            batch->in_msgs[i].msg_len = len;
+            memcpy(&batch->in_addr[i], dgram->from, sizeof(struct sockaddr_in));
+            batch->in_msgs[i].msg_hdr.msg_namelen = dgram->fromlen;
+        }
+        batch->batches++;
+        batch->datagrams += n;
+
+        published += process_client_batch(batch, 0, n, msg_matrix);
+        flush_replies(fd, batch);
+    }
+    return published;
 }
 
-uint_fast8_t handle_client_comms(int fd, matrix msg_matrix) {
-    char buffer[RESPONSE_SIZE] = {'\0'};
-    char op[STRING_SIZE] = {'\0'};
-    char input_buffer[STRING_SIZE] = {'\0'};
-    uint_fast8_t err = 0;
+bool is_batch_stalled(udp_batch this) {
+    return 0 < this->pending_count;
+}
 
-    struct sockaddr_in receive_address = {0, .sin_port = 0};
-    uint_fast16_t addrlen = sizeof(receive_address);
+uint64_t get_batch_syscalls(udp_batch this) {
+    return this->syscalls;
+}
 
-    int_fast16_t read_size = recvfrom(fd, buffer, sizeof(buffer), 0,
-            (struct sockaddr *)&receive_address, (socklen_t*)&addrlen);
+uint64_t get_batch_datagrams(udp_batch this) {
+    return this->datagrams;
+}
 
-    if (-1 == read_size) {
-        if (_VERBOSE_TEST) printf("\nUDP receive error\n");
+// ingest_record hands a message received from a server to the client thread. Returns false if the
+// ring is full: the server is stalled, and the record parsed again once the client thread drained it
+static bool ingest_record(struct server_state *state, server cur_server, struct replicated_message *record) {
+    if (!spsc_push(state->ingest_queue, record)) {
+        //The client thread sees the flag after its pops, or we see the room they made
+        atomic_store(&state->ingest_full, true);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!spsc_push(state->ingest_queue, record)) {
+            get_parser(cur_server)->stalled = true;
+            state->ingest_paused = true;
+            return false;
+        }
+    }
+
+    if (get_synced(cur_server) && record->lc >= get_next_lc(cur_server)) {
+        set_next_lc(cur_server, record->lc + 1);
+    }
+    return true;
+}
+
+// snapshot_arrived ends the join once the server asked for the messages answers
+static void snapshot_arrived(struct server_state *state, server cur_server) {
+    if (cur_server == state->snapshot_server) {
+        state->snapshot_server = NULL;
+        state->snapshot_wanted = false;
+        set_synced(cur_server, true);
+    }
+}
+
+// parse_message hands a message received from a server to the client thread, which stores it
+uint_fast8_t parse_message(struct server_state *state, server cur_server, char *info) {
+    struct replicated_message record;
+    char *content;
+
+    record.lc = strtoull(info, &content, 10);
+    if (content == info || ';' != *content) {
+        if (_VERBOSE_TEST) fprintf(stdout, KRED "error processing server data. data is invalid or corrupt\n" KNRM);
         return 1;
     }
 
-    sscanf(buffer, "%s%*[ ]%140[^\n]" , op, input_buffer); // Grab word, then throw away space and finally grab until \n
-    input_buffer[strlen(input_buffer)] = '\0';
+    size_t len = strnlen(++content, STRING_SIZE - 1);
+    memcpy(record.content, content, len);
+    record.content[len] = '\0';
 
-    if (_VERBOSE_TEST) puts(buffer);
+    return ingest_record(state, cur_server, &record) ? 0 : 2;
+}
 
-    if (0 == strcmp("PUBLISH", op)) {
-        err = handle_publish(msg_matrix, input_buffer);
-    } else if (0 == strcmp("GET_MESSAGES", op)) {
-        err = handle_get_messages(fd, (struct sockaddr *)&receive_address,
-                addrlen, msg_matrix, input_buffer);
+// parse_line handles one complete line of the stream, returns 1 if the server was dropped
+static uint_fast8_t parse_line(struct server_state *state, server cur_server, struct stream_parser *parser,
+        char *line, uint_fast32_t *ingested) {
+    if (0 == strncmp("SGET_MESSAGES", line, strlen("SGET_MESSAGES"))
+            && ('\0' == line[strlen("SGET_MESSAGES")] || ' ' == line[strlen("SGET_MESSAGES")])) {
+        bool delta = ' ' == line[strlen("SGET_MESSAGES")]; //"SGET_MESSAGES lc", only newer messages
+        uint64_t since = delta ? strtoull(line + strlen("SGET_MESSAGES "), NULL, 10) : 0;
+        if (handle_sget_messages(state, cur_server, delta, since) && -1 == get_fd(cur_server)) {
+            return 1; //Dropped
+        }
+    } else if (0 == strcmp("SMESSAGES", line)) {
+        parser->state = STREAM_SMESSAGES;
+        snapshot_arrived(state, cur_server);
+    } else if (0 == strncmp(HELLO_CODE " ", line, strlen(HELLO_CODE " "))) { //Binary offered, and its ports
+        int version = 0;
+        u_short udp_port = 0, tcp_port = 0;
+        sscanf(line + strlen(HELLO_CODE " "), "%d %hu %hu", &version, &udp_port, &tcp_port);
+        if (0 == get_udp_port(cur_server) && 0 < udp_port && 0 < tcp_port) { //Inbound, sent once
+            identify_server(state, cur_server, udp_port, tcp_port);
+        }
+        if (!state->text_only && 1 <= version) {
+            return switch_to_binary(state, cur_server, version);
+        }
+    } else if (!state->text_only && 0 == strncmp(BINARY_CODE " ", line, strlen(BINARY_CODE " "))) { //The rest of its stream is binary
+        parser->state = STREAM_BINARY;
+        return switch_to_binary(state, cur_server, atoi(line + strlen(BINARY_CODE " ")));
+    } else if (STREAM_SMESSAGES == parser->state) {
+        if ('\0' == line[0]) { //Empty line ends the block
+            parser->state = STREAM_COMMAND;
+        } else {
+            uint_fast8_t parsed = parse_message(state, cur_server, line);
+            if (1 == parsed) {
+                printf("Failed to parse_message %s \n", line);
+            } else if (0 == parsed) {
+                (*ingested)++;
+            }
+        }
     }
-    return err;
+    return 0;
 }
 
-uint_fast8_t parse_message(matrix msg_matrix, char *info) {
-    char msg[STRING_SIZE];
-    char lc_buffer[6];
-    uint_fast32_t mess_lc;
-    int sscanf_state = 0;
+static uint_fast8_t parse_binary(struct server_state *state, server cur_server, struct stream_parser *parser,
+        const char *data, size_t len, size_t *used, uint_fast32_t *ingested);
+
+// parse_inflated parses the decompressed bytes, the rest of a record or of a stall is kept.
+// Returns 1 if the server was dropped
+static uint_fast8_t parse_inflated(struct server_state *state, server cur_server, uint_fast32_t *ingested) {
+    struct stream_parser *inflated = get_inflated_parser(cur_server);
+    size_t used;
 
-    sscanf_state = sscanf(info, "%[^;];%140[^\n]",lc_buffer, msg); //Separates info and saves it in variables
-    if (2 != sscanf_state) {
-        if (_VERBOSE_TEST) fprintf(stdout, KRED "error processing id server data. data is invalid or corrupt\n" KNRM);
+    if (parse_binary(state, cur_server, inflated, inflated->buffer, inflated->len, &used, ingested)) {
         return 1;
     }
+    inflated->len -= used;
+    memmove(inflated->buffer, inflated->buffer + used, inflated->len);
+    return 0;
+}
+
+// inflate_block decompresses a BINARY_COMPRESSED block after the bytes the last one left and parses them.
+// Returns 1 if the server was dropped
+static uint_fast8_t inflate_block(struct server_state *state, server cur_server, const char *block, size_t len,
+        size_t raw_len, uint_fast32_t *ingested) {
+    struct stream_parser *inflated = get_inflated_parser(cur_server);
 
-    mess_lc = atoi(lc_buffer);
-    if (mess_lc > g_lc) {
-        g_lc = mess_lc;
+    if (raw_len != lz_decompress(block, len, inflated->buffer + inflated->len, RX_BUFFER_SIZE - inflated->len)) {
+        if (_VERBOSE_TEST) printf(KRED "\nmalformed compressed block from server, dropped\n" KNRM);
+        drop_server(state, cur_server);
+        return 1;
     }
+    inflated->len += raw_len;
+    return parse_inflated(state, cur_server, ingested);
+}
+
+// parse_binary handles the frames after BINARY, only whole records are used.
+// Returns 1 if the server was dropped, for a malformed frame too
+static uint_fast8_t parse_binary(struct server_state *state, server cur_server, struct stream_parser *parser,
+        const char *data, size_t len, size_t *used, uint_fast32_t *ingested) {
+    bool nested = (parser == get_parser(cur_server)->inflated); //Compressed blocks hold no compressed frames
+    struct replicated_message record;
+    size_t pos = 0;
+
+    while (pos < len) {
+        const char *cur = data + pos;
+        size_t left = len - pos, lc_len, value_len;
+        uint64_t lc, value = 0;
+
+        if (STREAM_BINARY_MESSAGES == parser->state) { //One record
+            lc_len = get_varint(cur, left, &lc);
+            value_len = lc_len ? get_varint(cur + lc_len, left - lc_len, &value) : 0;
+            if (value_len && STRING_SIZE <= value) {
+                break; //Malformed
+            } else if (!value_len || left - lc_len - value_len < value) {
+                if (BINARY_RECORD_MAX <= left) {
+                    break; //Malformed
+                }
+                *used = pos;
+                return 0; //Incomplete, kept for the next read
+            }
+
+            record.lc = lc;
+            memcpy(record.content, cur + lc_len + value_len, value);
+            record.content[value] = '\0';
+            if (!ingest_record(state, cur_server, &record)) {
+                *used = pos;
+                return 0; //Stalled, the record is parsed again
+            }
+            (*ingested)++;
+            pos += lc_len + value_len + value;
+            if (0 == --parser->remaining) {
+                parser->state = STREAM_BINARY;
+            }
+            continue;
+        }
+
+        uint8_t type = (uint8_t)cur[0]; //Frame header
+        if (BINARY_MESSAGES != type && BINARY_GET != type && (BINARY_COMPRESSED != type || nested)) {
+            break; //Malformed
+        }
+        value_len = 1 < left ? get_varint(cur + 1, left - 1, &value) : 0;
+        if (!value_len) {
+            if (BINARY_HEADER_MAX <= left) {
+                break; //Malformed
+            }
+            *used = pos;
+            return 0;
+        }
 
-    add_element(msg_matrix, get_size(msg_matrix), (item)new_message(msg), free_message);
+        if (BINARY_COMPRESSED == type) { //Raw length, then the block length
+            uint64_t block_len = 0;
+            size_t header_len = 1 + value_len;
+            size_t block_len_len = get_varint(cur + header_len, left - header_len, &block_len);
+            if (COMPRESS_BLOCK < value || lz_bound(COMPRESS_BLOCK) < block_len
+                    || (!block_len_len && 1 + 2 * VARINT_MAX <= left)) {
+                break; //Malformed
+            } else if (!block_len_len || left - header_len - block_len_len < block_len) {
+                *used = pos;
+                return 0; //Incomplete, it always fits in the receive buffer
+            }
+            header_len += block_len_len;
+            if (inflate_block(state, cur_server, cur + header_len, block_len, value, ingested)) {
+                return 1;
+            }
+            pos += header_len + block_len;
+            if (get_parser(cur_server)->stalled) { //The rest of the block waits in the inflated parser
+                *used = pos;
+                return 0;
+            }
+            continue;
+        }
+        pos += 1 + value_len;
 
+        if (BINARY_MESSAGES == type) {
+            if (0 == value) { //Only a reply ends with an empty frame
+                snapshot_arrived(state, cur_server);
+            }
+            parser->remaining = value;
+            parser->state = value ? STREAM_BINARY_MESSAGES : STREAM_BINARY;
+        } else if (handle_sget_messages(state, cur_server, 0 < value, value - 1)
+                && -1 == get_fd(cur_server)) {
+            return 1; //Dropped
+        }
+    }
+
+    if (pos < len) {
+        if (_VERBOSE_TEST) printf(KRED "\nmalformed binary frame from server, dropped\n" KNRM);
+        drop_server(state, cur_server);
+        return 1;
+    }
+    *used = pos;
     return 0;
 }
 
-// cnt_array[0] must be of type matrix and cnt_array[1] must be of type *fd_set
-void server_treat_communications(item obj, void *cnt_array[]) {
-    //Opt Args
-    matrix msg_matrix = (matrix) cnt_array[0];
-    fd_set *rfds = (fd_set *) cnt_array[1];
+uint_fast32_t parse_stream(struct server_state *state, server cur_server) {
+    struct stream_parser *parser = get_parser(cur_server);
+    char *line = parser->buffer, *end = parser->buffer + parser->len, *newline;
+    uint_fast32_t ingested = 0;
+
+    while (line < end) {
+        if (STREAM_BINARY <= parser->state) { //Switched by BINARY, for good
+            size_t used;
+            if (parse_binary(state, cur_server, parser, line, end - line, &used, &ingested)) {
+                return ingested; //Dropped, the parser was reset
+            }
+            line += used;
+            break;
+        }
+        if (NULL == (newline = memchr(line, '\n', end - line))) {
+            break;
+        }
+        *newline = '\0';
+        if (parse_line(state, cur_server, parser, line, &ingested)) {
+            return ingested; //Dropped, the parser was reset
+        }
+        if (parser->stalled) { //The line is parsed again
+            *newline = '\n';
+            break;
+        }
+        line = newline + 1;
+    }
+
+    parser->len = end - line;
+    if (RX_BUFFER_SIZE == parser->len && !parser->stalled) { //No line is this long, throw it away
+        if (_VERBOSE_TEST) printf(KRED "\nline too long from server, discarded\n" KNRM);
+        parser->len = 0;
+    } else if (line != parser->buffer) { //Keep the incomplete line
+        memmove(parser->buffer, line, parser->len);
+    }
+    return ingested;
+}
+
+// wake_client tells the client thread messages wait in the ingest ring
+static void wake_client(struct server_state *state) {
+    uint64_t one = 1;
+    if ((ssize_t)sizeof(one) != write(state->ingest_fd, &one, sizeof(one)) && _VERBOSE_TEST) {
+        printf("\nerror waking the client thread\n");
+    }
+}
+
+// Runs only when the server fd is ready, obj is the server and arg the shared state
+void server_treat_communications(int fd, uint32_t events, item obj, void *arg) {
+    struct server_state *state = (struct server_state *)arg;
     server cur_server = (server)obj;
-    int fd = get_fd(cur_server);
-    int_fast32_t nread = 0;
+    struct stream_parser *parser = get_parser(cur_server);
+    uint_fast32_t ingested = 0;
 
-    char *to_hold = (char *)malloc(RESPONSE_SIZE);
-    if (!to_hold) {
-        memory_error("tcp_fd_handle");
+    if ((events & EV_WRITE) && flush_server(state, cur_server)) {
+        return; //Dropped
+    }
+    if (!(events & (EV_READ | EV_ERROR))) {
         return;
     }
-    memset(to_hold, '\0', RESPONSE_SIZE);
 
-    char *to_analyze = (char *)malloc(STRING_SIZE * 3);
-    if (!to_analyze) {
-        memory_error("tcp_fd_handle");
-        return;
+    while (!get_send_queue(cur_server)->throttled && !parser->stalled) {
+        state->peer_reads++;
+        ssize_t nread = recv(fd, parser->buffer + parser->len, RX_BUFFER_SIZE - parser->len, MSG_DONTWAIT);
+        if (0 == nread) {
+            drop_server(state, cur_server);
+            break;
+        } else if (0 > nread) {
+            if (EINTR == errno) continue;
+            break;
+        }
+        state->peer_bytes += nread;
+        parser->len += nread;
+
+        ingested += parse_stream(state, cur_server);
+        if (-1 == get_fd(cur_server)) { //Dropped while parsing
+            break;
+        } else if (parser->stalled) { //Not read until the client thread drains the ring
+            update_watch(state, cur_server);
+        }
     }
-    memset(to_analyze, '\0', STRING_SIZE * 3);
 
+    if (0 < ingested) { //One wakeup per read
+        wake_client(state);
+    }
+}
 
-    uint_fast8_t err = 0, sms_state = 0;
-    char *aux_token, *token;
-    if (FD_ISSET(fd, rfds)) {
-        while (nread != -1) {
-            char micro_buffer[STRING_SIZE] = {'\0'};
-            nread = recv(fd, micro_buffer, STRING_SIZE - 1, MSG_DONTWAIT);
-            if (0 == nread) {
-                close_communication(cur_server);
-                break;
-            } else if (-1 == nread) {
-                break;
-            }
+size_t server_receive_stream(int fd, char *data, size_t len, item obj, void *arg) {
+    struct server_state *state = (struct server_state *)arg;
+    server cur_server = (server)obj;
+    struct stream_parser *parser = get_parser(cur_server);
+    uint_fast32_t ingested = 0;
+    size_t taken = 0;
+    (void)fd;
+
+    if (0 == len) {
+        drop_server(state, cur_server);
+        return 0;
+    }
 
-            bool message_end = false;
-            if(micro_buffer[nread - 1] == '\n') {
-                message_end = true;
-            }
+    state->peer_reads++;
+    while (taken < len && !get_send_queue(cur_server)->throttled && !parser->stalled) {
+        size_t room = RX_BUFFER_SIZE - parser->len;
+        size_t n = len - taken < room ? len - taken : room;
+        if (0 == n) { //parse_stream always makes room unless stalled
+            break;
+        }
+        memcpy(parser->buffer + parser->len, data + taken, n);
+        parser->len += n;
+        taken += n;
+        state->peer_bytes += n;
 
-            /* printf("MicroBuffer: %s\n", micro_buffer); */
-            token = strtok(micro_buffer, "\n");
-            while (token) {
-                /* printf("Token: %s\n", token); */
-                aux_token = strtok(NULL, "\n");
-                if (aux_token) {
-                    if (strlen(to_hold)) {
-                        snprintf(to_analyze, STRING_SIZE * 3, "%s%s", to_hold, token);
-                        to_hold[0] = '\0';
-                    } else {
-                        memcpy(to_analyze, token, STRING_SIZE * 3);
-                    }
-                } else {
-                    if(message_end) {
-                        if (strlen(to_hold)) {
-                            snprintf(to_analyze, STRING_SIZE * 3, "%s%s", to_hold, token);
-                        } else {
-                            memcpy(to_analyze, token, STRING_SIZE * 3);
-                        }
-                    } else {
-                        strncat(to_hold, token, STRING_SIZE);
-                        token = aux_token;
-                        continue;
-                    }
-                }
+        ingested += parse_stream(state, cur_server);
+        if (-1 == get_fd(cur_server)) { //Dropped while parsing
+            break;
+        } else if (parser->stalled) { //The rest is held by the loop until the client thread drains the ring
+            update_watch(state, cur_server);
+        }
+    }
 
-                /* printf("To Analyze: %s\n", to_analyze); */
-                if (sms_state) {
-                    err = parse_message(msg_matrix, to_analyze);
-                    if (err) {
-                        printf("Failed to parse_message %s \n", to_analyze);
-                    }
-                } else {
-                    if (0 == strcmp("SGET_MESSAGES", to_analyze)) {
-                        err = handle_sget_messages(fd, msg_matrix);
-                        if (err) {
-                            close_communication(cur_server);
-                        }
-                    } else if (0 == strcmp("SMESSAGES", to_analyze)) {
-                        sms_state = 1;
-                    }
-                }
+    if (0 < ingested) {
+        wake_client(state);
+    }
+    return taken;
+}
 
-                fflush(stdout);
-                to_analyze[0] = '\0';
-                token = aux_token;
-            }
+void resume_ingest(struct server_state *state) {
+    server cur_server;
+    uint_fast32_t ingested = 0;
+
+    state->ingest_paused = false;
+    for_each_server(cur_server, &state->connected) {
+        struct stream_parser *parser = get_parser(cur_server);
+        if (!parser->stalled) {
+            continue;
+        }
+        parser->stalled = false;
+        //What was decompressed goes first, then the rest of the stream
+        if (parser->inflated && parser->inflated->len && parse_inflated(state, cur_server, &ingested)) {
+            continue; //Dropped
+        }
+        if (!parser->stalled) {
+            ingested += parse_stream(state, cur_server);
+        }
+        if (-1 == get_fd(cur_server)) {
+            continue;
+        }
+        update_watch(state, cur_server);
+        if (parser->stalled) { //Full again, the others wait for the next drain
+            break;
         }
     }
 
-    free(to_hold);
-    free(to_analyze);
+    if (0 < ingested) {
+        wake_client(state);
+    }
 }
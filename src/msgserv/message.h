@@ -1,24 +1,277 @@
+#pragma once
 #include "../utils/struct_server.h"
 #include "../utils/utils.h"
 #include "../utils/struct_message.h"
+#include "../utils/util_queue.h"
+#include "../utils/util_lz.h"
+#include "../utils/util_wal.h"
+#include "event_loop.h"
 #include <alloca.h>
+#include <time.h>
+#include <sys/timerfd.h>
 
 #define MESSAGE_CODE "MESSAGES"
+#define UDP_BATCH 64        //Datagrams per recvmmsg
+#define UDP_BATCH_ROUNDS 4  //Max recvmmsg per wakeup, so peers are not starved
+#define BATCH_SCRATCH_SIZE (64 * 1024) //First arena block of a batch, grows to the biggest batch
 #define SMESSAGE_CODE "SMESSAGES"
+#define SEND_LOW_WATERMARK (1024 * 1024)      //Default, a throttled server is read again below it
+#define SEND_HIGH_WATERMARK (4 * 1024 * 1024) //Default, a server with more bytes queued is not read
+#define SEND_LIMIT_FACTOR 2 //A server with this many times the high watermark queued is disconnected
+#define COMPRESS_MIN (4 * 1024) //Shorter binary replies are not compressed
+#define SNAPSHOT_WINDOW (COMPRESS_BLOCK / WIRE_RECORD_SIZE) //Messages read from the matrix per SGET_MESSAGES chunk
+#define SNAPSHOT_QUEUED COMPRESS_BLOCK //Next chunk is read only while fewer bytes are queued to the server
+
+/*! \struct replicated_message
+    \brief Message exchanged between the client thread and the replication thread.
+*/
+struct replicated_message {
+    uint64_t      lc;
+    char          content[STRING_SIZE];
+};
+
+/*! \enum snapshot_form
+    \brief Protocols a SGET_MESSAGES reply is sent in, see struct snapshot_stream.
+*/
+enum snapshot_form {
+    SNAPSHOT_TEXT = 0,   //!< SMESSAGES block
+    SNAPSHOT_BINARY,     //!< BINARY_MESSAGES frame
+    SNAPSHOT_COMPRESSED, //!< BINARY_MESSAGES frames in BINARY_COMPRESSED frames
+};
+
+/*! \struct server_state
+    \brief State shared by the replication thread event handlers, see replication.h.
+*/
+struct server_state {
+    event_loop loop;        //!< Loop every peer fd is registered in
+    matrix     msg_matrix;  //!< Message storage, read only in this thread
+    registry   peers;       //!< Connected servers, by address and by fd
+    struct ilink connected; //!< Servers with an open stream, in the order they connected
+    server     host;        //!< This server
+    bool       prune;       //!< A server was dropped and the registry must be reaped
+    int        listen_fd;   //!< TCP listening socket
+    spsc_queue ingest_queue; //!< Messages received from the peers, stored by the client thread
+    int        ingest_fd;   //!< Eventfd written after pushing to ingest_queue
+    atomic_bool ingest_full; //!< A server stalled on a full ingest_queue, cleared by the client thread as it wakes us
+    bool       ingest_paused; //!< A server is stalled, see resume_ingest
+    char       *chunk;      //!< Window of a SGET_MESSAGES reply being queued, shared by every reply
+    char       *packed;     //!< The window compressed, for BINARY_COMPRESSED
+    bool       text_only;   //!< Do not offer or accept the binary protocol
+    registry   known_servers; //!< Servers synced before and dropped, see remember_server
+    size_t     send_low;    //!< Low watermark of the server send queues, in bytes
+    size_t     send_high;   //!< High watermark of the server send queues, in bytes
+    uint64_t   peer_reads;  //!< recv calls on server sockets, or chunks received by the loop (io_uring)
+    uint64_t   peer_bytes;  //!< Bytes received from servers
+    uint64_t   restored_lc; //!< Clock after the newest message of the storage file at startup, 0 if none
+
+    //Join state machine, see identity.h
+    atomic_int join_status;      //!< One of enum join_status, also read by the client thread
+    int        register_fd;      //!< UDP socket to the identity server
+    int        refresh_fd;       //!< Timer that refreshes the registration
+    int        retry_fd;         //!< Timer that repeats GET_SERVERS while joining
+    struct itimerspec refresh_timer;
+    time_t     join_started;
+    int        pending_connects; //!< Connects still in progress
+    bool       snapshot_wanted;  //!< SMESSAGES reply to our SGET_MESSAGES not received yet
+    server     snapshot_server;  //!< Server asked for SGET_MESSAGES
+};
 
 //TCP
-uint_fast8_t tcp_fd_handle(list servers_list, matrix msg_matrix, fd_set *rfds, int (*STAT_FD)(int, fd_set *));
-uint_fast8_t parse_messages(matrix msg_matrix);
-uint_fast8_t handle_sget_messages(int fd, matrix msg_matrix);
-uint_fast8_t share_last_message(list servers_list, matrix msg_matrix);
-void server_treat_communications(item obj, void *cnt_array[]);
-
-/*! \fn handle_client_comms(int fd, matrix msg_matrix)
-	\brief handle_client_comms receives the comunications via udp from the client.
-then interprets and sends back the requested info or saves the new message
+/*! \fn uint_fast8_t parse_message(struct server_state *state, server cur_server, char *info)
+	\brief Parses one "lc;message" line and hands it to the client thread.
+	Returns 0 on success, 1 for a malformed line, 2 if the ring to the client thread is full:
+	the server is stalled and the line must be parsed again, see resume_ingest.
+	\param state Shared server state
+	\param cur_server Server that sent it, its last clock is kept once synced
+	\param info NUL terminated line, without the newline
+*/
+uint_fast8_t parse_message(struct server_state *state, server cur_server, char *info);
+
+/*! \fn uint_fast32_t parse_stream(struct server_state *state, server cur_server)
+	\brief Parses every complete line, or binary record after BINARY, in the receive buffer of the server, in place.
+	The framing state and an incomplete last line are kept for the next read. If the ring to the
+	client thread fills up parsing stops, the rest is kept and the server is stalled, see resume_ingest.
+	Returns the number of messages handed to the client thread.
+	\param state Shared server state
+	\param cur_server Server whose buffer was filled
+*/
+uint_fast32_t parse_stream(struct server_state *state, server cur_server);
+/*! \fn void resume_ingest(struct server_state *state)
+	\brief Parses again what the stalled servers kept, and reads them again unless the ring fills up
+	once more. Called by the replication thread when the client thread has drained the ring.
+	\param state Shared server state
+*/
+void resume_ingest(struct server_state *state);
+/*! \fn uint_fast8_t handle_sget_messages(struct server_state *state, server cur_server, bool delta, uint64_t since)
+	\brief Streams the stored messages, "lc;message" lines or BINARY_MESSAGES frames, to the server that asked.
+	The matrix is read SNAPSHOT_WINDOW messages at a time, the next window only once the send queue
+	of the server drains below SNAPSHOT_QUEUED, so the reply never takes more than a few chunks of memory.
+	Binary chunks of at least COMPRESS_MIN bytes are compressed for servers that read BINARY_COMPRESSED.
+	With delta only the messages with a clock above since are sent, all of them if since
+	is above the newest clock (it was given by an older run of this server).
+	Messages stored while the reply is streamed are sent in it, not replicated separately.
+	Returns 0 unless the server was dropped.
+	\param state Shared server state
+	\param cur_server Server that sent SGET_MESSAGES
+	\param delta The request was "SGET_MESSAGES lc"
+	\param since Last clock the server received from us
+*/
+uint_fast8_t handle_sget_messages(struct server_state *state, server cur_server, bool delta, uint64_t since);
+
+/*! \fn uint_fast8_t send_sget_messages(struct server_state *state, server cur_server)
+	\brief Asks the server for its messages. If it was synced before only the messages
+	after the last one received are asked for, with "SGET_MESSAGES lc".
+	Returns 0 if the request was queued.
+	\param state Shared server state
+	\param cur_server Server asked
+*/
+uint_fast8_t send_sget_messages(struct server_state *state, server cur_server);
+
+/*! \fn uint_fast8_t queue_to_server(struct server_state *state, server cur_server, const char *data, size_t len)
+	\brief Sends data to a connected server without blocking.
+	What the socket does not take is queued and sent when the socket is writable.
+	Past the high watermark the server is not read until its queue drops below the low
+	watermark, and past SEND_LIMIT_FACTOR times the high watermark it is disconnected.
+	Returns 0 if the data was sent or queued, 1 if the server is not connected or was dropped.
+	\param state Shared server state
+	\param cur_server Destination server
+	\param data Bytes to send
+	\param len Number of bytes
+*/
+uint_fast8_t queue_to_server(struct server_state *state, server cur_server, const char *data, size_t len);
+
+/*! \fn void share_messages(struct server_state *state, const char *frame, size_t len, const char *binary, size_t binary_len)
+	\brief Sends the same messages to every connected server, in the protocol of each one.
+	\param state Shared server state
+	\param frame "SMESSAGES\n" followed by one "lc;message\n" per message
+	\param len Frame length
+	\param binary The BINARY_MESSAGES frame with the same messages
+	\param binary_len Binary frame length
+*/
+void share_messages(struct server_state *state, const char *frame, size_t len, const char *binary, size_t binary_len);
+
+/*! \fn uint_fast8_t send_hello(struct server_state *state, server cur_server)
+	\brief Sends HELLO to a server just connected to, see util_binary.h: the binary version offered,
+	0 if the binary protocol is disabled, and the ports this server listens on.
+	Until the server answers BINARY the text protocol is used, forever if it never does.
+	Returns 0 if HELLO was queued.
+	\param state Shared server state
+	\param cur_server Server connected to
+*/
+uint_fast8_t send_hello(struct server_state *state, server cur_server);
+
+/*! \fn int watch_server(struct server_state *state, server cur_server)
+	\brief Registers a connected server fd in the event loop.
+	\param state Shared server state
+	\param cur_server Server with a valid fd
+*/
+int  watch_server(struct server_state *state, server cur_server);
+
+/*! \fn void drop_server(struct server_state *state, server cur_server)
+	\brief Removes the server fd from the loop, closes it and marks the list for pruning.
+	\param state Shared server state
+	\param cur_server Server to disconnect
+*/
+void drop_server(struct server_state *state, server cur_server);
+
+/*! \fn void server_treat_communications(int fd, uint32_t events, item obj, void *arg)
+	\brief Event handler for a connected server. Only runs when its fd is ready.
+	\param fd Server socket
+	\param events Ready events
+	\param obj The server (struct _server)
+	\param arg Shared server state
+*/
+void server_treat_communications(int fd, uint32_t events, item obj, void *arg);
+
+/*! \fn size_t server_receive_stream(int fd, char *data, size_t len, item obj, void *arg)
+	\brief Stream handler for a connected server, the bytes were received by the loop (io_uring backend).
+Returns the bytes parsed, none once the server is throttled or stalled; len 0 drops the server.
+	\param fd Server socket
+	\param data Bytes received
+	\param len Number of bytes
+	\param obj The server (struct _server)
+	\param arg Shared server state
+*/
+size_t server_receive_stream(int fd, char *data, size_t len, item obj, void *arg);
+
+/*! \var typedef struct _udp_batch *udp_batch
+	\brief Preallocated recvmmsg/sendmmsg batch for the client socket.
+*/
+typedef struct _udp_batch *udp_batch;
+
+/*! \struct publish_record
+	\brief PUBLISH handed from a UDP worker to the writer thread.
+*/
+struct publish_record {
+	char content[STRING_SIZE];
+};
+
+udp_batch create_udp_batch();
+void free_udp_batch(udp_batch this);
+/*! \fn void set_publish_queue(udp_batch this, mpsc_queue publish_queue, int wake_fd)
+	\brief Worker mode: PUBLISH is pushed to publish_queue instead of stored, and wake_fd
+(an eventfd) is written once per batch so the writer thread drains the queue.
+	\param this Batch of the worker
+	\param publish_queue Queue of struct publish_record
+	\param wake_fd Writer eventfd
+*/
+void set_publish_queue(udp_batch this, mpsc_queue publish_queue, int wake_fd);
+/*! \fn void set_batch_wal(udp_batch this, wal log)
+	\brief Every PUBLISH stored by the batch is also appended to log, see handle_publish.
+	\param this Batch of the writer thread
+	\param log Write-ahead log, NULL for none
+*/
+void set_batch_wal(udp_batch this, wal log);
+/*! \fn void print_batch_stats(udp_batch this)
+	\brief Prints the number of batches and the average datagrams per batch.
+*/
+void print_batch_stats(udp_batch this);
+
+/*! \fn handle_client_comms(int fd, udp_batch batch, matrix msg_matrix)
+	\brief handle_client_comms drains the udp socket with recvmmsg, in batches.
+Every PUBLISH/GET_MESSAGES of a batch is handled and the replies are sent with one sendmmsg.
+Returns the number of published messages, to be shared with the other servers
+(always 0 in worker mode, where the writer thread stores and shares them).
+In worker mode a PUBLISH the queue has no room for stops the batch: the rest of it is kept,
+handled first on the next call, and the socket is not read until it is, see is_batch_stalled.
 	\param fd File descriptor for udp comms
+	\param batch Preallocated batch
 	\param msg_matrix Structure to allocate messages
 */
 //UDP
-uint_fast8_t handle_client_comms(int fd, matrix msg_matrix);
-uint_fast8_t handle_publish(matrix msg_matrix, char *input_buffer);
+uint_fast32_t handle_client_comms(int fd, udp_batch batch, matrix msg_matrix);
+/*! \fn uint_fast8_t handle_publish(matrix msg_matrix, wal log, char *input_buffer)
+	\brief Stores the message with the next clock and appends it to the log, if any.
+The log is only synced by the next commit_wal, once for every message of the loop iteration.
+Returns 2, a message was published.
+	\param msg_matrix Structure to allocate messages
+	\param log Write-ahead log, NULL for none
+	\param input_buffer Message content
+*/
+uint_fast8_t handle_publish(matrix msg_matrix, wal log, char *input_buffer);
+
+/*! \fn uint_fast32_t handle_client_datagrams(int fd, udp_batch batch, struct ev_datagram *dgrams, int count, matrix msg_matrix)
+	\brief Same as handle_client_comms for datagrams already received by the event loop (io_uring backend).
+Returns the number of published messages.
+	\param fd UDP socket, used for the replies
+	\param batch Preallocated batch
+	\param dgrams Datagrams received in this wakeup
+	\param count Number of datagrams
+	\param msg_matrix Structure to allocate messages
+*/
+uint_fast32_t handle_client_datagrams(int fd, udp_batch batch, struct ev_datagram *dgrams, int count, matrix msg_matrix);
+
+/*! \fn bool is_batch_stalled(udp_batch this)
+	\brief Returns true if the batch holds datagrams not handled because the publish queue was full.
+*/
+bool is_batch_stalled(udp_batch this);
+
+/*! \fn uint64_t get_batch_syscalls(udp_batch this)
+	\brief Returns the recvmmsg and sendmmsg calls made with the batch.
+*/
+uint64_t get_batch_syscalls(udp_batch this);
+
+/*! \fn uint64_t get_batch_datagrams(udp_batch this)
+	\brief Returns the client requests handled with the batch.
+*/
+uint64_t get_batch_datagrams(udp_batch this);
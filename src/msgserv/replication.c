@@ -0,0 +1,437 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include "replication.h"
+#include "identity.h"
+
+struct _replication {
+    struct server_state state;   //Replication thread only, except join_status
+    pthread_t      thread;
+    bool           started;
+    atomic_bool    stop;
+    int            wake_fd;      //Client -> replication: outbound messages, a command or stop
+    int            reader;       //Of the matrix, see add_matrix_reader
+    int            done_fd;      //Replication -> client: command finished
+    spsc_queue     outbound;     //Messages stored by the client thread
+    atomic_int     command;      //One of repl_command
+    uint_fast8_t   command_result;
+    char           *id_server_ip;
+    char           *id_server_port;
+    //Outbound SMESSAGES frame, and the same messages as a BINARY_MESSAGES frame, replication thread
+    char           *frame;
+    size_t         frame_len;
+    char           *binary_frame; //Records start after BINARY_HEADER_MAX bytes for the header
+    size_t         binary_len;
+    uint_fast32_t  frame_count;  //Messages in the frame
+    int            flush_fd;     //Timer that sends the frame at the end of the window
+    bool           flush_armed;
+    uint32_t       window_us;    //Current window, adapts to the publish rate
+    uint32_t       max_window_us;
+    uint64_t       frames;
+    //Published messages the ring had no room for, oldest first, client thread
+    struct message_key *backlog;
+    size_t         backlog_count;
+    size_t         backlog_size;
+    //Peer messages popped by drain_ingested, stored at once, client thread
+    struct replicated_message batch[INGEST_BUDGET];
+    //Stats, client thread
+    uint64_t       replicated;
+    uint64_t       ingested;
+    uint64_t       duplicates;   //Received messages already stored
+    uint64_t       dropped;      //Evicted from the matrix before the ring had room for them
+};
+
+//A stored message, found again with find_message
+struct message_key {
+    uint64_t lc;
+    uint64_t hash;
+};
+
+static void wake_fd_write(int fd) {
+    uint64_t one = 1;
+    if ((ssize_t)sizeof(one) != write(fd, &one, sizeof(one)) && _VERBOSE_TEST) {
+        printf("\nerror waking thread\n");
+    }
+}
+
+static void wake_fd_read(int fd) {
+    uint64_t wakeups;
+    if (0 > read(fd, &wakeups, sizeof(wakeups)) && EAGAIN != errno && _VERBOSE_TEST) {
+        printf("\nerror reading eventfd\n");
+    }
+}
+
+static uint_fast8_t run_command(replication this, int command) {
+    struct server_state *state = &this->state;
+
+    switch (command) {
+        case REPL_JOIN:
+            return handle_join(state, this->id_server_ip, this->id_server_port);
+        case REPL_SHOW_SERVERS:
+            if (0 != get_registry_size(state->peers)) print_registry(state->peers, print_server);
+            else printf("No registered servers\n");
+            fflush(stdout);
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+// adapt_window widens the window while publishes arrive together and closes it when they come one by one
+static void adapt_window(replication this, uint_fast32_t count) {
+    if (1 < count) {
+        this->window_us = this->window_us ? 2 * this->window_us : WINDOW_START_US;
+        this->window_us = this->window_us < this->max_window_us ? this->window_us : this->max_window_us;
+    } else {
+        this->window_us /= 2;
+        if (WINDOW_START_US > this->window_us) {
+            this->window_us = 0; //Light load, every wakeup is sent at once
+        }
+    }
+}
+
+// flush_frame sends the gathered messages to every server in one frame
+static void flush_frame(replication this) {
+    if (0 == this->frame_count) {
+        return;
+    }
+    char *records = this->binary_frame + BINARY_HEADER_MAX;
+    size_t header_len = put_binary_header(records, BINARY_MESSAGES, this->frame_count);
+    share_messages(&this->state, this->frame, this->frame_len,
+            records - header_len, header_len + this->binary_len);
+    this->frames++;
+    adapt_window(this, this->frame_count);
+    this->frame_len = 0;
+    this->binary_len = 0;
+    this->frame_count = 0;
+}
+
+static void append_to_frame(replication this, struct replicated_message *record) {
+    if (this->frame_len + WIRE_RECORD_SIZE > FRAME_SIZE) { //Full, send it
+        flush_frame(this);
+    }
+    if (0 == this->frame_len) {
+        this->frame_len = snprintf(this->frame, FRAME_SIZE, "%s\n", SMESSAGE_CODE);
+    }
+    this->frame_len += snprintf(this->frame + this->frame_len, FRAME_SIZE - this->frame_len, "%" PRIu64 ";%s\n",
+            record->lc, record->content);
+    this->binary_len += put_binary_record(this->binary_frame + BINARY_HEADER_MAX + this->binary_len,
+            record->lc, record->content, strlen(record->content));
+    this->frame_count++;
+}
+
+// flush_ready runs when the window of the frame is over
+static void flush_ready(int fd, uint32_t events, item obj, void *arg) {
+    replication this = (replication)arg;
+    (void)events; (void)obj;
+
+    wake_fd_read(fd);
+    this->flush_armed = false;
+    flush_frame(this);
+}
+
+// wake_ready runs in the replication thread when the client thread has work for it
+static void wake_ready(int fd, uint32_t events, item obj, void *arg) {
+    replication this = (replication)arg;
+    struct replicated_message record;
+    (void)events; (void)obj;
+
+    wake_fd_read(fd);
+    if (this->state.ingest_paused) { //The client thread made room in the ingest ring
+        resume_ingest(&this->state);
+    }
+    while (spsc_pop(this->outbound, &record)) {
+        append_to_frame(this, &record);
+    }
+    if (0 < this->frame_count) {
+        if (0 == this->window_us) {
+            flush_frame(this);
+        } else if (!this->flush_armed) { //Wait for the rest of the window
+            struct itimerspec window = {{0, 0}, {0, (long)this->window_us * 1000}};
+            timerfd_settime(this->flush_fd, 0, &window, NULL);
+            this->flush_armed = true;
+        }
+    }
+
+    int command = atomic_exchange(&this->command, REPL_NONE);
+    if (REPL_NONE != command) {
+        this->command_result = run_command(this, command);
+        wake_fd_write(this->done_fd);
+    }
+}
+
+static void *replication_run(void *arg) {
+    replication this = (replication)arg;
+    struct server_state *state = &this->state;
+
+    while (!atomic_load(&this->stop)) {
+        //The reads of the last iteration are done, see wake_replication
+        quiesce_matrix_reader(state->msg_matrix, this->reader);
+        if (0 > loop_run_once(state->loop, -1)) {
+            if (_VERBOSE_TEST) printf("error on replication event loop\n%d\n", errno);
+            break;
+        }
+
+        //Frees the servers dropped during this iteration
+        if (state->prune) {
+            reap_registry(state->peers, free_server);
+            state->prune = false;
+        }
+    }
+    park_matrix_reader(state->msg_matrix, this->reader);
+    return NULL;
+}
+
+replication create_replication(int backend, server host, matrix msg_matrix, int tcp_listen_fd,
+        struct itimerspec refresh_timer, char *id_server_ip, char *id_server_port, struct replication_limits limits) {
+    replication new_repl = (replication)calloc(1, sizeof(struct _replication));
+    if (!new_repl) {
+        memory_error("Unable to reserve replication memory");
+    }
+
+    struct server_state *state = &new_repl->state;
+    state->loop = create_event_loop(backend);
+    state->msg_matrix = msg_matrix;
+    if (is_matrix_file(msg_matrix) && get_size(msg_matrix) > get_first(msg_matrix)) { //Restored, the servers are asked for the newer ones
+        state->restored_lc = get_lc((message)get_element(msg_matrix, get_size(msg_matrix) - 1)) + 1;
+    }
+    state->peers = create_registry();
+    ilist_init(&state->connected);
+    state->known_servers = create_registry();
+    state->host = host;
+    state->register_fd = -1;
+    state->refresh_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    state->retry_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    state->refresh_timer = refresh_timer;
+    state->listen_fd = tcp_listen_fd;
+    state->send_low = limits.send_low;
+    state->send_high = limits.send_high;
+    state->text_only = limits.text_only;
+    state->ingest_queue = create_spsc_queue(REPLICATION_QUEUE_SIZE, sizeof(struct replicated_message));
+    state->ingest_fd = eventfd(0, EFD_NONBLOCK);
+    atomic_init(&state->join_status, JOIN_IDLE);
+    atomic_init(&state->ingest_full, false);
+
+    new_repl->wake_fd = eventfd(0, EFD_NONBLOCK);
+    new_repl->done_fd = eventfd(0, EFD_NONBLOCK);
+    new_repl->outbound = create_spsc_queue(REPLICATION_QUEUE_SIZE, sizeof(struct replicated_message));
+    new_repl->id_server_ip = id_server_ip;
+    new_repl->id_server_port = id_server_port;
+    new_repl->frame = (char *)malloc(FRAME_SIZE);
+    new_repl->binary_frame = (char *)malloc(BINARY_HEADER_MAX + FRAME_SIZE); //Records are never longer than text
+    if (!new_repl->frame || !new_repl->binary_frame) {
+        memory_error("Unable to reserve replication frame memory");
+    }
+    new_repl->flush_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    new_repl->max_window_us = limits.max_window_us;
+    atomic_init(&new_repl->stop, false);
+    atomic_init(&new_repl->command, REPL_NONE);
+    new_repl->reader = add_matrix_reader(msg_matrix);
+
+    if (!state->loop || 0 > new_repl->reader || 0 > state->refresh_fd || 0 > state->retry_fd || 0 > state->ingest_fd
+            || 0 > new_repl->wake_fd || 0 > new_repl->done_fd || 0 > new_repl->flush_fd
+            || 0 != loop_add_fd(state->loop, new_repl->flush_fd, EV_READ, flush_ready, NULL, new_repl)
+            || 0 != loop_add_acceptor(state->loop, tcp_listen_fd, tcp_new_comm, NULL, state)
+            || 0 != loop_add_fd(state->loop, new_repl->wake_fd, EV_READ, wake_ready, NULL, new_repl)) {
+        fprintf(stderr, KRED "Unable to create the replication thread resources\n" KNRM);
+        free_replication(new_repl);
+        return NULL;
+    }
+
+    //Signals are left to the client thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    new_repl->started = (0 == pthread_create(&new_repl->thread, NULL, replication_run, new_repl));
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!new_repl->started) {
+        free_replication(new_repl);
+        return NULL;
+    }
+
+    return new_repl;
+}
+
+int get_ingest_fd(replication this) {
+    return this->state.ingest_fd;
+}
+
+uint_fast32_t drain_ingested(replication this, matrix msg_matrix) {
+    uint64_t lc[INGEST_BUDGET];
+    char *content[INGEST_BUDGET];
+    uint_fast32_t stored, popped = 0;
+
+    //Reset the eventfd before draining, a push after this wakes us again
+    wake_fd_read(this->state.ingest_fd);
+    while (popped < INGEST_BUDGET && spsc_pop(this->state.ingest_queue, &this->batch[popped])) {
+        lc[popped] = this->batch[popped].lc;
+        content[popped] = this->batch[popped].content;
+        popped++;
+    }
+    //Merged at once, a snapshot older than the stored messages moves them up once
+    stored = store_replicated_messages(msg_matrix, popped, lc, content);
+
+    //A server stalled on the full ring is parsed again, see resume_ingest
+    atomic_thread_fence(memory_order_seq_cst);
+    if (0 < popped && atomic_exchange(&this->state.ingest_full, false)) {
+        wake_fd_write(this->wake_fd);
+    }
+
+    if (INGEST_BUDGET == popped) { //More may be waiting, serve the clients first
+        wake_fd_write(this->state.ingest_fd);
+    }
+    this->ingested += stored;
+    this->duplicates += popped - stored;
+    return stored;
+}
+
+static bool push_outbound(replication this, message to_share) {
+    struct replicated_message record;
+
+    record.lc = get_lc(to_share);
+    strncpy(record.content, get_string(to_share), STRING_SIZE - 1);
+    record.content[STRING_SIZE - 1] = '\0';
+    if (!spsc_push(this->outbound, &record)) {
+        return false;
+    }
+    this->replicated++;
+    return true;
+}
+
+// keep_key adds the message to the backlog, at most a matrix of keys: an older one is evicted already
+static void keep_key(replication this, matrix msg_matrix, message to_share) {
+    if (this->backlog_count >= get_capacity(msg_matrix)) {
+        size_t evicted = this->backlog_count - get_capacity(msg_matrix) + 1;
+        memmove(this->backlog, this->backlog + evicted, (this->backlog_count - evicted) * sizeof(struct message_key));
+        this->backlog_count -= evicted;
+        this->dropped += evicted;
+    }
+    if (this->backlog_count == this->backlog_size) {
+        size_t size = this->backlog_size ? 2 * this->backlog_size : 1024;
+        struct message_key *backlog = (struct message_key *)realloc(this->backlog, size * sizeof(struct message_key));
+        if (!backlog) {
+            memory_error("Unable to reserve replication memory");
+        }
+        this->backlog = backlog;
+        this->backlog_size = size;
+    }
+    struct message_key *key = &this->backlog[this->backlog_count++];
+    get_message_key(to_share, &key->lc, &key->hash);
+}
+
+// push_backlog reads the kept messages from the matrix again and pushes as many as the ring takes
+static void push_backlog(replication this, matrix msg_matrix) {
+    size_t room = spsc_free_slots(this->outbound), taken = 0;
+
+    for (; taken < this->backlog_count && taken < room; taken++) {
+        message to_share = find_message(msg_matrix, this->backlog[taken].lc, this->backlog[taken].hash);
+        if (to_share) {
+            push_outbound(this, to_share); //Within the room, never fails
+        } else {
+            this->dropped++; //Evicted meanwhile
+        }
+    }
+    memmove(this->backlog, this->backlog + taken, (this->backlog_count - taken) * sizeof(struct message_key));
+    this->backlog_count -= taken;
+}
+
+void replicate_messages(replication this, matrix msg_matrix, uint_fast32_t n) {
+    if (this->backlog_count) { //Older messages go first
+        push_backlog(this, msg_matrix);
+    }
+
+    n = get_size(msg_matrix) - get_first(msg_matrix) < n ? get_size(msg_matrix) - get_first(msg_matrix) : n;
+    for (uint64_t i = get_size(msg_matrix) - n; i < get_size(msg_matrix); i++) {
+        message to_share = (message)get_element(msg_matrix, i);
+        if (this->backlog_count || !push_outbound(this, to_share)) {
+            keep_key(this, msg_matrix, to_share);
+        }
+    }
+    wake_fd_write(this->wake_fd);
+}
+
+int get_replication_wait(replication this) {
+    return this->backlog_count ? REPLICATION_RETRY_MS : -1;
+}
+
+void wake_replication(replication this) {
+    wake_fd_write(this->wake_fd);
+}
+
+uint_fast8_t replication_command(replication this, int command) {
+    struct pollfd pfds[2] = {
+        {.fd = this->done_fd, .events = POLLIN},
+        {.fd = this->state.ingest_fd, .events = POLLIN},
+    };
+
+    atomic_store(&this->command, command);
+    wake_fd_write(this->wake_fd);
+    while (true) {
+        if (0 > poll(pfds, 2, -1)) {
+            continue; //Interrupted by a signal
+        }
+        if (pfds[1].revents & POLLIN) { //The replication thread may be waiting for ring space
+            drain_ingested(this, this->state.msg_matrix);
+        }
+        if (pfds[0].revents & POLLIN) {
+            wake_fd_read(this->done_fd);
+            return this->command_result;
+        }
+    }
+}
+
+int get_join_status(replication this) {
+    return atomic_load(&this->state.join_status);
+}
+
+void print_replication_stats(replication this) {
+    printf(KBLU "Replicated:" KNRM " %lu " KBLU "Waiting:" KNRM " %zu " KBLU "Dropped:" KNRM " %lu "
+            KBLU "Received from servers:" KNRM " %lu " KBLU "Duplicates:" KNRM " %lu\n", (unsigned long)this->replicated,
+            this->backlog_count, (unsigned long)this->dropped, (unsigned long)this->ingested,
+            (unsigned long)this->duplicates);
+    printf(KBLU "Server reads:" KNRM " %lu " KBLU "Bytes:" KNRM " %lu\n",
+            (unsigned long)this->state.peer_reads, (unsigned long)this->state.peer_bytes);
+    printf(KBLU "Frames sent:" KNRM " %lu " KBLU "Messages per frame:" KNRM " %.2f " KBLU "Window:" KNRM " %uus\n",
+            (unsigned long)this->frames, this->frames ? (double)this->replicated / this->frames : 0.0,
+            (unsigned)this->window_us);
+}
+
+void free_replication(replication this) {
+    if (!this) {
+        return;
+    }
+    struct server_state *state = &this->state;
+
+    if (this->started) {
+        atomic_store(&this->stop, true);
+        wake_fd_write(this->wake_fd);
+        pthread_join(this->thread, NULL);
+    }
+
+    if (state->loop) free_event_loop(state->loop);
+    free_registry(state->peers, free_server);
+    free_registry(state->known_servers, free_known_server);
+    close_fd(state->listen_fd);
+    close_fd(state->register_fd);
+    close_fd(state->refresh_fd);
+    close_fd(state->retry_fd);
+    close_fd(state->ingest_fd);
+    close_fd(this->wake_fd);
+    close_fd(this->done_fd);
+    close_fd(this->flush_fd);
+    free(this->frame);
+    free(this->binary_frame);
+    free_spsc_queue(state->ingest_queue);
+    free(state->chunk);
+    free(state->packed);
+    free_spsc_queue(this->outbound);
+    free(this->backlog);
+    if (id_server) {
+        freeaddrinfo(id_server);
+        id_server = NULL;
+    }
+    free(this);
+}
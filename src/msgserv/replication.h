@@ -0,0 +1,127 @@
+#pragma once
+/*! \file msgserv/replication.h
+ * \brief Replication thread. Owns the identity server join, the TCP listen socket and every peer socket.
+ *
+ * The client thread keeps the UDP traffic and stays the only writer of the message matrix.
+ * Messages stored by the client thread go to the peers through an SPSC ring, and messages
+ * received from the peers come back through another SPSC ring, each side woken by an eventfd.
+ * SGET_MESSAGES snapshots are built by this thread with lock free reads of the matrix.
+ */
+#include "../utils/struct_server.h"
+#include "../utils/util_matrix.h"
+#include "message.h"
+
+#define REPLICATION_QUEUE_SIZE 16384 //Records in each direction
+#define INGEST_BUDGET 256            //Peer messages stored per client loop iteration
+#define REPLICATION_RETRY_MS 1       //Client loop wait while published messages did not fit in the ring
+#define FRAME_SIZE (64 * 1024)       //A SMESSAGES frame is sent once it is this full
+#define WINDOW_MAX_US 500            //Default longest wait to gather messages in one frame
+#define WINDOW_START_US 20           //First window once publishes arrive together
+
+/*! \struct replication_limits
+    \brief Tunables of the replication thread.
+*/
+struct replication_limits {
+    size_t   send_low;      //!< Low watermark of the server send queues, see queue_to_server
+    size_t   send_high;     //!< High watermark of the server send queues
+    uint32_t max_window_us; //!< Longest wait to gather messages in one SMESSAGES frame, 0 disables it
+    bool     text_only;     //!< Keep the text protocol with every server, see util_binary.h
+};
+
+/*! \enum repl_command
+    \brief User commands run by the replication thread.
+*/
+enum repl_command {
+    REPL_NONE = 0,
+    REPL_JOIN,         //!< Starts the join, result is the handle_join error code
+    REPL_SHOW_SERVERS, //!< Prints the connected servers
+};
+
+/*! \var typedef struct _replication *replication
+    \brief Describes a pointer to struct _replication.
+*/
+typedef struct _replication *replication;
+
+/*! \fn replication create_replication(int backend, server host, matrix msg_matrix, int tcp_listen_fd, struct itimerspec refresh_timer, char *id_server_ip, char *id_server_port, struct replication_limits limits)
+    \brief Starts the replication thread with its own event loop.
+    Returns NULL if the thread could not be started.
+    \param backend Event loop backend.
+    \param host This server.
+    \param msg_matrix Message storage, only read by the replication thread.
+    \param tcp_listen_fd Listening socket, owned by the replication thread from now on.
+    \param refresh_timer Registration refresh interval.
+    \param id_server_ip Identity server address.
+    \param id_server_port Identity server port.
+    \param limits Send queue watermarks, replication window and protocol.
+*/
+replication create_replication(int backend, server host, matrix msg_matrix, int tcp_listen_fd,
+        struct itimerspec refresh_timer, char *id_server_ip, char *id_server_port, struct replication_limits limits);
+
+/*! \fn int get_ingest_fd(replication this)
+    \brief Returns the eventfd that is readable when messages from the peers are waiting.
+    \param this Replication selected.
+*/
+int get_ingest_fd(replication this);
+
+/*! \fn uint_fast32_t drain_ingested(replication this, matrix msg_matrix)
+    \brief Stores up to INGEST_BUDGET messages received from the peers. Client thread only.
+    Messages already stored, same clock and content, are dropped, see store_replicated_messages.
+    The batch popped is sorted and merged in one matrix write.
+    If more are waiting the ingest fd stays readable, so clients are served in between.
+    A server the replication thread stopped reading because the ring was full is read again, see resume_ingest.
+    Returns the number of stored messages.
+    \param this Replication selected.
+    \param msg_matrix Message storage.
+*/
+uint_fast32_t drain_ingested(replication this, matrix msg_matrix);
+
+/*! \fn void replicate_messages(replication this, matrix msg_matrix, uint_fast32_t n)
+    \brief Hands the last n stored messages to the replication thread. Client thread only.
+    Never blocks: the keys of the messages that do not fit in the ring are kept, in order, and
+    the messages are read again from the matrix and pushed once the ring has room, first by the
+    next call. Only those evicted from the matrix meanwhile are dropped and counted.
+    \param this Replication selected.
+    \param msg_matrix Message storage.
+    \param n Number of messages, 0 to only push the kept ones.
+*/
+void replicate_messages(replication this, matrix msg_matrix, uint_fast32_t n);
+
+/*! \fn int get_replication_wait(replication this)
+    \brief Milliseconds until replicate_messages should be called again to push the kept messages,
+    -1 if there are none. For the client event loop timeout.
+    \param this Replication selected.
+*/
+int get_replication_wait(replication this);
+
+/*! \fn void wake_replication(replication this)
+    \brief Makes the replication thread run a loop iteration, so it passes a quiescent point of the
+    matrix and the rings replaced by a resize can be freed, see quiesce_matrix_reader. Client thread only.
+    \param this Replication selected.
+*/
+void wake_replication(replication this);
+
+/*! \fn uint_fast8_t replication_command(replication this, int command)
+    \brief Runs a user command in the replication thread and waits for it.
+    Returns the command result.
+    \param this Replication selected.
+    \param command One of repl_command.
+*/
+uint_fast8_t replication_command(replication this, int command);
+
+/*! \fn int get_join_status(replication this)
+    \brief Returns the current enum join_status.
+    \param this Replication selected.
+*/
+int get_join_status(replication this);
+
+/*! \fn void print_replication_stats(replication this)
+    \brief Prints the messages exchanged with the replication thread.
+    \param this Replication selected.
+*/
+void print_replication_stats(replication this);
+
+/*! \fn void free_replication(replication this)
+    \brief Stops and joins the thread, then closes every socket it owns.
+    \param this Replication selected.
+*/
+void free_replication(replication this);
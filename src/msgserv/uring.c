@@ -0,0 +1,166 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+        void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(struct uring *this, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(this, 0, sizeof(struct uring));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CLAMP;
+    this->fd = sys_io_uring_setup(entries, &p);
+    if (0 > this->fd) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        close(this->fd); //Older than 5.11
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    this->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    this->ring_mem = mmap(NULL, this->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            this->fd, IORING_OFF_SQ_RING);
+    this->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    this->sqes = (struct io_uring_sqe *)mmap(NULL, this->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, this->fd, IORING_OFF_SQES);
+    if (MAP_FAILED == this->ring_mem || MAP_FAILED == (void *)this->sqes) {
+        if (MAP_FAILED != this->ring_mem) munmap(this->ring_mem, this->ring_size);
+        if (MAP_FAILED != (void *)this->sqes) munmap(this->sqes, this->sqes_size);
+        close(this->fd);
+        return -1;
+    }
+
+    char *ring = (char *)this->ring_mem;
+    this->sq_head = (unsigned *)(ring + p.sq_off.head);
+    this->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    this->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+    this->sq_array = (unsigned *)(ring + p.sq_off.array);
+    this->sqe_tail = *this->sq_tail;
+    this->cq_head = (unsigned *)(ring + p.cq_off.head);
+    this->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    this->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+    this->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    //Identity mapping, sqe i always sits at array slot i
+    for (unsigned i = 0; i <= this->sq_mask; i++) {
+        this->sq_array[i] = i;
+    }
+    return 0;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *this) {
+    unsigned head = __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE);
+
+    if (this->sqe_tail - head > this->sq_mask) { //Full, let the kernel consume it
+        uring_enter(this, 0, 0);
+        head = __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE);
+        if (this->sqe_tail - head > this->sq_mask) {
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe *sqe = &this->sqes[this->sqe_tail & this->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    this->sqe_tail++;
+    return sqe;
+}
+
+int uring_enter(struct uring *this, unsigned wait_nr, int timeout_ms) {
+    unsigned to_submit = this->sqe_tail - *this->sq_tail;
+    unsigned flags = 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg = {0};
+    void *argp = NULL;
+    size_t argsz = 0;
+
+    __atomic_store_n(this->sq_tail, this->sqe_tail, __ATOMIC_RELEASE);
+    if (0 < wait_nr) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (0 <= timeout_ms) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+            argp = &arg;
+            argsz = sizeof(arg);
+            flags |= IORING_ENTER_EXT_ARG;
+        }
+    }
+    if (0 == to_submit && 0 == wait_nr) {
+        return 0;
+    }
+
+    this->enters++;
+    if (0 > sys_io_uring_enter(this->fd, to_submit, wait_nr, flags, argp, argsz)) {
+        return (EINTR == errno || ETIME == errno || EBUSY == errno) ? 0 : -1;
+    }
+    return 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *this) {
+    unsigned head = *this->cq_head;
+    if (head == __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &this->cqes[head & this->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *this) {
+    __atomic_store_n(this->cq_head, *this->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+struct io_uring_buf_ring *uring_setup_buf_ring(struct uring *this, unsigned entries, int bgid) {
+    size_t size = entries * sizeof(struct io_uring_buf);
+    struct io_uring_buf_ring *br = (struct io_uring_buf_ring *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (MAP_FAILED == (void *)br) {
+        return NULL;
+    }
+
+    struct io_uring_buf_reg reg = {.ring_addr = (uint64_t)(uintptr_t)br, .ring_entries = entries, .bgid = bgid};
+    if (0 != sys_io_uring_register(this->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+        munmap(br, size);
+        return NULL;
+    }
+    br->tail = 0;
+    return br;
+}
+
+void uring_buf_ring_add(struct io_uring_buf_ring *br, unsigned mask, unsigned offset, void *addr, unsigned len, uint16_t bid) {
+    struct io_uring_buf *buf = &br->bufs[(br->tail + offset) & mask];
+    buf->addr = (uint64_t)(uintptr_t)addr;
+    buf->len = len;
+    buf->bid = bid;
+}
+
+void uring_buf_ring_advance(struct io_uring_buf_ring *br, unsigned count) {
+    __atomic_store_n(&br->tail, (uint16_t)(br->tail + count), __ATOMIC_RELEASE);
+}
+
+void uring_free_buf_ring(struct uring *this, struct io_uring_buf_ring *br, unsigned entries, int bgid) {
+    struct io_uring_buf_reg reg = {.bgid = bgid};
+    sys_io_uring_register(this->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(br, entries * sizeof(struct io_uring_buf));
+}
+
+void uring_exit(struct uring *this) {
+    munmap(this->sqes, this->sqes_size);
+    munmap(this->ring_mem, this->ring_size);
+    close(this->fd);
+}
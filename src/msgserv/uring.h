@@ -0,0 +1,91 @@
+#pragma once
+/*! \file msgserv/uring.h
+ * \brief Minimal io_uring plumbing on the raw syscalls, used by the io_uring event loop backend.
+ */
+#include <linux/io_uring.h>
+#include "../utils/utils.h"
+
+/*! \struct uring
+    \brief Mapped submission and completion rings.
+*/
+struct uring {
+    int                 fd;
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            sq_mask;
+    unsigned            *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned            sqe_tail;   //!< Next free sqe, published on submit
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            cq_mask;
+    struct io_uring_cqe *cqes;
+    void                *ring_mem;
+    size_t              ring_size;
+    size_t              sqes_size;
+    uint64_t            enters;     //!< io_uring_enter calls
+};
+
+/*! \fn int uring_init(struct uring *this, unsigned entries)
+    \brief Creates the ring. Returns 0 on success, -1 if io_uring is not available.
+    \param this Ring to fill.
+    \param entries Submission queue size.
+*/
+int uring_init(struct uring *this, unsigned entries);
+
+/*! \fn struct io_uring_sqe *uring_get_sqe(struct uring *this)
+    \brief Returns a zeroed sqe. If the submission queue is full it is submitted first.
+    \param this Ring selected.
+*/
+struct io_uring_sqe *uring_get_sqe(struct uring *this);
+
+/*! \fn int uring_enter(struct uring *this, unsigned wait_nr, int timeout_ms)
+    \brief Submits the queued sqes and waits for wait_nr completions, in one syscall.
+    Returns 0 on success, -1 on error (errno is set, EINTR and ETIME are not errors).
+    \param this Ring selected.
+    \param wait_nr Completions to wait for, 0 only submits.
+    \param timeout_ms Maximum wait, -1 blocks.
+*/
+int uring_enter(struct uring *this, unsigned wait_nr, int timeout_ms);
+
+/*! \fn struct io_uring_cqe *uring_peek_cqe(struct uring *this)
+    \brief Returns the oldest completion, or NULL. uring_cqe_seen releases it.
+    \param this Ring selected.
+*/
+struct io_uring_cqe *uring_peek_cqe(struct uring *this);
+
+/*! \fn void uring_cqe_seen(struct uring *this)
+    \brief Releases the completion returned by uring_peek_cqe.
+    \param this Ring selected.
+*/
+void uring_cqe_seen(struct uring *this);
+
+/*! \fn struct io_uring_buf_ring *uring_setup_buf_ring(struct uring *this, unsigned entries, int bgid)
+    \brief Registers a ring of provided buffers, the kernel picks one per received datagram.
+    Returns NULL on failure.
+    \param this Ring selected.
+    \param entries Number of buffers, power of two.
+    \param bgid Buffer group id given in the sqes.
+*/
+struct io_uring_buf_ring *uring_setup_buf_ring(struct uring *this, unsigned entries, int bgid);
+
+/*! \fn void uring_buf_ring_add(struct io_uring_buf_ring *br, unsigned mask, unsigned offset, void *addr, unsigned len, uint16_t bid)
+    \brief Stages a buffer at tail + offset. uring_buf_ring_advance publishes it.
+*/
+void uring_buf_ring_add(struct io_uring_buf_ring *br, unsigned mask, unsigned offset, void *addr, unsigned len, uint16_t bid);
+
+/*! \fn void uring_buf_ring_advance(struct io_uring_buf_ring *br, unsigned count)
+    \brief Hands count staged buffers to the kernel.
+*/
+void uring_buf_ring_advance(struct io_uring_buf_ring *br, unsigned count);
+
+/*! \fn void uring_free_buf_ring(struct uring *this, struct io_uring_buf_ring *br, unsigned entries, int bgid)
+    \brief Unregisters and frees a provided buffer ring.
+*/
+void uring_free_buf_ring(struct uring *this, struct io_uring_buf_ring *br, unsigned entries, int bgid);
+
+/*! \fn void uring_exit(struct uring *this)
+    \brief Closes the ring, the kernel cancels every pending request.
+    \param this Ring selected.
+*/
+void uring_exit(struct uring *this);
@@ -0,0 +1,181 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include "workers.h"
+#include "identity.h"
+
+struct _worker {
+    pthread_t   thread;
+    bool        started;
+    int         fd;
+    udp_batch   batch;
+    matrix      msg_matrix;
+    int         reader;     //See add_matrix_reader
+    int         room_fd;    //Written by the writer thread once the publish queue has room
+    atomic_bool full;       //Stalled on a full publish queue, cleared by the writer as it wakes us
+    atomic_bool *stop;
+};
+
+struct _worker_pool {
+    int            n;
+    struct _worker *workers;
+    mpsc_queue     publish_queue;
+    int            wake_fd;
+    atomic_bool    stop;
+};
+
+static void *worker_run(void *arg) {
+    struct _worker *worker = (struct _worker *)arg;
+    struct pollfd socket_pfd = {.fd = worker->fd, .events = POLLIN};
+    struct pollfd room_pfd = {.fd = worker->room_fd, .events = POLLIN};
+    uint64_t wakeups;
+
+    while (!atomic_load_explicit(worker->stop, memory_order_relaxed)) {
+        bool stalled = is_batch_stalled(worker->batch);
+        if (stalled) { //The writer sees the flag after its pops, or we see the room they made
+            atomic_store(&worker->full, true);
+            atomic_thread_fence(memory_order_seq_cst);
+            handle_client_comms(worker->fd, worker->batch, worker->msg_matrix);
+            stalled = is_batch_stalled(worker->batch);
+        }
+
+        //Nothing is read from the matrix while waiting, a resize does not wait for the poll.
+        //A stalled worker leaves its datagrams in the socket buffer until the queue has room
+        park_matrix_reader(worker->msg_matrix, worker->reader);
+        int ready = poll(stalled ? &room_pfd : &socket_pfd, 1, WORKER_POLL_MS);
+        quiesce_matrix_reader(worker->msg_matrix, worker->reader);
+        if (0 > ready && EINTR != errno) {
+            if (_VERBOSE_TEST) printf("\nworker poll error\n");
+            break;
+        }
+        if (0 < ready && stalled) {
+            if (0 > read(worker->room_fd, &wakeups, sizeof(wakeups)) && EAGAIN != errno) {
+                if (_VERBOSE_TEST) printf("\nerror reading the worker eventfd\n");
+            }
+        } else if (0 < ready) {
+            handle_client_comms(worker->fd, worker->batch, worker->msg_matrix);
+        }
+    }
+    park_matrix_reader(worker->msg_matrix, worker->reader);
+    return NULL;
+}
+
+worker_pool create_worker_pool(int n, server host, matrix msg_matrix) {
+    worker_pool new_pool = (worker_pool)calloc(1, sizeof(struct _worker_pool));
+    if (!new_pool) {
+        memory_error("Unable to reserve worker pool memory");
+    }
+    new_pool->workers = (struct _worker *)calloc(n, sizeof(struct _worker));
+    if (!new_pool->workers) {
+        memory_error("Unable to reserve workers memory");
+    }
+
+    new_pool->n = n;
+    for (int i = 0; i < n; i++) {
+        new_pool->workers[i].fd = -1;
+        new_pool->workers[i].room_fd = -1;
+        atomic_init(&new_pool->workers[i].full, false);
+    }
+    new_pool->publish_queue = create_mpsc_queue(PUBLISH_QUEUE_SIZE, sizeof(struct publish_record));
+    new_pool->wake_fd = eventfd(0, EFD_NONBLOCK);
+    atomic_init(&new_pool->stop, false);
+    if (0 > new_pool->wake_fd) {
+        free_worker_pool(new_pool);
+        return NULL;
+    }
+
+    for (int i = 0; i < n; i++) { //Every socket is bound before the first thread starts
+        struct _worker *worker = &new_pool->workers[i];
+        worker->fd = init_udp_shared(host, true);
+        worker->room_fd = eventfd(0, EFD_NONBLOCK);
+        worker->batch = create_udp_batch();
+        worker->msg_matrix = msg_matrix;
+        worker->reader = add_matrix_reader(msg_matrix);
+        worker->stop = &new_pool->stop;
+        set_publish_queue(worker->batch, new_pool->publish_queue, new_pool->wake_fd);
+        if (0 >= worker->fd || 0 > worker->room_fd || 0 > worker->reader) {
+            free_worker_pool(new_pool);
+            return NULL;
+        }
+    }
+
+    //Signals are left to the client thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (int i = 0; i < n; i++) {
+        struct _worker *worker = &new_pool->workers[i];
+        worker->started = (0 == pthread_create(&worker->thread, NULL, worker_run, worker));
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    for (int i = 0; i < n; i++) {
+        if (!new_pool->workers[i].started) {
+            free_worker_pool(new_pool);
+            return NULL;
+        }
+    }
+
+    return new_pool;
+}
+
+int get_wake_fd(worker_pool this) {
+    return this->wake_fd;
+}
+
+uint_fast32_t drain_publishes(worker_pool this, matrix msg_matrix, wal log) {
+    struct publish_record record;
+    uint64_t wakeups, one = 1;
+    uint_fast32_t stored = 0;
+
+    //Reset the eventfd before draining, a push after this wakes us again
+    if (0 > read(this->wake_fd, &wakeups, sizeof(wakeups)) && EAGAIN != errno) {
+        if (_VERBOSE_TEST) printf("\nerror reading the worker eventfd\n");
+    }
+
+    while (mpsc_pop(this->publish_queue, &record)) {
+        stored += 2 == handle_publish(msg_matrix, log, record.content);
+    }
+
+    //Workers stalled on the full queue read their sockets again
+    atomic_thread_fence(memory_order_seq_cst);
+    for (int i = 0; 0 < stored && i < this->n; i++) {
+        struct _worker *worker = &this->workers[i];
+        if (atomic_exchange(&worker->full, false)
+                && (ssize_t)sizeof(one) != write(worker->room_fd, &one, sizeof(one)) && _VERBOSE_TEST) {
+            printf("\nerror waking a worker\n");
+        }
+    }
+    return stored;
+}
+
+void print_worker_stats(worker_pool this) {
+    for (int i = 0; i < this->n; i++) {
+        printf(KBLU "Worker %d " KNRM, i);
+        print_batch_stats(this->workers[i].batch);
+    }
+}
+
+void free_worker_pool(worker_pool this) {
+    if (!this) {
+        return;
+    }
+
+    atomic_store(&this->stop, true);
+    for (int i = 0; i < this->n; i++) {
+        struct _worker *worker = &this->workers[i];
+        if (worker->started) {
+            pthread_join(worker->thread, NULL);
+        }
+        close_fd(worker->fd);
+        close_fd(worker->room_fd);
+        free_udp_batch(worker->batch);
+    }
+
+    close_fd(this->wake_fd);
+    free_mpsc_queue(this->publish_queue);
+    free(this->workers);
+    free(this);
+}
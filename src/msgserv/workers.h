@@ -0,0 +1,55 @@
+#pragma once
+/*! \file msgserv/workers.h
+ * \brief UDP worker pool. Every worker serves its own SO_REUSEPORT socket in a thread.
+ *
+ * GET_MESSAGES is answered by the workers with lock free reads of the message matrix.
+ * PUBLISH is pushed to an MPSC queue and stored by the main thread, the only writer.
+ */
+#include "../utils/struct_server.h"
+#include "../utils/util_matrix.h"
+#include "message.h"
+
+#define PUBLISH_QUEUE_SIZE 4096 //Records, a worker stops reading its socket while it is full
+#define WORKER_POLL_MS 200      //Workers check the stop flag at this interval
+
+/*! \var typedef struct _worker_pool *worker_pool
+    \brief Describes a pointer to struct _worker_pool.
+*/
+typedef struct _worker_pool *worker_pool;
+
+/*! \fn worker_pool create_worker_pool(int n, server host, matrix msg_matrix)
+    \brief Opens n UDP sockets on the host udp port and starts one worker per socket.
+    Returns NULL if a socket or a thread could not be created.
+    \param n Number of workers.
+    \param host This server.
+    \param msg_matrix Message storage, written only by the calling thread.
+*/
+worker_pool create_worker_pool(int n, server host, matrix msg_matrix);
+
+/*! \fn int get_wake_fd(worker_pool this)
+    \brief Returns the eventfd the workers write after queueing a PUBLISH.
+    \param this Pool selected.
+*/
+int get_wake_fd(worker_pool this);
+
+/*! \fn uint_fast32_t drain_publishes(worker_pool this, matrix msg_matrix, wal log)
+    \brief Stores every queued PUBLISH, see handle_publish. Must run on the writer thread.
+    Then wakes the workers stalled on the full queue.
+    Returns the number of stored messages, to be shared with the other servers.
+    \param this Pool selected.
+    \param msg_matrix Message storage.
+    \param log Write-ahead log, NULL for none.
+*/
+uint_fast32_t drain_publishes(worker_pool this, matrix msg_matrix, wal log);
+
+/*! \fn void print_worker_stats(worker_pool this)
+    \brief Prints the batch stats of every worker.
+    \param this Pool selected.
+*/
+void print_worker_stats(worker_pool this);
+
+/*! \fn void free_worker_pool(worker_pool this)
+    \brief Stops and joins the workers, then closes their sockets.
+    \param this Pool selected.
+*/
+void free_worker_pool(worker_pool this);
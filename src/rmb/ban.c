@@ -4,29 +4,12 @@
 	Private implementation
 */
 
-//Runs the list to check if the server is banned, if it is returns the server item, else NULL
-server is_server_in_list(list list_of_banned, server server_to_check){
-	if(list_of_banned) {
-        if ((get_head(list_of_banned))) {
-            if (!different_servers((server)get_node_item(get_head(list_of_banned)), server_to_check)) {
-                return (server)get_node_item(get_head(list_of_banned));
-            }
-
-            node next_node = get_next_node(get_head(list_of_banned));
-            if (!next_node) {
-                return NULL;
-            }
-
-            for (node aux_node = get_head(list_of_banned);
-            aux_node != NULL && next_node != NULL;
-            aux_node = next_node, next_node = get_next_node(next_node)) {
-                if (!different_servers((server )get_node_item(next_node), server_to_check)) {
-                    return (server )get_node_item(next_node);
-                }
-            }
-        }
+//Looks the server up in the banned ones, if it is there returns the server item, else NULL
+server is_server_in_list(registry list_of_banned, server server_to_check){
+    if (!list_of_banned) {
+        return NULL;
     }
-    return NULL;
+    return (server)find_in_registry(list_of_banned, get_server_key(server_to_check));
 }
 
 //Modifiers of the list fundamental parameter, ban time
@@ -47,17 +30,17 @@ int get_ban_time(server server_to_check){
 	Public use
 */
 
-void ban_server(list list_of_banned, server server_to_ban){
+void ban_server(registry list_of_banned, server server_to_ban){
 	server mem_server = copy_server(NULL, server_to_ban);
     server server_to_update = NULL;
     set_ban_time(mem_server, SERVER_BAN_TIME);
-    if (NULL == (server_to_update = is_server_in_list(list_of_banned, mem_server))) push_item_to_list(list_of_banned, mem_server);
+    if (NULL == (server_to_update = is_server_in_list(list_of_banned, mem_server))) add_to_registry(list_of_banned, get_server_key(mem_server), mem_server, -1);
     else if (0 > get_ban_time(server_to_update)){
     	set_ban_time(server_to_update, SERVER_BAN_TIME);
     }
 }
 
-bool is_banned(list list_of_banned, server server_to_check){
+bool is_banned(registry list_of_banned, server server_to_check){
     server server_to_update = NULL;
 	if (NULL != (server_to_update = is_server_in_list(list_of_banned, server_to_check))){
 		reduce_ban(server_to_update);
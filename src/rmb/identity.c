@@ -3,7 +3,7 @@
 #define REQUEST "GET_SERVERS"
 
 int init_program(struct addrinfo *id_server, int_fast32_t *outgoing_fd,
-	int_fast32_t *binded_fd, list *msgservers_lst, server *sel_server,
+	int_fast32_t *binded_fd, registry *msgservers_lst, server *sel_server,
 	struct itimerspec *new_timer, int_fast32_t *timer_fd)
 	{
 
@@ -38,6 +38,10 @@ int init_program(struct addrinfo *id_server, int_fast32_t *outgoing_fd,
         return 1; //EXIT FAILURE
     }
 
+    if (NULL != *sel_server && 0 != use_server(*binded_fd, *sel_server)) {
+        *sel_server = NULL; //Selected again by the loop
+    }
+
     /* Start Timer */
     *timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK);
     if (*timer_fd == -1) {
@@ -95,14 +99,14 @@ char *get_servers(int fd, struct addrinfo *id_server) {
     return NULL;
 }
 
-list parse_servers(char *id_serv_info) {
+registry parse_servers(char *id_serv_info) {
     char *separated_info;
     char step_mem_name[STRING_SIZE]; //To define later
     char step_mem_ip_addr[STRING_SIZE];
     int  sscanf_state = 0;
     u_short step_mem_udp_port;
     u_short step_mem_tcp_port;
-    list msgserv_list = create_list();
+    registry msgserv_list = create_registry();
 
     strtok(id_serv_info, "\n"); //Gets the first info, stoping at newline
     separated_info = strtok(NULL, "\n");
@@ -122,7 +126,7 @@ list parse_servers(char *id_serv_info) {
 
         set_fd(alloc_server, -2);
         set_connected(alloc_server, 0);
-        push_item_to_list( msgserv_list, alloc_server ); //Pushes to list
+        add_to_registry(msgserv_list, get_server_key(alloc_server), alloc_server, -1);
 
         separated_info = strtok(NULL, "\n");//Gets new info
     }
@@ -130,10 +134,10 @@ list parse_servers(char *id_serv_info) {
     return msgserv_list;
 }
 
-// fetch_servers returns a list parsed from the response of (get_servers).
-list fetch_servers(int fd, struct addrinfo *id_server) {
+// fetch_servers returns a registry parsed from the response of (get_servers).
+registry fetch_servers(int fd, struct addrinfo *id_server) {
     char *response;
-    list msgserv_lst = NULL;
+    registry msgserv_lst = NULL;
 
     response = get_servers(fd, id_server); //Show server will return NULL on disconnection
     if (NULL != response){
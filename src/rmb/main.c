@@ -90,8 +90,8 @@ int main(int argc, char *argv[]) {
     uint_fast8_t exit_code = EXIT_SUCCESS, err = EXIT_SUCCESS, max_fd = -1;
     uint_fast32_t msg_num = 0;
 
-    list msgservers_lst = NULL;
-    list banservers_lst = create_list();
+    registry msgservers_lst = NULL;
+    registry banservers_lst = create_registry();
 
     server sel_server;
 
@@ -160,6 +160,10 @@ int main(int argc, char *argv[]) {
                 sel_server = select_server(msgservers_lst);
             }
 
+            if (sel_server != NULL && use_server(binded_fd, sel_server)) {
+                err = true; //Not usable, try the next one
+                continue;
+            }
             if (sel_server != NULL) { //When it finds a server not yet banned
                 if (err) {
                     fprintf(stdout, KYEL "Failed...Attempting to send to another server\n" KNRM);
@@ -172,7 +176,7 @@ int main(int argc, char *argv[]) {
                 err = false;
                 fprintf(stderr, KYEL "No servers available..." KNRM);
                 fflush(stdout);
-                free_list(msgservers_lst, free_server); //Get new servers if the list is all run
+                free_registry(msgservers_lst, free_server); //Get new servers if the list is all run
                 msgservers_lst = fetch_servers(outgoing_fd, id_server);
                 if (msgservers_lst != NULL){
                 //After getting the list repeat the servers check on the new servers.
@@ -223,7 +227,7 @@ int main(int argc, char *argv[]) {
                 continue;
             } else if (0 == strcasecmp("show_servers", op) || 0 == strcmp("1", op)) {
                 //Prints the current reliable and untested servers list
-                print_list(msgservers_lst, print_server);
+                print_registry(msgservers_lst, print_server);
             } else if (0 == strcasecmp("publish", op) || 0 == strcmp("2", op)) {
                 if (0 == strlen(input_buffer)) {
                     //User input invalid
@@ -245,7 +249,7 @@ int main(int argc, char *argv[]) {
                         continue;
                     }
                     if('Y' == y_n_answer[0] || 'y' == y_n_answer[0]){
-                        err = publish(binded_fd, sel_server, input_buffer);
+                        err = publish(binded_fd, input_buffer);
                         if (2 == err){
                             fprintf(stderr, KRED "Please enter valid characters\n" KNRM);
                         }
@@ -254,7 +258,7 @@ int main(int argc, char *argv[]) {
                         }
                         //Make a test to the server (Just tests answering, not content) the zero msg_num configures the test
                         if(!err){
-                            err = ask_for_messages(binded_fd, sel_server, 0);
+                            err = ask_for_messages(binded_fd, 0);
                             if (err) {
                                 fprintf(stderr, KRED "Ask for messages error\n" KNRM);
                             }
@@ -264,7 +268,7 @@ int main(int argc, char *argv[]) {
                     }
                 }
                 else{
-                    err = publish(binded_fd, sel_server, input_buffer);
+                    err = publish(binded_fd, input_buffer);
                     if (2 == err){
                         fprintf(stderr, KRED "Please enter valid characters\n" KNRM);
                     }
@@ -273,7 +277,7 @@ int main(int argc, char *argv[]) {
                     }
                     //Make a test to the server (Just tests answering, not content) the zero msg_num configures the test
                     if (!err){
-                        err = ask_for_messages(binded_fd, sel_server, 0);
+                        err = ask_for_messages(binded_fd, 0);
                         if (err) {
                             fprintf(stderr, KRED "Ask for messages error\n" KNRM);
                         }
@@ -293,7 +297,7 @@ int main(int argc, char *argv[]) {
                 int msg_num_test = atoi(input_buffer);
                 if( 0 < msg_num_test) { //Requests the last $(msg_num_test) messages to the server
                     msg_num = msg_num_test;
-                    err = ask_for_messages(binded_fd, sel_server, msg_num); //Requests messages
+                    err = ask_for_messages(binded_fd, msg_num); //Requests messages
                     ask_server_test(); //Say that we still need to get an answer
                 }
                 else {
@@ -329,7 +333,7 @@ PROGRAM_EXIT: //Cleaning routine
     close_fd(binded_fd);
     freeaddrinfo(id_server);
     free_incoming_messages();
-    free_list(msgservers_lst, free_server);
-    free_list(banservers_lst, free_server);
+    free_registry(msgservers_lst, free_server);
+    free_registry(banservers_lst, free_server);
     return exit_code;
 }
@@ -23,53 +23,39 @@ int check_message_validity(char * msg){
 }
 
 // select_server returns a pointer to a random server in $(server_list).
-server select_server(list server_list) {
-    node head = get_head(server_list);
-    if (!head) {
+server select_server(registry server_list) {
+    if (!server_list || 0 == get_registry_size(server_list)) {
         return NULL;
     }
+    return (server)get_registry_item(server_list, rand() % get_registry_size(server_list));
+}
 
-    uint_fast16_t r = rand() % get_list_size(server_list);
-
-    for (uint_fast16_t i = 0; i < r; i ++) {
-        head = get_next_node(head);
+// rem_awol_server removes a server from the registry, the server in $(awol_server)
+void rem_awol_server(registry server_list, server awol_server){
+    if (!server_list) {
+        return;
+    }
+    struct peer_key key = get_server_key(awol_server);
+    item found = find_in_registry(server_list, key);
+    if (found) {
+        retire_from_registry(server_list, key, found);
+        reap_registry(server_list, free_server);
     }
-
-    return (server)get_node_item(head);
 }
 
-// rem_awol_server removes a server from the list, the server in $(awol_server)
-void rem_awol_server(list server_list, server awol_server){
-    if(server_list) { 
-        if ((get_head(server_list))) {
-            if (!different_servers((server)get_node_item(get_head(server_list)), awol_server)) {
-                remove_head(server_list, free_server);
-                return;
-            }
-
-            node next_node = get_next_node(get_head(server_list));
-            if (!next_node) {
-                return;
-            }
-
-            for (node aux_node = get_head(server_list);
-            aux_node != NULL && next_node != NULL;
-            aux_node = next_node, next_node = get_next_node(next_node)) {
-                if (!different_servers((server )get_node_item(next_node), awol_server)) {
-                    remove_next_node(server_list, aux_node, free_server);
-                    return;
-                }
-            }
-        }
+// use_server connects the UDP socket $(fd) to $(sel_server), the requests are sent to it
+// without an address and only its replies are received.
+int use_server(int fd, server sel_server) {
+    if (0 != connect(fd, (const struct sockaddr *)get_udp_sockaddr(sel_server), sizeof(struct sockaddr_in))) {
+        if (_VERBOSE_TEST) fprintf(stderr, KYEL "unable to use %s\n" KNRM, get_ip_address(sel_server));
+        return 1;
     }
+    return 0;
 }
 
-// publish sends a $(msg) with 140 characters max to $(sel_server).
-int publish(int fd, server sel_server, char *msg) {
+// publish sends a $(msg) with 140 characters max to the server in use.
+int publish(int fd, char *msg) {
     ssize_t n = 0;
-
-    struct sockaddr_in server_addr = { 0 , .sin_port = 0};
-    socklen_t addr_len;
     char msg_to_send[RESPONSE_SIZE];
 
     if (0 == check_message_validity(msg)){
@@ -78,51 +64,29 @@ int publish(int fd, server sel_server, char *msg) {
 
     sprintf(msg_to_send, "%s %s", PUBLISH, msg);
 
-    server_addr.sin_family = AF_INET;
-    if (1 != inet_aton(get_ip_address(sel_server), &server_addr.sin_addr)) {
-        if (_VERBOSE_TEST) fprintf(stderr, KYEL "unable to convert %s to address\n" KNRM, get_ip_address(sel_server));
-        return 1;
-    }
-
-    server_addr.sin_port = htons(get_udp_port(sel_server));
-    addr_len = sizeof(server_addr);
-
-    n = sendto(fd, msg_to_send, strlen(msg_to_send) + 1, 0,
-            (struct sockaddr*)&server_addr, addr_len);
+    n = send(fd, msg_to_send, strlen(msg_to_send) + 1, 0);
 
     if (-1 == n) {
-        if (_VERBOSE_TEST) fprintf(stderr, KYEL "unable to send to %s\n" KNRM, inet_ntoa(server_addr.sin_addr));
+        if (_VERBOSE_TEST) fprintf(stderr, KYEL "unable to send\n" KNRM);
         return 1;
     }
 
     return 0;
 }
 
-// ask_for_messages sends a UDP request to $(sel_server) for the last $(num) messages.
-int ask_for_messages(int fd, server sel_server, int num) {
+// ask_for_messages sends a UDP request to the server in use for the last $(num) messages.
+int ask_for_messages(int fd, int num) {
     ssize_t n = 0;
     uint_fast16_t real_msg_num = ( 0 != num ? num : 1 ); //Exception for server test
     _testing_with_results = ( 0 != num ? true : false );
 
-    socklen_t addr_len;
-    struct sockaddr_in server_addr = { 0 , .sin_port = 0};
     char msg_to_send[STRING_SIZE];
     sprintf(msg_to_send, "%s %zu", ASK, real_msg_num);
 
-    server_addr.sin_family = AF_INET;
-    if (1 != inet_aton(get_ip_address(sel_server), &server_addr.sin_addr)) {
-        if (_VERBOSE_TEST) fprintf(stderr, KYEL "unable to convert \"%s\" to address\n" KNRM, get_ip_address(sel_server));
-        return 1;
-    }
-
-    server_addr.sin_port = htons(get_udp_port(sel_server));
-    addr_len = sizeof(server_addr);
-
-    n = sendto(fd, msg_to_send, strlen(msg_to_send) + 1, 0,
-            (struct sockaddr*)&server_addr, addr_len);
+    n = send(fd, msg_to_send, strlen(msg_to_send) + 1, 0);
 
     if (0 > n) {
-        if (_VERBOSE_TEST) fprintf(stderr, KYEL "unable to send to %s\n" KNRM, inet_ntoa(server_addr.sin_addr));
+        if (_VERBOSE_TEST) fprintf(stderr, KYEL "unable to send\n" KNRM);
         return 1;
     }
     return 0;
@@ -6,34 +6,40 @@
 #include "../utils/utils.h"
 #include "../utils/struct_server.h"
 
-/*! \fn server select_server(list server_list);
+/*! \fn server select_server(registry server_list);
   \brief select_server returns a pointer to a random server in server_list.
-  \param server_list List containing server information.
+  \param server_list Registry containing server information.
   */
-server select_server(list server_list);
+server select_server(registry server_list);
 
-/*!\fn void rem_awol_server(list server_list, server awol_server);
-  \brief removes from the list the server on awol_server
-  \param server_list List containing server information.
+/*!\fn void rem_awol_server(registry server_list, server awol_server);
+  \brief removes from the registry the server on awol_server
+  \param server_list Registry containing server information.
   \param awol_server Server that is disconnected
 */
-void rem_awol_server(list server_list, server awol_server);
+void rem_awol_server(registry server_list, server awol_server);
 
-/*!\fn publish(int fd, server sel_server, char *msg)
-  \brief publish sends a msg with 140 characters max to sel_server.
-  \param fd Descriptor to use in send.
+/*!\fn int use_server(int fd, server sel_server)
+  \brief use_server connects the UDP socket to sel_server, publish and ask_for_messages send to it.
+  Must be called every time another server is selected. Returns 0 on success.
+  \param fd Descriptor to use in send and receive.
   \param sel_server Randomly selected server.
+  */
+int use_server(int fd, server sel_server);
+
+/*!\fn publish(int fd, char *msg)
+  \brief publish sends a msg with 140 characters max to the server in use.
+  \param fd Descriptor given to use_server.
   \param msg Message to publish
   */
-int publish(int fd, server sel_server, char *msg);
+int publish(int fd, char *msg);
 
-/*! \fn int ask_for_messages(int fd, server sel_server, int num)
-  \brief ask_for_messages sends a UDP request to sel_server for the last num messages.
-  \param fd Descriptor to use in send.
-  \param sel_server Randomly selected server.
+/*! \fn int ask_for_messages(int fd, int num)
+  \brief ask_for_messages sends a UDP request to the server in use for the last num messages.
+  \param fd Descriptor given to use_server.
   \param num Number of messages to get.
   */
-int ask_for_messages(int fd, server sel_server, int num);
+int ask_for_messages(int fd, int num);
 
 /*! \fn int handle_incoming_messages(int fd, uint num)
   \brief handle_incoming_messages receives all the messages and handles the content. Verifying the data.
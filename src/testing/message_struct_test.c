@@ -1,10 +1,39 @@
 /* #include "message_struct_test.h" */
 #include "../utils/struct_message.h"
+#include <sys/socket.h>
 #include "../msgserv/message.h"
 #include "greatest.h"
 
+// parse_into_matrix runs the server stream parser on to_parse, in two reads,
+// and stores what it handed to the client thread like drain_ingested does
+static void parse_into_matrix(const char *to_parse, size_t len, bool binary, matrix msg_matrix) {
+    struct server_state state = {.ingest_queue = create_spsc_queue(64, sizeof(struct replicated_message)),
+        .ingest_fd = -1};
+    server peer = new_server("Test", "127.0.0.1", 0, 0);
+    struct stream_parser *parser = get_parser(peer);
+    struct replicated_message record;
+    size_t half = len / 2;
+
+    if (binary) { //As after BINARY, the test server has no socket to answer it
+        parser->state = STREAM_BINARY;
+    }
+    memcpy(parser->buffer, to_parse, half); //Splits a line and the block
+    parser->len = half;
+    parse_stream(&state, peer);
+    memcpy(parser->buffer + parser->len, to_parse + half, len - half);
+    parser->len += len - half;
+    parse_stream(&state, peer);
+
+    while (spsc_pop(state.ingest_queue, &record)) {
+        store_replicated_message(msg_matrix, record.lc, record.content);
+    }
+    free_server(peer);
+    free_spsc_queue(state.ingest_queue);
+}
+
 
 TEST test_parse_not_full(void) {
+    g_lc = 0;
     char output[4098];
     bzero(output, 4098);
 
@@ -23,15 +52,588 @@ TEST test_parse_not_full(void) {
           "LC: 4 Message: Atqui reperies, inquit, in hoc quidem pertinacem; De ingenio eius in his disputationibus, non de moribus quaeritur. Atque ab his initiis pro\n";
 
     matrix this = create_matrix(8);
-    parse_messages(to_parse, this);
+    parse_into_matrix(to_parse, strlen(to_parse), false, this);
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
     freopen("/dev/null", "a", stdout);
-    setbuf(stdout, output);
+    setvbuf(stdout, output, _IOFBF, sizeof(output) - 1);
     print_matrix(this, print_message_plain);
-    freopen ("/dev/tty", "a", stdout);
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    setvbuf(stdout, NULL, _IOLBF, 0);
 
     ASSERT_STR_EQ(expected, output);
 
-    free_matrix(this, free_message);
+    free_matrix(this);
+    PASS();
+}
+
+// compress_frames puts the stream in two BINARY_COMPRESSED frames, split inside a record
+static size_t compress_frames(const char *stream, size_t len, char *frames) {
+    size_t half = len / 2, frames_len = 0;
+
+    for (size_t done = 0; done < len; done += half) {
+        size_t block = len - done < half ? len - done : half;
+        char compressed[1024];
+        size_t compressed_len = lz_compress(stream + done, block, compressed, sizeof(compressed));
+
+        frames[frames_len++] = BINARY_COMPRESSED;
+        frames_len += put_varint(frames + frames_len, block);
+        frames_len += put_varint(frames + frames_len, compressed_len);
+        memcpy(frames + frames_len, compressed, compressed_len);
+        frames_len += compressed_len;
+    }
+    return frames_len;
+}
+
+TEST test_parse_binary(bool compressed) {
+    const char *contents[] = {"first", "", "third, longer than one varint byte of clock"};
+    const uint64_t clocks[] = {5, 6, 300};
+    char to_parse[1024], frames[2048];
+    size_t len = BINARY_HEADER_MAX;
+
+    g_lc = 0;
+    for (int i = 0; i < 3; i++) {
+        len += put_binary_record(to_parse + len, clocks[i], contents[i], strlen(contents[i]));
+    }
+    size_t header_len = put_binary_header(to_parse + BINARY_HEADER_MAX, BINARY_MESSAGES, 3);
+
+    char *stream = to_parse + BINARY_HEADER_MAX - header_len;
+    len = len - BINARY_HEADER_MAX + header_len;
+    if (compressed) {
+        len = compress_frames(stream, len, frames);
+        stream = frames;
+    }
+
+    matrix this = create_matrix(8);
+    parse_into_matrix(stream, len, true, this);
+
+    ASSERT_EQ(3, get_size(this));
+    for (int i = 0; i < 3; i++) {
+        ASSERT_STR_EQ(contents[i], get_string((message)get_element(this, i)));
+    }
+    ASSERT_EQ(301, g_lc); //Clocks of the records were kept
+
+    free_matrix(this);
+    PASS();
+}
+
+// Text, binary and compressed streams of ten messages, through an ingest ring of four
+TEST test_ingest_stall(int form) {
+    struct server_state state = {.ingest_queue = create_spsc_queue(4, sizeof(struct replicated_message)),
+        .ingest_fd = -1};
+    server peer = new_server("Test", "127.0.0.1", 0, 0);
+    struct stream_parser *parser = get_parser(peer);
+    struct replicated_message record;
+    char stream[2048], frames[4096], *to_parse = stream;
+    size_t len = BINARY_HEADER_MAX;
+    int stalls = 0;
+
+    g_lc = 0;
+    ilist_init(&state.connected);
+    ilist_push_back(&state.connected, get_server_link(peer));
+    if (0 == form) {
+        len = snprintf(stream, sizeof(stream), "SMESSAGES\n");
+        for (int i = 0; i < 10; i++) {
+            len += snprintf(stream + len, sizeof(stream) - len, "%d;message %d\n", 10 + i, i);
+        }
+        len += snprintf(stream + len, sizeof(stream) - len, "\n");
+    } else {
+        char content[STRING_SIZE];
+        for (int i = 0; i < 10; i++) {
+            len += put_binary_record(stream + len, 10 + i, content, snprintf(content, sizeof(content), "message %d", i));
+        }
+        size_t header_len = put_binary_header(stream + BINARY_HEADER_MAX, BINARY_MESSAGES, 10);
+        to_parse = stream + BINARY_HEADER_MAX - header_len;
+        len = len - BINARY_HEADER_MAX + header_len;
+        if (2 == form) {
+            len = compress_frames(to_parse, len, frames);
+            to_parse = frames;
+        }
+        parser->state = STREAM_BINARY;
+    }
+
+    matrix this = create_matrix(16);
+    memcpy(parser->buffer, to_parse, len);
+    parser->len = len;
+    parse_stream(&state, peer);
+    while (parser->stalled) { //The client thread drains, then the replication thread resumes
+        stalls++;
+        while (spsc_pop(state.ingest_queue, &record)) {
+            store_replicated_message(this, record.lc, record.content);
+        }
+        resume_ingest(&state);
+        ASSERT(stalls < 10);
+    }
+    while (spsc_pop(state.ingest_queue, &record)) {
+        store_replicated_message(this, record.lc, record.content);
+    }
+
+    ASSERT(0 < stalls);
+    ASSERT_FALSE(state.ingest_paused);
+    ASSERT_EQ(10, get_size(this));
+    char *messages = get_first_n_messages(this, 10, MSG_W_LC, NULL);
+    ASSERT_STR_EQ("10;message 0\n11;message 1\n12;message 2\n13;message 3\n14;message 4\n"
+            "15;message 5\n16;message 6\n17;message 7\n18;message 8\n19;message 9\n", messages);
+    free(messages);
+
+    free_matrix(this);
+    free_server(peer);
+    free_spsc_queue(state.ingest_queue);
+    PASS();
+}
+
+TEST test_publish_stall(void) {
+    mpsc_queue queue = create_mpsc_queue(4, sizeof(struct publish_record));
+    udp_batch batch = create_udp_batch();
+    struct publish_record record;
+    char datagram[STRING_SIZE];
+    int fds[2], stalls = 0;
+
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_DGRAM, 0, fds));
+    for (int i = 0; i < 10; i++) {
+        ASSERT(0 < send(fds[0], datagram, snprintf(datagram, sizeof(datagram), "PUBLISH message %d", i), 0));
+    }
+
+    g_lc = 0;
+    matrix this = create_matrix(16);
+    set_publish_queue(batch, queue, -1);
+    handle_client_comms(fds[1], batch, this);
+    while (is_batch_stalled(batch)) { //The writer drains, then the worker handles the rest of its batch
+        stalls++;
+        while (mpsc_pop(queue, &record)) {
+            handle_publish(this, NULL, record.content);
+        }
+        handle_client_comms(fds[1], batch, this);
+        ASSERT(stalls < 10);
+    }
+    while (mpsc_pop(queue, &record)) {
+        handle_publish(this, NULL, record.content);
+    }
+
+    ASSERT(0 < stalls);
+    ASSERT_EQ(10, get_size(this));
+    char *messages = get_first_n_messages(this, 10, MSG_W_LC, NULL);
+    ASSERT_STR_EQ("0;message 0\n1;message 1\n2;message 2\n3;message 3\n4;message 4\n"
+            "5;message 5\n6;message 6\n7;message 7\n8;message 8\n9;message 9\n", messages);
+    free(messages);
+
+    close(fds[0]);
+    close(fds[1]);
+    free_matrix(this);
+    free_udp_batch(batch);
+    free_mpsc_queue(queue);
+    PASS();
+}
+
+TEST test_lz_round_trip(void) {
+    size_t len = 200 * 1024; //Past LZ_MAX_OFFSET, matches are looked for in a window
+    char *raw = (char *)malloc(len), *compressed = (char *)malloc(lz_bound(len)), *inflated = (char *)malloc(len);
+    ASSERT(raw && compressed && inflated);
+
+    srand(3);
+    for (size_t i = 0; i < len; ) { //Random bytes, one byte runs, short periods and long repeats
+        size_t run = 64 + rand() % 4096;
+        run = run < len - i ? run : len - i;
+        switch (rand() % 4) {
+            case 0:
+                for (size_t n = 0; n < run; n++) raw[i + n] = (char)rand();
+                break;
+            case 1:
+                memset(raw + i, 'a' + rand() % 26, run);
+                break;
+            case 2: {
+                size_t period = 2 + rand() % 14; //Offsets below 16 overlap the copy
+                for (size_t n = 0; n < run; n++) raw[i + n] = (char)('A' + (n % period));
+                break;
+            }
+            default:
+                if (i >= 5000) { //An earlier stretch again, a long match
+                    memmove(raw + i, raw + i - 5000 + rand() % 1000, run);
+                } else {
+                    memset(raw + i, '.', run);
+                }
+        }
+        i += run;
+    }
+
+    size_t compressed_len = lz_compress(raw, len, compressed, lz_bound(len));
+    ASSERT(0 < compressed_len && compressed_len < len);
+    ASSERT_EQ(len, lz_decompress(compressed, compressed_len, inflated, len));
+    ASSERT_MEM_EQ(raw, inflated, len);
+
+    ASSERT_EQ(0, lz_decompress(compressed, compressed_len, inflated, len - 1)); //Does not fit
+    ASSERT_EQ(0, lz_decompress(compressed, compressed_len - 1, inflated, len)); //Truncated in the last literals
+    ASSERT_EQ(0, lz_decompress("\xF0\xFF", 2, inflated, len));                 //Length bytes never end
+    ASSERT_EQ(0, lz_decompress("\x40" "ab", 3, inflated, len));                 //Fewer literals than the token says
+    ASSERT_EQ(0, lz_decompress("\x10" "a\x00\x00", 4, inflated, len));          //Offset 0
+    ASSERT_EQ(0, lz_decompress("\x10" "a\x02\x00", 4, inflated, len));          //Before the start of the output
+    ASSERT_EQ(0, lz_decompress("\x10" "a\x01", 3, inflated, len));              //Offset cut short
+    ASSERT_EQ(30, lz_decompress("\x1F" "a\x01\x00\x0A", 5, inflated, len));    //A run of 30, offset 1
+    ASSERT_EQ(0, memcmp(inflated, "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 30));
+
+    free(raw);
+    free(compressed);
+    free(inflated);
+    PASS();
+}
+
+TEST test_drop_duplicates(void) {
+    g_lc = 0;
+    const char *block = "SMESSAGES\n7;first\n8;second\n\n";
+    matrix this = create_matrix(2);
+
+    parse_into_matrix(block, strlen(block), false, this);
+    parse_into_matrix(block, strlen(block), false, this); //From both connections to the server
+    ASSERT_EQ(2, get_size(this));
+
+    ASSERT(store_replicated_message(this, 9, "first")); //Not the same clock, not the same message
+    ASSERT_EQ(NULL, store_replicated_message(this, 8, "second"));
+    ASSERT_EQ(NULL, store_replicated_message(this, 7, "first")); //Evicted, and older than the rest
+    ASSERT_EQ(3, get_size(this));
+
+    free_matrix(this);
+    PASS();
+}
+
+TEST test_late_messages(void) {
+    g_lc = 0;
+    matrix this = create_matrix(4);
+
+    store_replicated_message(this, 10, "ten");
+    store_replicated_message(this, 30, "thirty");
+    store_replicated_message(this, 20, "twenty"); //Arrived late
+    ASSERT_EQ(31, g_lc);
+    store_message(this, "local");
+    store_replicated_message(this, 15, "fifteen"); //Evicts ten
+    char *messages = get_first_n_messages(this, 4, MSG_W_LC, NULL);
+    ASSERT_STR_EQ("15;fifteen\n20;twenty\n30;thirty\n31;local\n", messages);
+    ASSERT_EQ(get_size(this) - 3, find_first_after(this, 15));
+    free(messages);
+
+    free_matrix(this);
+    PASS();
+}
+
+TEST test_late_batch(void) {
+    g_lc = 0;
+    matrix this = create_matrix(8), one_by_one = create_matrix(8);
+    char contents[64][STRING_SIZE], *src[64];
+    uint64_t lc[64];
+
+    for (int i = 1; i <= 8; i++) { //Full ring, 100 to 800
+        snprintf(contents[0], STRING_SIZE, "n%d", 100 * i);
+        store_replicated_message(this, 100 * i, contents[0]);
+        store_replicated_message(one_by_one, 100 * i, contents[0]);
+    }
+    for (int i = 0; i < 5; i++) { //Older snapshot, dropped as a whole
+        lc[i] = 10 * (i + 1);
+        snprintf(contents[i], STRING_SIZE, "n%d", 10 * (i + 1));
+        src[i] = contents[i];
+    }
+    ASSERT_EQ(0, store_replicated_messages(this, 5, lc, src));
+    ASSERT_EQ(8, get_size(this));
+
+    const uint64_t late[] = {900, 250, 700, 450, 250, 30}; //New, evicted by the others, stored, late, twice, too old
+    for (int i = 0; i < 6; i++) {
+        lc[i] = late[i];
+        snprintf(contents[i], STRING_SIZE, "n%lu", (unsigned long)late[i]);
+        src[i] = contents[i];
+    }
+    ASSERT_EQ(2, store_replicated_messages(this, 6, lc, src));
+    char *messages = get_first_n_messages(this, 8, MSG_W_LC, NULL);
+    ASSERT_STR_EQ("300;n300\n400;n400\n450;n450\n500;n500\n600;n600\n700;n700\n800;n800\n900;n900\n", messages);
+    free(messages);
+    ASSERT(insert_dedup(get_dedup(this), 250, hash_content("n250"))); //Its key went with it
+    remove_dedup(get_dedup(this), 250, hash_content("n250"));
+    ASSERT_FALSE(insert_dedup(get_dedup(this), 450, hash_content("n450")));
+
+    srand(7);
+    for (int round = 0; round < 200; round++) { //Random batches end like the same messages one at a time
+        size_t n = 1 + rand() % 64;
+        for (size_t i = 0; i < n; i++) {
+            lc[i] = g_lc + 8 - rand() % 40;
+            snprintf(contents[i], STRING_SIZE, "r%d", rand() % 4);
+            src[i] = contents[i];
+        }
+        store_replicated_messages(this, n, lc, src);
+        for (size_t i = 0; i < n; i++) {
+            store_replicated_message(one_by_one, lc[i], src[i]);
+        }
+        char *batched = get_first_n_messages(this, 8, MSG_W_LC, NULL);
+        char *single = get_first_n_messages(one_by_one, 8, MSG_W_LC, NULL);
+        ASSERT_STR_EQ(single, batched);
+        free(batched);
+        free(single);
+    }
+
+    free_matrix(this);
+    free_matrix(one_by_one);
+    PASS();
+}
+
+TEST test_byte_budget(void) {
+    g_lc = 0;
+    matrix this = create_matrix(16);
+    char content[STRING_SIZE];
+
+    for (int i = 0; i < 16; i++) { //Shorter than the average, every one fits
+        store_message(this, "short");
+    }
+    ASSERT_EQ(16, get_size(this) - get_first(this));
+
+    memset(content, 'x', STRING_SIZE - 1);
+    content[STRING_SIZE - 1] = '\0';
+    for (int i = 16; i < 80; i++) { //The longest ones take the bytes of more than one each
+        content[0] = 'a' + i % 26;
+        store_message(this, content);
+    }
+    uint64_t kept = get_size(this) - get_first(this);
+    ASSERT(0 < kept && kept < 16);
+    ASSERT_EQ(matrix_memory_for(16), get_matrix_memory(this));
+
+    char *messages = get_first_n_messages(this, 16, MSG_W_LC, NULL), *line = messages;
+    for (uint64_t index = get_first(this); index < get_size(this); index++) { //Every one kept is whole
+        content[0] = 'a' + index % 26;
+        ASSERT_EQ(index, strtoull(line, &line, 10));
+        ASSERT_EQ(0, strncmp(line + 1, content, STRING_SIZE - 1));
+        line += STRING_SIZE + 1;
+    }
+    ASSERT_EQ('\0', *line);
+    free(messages);
+
+    content[0] = 'a' + (get_first(this) - 1) % 26; //The key of a dropped one went with it
+    ASSERT(insert_dedup(get_dedup(this), get_first(this) - 1, hash_content(content)));
+
+    free_matrix(this);
+    PASS();
+}
+
+TEST test_resize_matrix(void) {
+    g_lc = 0;
+    matrix this = create_matrix(4);
+    char content[STRING_SIZE];
+
+    for (int i = 0; i < 6; i++) { //Keeps 20 to 50
+        snprintf(content, STRING_SIZE, "m%d", 10 * i);
+        store_replicated_message(this, 10 * i, content);
+    }
+    ASSERT_EQ(0, start_matrix_resize(this, 8, get_message_key));
+    ASSERT_FALSE(step_matrix_resize(this, 2));
+    store_replicated_message(this, 25, "late"); //Moves up what was copied, evicts 20 but the copy has it
+    ASSERT(step_matrix_resize(this, RESIZE_STEP));
+    store_message(this, "local");
+    ASSERT_EQ(8, get_capacity(this));
+    ASSERT_EQ(1, start_matrix_resize(this, 2, get_message_key)); //Old rings freed by the next step
+
+    store_message(this, "m52");
+    store_message(this, "m53");
+    char *messages = get_first_n_messages(this, 8, MSG_W_LC, NULL);
+    ASSERT_STR_EQ("20;m20\n25;late\n30;m30\n40;m40\n50;m50\n51;local\n52;m52\n53;m53\n", messages);
+    free(messages);
+    ASSERT_EQ(NULL, store_replicated_message(this, 40, "m40")); //The keys were copied too
+
+    free_matrix(this);
+    PASS();
+}
+
+TEST test_resize_readers(void) {
+    g_lc = 0;
+    matrix this = create_matrix(4);
+    int running = add_matrix_reader(this), parked = add_matrix_reader(this);
+
+    store_message(this, "one");
+    quiesce_matrix_reader(this, running);
+    ASSERT_EQ(0, start_matrix_resize(this, 8, get_message_key));
+    ASSERT(step_matrix_resize(this, RESIZE_STEP));
+    ASSERT_FALSE(step_matrix_resize(this, RESIZE_STEP)); //The running reader may still copy from the old rings
+    ASSERT_EQ(RESIZE_RETIRE_MS, get_resize_wait(this));
+    ASSERT_EQ(1, start_matrix_resize(this, 2, get_message_key));
+
+    quiesce_matrix_reader(this, parked); //Woke up after the swap, reads the new rings only
+    quiesce_matrix_reader(this, running);
+    ASSERT_EQ(0, get_resize_wait(this));
+    step_matrix_resize(this, RESIZE_STEP);
+    ASSERT_EQ(-1, get_resize_wait(this));
+    ASSERT_EQ(0, start_matrix_resize(this, 2, get_message_key));
+
+    ASSERT(step_matrix_resize(this, RESIZE_STEP));
+    park_matrix_reader(this, running); //Waiting for events, not waited for
+    ASSERT_EQ(RESIZE_RETIRE_MS, get_resize_wait(this)); //The other one runs since before the swap
+    park_matrix_reader(this, parked);
+    ASSERT_EQ(0, get_resize_wait(this));
+    free_matrix(this);
+    PASS();
+}
+
+TEST test_storage_file(void) {
+    char path[] = "/tmp/msg_storage_XXXXXX";
+    int fd = mkstemp(path);
+    g_lc = 0;
+    close(fd); //Empty, a new storage file
+
+    matrix this = create_matrix_file(4, path);
+    ASSERT(this);
+    store_replicated_message(this, 10, "ten");
+    store_replicated_message(this, 30, "thirty");
+    store_replicated_message(this, 20, "twenty"); //Moves thirty in the file
+    store_message(this, "local");
+    store_message(this, "newest"); //Evicts ten
+    free_matrix(this);
+
+    g_lc = 0;
+    this = create_matrix_file(100, path); //Keeps the capacity of the file
+    ASSERT_EQ(4, get_capacity(this));
+    ASSERT_EQ(4, load_messages(this));
+    ASSERT_EQ(33, g_lc);
+    char *messages = get_first_n_messages(this, 4, MSG_W_LC, NULL);
+    ASSERT_STR_EQ("20;twenty\n30;thirty\n31;local\n32;newest\n", messages);
+    free(messages);
+    ASSERT_EQ(NULL, store_replicated_message(this, 31, "local"));
+    strcpy(get_string((message)get_element(this, get_size(this) - 1)), "torn!!"); //As a crash while writing it
+    free_matrix(this);
+
+    this = create_matrix_file(4, path);
+    ASSERT_EQ(3, load_messages(this));
+    free_matrix(this);
+    unlink(path);
+    PASS();
+}
+
+static void replay_into(uint64_t lc, char *content, void *arg) {
+    store_replicated_message((matrix)arg, lc, content);
+}
+
+TEST test_wal_replay(void) {
+    char dir[] = "/tmp/msg_wal_XXXXXX", path[64];
+    ASSERT(mkdtemp(dir));
+    g_lc = 0;
+
+    matrix this = create_matrix(3);
+    wal log = create_wal(dir, 32, 3, 0); //Every commit fills a segment
+    ASSERT(log);
+    ASSERT_EQ(0, replay_wal(log, replay_into, this));
+    for (int i = 0; i < 6; i++) {
+        handle_publish(this, log, 0 == i % 2 ? "even" : "odd");
+        if (1 == i % 2) {
+            ASSERT_EQ(0, commit_wal(log)); //One sync for both
+        }
+    }
+    handle_publish(this, log, "unsynced"); //Synced by free_wal
+    free_wal(log);
+    free_matrix(this);
+
+    g_lc = 0;
+    this = create_matrix(3);
+    log = create_wal(dir, 32, 3, 0);
+    ASSERT_EQ(5, replay_wal(log, replay_into, this)); //The oldest segment was deleted
+    ASSERT_EQ(7, g_lc); //And now the next, the last two hold the three kept
+    char *messages = get_first_n_messages(this, 3, MSG_W_LC, NULL);
+    ASSERT_STR_EQ("4;even\n5;odd\n6;unsynced\n", messages);
+    free(messages);
+    free_wal(log);
+    free_matrix(this);
+
+    snprintf(path, sizeof(path), "%s/0000000000000003.wal", dir);
+    ASSERT_EQ(0, truncate(path, 30)); //As a crash while writing "unsynced"
+    g_lc = 0;
+    this = create_matrix(3);
+    log = create_wal(dir, 32, 3, 0);
+    ASSERT_EQ(2, replay_wal(log, replay_into, this));
+    ASSERT_EQ(6, g_lc);
+    free_wal(log);
+    free_matrix(this);
+
+    snprintf(path, sizeof(path), "%s/0000000000000009.wal", dir);
+    FILE *foreign = fopen(path, "w");
+    fputs("not a segment", foreign);
+    fclose(foreign);
+    ASSERT_EQ(NULL, create_wal(dir, 32, 3, 0));
+    for (int seq = 0; seq < 10; seq++) {
+        snprintf(path, sizeof(path), "%s/%016x.wal", dir, seq);
+        unlink(path);
+    }
+    rmdir(dir);
+    PASS();
+}
+
+TEST test_scratch_steady_state(void) {
+    g_lc = 0;
+    matrix this = create_matrix(64);
+    arena scratch = create_arena(256);
+    uint64_t warm = 0;
+
+    for (int i = 0; i < 64; i++) {
+        store_message(this, "a message long enough to outgrow the first block");
+    }
+    for (int iteration = 0; iteration < 4; iteration++) {
+        for (int reply = 0; reply < 8; reply++) {
+            ASSERT(get_first_n_messages(this, 64, MSG_WO_LC, scratch));
+        }
+        reset_arena(scratch);
+        if (0 == iteration) {
+            warm = get_arena_mallocs(scratch);
+        }
+    }
+    ASSERT_EQ(warm, get_arena_mallocs(scratch)); //Nothing allocated after the first iteration
+
+    free_arena(scratch);
+    free_matrix(this);
+    PASS();
+}
+
+TEST test_peer_registry(void) {
+    registry peers = create_registry();
+    server added[40];
+    char ip[STRING_SIZE];
+
+    for (int i = 0; i < 40; i++) { //Grows the index and the fd array
+        snprintf(ip, STRING_SIZE, "10.0.%d.%d", i / 8, i % 8);
+        added[i] = new_server("peer", ip, 5000 + i, 6000 + i);
+        set_fd(added[i], 100 + i);
+        add_to_registry(peers, get_server_key(added[i]), added[i], 100 + i);
+    }
+    server inbound = new_server("Inbound Server", "10.0.0.1", 0, 40000);
+    add_to_registry(peers, get_server_key(inbound), inbound, 200);
+    ASSERT_EQ(inbound, find_in_registry(peers, (struct peer_key){.ip = inet_addr("10.0.0.1")}));
+    struct peer_key inbound_key = get_server_key(inbound);
+    set_listen_ports(inbound, 7000, 7001); //Given in its HELLO
+    rekey_registry(peers, inbound_key, inbound, get_server_key(inbound));
+    ASSERT_EQ(NULL, find_in_registry(peers, inbound_key));
+    ASSERT_EQ(inbound, find_in_registry(peers, get_server_key(inbound)));
+    ASSERT_EQ(added[1], find_in_registry(peers, get_server_key(added[1]))); //Another server of the same host
+
+    for (size_t n = 0; n < get_registry_size(peers); n++) { //Dropped while iterating
+        server cur_server = (server)get_registry_item(peers, n);
+        if (0 == get_fd(cur_server) % 3) {
+            retire_from_registry(peers, get_server_key(cur_server), cur_server);
+            retire_from_registry(peers, get_server_key(cur_server), cur_server);
+            set_fd(cur_server, -1); //Closed, as drop_server does
+        }
+    }
+    ASSERT_EQ(41, get_registry_size(peers));
+    ASSERT_EQ(13, reap_registry(peers, free_server));
+    ASSERT_EQ(28, get_registry_size(peers));
+
+    for (int i = 0; i < 40; i++) {
+        snprintf(ip, STRING_SIZE, "10.0.%d.%d", i / 8, i % 8);
+        server key = new_server("key", ip, 5000 + i, 6000 + i);
+        server found = (server)find_in_registry(peers, get_server_key(key));
+        if (0 == (100 + i) % 3) {
+            ASSERT_EQ(NULL, found);
+            ASSERT_EQ(NULL, find_fd_in_registry(peers, 100 + i));
+        } else {
+            ASSERT_EQ(added[i], found);
+            ASSERT_EQ(added[i], find_fd_in_registry(peers, 100 + i));
+        }
+        free_server(key);
+    }
+
+    for (size_t n = 0; n < get_registry_size(peers); n++) { //Not open, free_server would close them
+        set_fd((server)get_registry_item(peers, n), -1);
+    }
+    free_registry(peers, free_server);
     PASS();
 }
 
@@ -42,14 +644,14 @@ TEST teacher_example_douro(void) {
     matrix msg_matrix = create_matrix(20);
 
     // Guadiana Comms
-    ASSERT_EQ(2, handle_publish(msg_matrix, "sabem qual o programa das JEEC?"));
+    ASSERT_EQ(2, handle_publish(msg_matrix, NULL, "sabem qual o programa das JEEC?"));
 
-    ASSERT_STR_EQ("sabem qual o programa das JEEC?\n", get_first_n_messages(msg_matrix, 10));
+    ASSERT_STR_EQ("sabem qual o programa das JEEC?\n", get_first_n_messages(msg_matrix, 10, MSG_WO_LC, NULL));
 
-    ASSERT_EQ(2, handle_publish(msg_matrix, "vê em jeec.tecnico.ulisboa.pt"));
+    ASSERT_EQ(2, handle_publish(msg_matrix, NULL, "vê em jeec.tecnico.ulisboa.pt"));
     ASSERT_STR_EQ("sabem qual o programa das JEEC?\n"
-            "vê em jeec.tecnico.ulisboa.pt"
-            , get_first_n_messages(msg_matrix, 10));
+            "vê em jeec.tecnico.ulisboa.pt\n"
+            , get_first_n_messages(msg_matrix, 10, MSG_WO_LC, NULL));
 
     ASSERT_EQ(2, g_lc);
 
@@ -60,6 +662,23 @@ TEST teacher_example_douro(void) {
 
 GREATEST_SUITE(msg_struct) {
     RUN_TEST(test_parse_not_full);
-    /* RUN_TEST(teacher_example_douro); */
+    RUN_TEST1(test_parse_binary, false);
+    RUN_TEST1(test_parse_binary, true);
+    RUN_TEST1(test_ingest_stall, 0);
+    RUN_TEST1(test_ingest_stall, 1);
+    RUN_TEST1(test_ingest_stall, 2);
+    RUN_TEST(test_publish_stall);
+    RUN_TEST(test_lz_round_trip);
+    RUN_TEST(test_drop_duplicates);
+    RUN_TEST(test_late_messages);
+    RUN_TEST(test_late_batch);
+    RUN_TEST(test_byte_budget);
+    RUN_TEST(test_resize_matrix);
+    RUN_TEST(test_resize_readers);
+    RUN_TEST(test_storage_file);
+    RUN_TEST(test_wal_replay);
+    RUN_TEST(test_scratch_steady_state);
+    RUN_TEST(test_peer_registry);
+    RUN_TEST(teacher_example_douro);
 }
 
@@ -1,115 +1,439 @@
+#include <inttypes.h>
 #include "struct_message.h"
 
+//A record of the MSG_RECORD ring, the content follows it
 struct _message {
-    uint_fast32_t lc;
-    char *content;
+    uint64_t lc;    //Lamport clock it was published with, on every server
+    uint64_t hash;  //hash_content, orders messages of the same clock and keys the dedup index
+    uint32_t len;   //Content bytes, without the NUL
+    uint32_t check; //record_check, with hash it tells a whole record from a torn one in a storage file
+    char     content[];
 };
 
-uint_fast32_t g_lc;
+//Record bytes of a content of len bytes, so the next record stays aligned
+#define MESSAGE_RECORD_SIZE(len) ((sizeof(struct _message) + (len) + 1 + 7) & ~(size_t)7)
+
+uint64_t g_lc;
+
+// record_check mixes the header fields, the content is checked by its hash
+static inline uint32_t record_check(uint64_t lc, uint64_t hash, uint32_t len) {
+    uint64_t mixed = (lc ^ hash ^ (uint64_t)len << 40) * 0xFF51AFD7ED558CCDull;
+    return (uint32_t)(mixed >> 32 ^ mixed);
+}
+
+//Key of a message of a replicated batch, sorted before the batch is merged
+struct batch_key {
+    uint64_t   lc;
+    uint64_t   hash;
+    const char *content;
+};
+
+static char   *late_records;  //Copy of the records moved by a late message, writer thread only
+static size_t late_reserved;
+static struct batch_key *batch_keys; //Keys of the batch being merged, writer thread only
+static size_t batch_reserved;
 
 // Gets
 char *get_string(message this) {
     return this->content;
 }
 
-int get_lc(message this) {
+uint64_t get_lc(message this) {
     return this->lc;
 }
 
-char *get_first_n_messages(matrix msg_matrix, int n, int MODE){
-    int list_size = (int)get_size(msg_matrix);
-    if (list_size == 0){
-        return NULL;
+void get_message_key(item got_item, uint64_t *lc, uint64_t *hash) {
+    *lc = ((message)got_item)->lc;
+    *hash = ((message)got_item)->hash;
+}
+
+size_t format_messages(matrix msg_matrix, uint64_t first, size_t n, int MODE, char *dst) {
+    size_t len = 0;
+
+    for (uint64_t index = first; index < first + n; index++) {
+        message this = (message)get_element(msg_matrix, index);
+        if (!this) {
+            break;
+        }
+        //Torn by the writer if it stored meanwhile, then repeated, but never read past the record
+        size_t content_len = this->len < STRING_SIZE ? this->len : STRING_SIZE - 1;
+        if (MSG_BINARY == MODE) {
+            len += put_binary_record(dst + len, this->lc, this->content, content_len);
+            continue;
+        }
+        len += sprintf(dst + len, "%" PRIu64 ";", this->lc);
+        memcpy(dst + len, this->content, content_len);
+        len += content_len;
+        dst[len++] = '\n';
     }
-    char *to_return = (char*)malloc(sizeof(char) * STRING_SIZE * n);
-    if (!to_return) {
+    return len;
+}
+
+int get_last_n_wire(matrix msg_matrix, size_t n, int MODE, struct iovec slices[2]) {
+    return get_last_wire(get_wire(msg_matrix, MODE), n, slices);
+}
+
+int get_range_wire(matrix msg_matrix, uint64_t first, size_t n, int MODE, struct iovec slices[2]) {
+    return get_wire_range(get_wire(msg_matrix, MODE), first, n, slices);
+}
+
+char *get_first_n_messages(matrix msg_matrix, size_t n, int MODE, arena scratch){
+    if (get_size(msg_matrix) == 0){
         return NULL;
     }
-    bzero(to_return, STRING_SIZE * n);
-    int i = list_size - n;
-
-    if (i < 0) {
-    	if (get_overflow(msg_matrix)){
-			for (uint_fast32_t j = get_capacity(msg_matrix) + i; j < get_capacity(msg_matrix); j++) {
-				if (!get_element(msg_matrix, j)) {
-					break;
-				}
-				char to_append[STRING_SIZE * 2] = {'\0'};
-                if (MSG_W_LC == MODE){
-                    snprintf(to_append, STRING_SIZE * 2 ,"%d;%s\n",get_lc(get_element(msg_matrix, j)),
-                    get_string(get_element(msg_matrix, j)) );
-                } else {
-                    snprintf(to_append, STRING_SIZE * 2 ,"%s\n",
-                    get_string(get_element(msg_matrix, j)) );
-                }
-                strncat(to_return, to_append, STRING_SIZE * n);
-			}
-    	}
-
-        for (i = 0; i < list_size; i++) {
-			if (!get_element(msg_matrix, i)) {
-				break;
-			}
-			char to_append[STRING_SIZE * 2] = {'\0'};
-			if (MSG_W_LC == MODE){
-                snprintf(to_append, STRING_SIZE * 2 ,"%d;%s\n",get_lc(get_element(msg_matrix, i)),
-                get_string(get_element(msg_matrix, i)) );
-            } else {
-                snprintf(to_append, STRING_SIZE * 2 ,"%s\n",
-                get_string(get_element(msg_matrix, i)) );
+    char *to_return = NULL;
+    size_t reserved = 0;
+
+    //Lock free read, repeated if the writer stored a message meanwhile
+    uint_fast32_t seq;
+    do {
+        struct iovec slices[2];
+        size_t len = 0, stored;
+        int count = 0;
+
+        seq = begin_matrix_read(msg_matrix);
+        stored = get_size(msg_matrix) - get_first(msg_matrix);
+        stored = n < stored ? n : stored;
+        if (MSG_WO_LC == MODE) {
+            count = get_last_n_wire(msg_matrix, n, MODE, slices);
+        } else { //Formatted from the records, at most the longest one each
+            len = stored * WIRE_RECORD_SIZE;
+        }
+        for (int i = 0; i < count; i++) {
+            len += slices[i].iov_len;
+        }
+        if (len + 1 > reserved) { //As long as the messages, not n times the longest one
+            if (!scratch) {
+                free(to_return);
             }
-			strncat(to_return, to_append, STRING_SIZE * n);
-		}
-    }
-    else {
-    	for (; i < list_size; i++) {
-			if (!get_element(msg_matrix, i)) {
-				break;
-			}
-			char to_append[STRING_SIZE * 2] = {'\0'};
-			if (MSG_W_LC == MODE){
-                snprintf(to_append, STRING_SIZE * 2 ,"%d;%s\n",get_lc(get_element(msg_matrix, i)),
-                get_string(get_element(msg_matrix, i)) );
-            } else {
-                snprintf(to_append, STRING_SIZE * 2 ,"%s\n",
-                get_string(get_element(msg_matrix, i)) );
+            reserved = len + 1;
+            to_return = scratch ? (char *)arena_alloc(scratch, reserved) : (char *)malloc(reserved);
+            if (!to_return) {
+                return NULL;
             }
-			strncat(to_return, to_append, STRING_SIZE * n);
-		}
-    }
+        }
+        len = 0;
+        for (int i = 0; i < count; i++) {
+            memcpy(to_return + len, slices[i].iov_base, slices[i].iov_len);
+            len += slices[i].iov_len;
+        }
+        if (MSG_WO_LC != MODE) {
+            len = format_messages(msg_matrix, get_size(msg_matrix) - stored, stored, MODE, to_return);
+        }
+        to_return[len] = '\0';
+    } while (retry_matrix_read(msg_matrix, seq));
 
     return to_return;
 }
 
-// Sets
-void set_lc(message this, uint_fast32_t new_lc) {
-    this->lc = new_lc;
-    return;
+// Methods
+// drop_first_message drops the oldest stored message and its dedup key, inside the write section
+static void drop_first_message(matrix msg_matrix) {
+    message oldest = (message)get_wire_record(get_wire(msg_matrix, MSG_RECORD), get_first(msg_matrix));
+
+    remove_dedup(get_dedup(msg_matrix), oldest->lc, oldest->hash);
+    drop_first_element(msg_matrix);
 }
 
-// Methods
-message new_message(char *src) {
-    message new_msg = (message)malloc(sizeof(struct _message));
-    new_msg->content = (char *)malloc(sizeof(char)*STRING_SIZE);
+// append_reply_form appends the GET_MESSAGES format of the message, the others are formatted
+// from the records when asked, see format_messages. Inside the write section
+static void append_reply_form(matrix msg_matrix, const char *content, size_t content_len) {
+    char bytes[STRING_SIZE + 1];
+
+    while (!wire_fits(get_wire(msg_matrix, MSG_WO_LC), content_len + 1)) {
+        drop_first_message(msg_matrix);
+    }
+    memcpy(bytes, content, content_len);
+    bytes[content_len] = '\n';
+    append_wire(get_wire(msg_matrix, MSG_WO_LC), bytes, content_len + 1);
+}
 
-    new_msg->lc = g_lc;
-    g_lc ++;
-    strncpy(new_msg->content, src, STRING_SIZE - 1);
-    new_msg->content[STRING_SIZE - 1] = '\0';
+// append_wire_forms appends the record and the reply format of the message, inside the write section.
+// The oldest messages are dropped first while it does not fit: the matrix is full, or their bytes are
+static void append_wire_forms(matrix msg_matrix, uint64_t lc, uint64_t hash, const char *content) {
+    union {
+        struct _message header;
+        char bytes[WIRE_RECORD_SIZE];
+    } record;
+    size_t content_len = strlen(content);
 
-    return new_msg;
+    while (!wire_fits(get_wire(msg_matrix, MSG_RECORD), MESSAGE_RECORD_SIZE(content_len))) {
+        drop_first_message(msg_matrix);
+    }
+
+    record.header.lc = lc;
+    record.header.hash = hash;
+    record.header.len = content_len;
+    record.header.check = record_check(lc, hash, content_len);
+    memcpy(record.header.content, content, content_len + 1);
+    append_wire(get_wire(msg_matrix, MSG_RECORD), record.bytes, MESSAGE_RECORD_SIZE(content_len));
+    append_reply_form(msg_matrix, content, content_len);
 }
 
+// message_record_len returns the length of a whole record of the storage file, 0 for a torn one
+static size_t message_record_len(const char *record, size_t room) {
+    const struct _message *this = (const struct _message *)record;
 
-void free_message(item got_item) {
-    if (!got_item) {
-        return;
+    if (room < sizeof(struct _message) || STRING_SIZE <= this->len || MESSAGE_RECORD_SIZE(this->len) > room
+            || record_check(this->lc, this->hash, this->len) != this->check
+            || memchr(this->content, '\0', this->len + 1) != this->content + this->len
+            || hash_content(this->content) != this->hash) {
+        return 0;
     }
-    message this = (message)got_item;
+    return MESSAGE_RECORD_SIZE(this->len);
+}
 
-    free(this->content);
-    free(this);
-    return;
+// key_after tells if the message goes after the key: by clock, then by content hash,
+// so every server keeps the same order whatever order the messages arrived in
+static inline bool key_after(message this, uint64_t lc, uint64_t hash) {
+    return this->lc > lc || (this->lc == lc && this->hash > hash);
+}
+
+// find_position returns the index the key is stored at, after every stored message with a lower key.
+// New messages are mostly the newest, then no search is needed
+static uint64_t find_position(matrix msg_matrix, uint64_t lc, uint64_t hash) {
+    uint64_t size = get_size(msg_matrix), low = get_first(msg_matrix), high = size;
+
+    if (low == high || !key_after((message)get_element(msg_matrix, size - 1), lc, hash)) {
+        return size;
+    }
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (key_after((message)get_element(msg_matrix, middle), lc, hash)) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return low;
+}
+
+// copy_late_records copies the n records from index on, which a late message moves up, and returns their length
+static size_t copy_late_records(matrix msg_matrix, uint64_t index, size_t n) {
+    struct iovec slices[2];
+    size_t len = 0;
+    int count = get_range_wire(msg_matrix, index, n, MSG_RECORD, slices);
+
+    for (int i = 0; i < count; i++) {
+        len += slices[i].iov_len;
+    }
+    if (len > late_reserved) { //Grows to the latest message seen, then reused
+        free(late_records);
+        late_reserved = len;
+        late_records = (char *)malloc(late_reserved);
+        if (!late_records) {
+            memory_error("Unable to reserve message memory");
+        }
+    }
+    len = 0;
+    for (int i = 0; i < count; i++) {
+        memcpy(late_records + len, slices[i].iov_base, slices[i].iov_len);
+        len += slices[i].iov_len;
+    }
+    return len;
+}
+
+// store_ordered stores the message in its place, the dedup key was added by the caller.
+// Returns NULL, and removes the key, if it is older than every message of a full matrix
+static message store_ordered(matrix msg_matrix, const char *content, uint64_t lc, uint64_t hash) {
+    uint64_t size = get_size(msg_matrix), index = find_position(msg_matrix, lc, hash);
+    size_t late_len = 0;
+
+    if (index == get_first(msg_matrix) && size - index >= get_capacity(msg_matrix)) {
+        remove_dedup(get_dedup(msg_matrix), lc, hash);
+        return NULL;
+    }
+    if (index < size) { //Arrived late, the newer ones are appended again after it
+        late_len = copy_late_records(msg_matrix, index, size - index);
+    }
+
+    begin_matrix_write(msg_matrix);
+    if (index < size) {
+        truncate_matrix(msg_matrix, index);
+    }
+    append_wire_forms(msg_matrix, lc, hash, content);
+    for (size_t offset = 0; offset < late_len; ) {
+        message moved = (message)(late_records + offset);
+        append_wire_forms(msg_matrix, moved->lc, moved->hash, moved->content);
+        offset += MESSAGE_RECORD_SIZE(moved->len);
+    }
+    add_element(msg_matrix);
+    set_matrix_clock(msg_matrix, g_lc);
+    end_matrix_write(msg_matrix);
+
+    //NULL if it was dropped itself, as the oldest, to fit the newer ones it moved up
+    return (message)get_element(msg_matrix, index);
+}
+
+// compare_batch_keys orders the keys like key_after, by clock then by content hash
+static int compare_batch_keys(const void *a, const void *b) {
+    const struct batch_key *this = (const struct batch_key *)a, *other = (const struct batch_key *)b;
+
+    if (this->lc != other->lc) {
+        return this->lc < other->lc ? -1 : 1;
+    }
+    return this->hash < other->hash ? -1 : this->hash > other->hash;
+}
+
+// drop_evicted removes the keys of the stored messages n sorted new ones evict from the matrix, the
+// oldest of both. Returns how many of the batch, its first ones, are evicted too and not stored
+static size_t drop_evicted(matrix msg_matrix, const struct batch_key *keys, size_t n) {
+    uint64_t size = get_size(msg_matrix), index = get_first(msg_matrix);
+    uint64_t total = size - index + n, evicted = total > get_capacity(msg_matrix) ? total - get_capacity(msg_matrix) : 0;
+    size_t dropped = 0;
+
+    for (; 0 < evicted; evicted--) {
+        message oldest = index < size ? (message)get_element(msg_matrix, index) : NULL;
+        if (dropped < n && (!oldest || key_after(oldest, keys[dropped].lc, keys[dropped].hash))) {
+            dropped++;
+        } else { //Dropped by append_wire_forms, the batch goes after it
+            remove_dedup(get_dedup(msg_matrix), oldest->lc, oldest->hash);
+            index++;
+        }
+    }
+    return dropped;
+}
+
+// merge_batch stores n sorted messages, none evicted by the others: the stored ones newer than
+// the first of them are copied and the matrix truncated once, then both are appended in order
+static void merge_batch(matrix msg_matrix, const struct batch_key *keys, size_t n) {
+    uint64_t size = get_size(msg_matrix), index = find_position(msg_matrix, keys[0].lc, keys[0].hash);
+    size_t late_len = 0, offset = 0, next = 0;
+
+    if (index < size) { //Late batch, the newer ones are appended again among it
+        late_len = copy_late_records(msg_matrix, index, size - index);
+    }
+
+    begin_matrix_write(msg_matrix);
+    if (index < size) {
+        truncate_matrix(msg_matrix, index);
+    }
+    while (next < n || offset < late_len) {
+        message moved = offset < late_len ? (message)(late_records + offset) : NULL;
+        if (next < n && (!moved || key_after(moved, keys[next].lc, keys[next].hash))) {
+            append_wire_forms(msg_matrix, keys[next].lc, keys[next].hash, keys[next].content);
+            next++;
+        } else {
+            append_wire_forms(msg_matrix, moved->lc, moved->hash, moved->content);
+            offset += MESSAGE_RECORD_SIZE(moved->len);
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        add_element(msg_matrix);
+    }
+    set_matrix_clock(msg_matrix, g_lc);
+    end_matrix_write(msg_matrix);
+}
+
+message store_message(matrix msg_matrix, char *src) {
+    char content[STRING_SIZE];
+
+    strncpy(content, src, STRING_SIZE - 1);
+    content[STRING_SIZE - 1] = '\0';
+    uint64_t lc = g_lc++, hash = hash_content(content);
+    insert_dedup(get_dedup(msg_matrix), lc, hash); //A new clock, never a duplicate
+    return store_ordered(msg_matrix, content, lc, hash);
+}
+
+message store_replicated_message(matrix msg_matrix, uint64_t lc, char *src) {
+    uint64_t hash = hash_content(src); //Content already cut to STRING_SIZE by the parser
+
+    if (!insert_dedup(get_dedup(msg_matrix), lc, hash)) {
+        return NULL; //Already stored
+    }
+    if (lc >= g_lc) { //Lamport clock, the next local message goes after it
+        g_lc = lc + 1;
+    }
+    return store_ordered(msg_matrix, src, lc, hash);
+}
+
+uint_fast32_t store_replicated_messages(matrix msg_matrix, size_t n, const uint64_t lc[], char *const src[]) {
+    dedup_index stored = get_dedup(msg_matrix);
+    size_t count = 0, unique = 0, dropped;
+
+    if (n > batch_reserved) { //Grows to the largest batch seen, then reused
+        free(batch_keys);
+        batch_reserved = n;
+        batch_keys = (struct batch_key *)malloc(batch_reserved * sizeof(struct batch_key));
+        if (!batch_keys) {
+            memory_error("Unable to reserve message memory");
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        uint64_t hash = hash_content(src[i]);
+        if (find_dedup(stored, lc[i], hash)) {
+            continue; //Already stored
+        }
+        if (lc[i] >= g_lc) {
+            g_lc = lc[i] + 1;
+        }
+        batch_keys[count++] = (struct batch_key){.lc = lc[i], .hash = hash, .content = src[i]};
+    }
+    if (1 < count) {
+        qsort(batch_keys, count, sizeof(struct batch_key), compare_batch_keys);
+    }
+    for (size_t i = 0; i < count; i++) { //Twice in the batch, kept once
+        if (0 == unique || 0 != compare_batch_keys(&batch_keys[unique - 1], &batch_keys[i])) {
+            batch_keys[unique++] = batch_keys[i];
+        }
+    }
+
+    //The index holds a matrix of keys, those of the evicted ones go before the new ones come
+    dropped = drop_evicted(msg_matrix, batch_keys, unique);
+    for (size_t i = dropped; i < unique; i++) {
+        insert_dedup(stored, batch_keys[i].lc, batch_keys[i].hash);
+    }
+    if (dropped < unique) {
+        merge_batch(msg_matrix, batch_keys + dropped, unique - dropped);
+    }
+    return unique - dropped;
+}
+
+uint64_t load_messages(matrix msg_matrix) {
+    uint64_t restored = restore_matrix(msg_matrix, message_record_len);
+
+    //Single threaded still, no write section
+    for (uint64_t i = get_first(msg_matrix); i < get_size(msg_matrix); i++) {
+        message this = (message)get_element(msg_matrix, i);
+        append_reply_form(msg_matrix, this->content, this->len);
+        insert_dedup(get_dedup(msg_matrix), this->lc, this->hash);
+        if (this->lc >= g_lc) {
+            g_lc = this->lc + 1;
+        }
+    }
+    if (get_matrix_clock(msg_matrix) > g_lc) {
+        g_lc = get_matrix_clock(msg_matrix);
+    }
+    return restored;
+}
+
+uint64_t find_first_after(matrix msg_matrix, uint64_t lc) {
+    uint64_t low = get_first(msg_matrix), high = get_size(msg_matrix);
+
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        message this = (message)get_element(msg_matrix, middle);
+        if (!this || this->lc > lc) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return low;
+}
+
+message find_message(matrix msg_matrix, uint64_t lc, uint64_t hash) {
+    uint64_t index = 0 < lc ? find_first_after(msg_matrix, lc - 1) : get_first(msg_matrix);
+
+    for (; index < get_size(msg_matrix); index++) { //Messages of one clock are few
+        message this = (message)get_element(msg_matrix, index);
+        if (this->lc != lc) {
+            break;
+        } else if (this->hash == hash) {
+            return this;
+        }
+    }
+    return NULL;
 }
 
 void print_message_plain(item got_item) {
@@ -119,7 +443,7 @@ void print_message_plain(item got_item) {
     message this = (message)got_item;
 
     fprintf(stdout,
-            "LC: %zu Message: %s\n",
+            "LC: %" PRIu64 " Message: %s\n",
             this->lc, this->content);
     return;
 }
@@ -131,7 +455,7 @@ void print_message(item got_item) {
     message this = (message)got_item;
 
     fprintf(stdout,
-            KBLU "LC:" RESET " %zu "
+            KBLU "LC:" RESET " %" PRIu64 " "
             KBLU "Message:" RESET " %s\n",
             this->lc, this->content);
     return;
@@ -2,22 +2,127 @@
 #include "utils.h"
 #include "string.h"
 #include "../utils/util_matrix.h"
+#include "../utils/util_binary.h"
+#include "../utils/util_arena.h"
 
-#define MSG_WO_LC 0
-#define MSG_W_LC 1
+#define MSG_WO_LC 0 //Kept in a ring, GET_MESSAGES replies are sent from it without copying
+#define MSG_RECORD ELEMENT_FORM //The messages themselves, clock, hash and content
+#define MSG_W_LC WIRE_FORMS //Formatted from the records when asked, see format_messages
+#define MSG_BINARY (WIRE_FORMS + 1) //Records of a BINARY_MESSAGES frame, see util_binary.h
 
+/*! \var typedef struct _message *message
+    \brief A stored message. Points inside the matrix, at its record in the MSG_RECORD ring,
+    so messages are never allocated one by one. Valid as the wire slices, see get_last_n_wire.
+*/
 typedef struct _message *message;
-extern uint_fast32_t g_lc;
+extern uint64_t g_lc; //Lamport clock of the next local message
 
 // Gets
 char    *get_string(message this);
-int     get_lc(message this);
-char    *get_first_n_messages(matrix msg_matrix, int n, int MODE);
-// Sets
-void    set_lc(message this, uint_fast32_t new_lc);
+uint64_t get_lc(message this);
+/*! \fn char *get_first_n_messages(matrix msg_matrix, size_t n, int MODE, arena scratch)
+    \brief Returns a copy of the last n messages, oldest first, one per line.
+    Safe from any thread. Returns NULL if there are no messages.
+    \param msg_matrix Message storage.
+    \param n Number of messages, at most the matrix capacity.
+    \param MODE MSG_WO_LC, copied from its ring, or MSG_W_LC ("lc;message"), formatted.
+    \param scratch Arena of the calling thread the copy is taken from, NULL to malloc it.
+*/
+char    *get_first_n_messages(matrix msg_matrix, size_t n, int MODE, arena scratch);
+/*! \fn int get_last_n_wire(matrix msg_matrix, size_t n, int MODE, struct iovec slices[2])
+    \brief Points slices at the last n messages already in reply format, without copying.
+    Returns the number of slices used. The bytes are only stable for the writer thread,
+    and while it stores less than WIRE_SLACK messages. Other threads must copy them
+    inside a matrix read, see get_first_n_messages.
+    \param msg_matrix Message storage.
+    \param n Number of messages, at most the matrix capacity.
+    \param MODE MSG_WO_LC or MSG_RECORD.
+    \param slices Filled with at most two contiguous slices.
+*/
+int     get_last_n_wire(matrix msg_matrix, size_t n, int MODE, struct iovec slices[2]);
+/*! \fn int get_range_wire(matrix msg_matrix, uint64_t first, size_t n, int MODE, struct iovec slices[2])
+    \brief Same as get_last_n_wire for the n messages starting at the element index first.
+    Returns 0 if they are not all stored any more.
+    \param msg_matrix Message storage.
+    \param first Index of the first message, as given to add_element.
+    \param n Number of messages.
+    \param MODE MSG_WO_LC or MSG_RECORD.
+    \param slices Filled with at most two contiguous slices.
+*/
+int     get_range_wire(matrix msg_matrix, uint64_t first, size_t n, int MODE, struct iovec slices[2]);
+/*! \fn size_t format_messages(matrix msg_matrix, uint64_t first, size_t n, int MODE, char *dst)
+    \brief Writes the n messages starting at the element index first to dst in a reply format
+    that is not kept in a ring, and returns the bytes written. Stops at a message not stored.
+    From another thread only inside a matrix read, repeated if the writer stored meanwhile.
+    \param msg_matrix Message storage.
+    \param first Index of the first message, as given to add_element.
+    \param n Number of messages.
+    \param MODE MSG_W_LC or MSG_BINARY.
+    \param dst At least n * WIRE_RECORD_SIZE bytes.
+*/
+size_t  format_messages(matrix msg_matrix, uint64_t first, size_t n, int MODE, char *dst);
 // Methods
-message new_message(char *src);
-void    free_message(item got_item);
+/*! \fn message store_message(matrix msg_matrix, char *src)
+    \brief Stores a new message after the last one, with the next clock. Only the writer thread may call it.
+    The oldest messages are evicted when the matrix is full, or when the rings need their bytes,
+    and overwritten in place inside a matrix write
+    so readers in other threads never see freed memory.
+    \param msg_matrix Message storage.
+    \param src Message content.
+*/
+message store_message(matrix msg_matrix, char *src);
+/*! \fn message store_replicated_message(matrix msg_matrix, uint64_t lc, char *src)
+    \brief Stores a message received from a server with the clock it was published with,
+    unless a stored one has the same clock and content. The clock of this server moves past lc.
+    Messages are kept in (clock, content hash) order: one that arrives late is inserted
+    in its place with a binary search, and the newer ones move up by one.
+    Returns NULL for a duplicate, or a message older than every one of a full matrix.
+    Only the writer thread may call it.
+    \param msg_matrix Message storage.
+    \param lc Clock the message was sent with.
+    \param src Message content.
+*/
+message store_replicated_message(matrix msg_matrix, uint64_t lc, char *src);
+/*! \fn uint_fast32_t store_replicated_messages(matrix msg_matrix, size_t n, const uint64_t lc[], char *const src[])
+    \brief Same as store_replicated_message for n messages at once, in any order.
+    The batch is sorted and merged in one matrix write: the stored messages newer than its
+    oldest one are moved up once for the whole batch, not once per late message.
+    Returns the number of messages stored. Only the writer thread may call it.
+    \param msg_matrix Message storage.
+    \param n Number of messages.
+    \param lc Clock each message was sent with.
+    \param src Content of each message, valid until the call returns.
+*/
+uint_fast32_t store_replicated_messages(matrix msg_matrix, size_t n, const uint64_t lc[], char *const src[]);
+/*! \fn uint64_t load_messages(matrix msg_matrix)
+    \brief Finds the messages of a storage file again after a restart, see create_matrix_file,
+    and fills the reply formats and the dedup index with them. The clock moves past the newest.
+    Records torn by a crash end the scan. Returns the number of messages found. Before other threads start.
+    \param msg_matrix Message storage made by create_matrix_file.
+*/
+uint64_t load_messages(matrix msg_matrix);
+/*! \fn message find_message(matrix msg_matrix, uint64_t lc, uint64_t hash)
+    \brief Returns the stored message with that clock and content hash, NULL if it is not stored.
+    Binary search, from another thread only inside a matrix read.
+    \param msg_matrix Message storage.
+    \param lc Clock of the message.
+    \param hash Content hash, see get_message_key.
+*/
+message find_message(matrix msg_matrix, uint64_t lc, uint64_t hash);
+/*! \fn uint64_t find_first_after(matrix msg_matrix, uint64_t lc)
+    \brief Returns the index of the first stored message with a clock above lc, get_size if none.
+    Binary search, from another thread only inside a matrix read.
+    \param msg_matrix Message storage.
+    \param lc Clock selected.
+*/
+uint64_t find_first_after(matrix msg_matrix, uint64_t lc);
+/*! \fn void get_message_key(item got_item, uint64_t *lc, uint64_t *hash)
+    \brief Gives the dedup key of a stored message, for start_matrix_resize.
+    \param got_item Message selected.
+    \param lc Set to its clock.
+    \param hash Set to its content hash.
+*/
+void    get_message_key(item got_item, uint64_t *lc, uint64_t *hash);
 void    print_message(item got_item);
 void    print_message_plain(item got_item);
 
@@ -1,29 +1,45 @@
 #include "struct_server.h"
 
 struct _server {
-    char    *name;
-    char    *ip_addr;
-    u_short udp_port;
-    u_short tcp_port;
+    struct ilink link; //First, see get_server_link
+    int     fd;        //With the links, read by every walk
     bool    connected;
-    int     fd;
+    bool    synced;  //Clocks of this server received since a snapshot
+    char    *name;
+    struct sockaddr_in udp_addr; //Resolved once, the text form is only built to be shown
+    struct sockaddr_in tcp_addr;
+    uint64_t next_lc;
+    struct stream_parser parser;
+    struct send_queue    outbound;
+    struct snapshot_stream snapshot;
 };
 
+_Static_assert(0 == offsetof(struct _server, link), "get_server_link casts the server");
+
 // GETS {{{
 char *get_name(server this) {
     return this->name;
 }
 
 char *get_ip_address(server this) {
-    return this->ip_addr;
+    static __thread char text[INET_ADDRSTRLEN];
+    return (char *)inet_ntop(AF_INET, &this->udp_addr.sin_addr, text, INET_ADDRSTRLEN);
 }
 
 u_short get_udp_port(server this) {
-    return this->udp_port;
+    return ntohs(this->udp_addr.sin_port);
 }
 
 u_short get_tcp_port(server this) {
-    return this->tcp_port;
+    return ntohs(this->tcp_addr.sin_port);
+}
+
+const struct sockaddr_in *get_udp_sockaddr(server this) {
+    return &this->udp_addr;
+}
+
+const struct sockaddr_in *get_tcp_sockaddr(server this) {
+    return &this->tcp_addr;
 }
 
 bool get_connected(server this) {
@@ -34,28 +50,60 @@ int get_fd(server this) {
     return this->fd;
 }
 
-struct addrinfo *get_server_address(char *server_ip, char *server_port) {
-    struct addrinfo hints = { .ai_socktype = SOCK_DGRAM, .ai_family=AF_INET };
-    struct addrinfo *result;
-    int err;
+bool get_synced(server this) {
+    return this->synced;
+}
 
-    err = getaddrinfo(server_ip, server_port, &hints, &result);
-    if(0 != err){
-        if ( true == is_verbose() ) perror("getaddrinfo");
-        if ( true == is_verbose() ) printf("getaddrinfo : %s \n",gai_strerror(err));
-        return NULL;
+uint64_t get_next_lc(server this) {
+    return this->next_lc;
+}
+
+struct stream_parser *get_parser(server this) {
+    if (!this->parser.buffer) {
+        this->parser.buffer = (char *)malloc(RX_BUFFER_SIZE);
+        if (!this->parser.buffer) {
+            memory_error("Unable to reserve server receive buffer memory");
+        }
     }
+    return &this->parser;
+}
 
-    return result;
+struct stream_parser *get_inflated_parser(server this) {
+    if (!this->parser.inflated) {
+        this->parser.inflated = (struct stream_parser *)calloc(1, sizeof(struct stream_parser));
+        if (!this->parser.inflated) {
+            memory_error("Unable to reserve server decompression memory");
+        }
+        this->parser.inflated->buffer = (char *)malloc(RX_BUFFER_SIZE);
+        if (!this->parser.inflated->buffer) {
+            memory_error("Unable to reserve server decompression memory");
+        }
+        this->parser.inflated->state = STREAM_BINARY;
+    }
+    return this->parser.inflated;
+}
+
+struct send_queue *get_send_queue(server this) {
+    return &this->outbound;
 }
 
-struct addrinfo *get_server_address_tcp(char *server_ip, char *server_port) {
-    struct addrinfo hints = { .ai_socktype = SOCK_STREAM, .ai_family=AF_INET };
+struct snapshot_stream *get_snapshot_stream(server this) {
+    return &this->snapshot;
+}
+
+struct peer_key get_server_key(server this) {
+    u_short udp_port = get_udp_port(this);
+    return (struct peer_key){.ip = this->udp_addr.sin_addr.s_addr, .udp_port = udp_port,
+            .tcp_port = udp_port ? get_tcp_port(this) : 0};
+}
+
+struct addrinfo *get_server_address(char *server_ip, char *server_port) {
+    struct addrinfo hints = { .ai_socktype = SOCK_DGRAM, .ai_family=AF_INET };
     struct addrinfo *result;
     int err;
 
     err = getaddrinfo(server_ip, server_port, &hints, &result);
-    if(err != 0){
+    if(0 != err){
         if ( true == is_verbose() ) perror("getaddrinfo");
         if ( true == is_verbose() ) printf("getaddrinfo : %s \n",gai_strerror(err));
         return NULL;
@@ -63,6 +111,7 @@ struct addrinfo *get_server_address_tcp(char *server_ip, char *server_port) {
 
     return result;
 }
+
 // }}}
 
 /*
@@ -80,13 +129,36 @@ struct addrinfo *get_server_address_tcp(char *server_ip, char *server_port) {
 */
 
 /* Server Functions */
+// resolve_ip converts the ip, or resolves the host name once, INADDR_NONE if it can't
+static struct in_addr resolve_ip(char *ip_addr) {
+    struct in_addr ip = {.s_addr = INADDR_NONE};
+    struct addrinfo hints = {.ai_family = AF_INET}, *result = NULL;
+
+    if (1 == inet_aton(ip_addr, &ip)) {
+        return ip;
+    }
+    if (0 == getaddrinfo(ip_addr, NULL, &hints, &result)) {
+        ip = ((struct sockaddr_in *)result->ai_addr)->sin_addr;
+        freeaddrinfo(result);
+    } else if ( true == is_verbose() ) {
+        printf( KRED "unable to resolve %s\n" KNRM, ip_addr);
+    }
+    return ip;
+}
+
 server new_server(char *name, char *ip_addr, u_short udp_port, u_short tcp_port) {
+    return new_server_from_addr(name, resolve_ip(ip_addr), udp_port, tcp_port);
+}
+
+server new_server_from_addr(char *name, struct in_addr ip, u_short udp_port, u_short tcp_port) {
 	server pserver_to_node = NULL;
 
 	pserver_to_node = (server)malloc(sizeof(struct _server));
     if(!pserver_to_node ) {
         memory_error("Unable to reserve server struct memory");
     }
+    ilist_init(&pserver_to_node->link);
+    pserver_to_node->name = NULL;
    	if(name) {
         pserver_to_node->name = (char *)malloc(STRING_SIZE);
         if (!pserver_to_node->name) {
@@ -99,25 +171,23 @@ server new_server(char *name, char *ip_addr, u_short udp_port, u_short tcp_port)
        	}
     }
 
-	pserver_to_node->ip_addr = (char *)malloc(sizeof(char)*(strlen(ip_addr)+1));
-   	if(pserver_to_node->ip_addr == NULL) memory_error("Unable to reserve server ip address memory");
-   	if ( NULL == memcpy(pserver_to_node->ip_addr, ip_addr, strlen(ip_addr)+1)) {
-   		if ( true == is_verbose() ) printf( KRED "error copying ip address to server struct" KNRM );
-   		return NULL;
-   	}
-
-   	pserver_to_node->udp_port  = udp_port;
-   	pserver_to_node->tcp_port  = tcp_port;
+    pserver_to_node->udp_addr = (struct sockaddr_in){.sin_family = AF_INET, .sin_addr = ip, .sin_port = htons(udp_port)};
+    pserver_to_node->tcp_addr = (struct sockaddr_in){.sin_family = AF_INET, .sin_addr = ip, .sin_port = htons(tcp_port)};
     pserver_to_node->connected = false;
     pserver_to_node->fd = -1;
+    pserver_to_node->synced = false;
+    pserver_to_node->next_lc = 0;
+    pserver_to_node->parser = (struct stream_parser){.buffer = NULL, .len = 0, .state = STREAM_COMMAND};
+    pserver_to_node->outbound = (struct send_queue){.buffer = NULL, .head = 0, .len = 0, .size = 0, .throttled = false};
+    pserver_to_node->snapshot = (struct snapshot_stream){.active = false};
 
    	return pserver_to_node;
 }
 
 int different_servers(server serv1, server serv2) {
-    if (!strcmp(serv1->ip_addr,serv2->ip_addr)
-        && serv1->udp_port == serv2->udp_port
-        && serv1->tcp_port == serv2->tcp_port) {
+    if (serv1->udp_addr.sin_addr.s_addr == serv2->udp_addr.sin_addr.s_addr
+        && serv1->udp_addr.sin_port == serv2->udp_addr.sin_port
+        && serv1->tcp_addr.sin_port == serv2->tcp_addr.sin_port) {
         return 0;
     }
     return 1;
@@ -127,18 +197,15 @@ server copy_server(server serv1, server serv2) {
     server serv_new = NULL;
 
     if(!serv1){
-        serv_new = new_server(serv2->name, serv2->ip_addr, serv2->udp_port, serv2->tcp_port);
+        serv_new = new_server_from_addr(serv2->name, serv2->udp_addr.sin_addr,
+                get_udp_port(serv2), get_tcp_port(serv2));
     } else {
         if (!strncpy(serv1->name, serv2->name, strlen(serv2->name)+1)){
             if ( true == is_verbose() ) printf( KRED "error copying name to server struct" KNRM );
             return NULL; //EXIT_FAILURE
         }
-        if (!strncpy(serv1->ip_addr, serv2->ip_addr, strlen(serv2->ip_addr)+1) ){
-            if ( true == is_verbose() ) printf( KRED "error copying ip address to server struct" KNRM );
-            return NULL; //EXIT_FAILURE
-        }
-        serv1->udp_port = serv2->udp_port;
-        serv1->tcp_port = serv2->tcp_port;
+        serv1->udp_addr = serv2->udp_addr;
+        serv1->tcp_addr = serv2->tcp_addr;
         serv_new = serv1;
     }
 
@@ -152,6 +219,19 @@ void set_connected(server this, bool connected) {
 }
 
 
+void set_synced(server this, bool synced) {
+    this->synced = synced;
+}
+
+void set_next_lc(server this, uint64_t next_lc) {
+    this->next_lc = next_lc;
+}
+
+void set_listen_ports(server this, u_short udp_port, u_short tcp_port) {
+    this->udp_addr.sin_port = htons(udp_port);
+    this->tcp_addr.sin_port = htons(tcp_port);
+}
+
 void set_fd(server this, int fd){
     this->fd = fd;
     return;
@@ -166,7 +246,7 @@ void print_server(item got_item) {
             KRED "Server IP:"   RESET " %s "
             KYEL "UDP Port:"    RESET " %hu "
             KYEL "TCP Port:"    RESET " %hu ",
-            this->name, this->ip_addr, this->udp_port, this->tcp_port);
+            this->name, get_ip_address(this), get_udp_port(this), get_tcp_port(this));
     }
     else{
         fprintf(stdout, KCYN "Server to remove: invalid" KNRM);
@@ -180,11 +260,17 @@ void free_server(item got_item) {
         return;
     }
 
+    ilist_remove(&this->link);
     if (this->fd > 0) {
         close_fd(this->fd);
     }
+    if (this->parser.inflated) {
+        free(this->parser.inflated->buffer);
+        free(this->parser.inflated);
+    }
+    free(this->parser.buffer);
+    free(this->outbound.buffer);
     free(this->name);
-    free(this->ip_addr);
     free(this);
     return;
 }
@@ -193,4 +279,20 @@ void close_communication(server this) {
     close_fd(this->fd);
     this->fd = -1;
     this->connected = false;
+    //The buffer is kept, a handler may still be parsing it
+    this->parser.len = 0;
+    this->parser.state = STREAM_COMMAND;
+    this->parser.remaining = 0;
+    this->parser.stalled = false;
+    if (this->parser.inflated) {
+        this->parser.inflated->len = 0;
+        this->parser.inflated->state = STREAM_BINARY;
+        this->parser.inflated->remaining = 0;
+    }
+    this->outbound.head = 0;
+    this->outbound.len = 0;
+    this->outbound.throttled = false;
+    this->outbound.binary = false;
+    this->outbound.compress = false;
+    this->snapshot.active = false;
 }
@@ -6,23 +6,156 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include "utils.h"
-#include "util_list.h"
+#include "util_ilist.h"
+#include "util_registry.h"
+
+#define RX_BUFFER_SIZE (64 * 1024) //Bytes read from a server per recv
 
 typedef struct _server *server;
 
+/*! \fn struct ilink *get_server_link(server this)
+    \brief Links of the server in an intrusive list, see util_ilist.h. A server is in one list at most.
+    They are the first member of the server, so both conversions are a cast.
+    \param this Server selected.
+*/
+static inline struct ilink *get_server_link(server this) {
+    return (struct ilink *)this;
+}
+
+/*! \fn server server_of_link(struct ilink *link)
+    \brief Server that holds the links.
+    \param link Links from get_server_link.
+*/
+static inline server server_of_link(struct ilink *link) {
+    return (server)link;
+}
+
+/*! \def for_each_server(cur_server, head)
+    \brief Iterates over the servers of an intrusive list, setting cur_server to each one.
+    The current server may be removed.
+*/
+#define for_each_server(cur_server, head) \
+    for (struct ilink *cur_server##_link = (head)->next, *cur_server##_next = cur_server##_link->next; \
+            cur_server##_link != (head) && ((cur_server) = server_of_link(cur_server##_link), true); \
+            cur_server##_link = cur_server##_next, cur_server##_next = cur_server##_link->next)
+
+/*! \enum stream_state
+    \brief Framing of the TCP stream of a server, kept between reads.
+*/
+enum stream_state {
+    STREAM_COMMAND = 0, //!< Waiting for SGET_MESSAGES or SMESSAGES
+    STREAM_SMESSAGES,   //!< Inside a SMESSAGES block, lines are "lc;message"
+    STREAM_BINARY,      //!< After BINARY, waiting for a frame header
+    STREAM_BINARY_MESSAGES, //!< Inside a BINARY_MESSAGES frame
+};
+
+/*! \struct stream_parser
+    \brief Receive buffer and framing state of a connected server.
+*/
+struct stream_parser {
+    char         *buffer; //!< RX_BUFFER_SIZE bytes, reserved on the first read
+    size_t       len;     //!< Bytes received and not parsed yet, an incomplete line
+    uint_fast8_t state;   //!< One of enum stream_state
+    uint64_t     remaining; //!< Records left in the BINARY_MESSAGES frame
+    struct stream_parser *inflated; //!< Stream inside the BINARY_COMPRESSED frames, see get_inflated_parser
+    bool         stalled; //!< The ring to the client thread was full, not read until it drains, see resume_ingest
+};
+
+/*! \struct send_queue
+    \brief Bytes accepted for a connected server that its socket did not take yet.
+*/
+struct send_queue {
+    char   *buffer;   //!< Grows as needed, kept until the server is freed
+    size_t head;      //!< First byte not sent
+    size_t len;       //!< Bytes waiting
+    size_t size;      //!< Bytes reserved
+    bool   throttled; //!< Reading from the server paused until the queue drains
+    bool   binary;    //!< BINARY was sent, the next frames use the binary protocol
+    bool   compress;  //!< The server reads BINARY_COMPRESSED frames
+};
+
+/*! \struct snapshot_stream
+    \brief SGET_MESSAGES reply being sent to a server, one window of stored messages at a time.
+*/
+struct snapshot_stream {
+    bool         active;
+    uint_fast8_t form; //!< Protocol of the reply, kept until it ends
+    uint64_t     next; //!< Index of the next message to send
+};
+
 /* GETS */
 char    *get_name(server this);
+/*! \fn char *get_ip_address(server this)
+    \brief Returns the ip in text, to be shown. The buffer is kept until the next call in the thread.
+    \param this Server selected.
+*/
 char    *get_ip_address(server this);
 u_short get_udp_port(server this);
 u_short get_tcp_port(server this);
 bool    get_connected(server this);
 int     get_fd(server this);
+/*! \fn bool get_synced(server this)
+    \brief True once a SMESSAGES snapshot was received from the server, then get_next_lc is valid.
+    \param this Server selected.
+*/
+bool    get_synced(server this);
+/*! \fn uint64_t get_next_lc(server this)
+    \brief Clock after the last message received from the server, 0 if none since the sync.
+    \param this Server selected.
+*/
+uint64_t get_next_lc(server this);
+/*! \fn struct stream_parser *get_parser(server this)
+    \brief Returns the stream parser of the server, with its receive buffer reserved.
+    \param this Server selected.
+*/
+struct  stream_parser *get_parser(server this);
+/*! \fn struct stream_parser *get_inflated_parser(server this)
+    \brief Returns the parser of the decompressed stream of the server, reserved on the first call.
+    Its buffer keeps the decompressed bytes not parsed yet.
+    \param this Server selected.
+*/
+struct  stream_parser *get_inflated_parser(server this);
+/*! \fn struct send_queue *get_send_queue(server this)
+    \brief Returns the outbound queue of the server.
+    \param this Server selected.
+*/
+struct  send_queue *get_send_queue(server this);
+/*! \fn struct snapshot_stream *get_snapshot_stream(server this)
+    \brief Returns the SGET_MESSAGES reply the server is being sent.
+    \param this Server selected.
+*/
+struct  snapshot_stream *get_snapshot_stream(server this);
+/*! \fn struct peer_key get_server_key(server this)
+    \brief Returns the binary address the server is registered by. An inbound server is
+    found by (ip, 0, 0) until it gives its listening ports in HELLO, see set_listen_ports.
+    \param this Server selected.
+*/
+struct  peer_key get_server_key(server this);
+/*! \fn const struct sockaddr_in *get_udp_sockaddr(server this)
+    \brief Returns the address of the UDP port of the server, resolved when it was created.
+    \param this Server selected.
+*/
+const struct sockaddr_in *get_udp_sockaddr(server this);
+/*! \fn const struct sockaddr_in *get_tcp_sockaddr(server this)
+    \brief Returns the address of the TCP port of the server, resolved when it was created.
+    \param this Server selected.
+*/
+const struct sockaddr_in *get_tcp_sockaddr(server this);
 struct  addrinfo *get_server_address(char *server_ip, char *server_port);
-struct  addrinfo *get_server_address_tcp(char *server_ip, char *server_port);
 
 /* SETS */
 void set_fd(server this, int fd);
 void set_connected(server this, bool connected);
+void set_synced(server this, bool synced);
+void set_next_lc(server this, uint64_t next_lc);
+/*! \fn void set_listen_ports(server this, u_short udp_port, u_short tcp_port)
+    \brief Gives an inbound server the ports it listens on, instead of the port it connected from.
+    Its key changes, the caller moves it in the registries, see rekey_registry.
+    \param this Server selected.
+    \param udp_port UDP port.
+    \param tcp_port TCP port.
+*/
+void set_listen_ports(server this, u_short udp_port, u_short tcp_port);
 
 /* METHODS */
 void free_server(item got_item);
@@ -30,4 +163,12 @@ void print_server(item got_item);
 server copy_server(server serv1, server serv2);
 int different_servers(server serv1, server serv2);
 server new_server(char *name, char* ip_address, u_short udp_port, u_short tcp_port);
+/*! \fn server new_server_from_addr(char *name, struct in_addr ip, u_short udp_port, u_short tcp_port)
+    \brief Same as new_server, with the ip already in binary.
+    \param name Server name.
+    \param ip Address of the server.
+    \param udp_port UDP port, 0 for an inbound server.
+    \param tcp_port TCP port.
+*/
+server new_server_from_addr(char *name, struct in_addr ip, u_short udp_port, u_short tcp_port);
 void close_communication(server this);
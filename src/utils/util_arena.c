@@ -0,0 +1,94 @@
+#include <stddef.h>
+#include "util_arena.h"
+
+//Block taken when the current one is full, freed by the next reset
+struct arena_block {
+    struct arena_block *next;
+    size_t             size;
+    max_align_t        data[];
+};
+
+struct _arena {
+    char               *block;
+    size_t             size;
+    size_t             used;
+    struct arena_block *extra;
+    size_t             needed;  //Bytes the iteration took, extra blocks included
+    uint64_t           mallocs;
+};
+
+static inline size_t align_up(size_t len) {
+    return (len + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+arena create_arena(size_t size) {
+    arena new_arena = (arena)calloc(1, sizeof(struct _arena));
+    if (!new_arena) {
+        memory_error("Unable to reserve arena memory");
+    }
+    new_arena->size = align_up(size ? size : 1);
+    new_arena->block = (char *)aligned_alloc(ARENA_ALIGN, new_arena->size);
+    if (!new_arena->block) {
+        memory_error("Unable to reserve arena memory");
+    }
+    new_arena->mallocs = 1;
+    return new_arena;
+}
+
+void *arena_alloc(arena this, size_t len) {
+    len = align_up(len ? len : 1);
+    this->needed += len;
+    if (len <= this->size - this->used) {
+        void *bytes = this->block + this->used;
+        this->used += len;
+        return bytes;
+    }
+
+    struct arena_block *extra = (struct arena_block *)malloc(sizeof(struct arena_block) + len);
+    if (!extra) {
+        memory_error("Unable to reserve arena memory");
+    }
+    this->mallocs++;
+    extra->next = this->extra;
+    extra->size = len;
+    this->extra = extra;
+    return extra->data;
+}
+
+static void free_extra_blocks(arena this) {
+    while (this->extra) {
+        struct arena_block *next = this->extra->next;
+        free(this->extra);
+        this->extra = next;
+    }
+}
+
+void reset_arena(arena this) {
+    if (this->extra) { //Too small for this iteration, the next one gets a block that fits
+        free_extra_blocks(this);
+        while (this->size < this->needed) {
+            this->size *= 2;
+        }
+        free(this->block);
+        this->block = (char *)aligned_alloc(ARENA_ALIGN, this->size);
+        if (!this->block) {
+            memory_error("Unable to reserve arena memory");
+        }
+        this->mallocs++;
+    }
+    this->used = 0;
+    this->needed = 0;
+}
+
+uint64_t get_arena_mallocs(arena this) {
+    return this->mallocs;
+}
+
+void free_arena(arena this) {
+    if (!this) {
+        return;
+    }
+    free_extra_blocks(this);
+    free(this->block);
+    free(this);
+}
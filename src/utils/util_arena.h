@@ -0,0 +1,48 @@
+#pragma once
+/*! \file util_arena.h
+ * \brief Bump pointer arena for the buffers of one loop iteration.
+ *
+ * Buffers are taken from one block by moving a pointer and all released at once by
+ * reset_arena, at the end of the iteration. An iteration that needs more than the block
+ * gets extra blocks, and the next reset grows the block to what it needed, so once the
+ * load is steady the arena never calls malloc again. get_arena_mallocs counts the calls.
+ */
+#include "utils.h"
+
+#define ARENA_ALIGN 16
+
+/*! \var typedef struct _arena *arena
+    \brief Arena owned by one thread.
+*/
+typedef struct _arena *arena;
+
+/*! \fn arena create_arena(size_t size)
+    \brief Initializes an arena with a first block of size bytes.
+    \param size Bytes of the block, it grows to the biggest iteration.
+*/
+arena create_arena(size_t size);
+
+/*! \fn void *arena_alloc(arena this, size_t len)
+    \brief Returns len bytes, aligned to ARENA_ALIGN, valid until the next reset_arena.
+    \param this Arena selected.
+    \param len Bytes wanted.
+*/
+void *arena_alloc(arena this, size_t len);
+
+/*! \fn void reset_arena(arena this)
+    \brief Releases every buffer, at the end of the iteration.
+    \param this Arena selected.
+*/
+void reset_arena(arena this);
+
+/*! \fn uint64_t get_arena_mallocs(arena this)
+    \brief Returns the malloc calls made by the arena since it was created.
+    \param this Arena selected.
+*/
+uint64_t get_arena_mallocs(arena this);
+
+/*! \fn void free_arena(arena this)
+    \brief Frees the arena and its blocks.
+    \param this Arena selected.
+*/
+void free_arena(arena this);
@@ -0,0 +1,104 @@
+#pragma once
+/*! \file util_binary.h
+ * \brief Binary framing of the server to server protocol.
+ *
+ * A server offers it with the text line "HELLO <version> <udp port> <tcp port>", version 0 if it
+ * only speaks text, sent first on every connection it opens: the ports tell the server that
+ * accepted the connection which server it is. A server that knows the binary protocol answers
+ * "BINARY <version>", with the lowest of both versions, and every byte it sends after that
+ * line is binary. The other side switches its own stream the same way, so each direction
+ * changes at its own marker. Servers that do not know HELLO ignore it and both keep the
+ * text protocol.
+ *
+ * Frames start with a type byte:
+ *  - BINARY_MESSAGES: varint count, then count records of varint lc, varint length, content.
+ *    A SGET_MESSAGES reply is a series of them ended by a frame of count 0.
+ *  - BINARY_GET: varint, 0 asks for every message, lc + 1 for the messages after lc.
+ *  - BINARY_COMPRESSED (version 2): varint raw length, varint length, then an util_lz.h block.
+ *    The blocks of consecutive frames, once decompressed, are a stream of the other frames.
+ */
+#include <string.h>
+#include "utils.h"
+
+#define BINARY_VERSION 2
+#define COMPRESSED_VERSION 2                    //First version with BINARY_COMPRESSED
+#define COMPRESS_BLOCK (32 * 1024)              //Longest raw length of a BINARY_COMPRESSED block
+#define HELLO_CODE "HELLO"
+#define BINARY_CODE "BINARY"
+#define VARINT_MAX 10                           //Bytes of a 64 bit varint
+#define BINARY_HEADER_MAX (1 + VARINT_MAX)      //Type byte and count
+#define BINARY_RECORD_MAX (2 * VARINT_MAX + STRING_SIZE)
+
+/*! \enum binary_frame
+    \brief Type byte of a binary frame.
+*/
+enum binary_frame {
+    BINARY_MESSAGES = 1, //!< Same as SMESSAGES
+    BINARY_GET,          //!< Same as SGET_MESSAGES
+    BINARY_COMPRESSED,   //!< Part of a compressed stream of frames
+};
+
+/*! \fn size_t put_varint(char *dst, uint64_t value)
+    \brief Writes value 7 bits per byte, low bits first. Returns the bytes written.
+    \param dst At least VARINT_MAX bytes.
+    \param value Value to write.
+*/
+static inline size_t put_varint(char *dst, uint64_t value) {
+    size_t len = 0;
+    while (0x80 <= value) {
+        dst[len++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    dst[len++] = (char)value;
+    return len;
+}
+
+/*! \fn size_t get_varint(const char *src, size_t len, uint64_t *value)
+    \brief Reads a varint written by put_varint.
+    Returns the bytes read, 0 if src ends before the varint does or it is longer than VARINT_MAX.
+    \param src Bytes received.
+    \param len Bytes available in src.
+    \param value Filled with the value read.
+*/
+static inline size_t get_varint(const char *src, size_t len, uint64_t *value) {
+    uint64_t result = 0;
+    len = len < VARINT_MAX ? len : VARINT_MAX;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t byte = (uint8_t)src[i];
+        result |= (uint64_t)(byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/*! \fn size_t put_binary_record(char *dst, uint64_t lc, const char *content, size_t len)
+    \brief Writes one message record of a BINARY_MESSAGES frame. Returns the bytes written.
+    \param dst At least BINARY_RECORD_MAX bytes.
+    \param lc Message clock.
+    \param content Message content, not NUL terminated.
+    \param len Content length, below STRING_SIZE.
+*/
+static inline size_t put_binary_record(char *dst, uint64_t lc, const char *content, size_t len) {
+    size_t used = put_varint(dst, lc);
+    used += put_varint(dst + used, len);
+    memcpy(dst + used, content, len);
+    return used + len;
+}
+
+/*! \fn size_t put_binary_header(char *end, uint_fast8_t type, uint64_t value)
+    \brief Writes a frame header so that it ends right before end, for frames whose
+    count is known only after the records were written. Returns the header length.
+    \param end First byte after the header, with BINARY_HEADER_MAX bytes reserved before it.
+    \param type One of enum binary_frame.
+    \param value Count of a BINARY_MESSAGES frame, value of a BINARY_GET frame.
+*/
+static inline size_t put_binary_header(char *end, uint_fast8_t type, uint64_t value) {
+    char varint[VARINT_MAX];
+    size_t len = put_varint(varint, value);
+    memcpy(end - len, varint, len);
+    *(end - len - 1) = (char)type;
+    return len + 1;
+}
@@ -0,0 +1,93 @@
+#include "util_dedup.h"
+#include "util_slab.h"
+
+struct dedup_key {
+    uint64_t hash;
+    uint64_t lc; //Plus one, 0 is an empty slot
+};
+
+struct _dedup_index {
+    struct dedup_key *slots;
+    size_t           mask;
+};
+
+// slot_of mixes both halves of the key into a slot
+static inline size_t slot_of(dedup_index this, uint64_t lc, uint64_t hash) {
+    return (size_t)((hash ^ (lc * 0x9E3779B97F4A7C15ull)) * 0xFF51AFD7ED558CCDull >> 32) & this->mask;
+}
+
+// find_slot returns the slot of the key, or the empty slot that ends its probe
+static size_t find_slot(dedup_index this, uint64_t lc, uint64_t hash) {
+    size_t slot = slot_of(this, lc, hash);
+    while (this->slots[slot].lc && (this->slots[slot].lc != lc + 1 || this->slots[slot].hash != hash)) {
+        slot = (slot + 1) & this->mask;
+    }
+    return slot;
+}
+
+// slots_for returns the slots of an index for keys, at most half full so probes stay short
+static inline size_t slots_for(size_t keys) {
+    size_t slots = 16;
+    while (slots < 2 * keys) {
+        slots *= 2;
+    }
+    return slots;
+}
+
+dedup_index create_dedup_index(size_t keys) {
+    dedup_index new_index = (dedup_index)malloc(sizeof(struct _dedup_index));
+    size_t slots = slots_for(keys);
+
+    if (!new_index) {
+        memory_error("Unable to reserve dedup index memory");
+    }
+    new_index->slots = (struct dedup_key *)create_slab(slots * sizeof(struct dedup_key));
+    new_index->mask = slots - 1;
+    return new_index;
+}
+
+bool insert_dedup(dedup_index this, uint64_t lc, uint64_t hash) {
+    size_t slot = find_slot(this, lc, hash);
+    if (this->slots[slot].lc) {
+        return false;
+    }
+    this->slots[slot] = (struct dedup_key){.hash = hash, .lc = lc + 1};
+    return true;
+}
+
+bool find_dedup(dedup_index this, uint64_t lc, uint64_t hash) {
+    return 0 != this->slots[find_slot(this, lc, hash)].lc;
+}
+
+void remove_dedup(dedup_index this, uint64_t lc, uint64_t hash) {
+    size_t hole = find_slot(this, lc, hash);
+    if (!this->slots[hole].lc) {
+        return;
+    }
+
+    //Moves back every key after the hole that would not be found past it
+    for (size_t slot = (hole + 1) & this->mask; this->slots[slot].lc; slot = (slot + 1) & this->mask) {
+        size_t home = slot_of(this, this->slots[slot].lc - 1, this->slots[slot].hash);
+        if (((slot - home) & this->mask) >= ((slot - hole) & this->mask)) {
+            this->slots[hole] = this->slots[slot];
+            hole = slot;
+        }
+    }
+    this->slots[hole].lc = 0;
+}
+
+size_t get_dedup_memory(dedup_index this) {
+    return sizeof(struct _dedup_index) + (this->mask + 1) * sizeof(struct dedup_key);
+}
+
+size_t dedup_memory_for(size_t keys) {
+    return sizeof(struct _dedup_index) + slots_for(keys) * sizeof(struct dedup_key);
+}
+
+void free_dedup_index(dedup_index this) {
+    if (!this) {
+        return;
+    }
+    free_slab(this->slots, (this->mask + 1) * sizeof(struct dedup_key));
+    free(this);
+}
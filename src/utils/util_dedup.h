@@ -0,0 +1,75 @@
+#pragma once
+/*! \file util_dedup.h
+ * \brief Open addressing index of the stored messages, by origin clock and content hash.
+ *
+ * Used by the writer thread to drop a replicated message that is already stored, as when
+ * it arrives from both connections to a server or in the snapshots of two servers.
+ * Linear probing, at most half full, entries are removed by shifting back the ones after
+ * them so lookups never need tombstones.
+ */
+#include "utils.h"
+
+/*! \var typedef struct _dedup_index *dedup_index
+    \brief Set of (clock, hash) keys, sized for a fixed number of messages.
+*/
+typedef struct _dedup_index *dedup_index;
+
+/*! \fn uint64_t hash_content(const char *content)
+    \brief 64 bit FNV-1a hash of a NUL terminated message.
+    \param content Message content.
+*/
+static inline uint64_t hash_content(const char *content) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const unsigned char *c = (const unsigned char *)content; *c; c++) {
+        hash = (hash ^ *c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/*! \fn dedup_index create_dedup_index(size_t keys)
+    \brief Initializes an empty index for up to keys messages.
+    \param keys Messages stored at once, the matrix capacity.
+*/
+dedup_index create_dedup_index(size_t keys);
+
+/*! \fn bool insert_dedup(dedup_index this, uint64_t lc, uint64_t hash)
+    \brief Adds the key. Returns false if it was already there, the message is a duplicate.
+    \param this Index selected.
+    \param lc Origin clock of the message.
+    \param hash hash_content of the message.
+*/
+bool insert_dedup(dedup_index this, uint64_t lc, uint64_t hash);
+
+/*! \fn bool find_dedup(dedup_index this, uint64_t lc, uint64_t hash)
+    \brief Returns true if the key is there, without adding it.
+    \param this Index selected.
+    \param lc Origin clock of the message.
+    \param hash hash_content of the message.
+*/
+bool find_dedup(dedup_index this, uint64_t lc, uint64_t hash);
+
+/*! \fn void remove_dedup(dedup_index this, uint64_t lc, uint64_t hash)
+    \brief Removes the key of an evicted message, if present.
+    \param this Index selected.
+    \param lc Origin clock of the message.
+    \param hash hash_content of the message.
+*/
+void remove_dedup(dedup_index this, uint64_t lc, uint64_t hash);
+
+/*! \fn size_t get_dedup_memory(dedup_index this)
+    \brief Bytes reserved by the index.
+    \param this Index selected.
+*/
+size_t get_dedup_memory(dedup_index this);
+
+/*! \fn size_t dedup_memory_for(size_t keys)
+    \brief Bytes get_dedup_memory would report for an index made by create_dedup_index(keys).
+    \param keys Messages stored at once.
+*/
+size_t dedup_memory_for(size_t keys);
+
+/*! \fn void free_dedup_index(dedup_index this)
+    \brief Frees the index.
+    \param this Index selected.
+*/
+void free_dedup_index(dedup_index this);
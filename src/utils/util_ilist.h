@@ -0,0 +1,83 @@
+#pragma once
+/*! \file util_ilist.h
+ * \brief Intrusive doubly linked list, also used as a queue.
+ *
+ * The links live inside the element, so adding an element never calls malloc and going to
+ * the next element is one pointer, not a node and then its item. Every function is inline
+ * and the element type is recovered with ilist_entry, so iterating compiles to a plain loop
+ * with no callback. A list is a struct ilink head linked to itself when empty.
+ */
+#include <stddef.h>
+#include "utils.h"
+
+/*! \struct ilink
+    \brief Links of an element, or the head of a list.
+*/
+struct ilink {
+    struct ilink *prev;
+    struct ilink *next;
+};
+
+/*! \def ilist_entry(link, type, member)
+    \brief Element of type that holds link in its member.
+*/
+#define ilist_entry(link, type, member) ((type *)((char *)(link) - offsetof(type, member)))
+
+/*! \def ilist_for_each(link, head)
+    \brief Iterates over the links of the list. The current element may be removed.
+*/
+#define ilist_for_each(link, head) \
+    for (struct ilink *link = (head)->next, *link##_next = link->next; link != (head); \
+            link = link##_next, link##_next = link->next)
+
+/*! \fn void ilist_init(struct ilink *link)
+    \brief Makes an empty list, or an element that is in no list.
+    \param link Head or element links.
+*/
+static inline void ilist_init(struct ilink *link) {
+    link->prev = link;
+    link->next = link;
+}
+
+/*! \fn bool ilist_empty(const struct ilink *head)
+    \brief True if the list has no elements. For an element, true if it is in no list.
+    \param head Head of the list.
+*/
+static inline bool ilist_empty(const struct ilink *head) {
+    return head->next == head;
+}
+
+/*! \fn void ilist_push_back(struct ilink *head, struct ilink *link)
+    \brief Appends an element that is in no list.
+    \param head Head of the list.
+    \param link Element links.
+*/
+static inline void ilist_push_back(struct ilink *head, struct ilink *link) {
+    link->prev = head->prev;
+    link->next = head;
+    head->prev->next = link;
+    head->prev = link;
+}
+
+/*! \fn void ilist_remove(struct ilink *link)
+    \brief Takes the element out of its list, it is then in no list. Does nothing if it was in none.
+    \param link Element links.
+*/
+static inline void ilist_remove(struct ilink *link) {
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    ilist_init(link);
+}
+
+/*! \fn struct ilink *ilist_pop_front(struct ilink *head)
+    \brief Removes and returns the first element, NULL if the list is empty.
+    \param head Head of the list.
+*/
+static inline struct ilink *ilist_pop_front(struct ilink *head) {
+    struct ilink *link = head->next;
+    if (link == head) {
+        return NULL;
+    }
+    ilist_remove(link);
+    return link;
+}
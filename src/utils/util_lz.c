@@ -0,0 +1,182 @@
+#include <string.h>
+#include "util_lz.h"
+
+static inline uint32_t read32(const uint8_t *src) {
+    uint32_t value;
+    memcpy(&value, src, sizeof(value));
+    return value;
+}
+
+static inline uint64_t read64(const uint8_t *src) {
+    uint64_t value;
+    memcpy(&value, src, sizeof(value));
+    return value;
+}
+
+// copy_wild copies in 16 byte steps, so it may write up to 15 bytes after dst + len
+static inline void copy_wild(uint8_t *dst, const uint8_t *src, size_t len) {
+    uint8_t *end = dst + len;
+    do {
+        memcpy(dst, src, 16);
+        dst += 16;
+        src += 16;
+    } while (dst < end);
+}
+
+// match_length counts the equal bytes of a and b, up to limit, 8 at a time
+static inline size_t match_length(const uint8_t *a, const uint8_t *b, size_t limit) {
+    size_t len = 0;
+    while (len + 8 <= limit) {
+        uint64_t diff = read64(a + len) ^ read64(b + len);
+        if (diff) {
+            return len + (__builtin_ctzll(diff) >> 3);
+        }
+        len += 8;
+    }
+    while (len < limit && a[len] == b[len]) {
+        len++;
+    }
+    return len;
+}
+
+static inline uint32_t hash_position(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// put_length writes the part of a length that does not fit in the token nibble
+static inline size_t put_length(uint8_t *dst, size_t length) {
+    size_t used = 0;
+    for (length -= 15; 255 <= length; length -= 255) {
+        dst[used++] = 255;
+    }
+    dst[used++] = (uint8_t)length;
+    return used;
+}
+
+// get_length reads the bytes added to a nibble of 15, returns false past the end
+static inline bool get_length(const uint8_t *src, size_t len, size_t *pos, size_t *length) {
+    uint8_t byte;
+    do {
+        if (*pos >= len) {
+            return false;
+        }
+        byte = src[(*pos)++];
+        *length += byte;
+    } while (255 == byte);
+    return true;
+}
+
+size_t lz_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+// put_sequence writes the literals from anchor and a match, match 0 for the last sequence.
+// Returns the new output length, 0 if it does not fit
+static size_t put_sequence(uint8_t *dst, size_t out, size_t capacity, const uint8_t *literals,
+        size_t literal_len, size_t offset, size_t match) {
+    if (out + 1 + literal_len / 255 + 1 + literal_len + 2 + match / 255 + 1 > capacity) {
+        return 0;
+    }
+
+    uint8_t *token = dst + out++;
+    size_t match_code = match ? match - LZ_MIN_MATCH : 0;
+    *token = (uint8_t)(((15 < literal_len ? 15 : literal_len) << 4) | (15 < match_code ? 15 : match_code));
+    if (15 <= literal_len) {
+        out += put_length(dst + out, literal_len);
+    }
+    memcpy(dst + out, literals, literal_len);
+    out += literal_len;
+
+    if (match) {
+        dst[out++] = (uint8_t)offset;
+        dst[out++] = (uint8_t)(offset >> 8);
+        if (15 <= match_code) {
+            out += put_length(dst + out, match_code);
+        }
+    }
+    return out;
+}
+
+size_t lz_compress(const char *src, size_t len, char *dst, size_t capacity) {
+    const uint8_t *in = (const uint8_t *)src;
+    uint32_t table[1 << LZ_HASH_BITS] = {0}; //Position plus one of the last sequence with each hash
+    size_t pos = 0, anchor = 0, out = 0, misses = 0;
+
+    while (pos + LZ_MIN_MATCH + LZ_END_LITERALS <= len) {
+        uint32_t sequence = read32(in + pos);
+        uint32_t hash = hash_position(sequence);
+        size_t candidate = table[hash];
+        table[hash] = (uint32_t)pos + 1;
+
+        if (!candidate || pos - --candidate > LZ_MAX_OFFSET || read32(in + candidate) != sequence) {
+            pos += 1 + (misses++ >> 6); //Longer steps over data that does not compress
+            continue;
+        }
+
+        misses = 0;
+        size_t match = LZ_MIN_MATCH + match_length(in + candidate + LZ_MIN_MATCH, in + pos + LZ_MIN_MATCH,
+                len - LZ_END_LITERALS - pos - LZ_MIN_MATCH);
+        out = put_sequence((uint8_t *)dst, out, capacity, in + anchor, pos - anchor, pos - candidate, match);
+        if (!out) {
+            return 0;
+        }
+        pos += match;
+        anchor = pos;
+    }
+
+    return put_sequence((uint8_t *)dst, out, capacity, in + anchor, len - anchor, 0, 0);
+}
+
+size_t lz_decompress(const char *src, size_t len, char *dst, size_t capacity) {
+    const uint8_t *in = (const uint8_t *)src;
+    uint8_t *out = (uint8_t *)dst;
+    size_t pos = 0, written = 0;
+
+    while (pos < len) {
+        uint8_t token = in[pos++];
+        size_t literal_len = token >> 4, match = token & 15;
+
+        if (15 == literal_len && !get_length(in, len, &pos, &literal_len)) {
+            return 0;
+        }
+        if (literal_len > len - pos || literal_len > capacity - written) {
+            return 0;
+        }
+        if (literal_len + 16 <= len - pos && literal_len + 16 <= capacity - written) {
+            copy_wild(out + written, in + pos, literal_len);
+        } else {
+            memcpy(out + written, in + pos, literal_len);
+        }
+        pos += literal_len;
+        written += literal_len;
+        if (pos == len) { //Last sequence
+            return written;
+        }
+
+        if (2 > len - pos) {
+            return 0;
+        }
+        size_t offset = in[pos] | (size_t)in[pos + 1] << 8;
+        pos += 2;
+        if (15 == match && !get_length(in, len, &pos, &match)) {
+            return 0;
+        }
+        match += LZ_MIN_MATCH;
+        if (0 == offset || offset > written || match > capacity - written) {
+            return 0;
+        }
+
+        uint8_t *from = out + written - offset;
+        if (16 <= offset && match + 16 <= capacity - written) {
+            copy_wild(out + written, from, match);
+        } else if (offset >= match) {
+            memcpy(out + written, from, match);
+        } else { //Overlapping, a repeated pattern
+            for (size_t i = 0; i < match; i++) {
+                out[written + i] = from[i];
+            }
+        }
+        written += match;
+    }
+    return written;
+}
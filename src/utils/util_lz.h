@@ -0,0 +1,41 @@
+#pragma once
+/*! \file util_lz.h
+ * \brief Byte oriented LZ77 compression for snapshot transfers, in the LZ4 block layout.
+ *
+ * A block is a list of sequences. Each one starts with a token byte: the high nibble is the
+ * number of literals and the low nibble the match length minus LZ_MIN_MATCH, 15 meaning that
+ * more length bytes follow (added up until one is below 255). Then come the literals, and the
+ * match offset in two little endian bytes. The last sequence only has literals.
+ */
+#include "utils.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_END_LITERALS 5  //The last bytes of a block are always literals
+#define LZ_HASH_BITS 14    //Positions remembered while compressing
+
+/*! \fn size_t lz_bound(size_t len)
+    \brief Longest compressed block for len input bytes, incompressible input included.
+    \param len Input length.
+*/
+size_t lz_bound(size_t len);
+
+/*! \fn size_t lz_compress(const char *src, size_t len, char *dst, size_t capacity)
+    \brief Compresses src into dst. Returns the compressed length, 0 if dst is too small.
+    \param src Input bytes.
+    \param len Input length, at most LZ_MAX_OFFSET is looked back.
+    \param dst Output, lz_bound(len) bytes never fall short.
+    \param capacity Bytes available in dst.
+*/
+size_t lz_compress(const char *src, size_t len, char *dst, size_t capacity);
+
+/*! \fn size_t lz_decompress(const char *src, size_t len, char *dst, size_t capacity)
+    \brief Decompresses a block made by lz_compress. Every length and offset is checked,
+    so a malformed block never reads or writes out of bounds.
+    Returns the decompressed length, 0 if the block is malformed or does not fit in dst.
+    \param src Compressed block.
+    \param len Block length.
+    \param dst Output.
+    \param capacity Bytes available in dst.
+*/
+size_t lz_decompress(const char *src, size_t len, char *dst, size_t capacity);
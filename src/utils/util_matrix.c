@@ -1,10 +1,57 @@
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "util_matrix.h"
 
+#define MATRIX_FILE_MAGIC "MSGRING2"
+#define MATRIX_FILE_HEADER 4096 //The ring starts on the next page
+
+//Bytes each form keeps per element on average: "content\n", and the element record with its header and NUL
+static const size_t average_record[WIRE_FORMS] = {MATRIX_AVERAGE_CONTENT + 1, MATRIX_AVERAGE_CONTENT + 32};
+
+//Start of a storage file, the ring of the elements follows it
+struct matrix_file {
+    char     magic[8];
+    uint64_t capacity;
+    uint64_t max_record;
+    uint64_t budget;       //Of the ring of the elements
+    uint64_t clock;        //set_matrix_clock
+    struct wire_mark mark; //Of the elements, saved by every end_matrix_write
+};
+
+//Rings of another capacity filled by a resize, swapped in once they hold every element
+struct matrix_copy {
+    wire_ring   wire[WIRE_FORMS];
+    dedup_index dedup;
+    size_t      capacity;
+    uint64_t    first; //Oldest element copied
+    uint64_t    next;  //Next element to copy
+    void        (*key_of)(item, uint64_t *, uint64_t *);
+};
+
+//Quiescent point counter of a reader thread, even while it runs and odd while it is parked.
+//On its own cache line, every reader writes its own
+struct matrix_reader {
+    atomic_uint_fast64_t epoch;
+    char                 padding[64 - sizeof(atomic_uint_fast64_t)];
+};
+
 struct _matrix {
-    item   *array;
-    size_t size;
-    size_t capacity;
+    uint64_t size;  //Elements ever added, the next index
+    size_t   capacity;
+    uint64_t first; //Oldest element stored
     bool   overflow;
+    atomic_uint_fast32_t seq; //Seqlock, odd while the writer is changing the matrix
+    wire_ring wire[WIRE_FORMS];
+    dedup_index dedup;
+    struct matrix_copy *resize;  //Resize in progress, NULL if none
+    struct matrix_copy *retired; //Rings replaced by the last resize, freed once the readers left them
+    uint64_t           retired_epochs[MATRIX_READERS]; //Of every reader when they were replaced
+    struct matrix_reader readers[MATRIX_READERS];
+    int                reader_count;
+    struct matrix_file *file;    //Mapped storage file, NULL if the elements are only in memory
+    size_t             file_size;
 };
 
 /* MATRIX */
@@ -15,28 +62,108 @@ size_t get_capacity(matrix this) {
     return this->capacity;
 }
 
-size_t get_size(matrix this) {
+uint64_t get_size(matrix this) {
     return this->size;
 }
 
-item get_element(matrix this, uint_fast32_t index) {
-    return this->array[index % this->capacity];
+uint64_t get_first(matrix this) {
+    return this->first;
+}
+
+item get_element(matrix this, uint64_t index) {
+    if (index >= this->size || index < this->first) {
+        return NULL;
+    }
+    return (item)get_wire_record(this->wire[ELEMENT_FORM], index);
+}
+
+wire_ring get_wire(matrix this, int form) {
+    return this->wire[form];
+}
+
+dedup_index get_dedup(matrix this) {
+    return this->dedup;
+}
+
+// form_budget returns the bytes the ring of the form keeps for capacity elements
+static inline size_t form_budget(int form, size_t capacity) {
+    return capacity * average_record[form];
 }
 
-void add_element(matrix this, uint_fast32_t index, item to_add, void (*free_item)(item)) {
-    index = index % this->capacity;
+// copy_memory returns the bytes of the rings of a resize
+static size_t copy_memory(struct matrix_copy *copy) {
+    size_t bytes = sizeof(struct matrix_copy) + get_dedup_memory(copy->dedup);
+    for (int form = 0; form < WIRE_FORMS; form++) {
+        bytes += get_wire_memory(copy->wire[form]);
+    }
+    return bytes;
+}
 
-    if(this->array[index]) {
-        free_item(this->array[index]);
-        this->overflow = true;
+size_t get_matrix_memory(matrix this) {
+    size_t bytes = sizeof(struct _matrix) + get_dedup_memory(this->dedup);
+    for (int form = 0; form < WIRE_FORMS; form++) {
+        bytes += get_wire_memory(this->wire[form]);
+    }
+    if (this->resize) {
+        bytes += copy_memory(this->resize);
     }
+    if (this->retired) {
+        bytes += copy_memory(this->retired);
+    }
+    return bytes;
+}
+
+size_t matrix_memory_for(size_t capacity) {
+    size_t bytes = sizeof(struct _matrix) + dedup_memory_for(capacity);
+    for (int form = 0; form < WIRE_FORMS; form++) {
+        bytes += wire_memory_for(capacity, WIRE_RECORD_SIZE, form_budget(form, capacity));
+    }
+    return bytes;
+}
+
+size_t capacity_for_memory(size_t bytes) {
+    size_t low = 0, high = bytes / average_record[ELEMENT_FORM] + 1;
 
-    this->array[index] = to_add;
+    //Largest capacity that fits, the memory grows with it
+    while (low + 1 < high) {
+        size_t middle = low + (high - low) / 2;
+        if (matrix_memory_for(middle) <= bytes) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+void add_element(matrix this) {
     this->size++;
-    return;
 }
 
-matrix create_matrix(size_t capacity) {
+void drop_first_element(matrix this) {
+    this->first++;
+    this->overflow = true;
+    for (int form = 0; form < WIRE_FORMS; form++) {
+        drop_wire(this->wire[form], this->first);
+    }
+}
+
+void truncate_matrix(matrix this, uint64_t index) {
+    struct matrix_copy *copy = this->resize;
+
+    for (int form = 0; form < WIRE_FORMS; form++) {
+        truncate_wire(this->wire[form], index);
+    }
+    if (copy && copy->next > index) { //What was copied from index on moved, copied again
+        copy->next = index > copy->first ? index : copy->first;
+        for (int form = 0; form < WIRE_FORMS; form++) {
+            truncate_wire(copy->wire[form], copy->next);
+        }
+    }
+}
+
+// new_matrix makes the matrix, with the ring of the elements on element_bytes if not NULL
+static matrix new_matrix(size_t capacity, char *element_bytes) {
     matrix new_matrix = NULL;
 
     /* Create matrix */
@@ -44,34 +171,338 @@ matrix create_matrix(size_t capacity) {
     if(!new_matrix)
         memory_error("Unable to reserve matrix memory");
 
-    new_matrix->array = (item)calloc(capacity, sizeof(item));
-    if(!new_matrix->array)
-        memory_error("Unable to reserve array memory");
-
     /* Set capacity */
     new_matrix->capacity = capacity;
 
     /* Set size to 0 */
     new_matrix->size = 0;
+    new_matrix->first = 0;
+    new_matrix->overflow = false;
+    new_matrix->resize = new_matrix->retired = NULL;
+    new_matrix->reader_count = 0;
+    new_matrix->file = NULL;
+    atomic_init(&new_matrix->seq, 0);
+    for (int form = 0; form < WIRE_FORMS; form++) {
+        new_matrix->wire[form] = form == ELEMENT_FORM && element_bytes
+            ? create_wire_ring_on(capacity, WIRE_RECORD_SIZE, form_budget(form, capacity), element_bytes)
+            : create_wire_ring(capacity, WIRE_RECORD_SIZE, form_budget(form, capacity));
+    }
+    new_matrix->dedup = create_dedup_index(capacity);
 
     return new_matrix;
 }
 
+matrix create_matrix(size_t capacity) {
+    return new_matrix(capacity, NULL);
+}
+
+matrix create_matrix_file(size_t capacity, const char *path) {
+    struct matrix_file header = {.capacity = capacity, .max_record = WIRE_RECORD_SIZE,
+        .budget = form_budget(ELEMENT_FORM, capacity)};
+    struct stat file_stat;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+
+    if (0 > fd || 0 > fstat(fd, &file_stat)) {
+        close_fd(fd);
+        return NULL;
+    }
+    bool created = 0 == file_stat.st_size;
+    if (!created && (sizeof(header) != pread(fd, &header, sizeof(header), 0)
+            || 0 != memcmp(header.magic, MATRIX_FILE_MAGIC, sizeof(header.magic))
+            || WIRE_RECORD_SIZE != header.max_record || 0 == header.capacity
+            || form_budget(ELEMENT_FORM, header.capacity) != header.budget)) {
+        close_fd(fd); //Not a storage file, or of another record size or budget, left untouched
+        return NULL;
+    }
+
+    //An existing file keeps its capacity, resizing would drop the ring it holds
+    size_t file_size = MATRIX_FILE_HEADER + wire_bytes_for(header.budget, WIRE_RECORD_SIZE);
+    if ((created && 0 > ftruncate(fd, file_size)) || (!created && (size_t)file_stat.st_size < file_size)) {
+        close_fd(fd);
+        return NULL;
+    }
+    struct matrix_file *file = (struct matrix_file *)mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close_fd(fd); //The mapping keeps the file
+    if (MAP_FAILED == file) {
+        return NULL;
+    }
+
+    matrix this = new_matrix(header.capacity, (char *)file + MATRIX_FILE_HEADER);
+    this->file = file;
+    this->file_size = file_size;
+    if (created) {
+        memcpy(file->magic, MATRIX_FILE_MAGIC, sizeof(file->magic));
+        file->capacity = header.capacity;
+        file->max_record = header.max_record;
+        file->budget = header.budget;
+        file->clock = 0;
+        get_wire_mark(this->wire[ELEMENT_FORM], &file->mark);
+    }
+    return this;
+}
+
+uint64_t restore_matrix(matrix this, size_t (*record_len)(const char *record, size_t room)) {
+    if (!this->file) {
+        return 0;
+    }
+
+    this->size = restore_wire(this->wire[ELEMENT_FORM], &this->file->mark, record_len);
+    this->first = this->file->mark.oldest < this->size ? this->file->mark.oldest : this->size;
+    this->overflow = 0 < this->first;
+    for (int form = 0; form < WIRE_FORMS; form++) {
+        if (form != ELEMENT_FORM) { //Empty, the caller appends the elements again
+            seek_wire(this->wire[form], this->first);
+        }
+    }
+    get_wire_mark(this->wire[ELEMENT_FORM], &this->file->mark); //Without the records torn by a crash
+    return this->size - this->first;
+}
+
+bool is_matrix_file(matrix this) {
+    return NULL != this->file;
+}
+
+uint64_t get_matrix_clock(matrix this) {
+    return this->file ? this->file->clock : 0;
+}
+
+void set_matrix_clock(matrix this, uint64_t clock) {
+    if (this->file) {
+        this->file->clock = clock;
+    }
+}
+
+/* RESIZE */
+// start_copy makes empty rings for the newest elements that fit in the capacity of the copy
+static void start_copy(matrix this, struct matrix_copy *copy) {
+    copy->first = this->size - this->first > copy->capacity ? this->size - copy->capacity : this->first;
+    copy->next = copy->first;
+    for (int form = 0; form < WIRE_FORMS; form++) {
+        copy->wire[form] = create_wire_ring(copy->capacity, WIRE_RECORD_SIZE, form_budget(form, copy->capacity));
+        seek_wire(copy->wire[form], copy->first);
+    }
+    copy->dedup = create_dedup_index(copy->capacity);
+}
+
+static void free_copy(struct matrix_copy *copy) {
+    for (int form = 0; form < WIRE_FORMS; form++) {
+        free_wire_ring(copy->wire[form]);
+    }
+    free_dedup_index(copy->dedup);
+}
+
+// copy_fits tells if the records of an element fit the rings of the copy without dropping the oldest one
+static bool copy_fits(struct matrix_copy *copy, const struct iovec records[WIRE_FORMS]) {
+    for (int form = 0; form < WIRE_FORMS; form++) {
+        if (!wire_fits(copy->wire[form], records[form].iov_len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// copy_element appends the element to the rings of the copy, dropping their oldest ones when full
+static void copy_element(matrix this, struct matrix_copy *copy, uint64_t index) {
+    struct iovec records[WIRE_FORMS], slices[2];
+    uint64_t lc, hash;
+
+    for (int form = 0; form < WIRE_FORMS; form++) { //A record is never split, one slice
+        get_wire_range(this->wire[form], index, 1, slices);
+        records[form] = slices[0];
+    }
+    while (!copy_fits(copy, records)) {
+        copy->key_of((item)get_wire_record(copy->wire[ELEMENT_FORM], copy->first), &lc, &hash);
+        remove_dedup(copy->dedup, lc, hash);
+        copy->first++;
+        for (int form = 0; form < WIRE_FORMS; form++) {
+            drop_wire(copy->wire[form], copy->first);
+        }
+    }
+    for (int form = 0; form < WIRE_FORMS; form++) {
+        append_wire(copy->wire[form], records[form].iov_base, records[form].iov_len);
+    }
+    copy->key_of(get_element(this, index), &lc, &hash);
+    insert_dedup(copy->dedup, lc, hash);
+}
+
+// swap_copy makes the copy the matrix, the rings it replaces are kept for the readers still in them
+static void swap_copy(matrix this, struct matrix_copy *copy) {
+    begin_matrix_write(this);
+    for (int form = 0; form < WIRE_FORMS; form++) {
+        wire_ring wire = this->wire[form];
+        this->wire[form] = copy->wire[form];
+        copy->wire[form] = wire;
+    }
+    dedup_index dedup = this->dedup;
+    this->dedup = copy->dedup;
+    copy->dedup = dedup;
+    size_t capacity = this->capacity;
+    this->capacity = copy->capacity;
+    copy->capacity = capacity;
+    this->first = copy->first;
+    this->overflow = this->overflow || 0 < this->first;
+    end_matrix_write(this);
+
+    this->resize = NULL;
+    this->retired = copy;
+    //A reader that quiesces after the swap, ordered by its fence, reads the new rings only
+    atomic_thread_fence(memory_order_seq_cst);
+    for (int reader = 0; reader < this->reader_count; reader++) {
+        this->retired_epochs[reader] = atomic_load_explicit(&this->readers[reader].epoch, memory_order_acquire);
+    }
+}
+
+// readers_left_retired tells if every reader was parked at the swap, or passed a quiescent point since
+static bool readers_left_retired(matrix this) {
+    for (int reader = 0; reader < this->reader_count; reader++) {
+        uint64_t epoch = this->retired_epochs[reader];
+        if (!(epoch & 1) && epoch == atomic_load_explicit(&this->readers[reader].epoch, memory_order_acquire)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint_fast8_t start_matrix_resize(matrix this, size_t capacity, void (*key_of)(item, uint64_t *, uint64_t *)) {
+    if (0 == capacity) {
+        return 2;
+    }
+    if (this->file) {
+        return 3;
+    }
+    if (this->resize || this->retired) {
+        return 1;
+    }
+    if (capacity == this->capacity) {
+        return 0;
+    }
+
+    struct matrix_copy *copy = (struct matrix_copy *)malloc(sizeof(struct matrix_copy));
+    if (!copy) {
+        memory_error("Unable to reserve matrix memory");
+    }
+    copy->capacity = capacity;
+    copy->key_of = key_of;
+    start_copy(this, copy);
+    this->resize = copy;
+    return 0;
+}
+
+bool step_matrix_resize(matrix this, size_t records) {
+    struct matrix_copy *copy = this->resize;
+
+    if (this->retired && readers_left_retired(this)) {
+        free_copy(this->retired);
+        free(this->retired);
+        this->retired = NULL;
+    }
+    if (!copy) {
+        return false;
+    }
+    if (copy->next < this->first) { //Evicted before it was copied, the writer is faster than the copy
+        free_copy(copy);
+        start_copy(this, copy);
+    }
+
+    for (; 0 < records && copy->next < this->size; records--, copy->next++) {
+        copy_element(this, copy, copy->next);
+    }
+    if (copy->next < this->size) {
+        return false;
+    }
+    swap_copy(this, copy);
+    return true;
+}
+
+int get_resize_wait(matrix this) {
+    if (this->resize) {
+        return 0;
+    }
+    if (this->retired) {
+        return readers_left_retired(this) ? 0 : RESIZE_RETIRE_MS;
+    }
+    return -1;
+}
+
+/* READERS */
+int add_matrix_reader(matrix this) {
+    if (MATRIX_READERS == this->reader_count) {
+        return -1;
+    }
+    atomic_init(&this->readers[this->reader_count].epoch, 1); //Parked until it starts reading
+    return this->reader_count++;
+}
+
+void quiesce_matrix_reader(matrix this, int reader) {
+    atomic_uint_fast64_t *epoch = &this->readers[reader].epoch;
+
+    //Next even value, the reads before are done
+    atomic_store_explicit(epoch, (atomic_load_explicit(epoch, memory_order_relaxed) + 2) & ~(uint64_t)1,
+            memory_order_release);
+    //The writer sees the new epoch, or this thread the rings of the last swap
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void park_matrix_reader(matrix this, int reader) {
+    atomic_uint_fast64_t *epoch = &this->readers[reader].epoch;
+
+    atomic_store_explicit(epoch, atomic_load_explicit(epoch, memory_order_relaxed) | 1, memory_order_release);
+}
+
+/* SEQLOCK */
+void begin_matrix_write(matrix this) {
+    uint_fast32_t seq = atomic_load_explicit(&this->seq, memory_order_relaxed);
+    atomic_store_explicit(&this->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+void end_matrix_write(matrix this) {
+    if (this->file) { //The records are written, the mark moves past them
+        get_wire_mark(this->wire[ELEMENT_FORM], &this->file->mark);
+    }
+    uint_fast32_t seq = atomic_load_explicit(&this->seq, memory_order_relaxed);
+    atomic_store_explicit(&this->seq, seq + 1, memory_order_release);
+}
+
+uint_fast32_t begin_matrix_read(matrix this) {
+    uint_fast32_t seq;
+    while ((seq = atomic_load_explicit(&this->seq, memory_order_acquire)) & 1) {
+        //Writer inside, wait for it
+    }
+    return seq;
+}
+
+bool retry_matrix_read(matrix this, uint_fast32_t seq) {
+    atomic_thread_fence(memory_order_acquire);
+    return seq != atomic_load_explicit(&this->seq, memory_order_relaxed);
+}
+
 void print_matrix(matrix this, void (*print_item)(item)) {
-    for (uint_fast32_t i = 0; i < this->capacity; i++) {
-        print_item(this->array[i]);
+    for (uint64_t i = this->first; i < this->size; i++) {
+        print_item(get_element(this, i));
     }
 }
 
-void free_matrix(matrix this, void (*free_item)(item)) {
+void free_matrix(matrix this) {
     if (!this) {
         return;
     }
-    /* Free every item of matrix*/
-    for (uint_fast32_t i = 0; i < this->capacity; i++) {
-        free_item(this->array[i]);
+    for (int form = 0; form < WIRE_FORMS; form++) {
+        free_wire_ring(this->wire[form]);
+    }
+    free_dedup_index(this->dedup);
+    if (this->resize) {
+        free_copy(this->resize);
+        free(this->resize);
+    }
+    if (this->retired) {
+        free_copy(this->retired);
+        free(this->retired);
+    }
+    if (this->file) {
+        msync(this->file, this->file_size, MS_SYNC);
+        munmap(this->file, this->file_size);
     }
-    free(this->array);
 
     /* Bring freedom to matrix */
     free(this);
@@ -1,12 +1,25 @@
 /*! \file util_matrix.h
  * \brief Matrix structure definition 
 */
+#pragma once
+#include <stdatomic.h>
 #include "utils.h"
+#include "util_wire.h"
+#include "util_dedup.h"
+
+#define WIRE_FORMS 2 //Formats kept for every element, see get_wire
+#define MATRIX_AVERAGE_CONTENT 64 //Content bytes per element the rings are sized for, see create_matrix
+#define ELEMENT_FORM (WIRE_FORMS - 1) //The records of this form are the elements
+#define RESIZE_STEP 1024 //Elements a resize copies per step, tens of microseconds
+#define MATRIX_READERS 64 //Most threads reading the matrix besides the writer, see add_matrix_reader
+#define RESIZE_RETIRE_MS 1 //Loop wait while replaced rings wait for a reader to pass a quiescent point
 
 /*! \var typedef struct _matrix *matrix
     \brief Back linked matrix
     Describes a pointer to struct _matrix.
     It is backlinked so accessing 207 goes to 007.
+    The elements are not allocated one by one: each is a record of the ELEMENT_FORM wire ring,
+    so they are contiguous in memory and the ring start offsets are their index.
 */
 typedef struct _matrix *matrix;
 
@@ -24,35 +37,204 @@ bool get_overflow(matrix this);
 */
 size_t get_capacity(matrix this);
 
-/*! \fn size_t get_size(matrix this);
-    \brief Next vacant position.
+/*! \fn uint64_t get_size(matrix this);
+    \brief Next vacant position. Indexes are 64 bit sequence numbers, they never wrap.
     \param this Matrix selected.
 */
-size_t get_size(matrix this);
+uint64_t get_size(matrix this);
 
-/*! \fn item get_element(matrix this, uint_fast32_t index);
-    \brief Returns matrix element in index.
+/*! \fn uint64_t get_first(matrix this);
+    \brief Index of the oldest element stored, get_size if there is none.
+    \param this Matrix selected.
+*/
+uint64_t get_first(matrix this);
+
+/*! \fn item get_element(matrix this, uint64_t index);
+    \brief Returns matrix element in index, NULL if it is not stored.
     \param this Matrix selected.
     \param index Selected index.
 */
-item get_element(matrix this, uint_fast32_t index);
+item get_element(matrix this, uint64_t index);
+
+/*! \fn wire_ring get_wire(matrix this, int form)
+    \brief Returns the ring with the elements already in the wire format selected.
+    The writer appends to it inside its write section.
+    \param this Matrix selected.
+    \param form Format index, below WIRE_FORMS.
+*/
+wire_ring get_wire(matrix this, int form);
+
+/*! \fn dedup_index get_dedup(matrix this)
+    \brief Returns the index of the stored elements used to find duplicates. Writer thread only.
+    \param this Matrix selected.
+*/
+dedup_index get_dedup(matrix this);
 
 // Methods
 /*! \fn matrix create_matrix(size_t capacity)
-    \brief Initializes matrix structure
+    \brief Initializes matrix structure. Its rings are sized by bytes, for capacity elements of
+    MATRIX_AVERAGE_CONTENT bytes: longer ones make the writer drop the oldest before capacity is reached.
     \param capacity max size
 */
 matrix create_matrix(size_t capacity);
 
-/*! \fn void add_element(matrix this, uint_fast32_t index, item to_add, void (*free_item)(item))
-    \brief Adds element to array position desired.
-    If needed removes existing element.
+/*! \fn matrix create_matrix_file(size_t capacity, const char *path)
+    \brief Initializes a matrix whose elements live in the file, mapped in memory, so they
+    survive a restart. A new file is made for the capacity; an existing one keeps its own,
+    and its elements are found again by restore_matrix. The other wire forms and the dedup
+    index stay in memory. Returns NULL if the file cannot be mapped or is not a storage file.
+    \param capacity max size, if the file is new
+    \param path Storage file.
+*/
+matrix create_matrix_file(size_t capacity, const char *path);
+
+/*! \fn uint64_t restore_matrix(matrix this, size_t (*record_len)(const char *record, size_t room))
+    \brief Finds the elements of the storage file again, see restore_wire, and returns how many.
+    The other wire forms are left empty at the first of them, for the caller to fill.
+    \param this Matrix made by create_matrix_file.
+    \param record_len Length of a valid element record, 0 if it is not one.
+*/
+uint64_t restore_matrix(matrix this, size_t (*record_len)(const char *record, size_t room));
+
+/*! \fn bool is_matrix_file(matrix this)
+    \brief True if the elements live in a storage file.
+    \param this Matrix selected.
+*/
+bool is_matrix_file(matrix this);
+
+/*! \fn uint64_t get_matrix_clock(matrix this)
+    \brief Clock saved in the storage file by set_matrix_clock, 0 without a file.
+    \param this Matrix selected.
+*/
+uint64_t get_matrix_clock(matrix this);
+
+/*! \fn void set_matrix_clock(matrix this, uint64_t clock)
+    \brief Saves the clock in the storage file, if any. Writer thread only.
+    \param this Matrix selected.
+    \param clock Next clock of the writer.
+*/
+void set_matrix_clock(matrix this, uint64_t clock);
+
+/*! \fn size_t get_matrix_memory(matrix this)
+    \brief Bytes reserved by the matrix, wire rings and index included.
+    \param this Matrix selected.
+*/
+size_t get_matrix_memory(matrix this);
+
+/*! \fn size_t matrix_memory_for(size_t capacity)
+    \brief Bytes get_matrix_memory reports for a matrix of the capacity, without a resize in progress.
+    \param capacity max size
+*/
+size_t matrix_memory_for(size_t capacity);
+
+/*! \fn size_t capacity_for_memory(size_t bytes)
+    \brief Largest capacity whose matrix takes at most bytes, 0 if not even one element fits.
+    \param bytes Memory budget.
+*/
+size_t capacity_for_memory(size_t bytes);
+
+/*! \fn void add_element(matrix this)
+    \brief Counts one more element, once the writer appended its records to every wire form.
+    \param this Matrix selected.
+*/
+void add_element(matrix this);
+
+/*! \fn void drop_first_element(matrix this)
+    \brief Drops the oldest element from every wire form, before appending a record that does not
+    fit one of them, see wire_fits. Writer thread only, inside its write section.
+    \param this Matrix selected, with an element appended.
+*/
+void drop_first_element(matrix this);
+
+/*! \fn void truncate_matrix(matrix this, uint64_t index)
+    \brief Drops the records of every wire form from index on, so they can be appended again
+    in another order. Writer thread only, inside its write section.
+    \param this Matrix selected.
+    \param index First element dropped, one of the stored ones.
+*/
+void truncate_matrix(matrix this, uint64_t index);
+
+// Resize
+/*! \fn uint_fast8_t start_matrix_resize(matrix this, size_t capacity, void (*key_of)(item, uint64_t *, uint64_t *))
+    \brief Starts changing the capacity. New rings are filled with the newest elements that fit,
+    in order, by step_matrix_resize, while the matrix keeps working with the current ones.
+    Returns 0 if started, or if it has that capacity already, 1 if the last resize did not end, 2 for no capacity,
+    3 if the elements live in a storage file.
+    Writer thread only.
+    \param this Matrix selected.
+    \param capacity New max size.
+    \param key_of Gives the dedup key of an element.
+*/
+uint_fast8_t start_matrix_resize(matrix this, size_t capacity, void (*key_of)(item, uint64_t *, uint64_t *));
+
+/*! \fn bool step_matrix_resize(matrix this, size_t records)
+    \brief Copies up to records elements to the new rings. Once they hold every element they
+    replace the current ones inside a write section, and true is returned.
+    Also frees the rings replaced by the last resize once every reader passed a quiescent point
+    after it, see quiesce_matrix_reader. Writer thread only, once per loop iteration.
+    \param this Matrix selected.
+    \param records Most elements copied, RESIZE_STEP.
+*/
+bool step_matrix_resize(matrix this, size_t records);
+
+/*! \fn int get_resize_wait(matrix this)
+    \brief Longest wait in milliseconds before the next step_matrix_resize, -1 if none is needed.
+    \param this Matrix selected.
+*/
+int get_resize_wait(matrix this);
+
+// Readers
+/*! \fn int add_matrix_reader(matrix this)
+    \brief Registers a thread that reads the matrix, before it starts. The rings a resize replaces are
+    only freed once every reader passed a quiescent point, so none of them still copies from them.
+    Returns the reader number, -1 if MATRIX_READERS are registered. Writer thread only.
+    \param this Matrix selected.
+*/
+int add_matrix_reader(matrix this);
+
+/*! \fn void quiesce_matrix_reader(matrix this, int reader)
+    \brief Tells the writer the reader holds nothing read from the matrix. Once per loop iteration of
+    the reader, outside any read, and after a park_matrix_reader before the next read.
+    \param this Matrix selected.
+    \param reader Number given by add_matrix_reader.
+*/
+void quiesce_matrix_reader(matrix this, int reader);
+
+/*! \fn void park_matrix_reader(matrix this, int reader)
+    \brief Same as quiesce_matrix_reader for a reader about to block, or to stop: it is past every
+    resize until its next quiesce_matrix_reader, so the writer does not wait for it to wake up.
+    \param this Matrix selected.
+    \param reader Number given by add_matrix_reader.
+*/
+void park_matrix_reader(matrix this, int reader);
+
+// Seqlock
+/*! \fn void begin_matrix_write(matrix this)
+    \brief Starts a change of the matrix. Only one thread, the writer, may change it.
+    Readers in other threads see the change all at once, or retry.
+    \param this Matrix selected.
+*/
+void begin_matrix_write(matrix this);
+
+/*! \fn void end_matrix_write(matrix this)
+    \brief Ends the change started by begin_matrix_write. With a storage file, saves where the elements are.
+    \param this Matrix selected.
+*/
+void end_matrix_write(matrix this);
+
+/*! \fn uint_fast32_t begin_matrix_read(matrix this)
+    \brief Starts a lock free read from a thread that is not the writer.
+    Returns the sequence to give to retry_matrix_read.
+    \param this Matrix selected.
+*/
+uint_fast32_t begin_matrix_read(matrix this);
+
+/*! \fn bool retry_matrix_read(matrix this, uint_fast32_t seq)
+    \brief Returns true if the writer changed the matrix during the read, which must be repeated.
     \param this Matrix selected.
-    \param index Index selected.
-    \param to_add Item to add to matrix.
-    \param free_item Free item function.
+    \param seq Value returned by begin_matrix_read.
 */
-void add_element(matrix this, uint_fast32_t index, item to_add, void (*free_item)(item));
+bool retry_matrix_read(matrix this, uint_fast32_t seq);
 
 /*! \fn void print_matrix(matrix this, void (*print_item)(item));
     \brief Print full matrix.
@@ -61,9 +243,8 @@ void add_element(matrix this, uint_fast32_t index, item to_add, void (*free_item
 */
 void print_matrix(matrix this, void (*print_item)(item));
 
-/*! \fn void free_matrix(matrix this, void (*free_item)(item));
+/*! \fn void free_matrix(matrix this);
     \brief Frees matrix and all it's elements.
     \param this Matrix selected.
-    \param free_item Free item function.
 */
-void free_matrix(matrix this, void (*free_item)(item));
+void free_matrix(matrix this);
@@ -0,0 +1,174 @@
+#include <string.h>
+#include "util_queue.h"
+
+#define CACHE_LINE 64
+
+// Each cell has a sequence number telling who may use it next (D. Vyukov bounded queue)
+struct _cell {
+    atomic_size_t seq;
+    char          record[];
+};
+
+struct _mpsc_queue {
+    size_t        mask;
+    size_t        record_size;
+    size_t        cell_size;
+    char          *cells;
+    _Alignas(CACHE_LINE) atomic_size_t tail; //Producers
+    _Alignas(CACHE_LINE) size_t head;        //Consumer
+};
+
+static inline struct _cell *get_cell(mpsc_queue this, size_t pos) {
+    return (struct _cell *)(this->cells + (pos & this->mask) * this->cell_size);
+}
+
+mpsc_queue create_mpsc_queue(size_t capacity, size_t record_size) {
+    mpsc_queue new_queue = (mpsc_queue)aligned_alloc(CACHE_LINE, sizeof(struct _mpsc_queue));
+    if (!new_queue) {
+        memory_error("Unable to reserve queue memory");
+    }
+
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    new_queue->mask = size - 1;
+    new_queue->record_size = record_size;
+    new_queue->cell_size = (sizeof(struct _cell) + record_size + 7) & ~(size_t)7;
+    new_queue->cells = (char *)malloc(size * new_queue->cell_size);
+    if (!new_queue->cells) {
+        memory_error("Unable to reserve queue cells memory");
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&get_cell(new_queue, i)->seq, i);
+    }
+    atomic_init(&new_queue->tail, 0);
+    new_queue->head = 0;
+
+    return new_queue;
+}
+
+bool mpsc_push(mpsc_queue this, const void *record) {
+    size_t pos = atomic_load_explicit(&this->tail, memory_order_relaxed);
+
+    while (true) {
+        struct _cell *cell = get_cell(this, pos);
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (0 == diff) { //Free cell, claim it
+            if (atomic_compare_exchange_weak_explicit(&this->tail, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed)) {
+                memcpy(cell->record, record, this->record_size);
+                atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (0 > diff) { //Full
+            return false;
+        } else {
+            pos = atomic_load_explicit(&this->tail, memory_order_relaxed);
+        }
+    }
+}
+
+bool mpsc_pop(mpsc_queue this, void *record) {
+    struct _cell *cell = get_cell(this, this->head);
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+
+    if (seq != this->head + 1) { //Empty, or the producer did not finish the copy
+        return false;
+    }
+
+    memcpy(record, cell->record, this->record_size);
+    atomic_store_explicit(&cell->seq, this->head + this->mask + 1, memory_order_release);
+    this->head++;
+    return true;
+}
+
+void free_mpsc_queue(mpsc_queue this) {
+    if (!this) {
+        return;
+    }
+    free(this->cells);
+    free(this);
+}
+
+struct _spsc_queue {
+    size_t        mask;
+    size_t        record_size;
+    char          *records;
+    _Alignas(CACHE_LINE) atomic_size_t tail; //Producer
+    size_t        cached_head;
+    _Alignas(CACHE_LINE) atomic_size_t head; //Consumer
+    size_t        cached_tail;
+};
+
+spsc_queue create_spsc_queue(size_t capacity, size_t record_size) {
+    spsc_queue new_queue = (spsc_queue)aligned_alloc(CACHE_LINE, sizeof(struct _spsc_queue));
+    if (!new_queue) {
+        memory_error("Unable to reserve queue memory");
+    }
+
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    new_queue->mask = size - 1;
+    new_queue->record_size = record_size;
+    new_queue->records = (char *)malloc(size * record_size);
+    if (!new_queue->records) {
+        memory_error("Unable to reserve queue records memory");
+    }
+
+    atomic_init(&new_queue->tail, 0);
+    atomic_init(&new_queue->head, 0);
+    new_queue->cached_head = 0;
+    new_queue->cached_tail = 0;
+
+    return new_queue;
+}
+
+size_t spsc_free_slots(spsc_queue this) {
+    size_t tail = atomic_load_explicit(&this->tail, memory_order_relaxed);
+    this->cached_head = atomic_load_explicit(&this->head, memory_order_acquire);
+    return this->mask + 1 - (tail - this->cached_head);
+}
+
+bool spsc_push(spsc_queue this, const void *record) {
+    size_t tail = atomic_load_explicit(&this->tail, memory_order_relaxed);
+
+    if (tail - this->cached_head > this->mask) { //Looks full, see how far the consumer went
+        this->cached_head = atomic_load_explicit(&this->head, memory_order_acquire);
+        if (tail - this->cached_head > this->mask) {
+            return false;
+        }
+    }
+    memcpy(this->records + (tail & this->mask) * this->record_size, record, this->record_size);
+    atomic_store_explicit(&this->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+bool spsc_pop(spsc_queue this, void *record) {
+    size_t head = atomic_load_explicit(&this->head, memory_order_relaxed);
+
+    if (head == this->cached_tail) { //Looks empty, see how far the producer went
+        this->cached_tail = atomic_load_explicit(&this->tail, memory_order_acquire);
+        if (head == this->cached_tail) {
+            return false;
+        }
+    }
+    memcpy(record, this->records + (head & this->mask) * this->record_size, this->record_size);
+    atomic_store_explicit(&this->head, head + 1, memory_order_release);
+    return true;
+}
+
+void free_spsc_queue(spsc_queue this) {
+    if (!this) {
+        return;
+    }
+    free(this->records);
+    free(this);
+}
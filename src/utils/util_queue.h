@@ -0,0 +1,82 @@
+#pragma once
+/*! \file util_queue.h
+ * \brief Bounded lock-free queues of fixed size records.
+ */
+#include <stdatomic.h>
+#include "utils.h"
+
+/*! \var typedef struct _mpsc_queue *mpsc_queue
+    \brief Bounded multi producer, single consumer queue.
+    Producers never take a lock, a full queue makes the push fail.
+*/
+typedef struct _mpsc_queue *mpsc_queue;
+
+/*! \fn mpsc_queue create_mpsc_queue(size_t capacity, size_t record_size)
+    \brief Initializes the queue. capacity is rounded up to a power of two.
+    \param capacity Number of records.
+    \param record_size Size in bytes of each record.
+*/
+mpsc_queue create_mpsc_queue(size_t capacity, size_t record_size);
+
+/*! \fn bool mpsc_push(mpsc_queue this, const void *record)
+    \brief Copies record into the queue. Safe from any thread.
+    Returns false if the queue is full.
+    \param this Queue selected.
+    \param record Pointer to record_size bytes.
+*/
+bool mpsc_push(mpsc_queue this, const void *record);
+
+/*! \fn bool mpsc_pop(mpsc_queue this, void *record)
+    \brief Copies the oldest record out of the queue. Only the consumer thread may call it.
+    Returns false if the queue is empty.
+    \param this Queue selected.
+    \param record Destination with record_size bytes.
+*/
+bool mpsc_pop(mpsc_queue this, void *record);
+
+/*! \fn void free_mpsc_queue(mpsc_queue this)
+    \brief Frees the queue.
+    \param this Queue selected.
+*/
+void free_mpsc_queue(mpsc_queue this);
+
+/*! \var typedef struct _spsc_queue *spsc_queue
+    \brief Bounded single producer, single consumer ring.
+    Each side only touches the other side index when its cached copy runs out.
+*/
+typedef struct _spsc_queue *spsc_queue;
+
+/*! \fn spsc_queue create_spsc_queue(size_t capacity, size_t record_size)
+    \brief Initializes the ring. capacity is rounded up to a power of two.
+    \param capacity Number of records.
+    \param record_size Size in bytes of each record.
+*/
+spsc_queue create_spsc_queue(size_t capacity, size_t record_size);
+
+/*! \fn size_t spsc_free_slots(spsc_queue this)
+    \brief Returns how many records can be pushed without failing. Producer thread only.
+    \param this Ring selected.
+*/
+size_t spsc_free_slots(spsc_queue this);
+
+/*! \fn bool spsc_push(spsc_queue this, const void *record)
+    \brief Copies record into the ring. Producer thread only.
+    Returns false if the ring is full.
+    \param this Ring selected.
+    \param record Pointer to record_size bytes.
+*/
+bool spsc_push(spsc_queue this, const void *record);
+
+/*! \fn bool spsc_pop(spsc_queue this, void *record)
+    \brief Copies the oldest record out of the ring. Consumer thread only.
+    Returns false if the ring is empty.
+    \param this Ring selected.
+    \param record Destination with record_size bytes.
+*/
+bool spsc_pop(spsc_queue this, void *record);
+
+/*! \fn void free_spsc_queue(spsc_queue this)
+    \brief Frees the ring.
+    \param this Ring selected.
+*/
+void free_spsc_queue(spsc_queue this);
@@ -0,0 +1,268 @@
+#include <string.h>
+#include "util_registry.h"
+
+struct registry_entry {
+    struct peer_key key;
+    item            obj;
+    int             fd;
+    bool            retired;
+};
+
+struct _registry {
+    struct registry_entry *entries; //Dense, in the order the peers were added until a reap
+    size_t                count;
+    size_t                size;
+    size_t                *slots;   //Entry plus one, 0 is an empty slot
+    size_t                mask;
+    size_t                indexed;  //Entries in the slots, the retired ones are not
+    size_t                *by_fd;   //Entry plus one, indexed by fd
+    size_t                fd_size;
+    size_t                *retired; //Entries to remove on the next reap
+    size_t                retired_count;
+    size_t                retired_size;
+};
+
+static inline bool same_key(struct peer_key a, struct peer_key b) {
+    return a.ip == b.ip && a.udp_port == b.udp_port && a.tcp_port == b.tcp_port;
+}
+
+// slot_of mixes every bit of the key, addresses of one network differ only in their high bytes
+static inline size_t slot_of(registry this, struct peer_key key) {
+    uint64_t packed = (uint64_t)key.ip << 32 | (uint64_t)key.udp_port << 16 | key.tcp_port;
+    packed = (packed ^ packed >> 33) * 0xFF51AFD7ED558CCDull;
+    packed = (packed ^ packed >> 33) * 0xC4CEB9FE1A85EC53ull;
+    return (size_t)(packed ^ packed >> 33) & this->mask;
+}
+
+// find_entry returns the slot holding the peer, or an empty slot if it is not indexed
+static size_t find_entry(registry this, struct peer_key key, item obj) {
+    size_t slot = slot_of(this, key);
+    while (this->slots[slot] && this->entries[this->slots[slot] - 1].obj != obj) {
+        slot = (slot + 1) & this->mask;
+    }
+    return slot;
+}
+
+static void insert_slot(registry this, size_t entry) {
+    size_t slot = slot_of(this, this->entries[entry].key);
+    while (this->slots[slot]) {
+        slot = (slot + 1) & this->mask;
+    }
+    this->slots[slot] = entry + 1;
+    this->indexed++;
+}
+
+// remove_slot empties the slot, moving back the entries after it that would not be found past it
+static void remove_slot(registry this, size_t hole) {
+    for (size_t slot = (hole + 1) & this->mask; this->slots[slot]; slot = (slot + 1) & this->mask) {
+        size_t home = slot_of(this, this->entries[this->slots[slot] - 1].key);
+        if (((slot - home) & this->mask) >= ((slot - hole) & this->mask)) {
+            this->slots[hole] = this->slots[slot];
+            hole = slot;
+        }
+    }
+    this->slots[hole] = 0;
+    this->indexed--;
+}
+
+// grow_slots doubles the index when it would be more than half full, probes stay short
+static void grow_slots(registry this) {
+    size_t slots = 2 * (this->mask + 1);
+
+    free(this->slots);
+    this->slots = (size_t *)calloc(slots, sizeof(size_t));
+    if (!this->slots) {
+        memory_error("Unable to reserve registry memory");
+    }
+    this->mask = slots - 1;
+    this->indexed = 0;
+    for (size_t entry = 0; entry < this->count; entry++) {
+        if (!this->entries[entry].retired) {
+            insert_slot(this, entry);
+        }
+    }
+}
+
+static void index_fd(registry this, size_t entry, int fd) {
+    if (0 >= fd) {
+        return;
+    }
+    if ((size_t)fd >= this->fd_size) {
+        size_t fd_size = this->fd_size ? this->fd_size : 64;
+        while (fd_size <= (size_t)fd) {
+            fd_size *= 2;
+        }
+        size_t *by_fd = (size_t *)realloc(this->by_fd, fd_size * sizeof(size_t));
+        if (!by_fd) {
+            memory_error("Unable to reserve registry memory");
+        }
+        memset(by_fd + this->fd_size, 0, (fd_size - this->fd_size) * sizeof(size_t));
+        this->by_fd = by_fd;
+        this->fd_size = fd_size;
+    }
+    this->by_fd[fd] = entry + 1;
+}
+
+static void unindex_fd(registry this, size_t entry) {
+    int fd = this->entries[entry].fd;
+    if (0 < fd && (size_t)fd < this->fd_size && entry + 1 == this->by_fd[fd]) {
+        this->by_fd[fd] = 0;
+    }
+}
+
+registry create_registry() {
+    registry new_registry = (registry)calloc(1, sizeof(struct _registry));
+    if (!new_registry) {
+        memory_error("Unable to reserve registry memory");
+    }
+    new_registry->slots = (size_t *)calloc(16, sizeof(size_t));
+    if (!new_registry->slots) {
+        memory_error("Unable to reserve registry memory");
+    }
+    new_registry->mask = 15;
+    return new_registry;
+}
+
+void add_to_registry(registry this, struct peer_key key, item obj, int fd) {
+    if (this->count == this->size) {
+        size_t size = this->size ? 2 * this->size : 16;
+        struct registry_entry *entries = (struct registry_entry *)realloc(this->entries,
+                size * sizeof(struct registry_entry));
+        if (!entries) {
+            memory_error("Unable to reserve registry memory");
+        }
+        this->entries = entries;
+        this->size = size;
+    }
+    if (2 * (this->indexed + 1) > this->mask + 1) {
+        grow_slots(this);
+    }
+
+    size_t entry = this->count++;
+    this->entries[entry] = (struct registry_entry){.key = key, .obj = obj, .fd = fd, .retired = false};
+    insert_slot(this, entry);
+    index_fd(this, entry, fd);
+}
+
+void set_registry_fd(registry this, struct peer_key key, item obj, int fd) {
+    size_t slot = find_entry(this, key, obj);
+    if (!this->slots[slot]) {
+        return; //Retired
+    }
+    size_t entry = this->slots[slot] - 1;
+    unindex_fd(this, entry);
+    this->entries[entry].fd = fd;
+    index_fd(this, entry, fd);
+}
+
+void rekey_registry(registry this, struct peer_key key, item obj, struct peer_key new_key) {
+    size_t slot = find_entry(this, key, obj);
+    if (!this->slots[slot]) {
+        return; //Retired
+    }
+    size_t entry = this->slots[slot] - 1;
+    remove_slot(this, slot); //Found by the old key, before it changes
+    this->entries[entry].key = new_key;
+    insert_slot(this, entry);
+}
+
+item find_in_registry(registry this, struct peer_key key) {
+    for (size_t slot = slot_of(this, key); this->slots[slot]; slot = (slot + 1) & this->mask) {
+        struct registry_entry *entry = &this->entries[this->slots[slot] - 1];
+        if (same_key(entry->key, key)) {
+            return entry->obj;
+        }
+    }
+    return NULL;
+}
+
+item find_fd_in_registry(registry this, int fd) {
+    if (0 >= fd || (size_t)fd >= this->fd_size || !this->by_fd[fd]) {
+        return NULL;
+    }
+    return this->entries[this->by_fd[fd] - 1].obj;
+}
+
+void retire_from_registry(registry this, struct peer_key key, item obj) {
+    size_t slot = find_entry(this, key, obj);
+    if (!this->slots[slot]) {
+        return; //Retired already
+    }
+    size_t entry = this->slots[slot] - 1;
+    remove_slot(this, slot);
+    unindex_fd(this, entry);
+    this->entries[entry].retired = true;
+
+    if (this->retired_count == this->retired_size) {
+        size_t size = this->retired_size ? 2 * this->retired_size : 16;
+        size_t *retired = (size_t *)realloc(this->retired, size * sizeof(size_t));
+        if (!retired) {
+            memory_error("Unable to reserve registry memory");
+        }
+        this->retired = retired;
+        this->retired_size = size;
+    }
+    this->retired[this->retired_count++] = entry;
+}
+
+static int compare_descending(const void *a, const void *b) {
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return (x < y) - (x > y);
+}
+
+size_t reap_registry(registry this, void (*free_item)(item)) {
+    size_t reaped = this->retired_count;
+
+    //From the last entry back, so the one moved into each hole is never retired
+    qsort(this->retired, this->retired_count, sizeof(size_t), compare_descending);
+    for (size_t n = 0; n < this->retired_count; n++) {
+        size_t entry = this->retired[n], last = --this->count;
+        if (free_item) {
+            free_item(this->entries[entry].obj);
+        }
+        if (entry == last) {
+            continue;
+        }
+
+        this->slots[find_entry(this, this->entries[last].key, this->entries[last].obj)] = entry + 1;
+        unindex_fd(this, last);
+        this->entries[entry] = this->entries[last];
+        index_fd(this, entry, this->entries[entry].fd);
+    }
+    this->retired_count = 0;
+    return reaped;
+}
+
+size_t get_registry_size(registry this) {
+    return this->count;
+}
+
+item get_registry_item(registry this, size_t index) {
+    return this->entries[index].obj;
+}
+
+void print_registry(registry this, void (*print)(item)) {
+    fprintf(stdout, "Size of list: %zu\n", this->count - this->retired_count);
+    for (size_t entry = 0; entry < this->count; entry++) {
+        if (this->entries[entry].retired) {
+            continue;
+        }
+        printf("❯❯ ");
+        print(this->entries[entry].obj);
+        printf("\n");
+    }
+}
+
+void free_registry(registry this, void (*free_item)(item)) {
+    if (!this) {
+        return;
+    }
+    for (size_t entry = 0; entry < this->count && free_item; entry++) {
+        free_item(this->entries[entry].obj);
+    }
+    free(this->entries);
+    free(this->slots);
+    free(this->by_fd);
+    free(this->retired);
+    free(this);
+}
@@ -0,0 +1,116 @@
+#pragma once
+/*! \file util_registry.h
+ * \brief Set of peers indexed by binary address and by socket, for the server lists.
+ *
+ * Entries are kept in a dense array, iterated by index, with an open addressing index by
+ * peer_key and an array indexed by fd. Lookups, additions and removals take constant time.
+ * A peer dropped while the entries are being iterated is retired: lookups stop finding
+ * it at once, and reap_registry frees it after the iteration, touching only the retired
+ * entries. Several entries may share a key, lookups return any of them.
+ */
+#include <netinet/in.h>
+#include "utils.h"
+
+/*! \struct peer_key
+    \brief Binary address of a peer.
+*/
+struct peer_key {
+    in_addr_t ip;       //!< Network byte order
+    u_short   udp_port;
+    u_short   tcp_port;
+};
+
+/*! \var typedef struct _registry *registry
+    \brief Peers of one thread.
+*/
+typedef struct _registry *registry;
+
+/*! \fn registry create_registry()
+    \brief Initializes an empty registry, it grows as peers are added.
+*/
+registry create_registry();
+
+/*! \fn void add_to_registry(registry this, struct peer_key key, item obj, int fd)
+    \brief Adds the peer at the end of the entries.
+    \param this Registry selected.
+    \param key Address the peer is found by.
+    \param obj Peer.
+    \param fd Socket of the peer, or a negative value if it has none yet.
+*/
+void add_to_registry(registry this, struct peer_key key, item obj, int fd);
+
+/*! \fn void set_registry_fd(registry this, struct peer_key key, item obj, int fd)
+    \brief Indexes the peer by its new socket, after a connect.
+    \param this Registry selected.
+    \param key Address of the peer.
+    \param obj Peer.
+    \param fd Socket of the peer.
+*/
+void set_registry_fd(registry this, struct peer_key key, item obj, int fd);
+
+/*! \fn void rekey_registry(registry this, struct peer_key key, item obj, struct peer_key new_key)
+    \brief Indexes the peer by another address, once an inbound peer gave its listening ports.
+    Does nothing if the peer was retired.
+    \param this Registry selected.
+    \param key Address the peer was added with.
+    \param obj Peer.
+    \param new_key Address it is found by from now on.
+*/
+void rekey_registry(registry this, struct peer_key key, item obj, struct peer_key new_key);
+
+/*! \fn item find_in_registry(registry this, struct peer_key key)
+    \brief Returns a peer with the key, or NULL.
+    \param this Registry selected.
+    \param key Address searched.
+*/
+item find_in_registry(registry this, struct peer_key key);
+
+/*! \fn item find_fd_in_registry(registry this, int fd)
+    \brief Returns the peer with the socket, or NULL.
+    \param this Registry selected.
+    \param fd Socket searched.
+*/
+item find_fd_in_registry(registry this, int fd);
+
+/*! \fn void retire_from_registry(registry this, struct peer_key key, item obj)
+    \brief Stops finding the peer, it is freed by the next reap_registry. Does nothing if
+    the peer was retired already.
+    \param this Registry selected.
+    \param key Address of the peer.
+    \param obj Peer.
+*/
+void retire_from_registry(registry this, struct peer_key key, item obj);
+
+/*! \fn size_t reap_registry(registry this, void (*free_item)(item))
+    \brief Removes and frees the retired peers, when no iteration is running. Returns how many.
+    \param this Registry selected.
+    \param free_item Frees one peer.
+*/
+size_t reap_registry(registry this, void (*free_item)(item));
+
+/*! \fn size_t get_registry_size(registry this)
+    \brief Returns the number of entries, the retired ones not reaped yet included.
+    \param this Registry selected.
+*/
+size_t get_registry_size(registry this);
+
+/*! \fn item get_registry_item(registry this, size_t index)
+    \brief Returns the peer of an entry, index below get_registry_size.
+    \param this Registry selected.
+    \param index Entry.
+*/
+item get_registry_item(registry this, size_t index);
+
+/*! \fn void print_registry(registry this, void (*print)(item))
+    \brief Prints every peer, one per line.
+    \param this Registry selected.
+    \param print Prints one peer.
+*/
+void print_registry(registry this, void (*print)(item));
+
+/*! \fn void free_registry(registry this, void (*free_item)(item))
+    \brief Frees the registry and every peer in it.
+    \param this Registry selected.
+    \param free_item Frees one peer.
+*/
+void free_registry(registry this, void (*free_item)(item));
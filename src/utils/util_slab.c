@@ -0,0 +1,50 @@
+#include <sys/mman.h>
+#include "util_slab.h"
+
+// mapped_size returns the bytes mapped for a block, whole huge pages so both kinds unmap alike
+static inline size_t mapped_size(size_t bytes) {
+    return (bytes + SLAB_HUGE_PAGE - 1) & ~(SLAB_HUGE_PAGE - 1);
+}
+
+static bool slab_huge = true;
+
+void set_slab_huge(bool huge) {
+    slab_huge = huge;
+}
+
+void *create_slab(size_t bytes) {
+    void *slab;
+
+    if (bytes < SLAB_MAP_MIN) {
+        slab = calloc(1, bytes);
+        if (!slab) {
+            memory_error("Unable to reserve slab memory");
+        }
+        return slab;
+    }
+
+    //Huge pages are taken from the pool when mapped, never a SIGBUS when touched later
+    bytes = mapped_size(bytes);
+    slab = !slab_huge ? MAP_FAILED : mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (MAP_FAILED != slab) {
+        return slab;
+    }
+    //Not enough reserved huge pages, transparent ones are used where the kernel can
+    slab = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == slab) {
+        memory_error("Unable to reserve slab memory");
+    }
+    madvise(slab, bytes, slab_huge ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+    return slab;
+}
+
+void free_slab(void *slab, size_t bytes) {
+    if (!slab) {
+        return;
+    }
+    if (bytes < SLAB_MAP_MIN) {
+        free(slab);
+        return;
+    }
+    munmap(slab, mapped_size(bytes));
+}
@@ -0,0 +1,34 @@
+#pragma once
+/*! \file util_slab.h
+ * \brief Zeroed blocks for the message storage, on huge pages once they are big.
+ *
+ * A board of millions of messages spreads its rings over gigabytes, so with 4 KiB pages
+ * every access to an old message is a TLB miss. Blocks of at least SLAB_MAP_MIN bytes are
+ * mapped on their own: from the reserved huge pages (MAP_HUGETLB) if there are enough,
+ * else as normal pages the kernel is asked to back with transparent huge pages. Those are
+ * mapped without reserving swap, so the pages are only taken as the rings fill.
+ * Smaller blocks come from calloc.
+ */
+#include "utils.h"
+
+#define SLAB_HUGE_PAGE (2ul << 20)
+#define SLAB_MAP_MIN (2 * SLAB_HUGE_PAGE)
+
+/*! \fn void set_slab_huge(bool huge)
+    \brief Huge pages for the next slabs or not, they are by default. For the benchmarks.
+    \param huge Use them.
+*/
+void set_slab_huge(bool huge);
+
+/*! \fn void *create_slab(size_t bytes)
+    \brief Returns bytes zeroed bytes, aligned to the page.
+    \param bytes Size of the block.
+*/
+void *create_slab(size_t bytes);
+
+/*! \fn void free_slab(void *slab, size_t bytes)
+    \brief Frees the block.
+    \param slab Block selected, may be NULL.
+    \param bytes Size given to create_slab.
+*/
+void free_slab(void *slab, size_t bytes);
@@ -0,0 +1,340 @@
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "util_wal.h"
+#include "util_dedup.h"
+
+#define WAL_MAGIC "MSGWAL01" //First bytes of every segment
+#define WAL_MAGIC_LEN 8
+#define WAL_NAME_LEN 20      //Sequence number in 16 hex digits and ".wal"
+
+//Before the content of every record
+struct wal_record {
+    uint32_t len;   //Content bytes, without the NUL
+    uint32_t check; //wal_check, tells a whole record from one torn by a crash
+    uint64_t lc;
+};
+
+struct wal_segment {
+    uint64_t seq;
+    uint64_t records; //Synced, or found by replay_wal
+};
+
+struct _wal {
+    int      dir_fd;
+    int      fd;            //Current segment, the last one
+    size_t   segment_bytes;
+    size_t   written;       //Bytes of the current segment
+    size_t   keep;
+    uint64_t window_ns;
+    struct wal_segment *segments; //Oldest first
+    size_t   count;
+    size_t   size;
+    char     *buffer;       //Records not written yet
+    size_t   buffered;
+    size_t   buffer_size;
+    uint64_t unsynced;      //Records appended since the last sync
+    uint64_t oldest_at;     //When the first of them was appended
+    //Stats
+    uint64_t records;
+    uint64_t syncs;
+    uint64_t lost;
+};
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// wal_check mixes the header fields, the content is checked by its hash
+static inline uint32_t wal_check(uint64_t lc, uint64_t hash, uint32_t len) {
+    uint64_t mixed = (lc ^ hash ^ (uint64_t)len << 40) * 0xC4CEB9FE1A85EC53ull;
+    return (uint32_t)(mixed >> 32 ^ mixed);
+}
+
+static void segment_name(char name[WAL_NAME_LEN + 1], uint64_t seq) {
+    snprintf(name, WAL_NAME_LEN + 1, "%016" PRIx64 ".wal", seq);
+}
+
+static void push_segment(wal this, uint64_t seq) {
+    if (this->count == this->size) {
+        size_t size = this->size ? 2 * this->size : 16;
+        struct wal_segment *segments = (struct wal_segment *)realloc(this->segments, size * sizeof(struct wal_segment));
+        if (!segments) {
+            memory_error("Unable to reserve log memory");
+        }
+        this->segments = segments;
+        this->size = size;
+    }
+    this->segments[this->count++] = (struct wal_segment){.seq = seq, .records = 0};
+}
+
+// open_segment starts the segment after the last one, its name is synced with the directory
+static bool open_segment(wal this) {
+    uint64_t seq = this->count ? this->segments[this->count - 1].seq + 1 : 0;
+    char name[WAL_NAME_LEN + 1];
+
+    segment_name(name, seq);
+    this->fd = openat(this->dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+    if (0 > this->fd) {
+        return false;
+    }
+    if (WAL_MAGIC_LEN != write(this->fd, WAL_MAGIC, WAL_MAGIC_LEN) || 0 > fdatasync(this->fd) || 0 > fsync(this->dir_fd)) {
+        close_fd(this->fd);
+        this->fd = -1;
+        unlinkat(this->dir_fd, name, 0);
+        return false;
+    }
+    this->written = WAL_MAGIC_LEN;
+    push_segment(this, seq);
+    return true;
+}
+
+// trim_segments deletes the oldest segments while the newer ones hold the messages kept
+static void trim_segments(wal this) {
+    uint64_t newer = 0;
+    size_t dropped = 0;
+    char name[WAL_NAME_LEN + 1];
+
+    for (size_t s = 0; s < this->count; s++) {
+        newer += this->segments[s].records;
+    }
+    while (dropped + 1 < this->count && newer - this->segments[dropped].records >= this->keep) {
+        newer -= this->segments[dropped].records;
+        segment_name(name, this->segments[dropped].seq);
+        unlinkat(this->dir_fd, name, 0);
+        dropped++;
+    }
+    memmove(this->segments, this->segments + dropped, (this->count - dropped) * sizeof(struct wal_segment));
+    this->count -= dropped;
+}
+
+static int compare_segments(const void *a, const void *b) {
+    uint64_t x = ((const struct wal_segment *)a)->seq, y = ((const struct wal_segment *)b)->seq;
+    return (x > y) - (x < y);
+}
+
+// is_segment tells if the file starts as a log segment
+static bool is_segment(wal this, const char *name) {
+    char magic[WAL_MAGIC_LEN];
+    int fd = openat(this->dir_fd, name, O_RDONLY);
+    bool segment = 0 <= fd && WAL_MAGIC_LEN == pread(fd, magic, WAL_MAGIC_LEN, 0)
+            && 0 == memcmp(magic, WAL_MAGIC, WAL_MAGIC_LEN);
+
+    close_fd(fd);
+    return segment;
+}
+
+wal create_wal(const char *dir, size_t segment_bytes, size_t keep, uint64_t window_us) {
+    if (0 > mkdir(dir, 0755) && EEXIST != errno) {
+        return NULL;
+    }
+    DIR *listing = opendir(dir);
+    if (!listing) {
+        return NULL;
+    }
+
+    wal new_wal = (wal)calloc(1, sizeof(struct _wal));
+    if (!new_wal) {
+        memory_error("Unable to reserve log memory");
+    }
+    new_wal->dir_fd = dirfd(listing);
+    new_wal->fd = -1;
+    new_wal->segment_bytes = segment_bytes;
+    new_wal->keep = keep;
+    new_wal->window_ns = window_us * 1000;
+
+    bool foreign = false;
+    for (struct dirent *entry = readdir(listing); entry && !foreign; entry = readdir(listing)) {
+        uint64_t seq;
+        int end = 0;
+        if (WAL_NAME_LEN != strlen(entry->d_name) || 1 != sscanf(entry->d_name, "%16" SCNx64 ".wal%n", &seq, &end)
+                || WAL_NAME_LEN != end) {
+            continue; //Not a segment name, not ours
+        }
+        foreign = !is_segment(new_wal, entry->d_name);
+        push_segment(new_wal, seq);
+    }
+    if (new_wal->count) {
+        qsort(new_wal->segments, new_wal->count, sizeof(struct wal_segment), compare_segments);
+    }
+
+    new_wal->dir_fd = dup(dirfd(listing));
+    closedir(listing);
+    if (foreign || 0 > new_wal->dir_fd || !open_segment(new_wal)) { //A foreign file is left untouched
+        free_wal(new_wal);
+        return NULL;
+    }
+    return new_wal;
+}
+
+// replay_segment calls apply for every whole record of the segment, returns how many
+static uint64_t replay_segment(wal this, uint64_t seq, void (*apply)(uint64_t, char *, void *), void *arg) {
+    char name[WAL_NAME_LEN + 1], content[STRING_SIZE];
+    struct stat file_stat;
+    uint64_t replayed = 0;
+
+    segment_name(name, seq);
+    int fd = openat(this->dir_fd, name, O_RDONLY);
+    if (0 > fd || 0 > fstat(fd, &file_stat) || WAL_MAGIC_LEN >= (size_t)file_stat.st_size) {
+        close_fd(fd);
+        return 0;
+    }
+    size_t size = file_stat.st_size;
+    const char *bytes = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close_fd(fd);
+    if (MAP_FAILED == bytes) {
+        return 0;
+    }
+
+    for (size_t offset = WAL_MAGIC_LEN; offset + sizeof(struct wal_record) <= size; ) {
+        struct wal_record header;
+        memcpy(&header, bytes + offset, sizeof(header));
+        if (STRING_SIZE <= header.len || size - offset - sizeof(header) < header.len) {
+            break; //Torn by a crash
+        }
+        memcpy(content, bytes + offset + sizeof(header), header.len);
+        content[header.len] = '\0';
+        if (strlen(content) != header.len || wal_check(header.lc, hash_content(content), header.len) != header.check) {
+            break;
+        }
+        apply(header.lc, content, arg);
+        replayed++;
+        offset += sizeof(header) + header.len;
+    }
+    munmap((void *)bytes, size);
+    return replayed;
+}
+
+uint64_t replay_wal(wal this, void (*apply)(uint64_t lc, char *content, void *arg), void *arg) {
+    uint64_t replayed = 0;
+    char name[WAL_NAME_LEN + 1];
+
+    for (size_t s = 0; s + 1 < this->count; ) { //The last one is the new segment
+        this->segments[s].records = replay_segment(this, this->segments[s].seq, apply, arg);
+        replayed += this->segments[s].records;
+        if (0 < this->segments[s].records) {
+            s++;
+            continue;
+        }
+        segment_name(name, this->segments[s].seq); //Left empty by a restart, or unreadable
+        unlinkat(this->dir_fd, name, 0);
+        memmove(&this->segments[s], &this->segments[s + 1], (this->count - s - 1) * sizeof(struct wal_segment));
+        this->count--;
+    }
+    trim_segments(this);
+    return replayed;
+}
+
+// write_buffer writes the buffered records to the segment, those written are taken out of the buffer
+static bool write_buffer(wal this) {
+    size_t done = 0;
+    bool written = true;
+
+    while (done < this->buffered) {
+        ssize_t n = write(this->fd, this->buffer + done, this->buffered - done);
+        if (0 > n && EINTR == errno) {
+            continue;
+        } else if (0 >= n) {
+            written = false;
+            break;
+        }
+        done += n;
+    }
+    memmove(this->buffer, this->buffer + done, this->buffered - done); //A retry goes on after them
+    this->buffered -= done;
+    this->written += done;
+    return written;
+}
+
+void append_wal(wal this, uint64_t lc, const char *content) {
+    struct wal_record header = {.len = (uint32_t)strlen(content), .lc = lc};
+    size_t need = sizeof(header) + header.len;
+
+    header.check = wal_check(lc, hash_content(content), header.len);
+    if (this->buffered + need > this->buffer_size) {
+        size_t size = this->buffer_size ? this->buffer_size : 4096;
+        while (size < this->buffered + need) {
+            size *= 2;
+        }
+        char *buffer = (char *)realloc(this->buffer, size);
+        if (!buffer) {
+            memory_error("Unable to reserve log memory");
+        }
+        this->buffer = buffer;
+        this->buffer_size = size;
+    }
+    memcpy(this->buffer + this->buffered, &header, sizeof(header));
+    memcpy(this->buffer + this->buffered + sizeof(header), content, header.len);
+    this->buffered += need;
+
+    if (0 == this->unsynced++) {
+        this->oldest_at = now_ns();
+    }
+    if (WAL_BUFFER_MAX <= this->buffered) {
+        write_buffer(this); //A failure is seen by the commit
+    }
+}
+
+uint_fast8_t commit_wal(wal this) {
+    if (0 == this->unsynced || (this->window_ns && now_ns() - this->oldest_at < this->window_ns)) {
+        return 0;
+    }
+
+    bool synced = write_buffer(this) && 0 == fdatasync(this->fd);
+    this->syncs++;
+    if (synced) {
+        this->segments[this->count - 1].records += this->unsynced;
+        this->records += this->unsynced;
+    } else { //The segment may end in a torn record, the next ones go to a new one
+        this->lost += this->unsynced;
+        this->buffered = 0;
+    }
+    this->unsynced = 0;
+
+    if (!synced || this->written >= this->segment_bytes) {
+        close_fd(this->fd);
+        this->fd = -1;
+        open_segment(this); //If it fails the next commit tries again
+        trim_segments(this);
+    }
+    return synced ? 0 : 1;
+}
+
+int get_wal_wait(wal this) {
+    if (0 == this->unsynced) {
+        return -1;
+    }
+    uint64_t waited = now_ns() - this->oldest_at;
+    return waited >= this->window_ns ? 0 : (int)((this->window_ns - waited + 999999) / 1000000);
+}
+
+void set_wal_keep(wal this, size_t keep) {
+    this->keep = keep;
+}
+
+void print_wal_stats(wal this) {
+    printf(KBLU "Log:" KNRM " %lu records in %lu syncs (%.1f per sync), %lu lost, %zu segments\n",
+            (unsigned long)this->records, (unsigned long)this->syncs,
+            this->syncs ? (double)this->records / this->syncs : 0.0, (unsigned long)this->lost, this->count);
+}
+
+void free_wal(wal this) {
+    if (!this) {
+        return;
+    }
+    if (0 < this->unsynced && (!write_buffer(this) || 0 > fdatasync(this->fd))) {
+        if (_VERBOSE_TEST) printf("\nerror syncing the log\n");
+    }
+    close_fd(this->fd);
+    close_fd(this->dir_fd);
+    free(this->segments);
+    free(this->buffer);
+    free(this);
+}
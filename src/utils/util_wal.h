@@ -0,0 +1,79 @@
+#pragma once
+/*! \file util_wal.h
+ * \brief Write-ahead log of the published messages, synced once per group of them.
+ *
+ * append_wal only copies the record to a buffer. commit_wal writes the buffer to the
+ * current segment and syncs it, so every publish of a loop iteration, or of a time window,
+ * shares one fdatasync. The log is a directory of segments named by their sequence number.
+ * A segment that reaches its size is closed and a new one started, and the oldest ones are
+ * deleted while the newer ones hold the messages kept. At startup replay_wal reads them back
+ * in order; a record torn by a crash ends its segment, and the log goes on in a new one.
+ */
+#include "utils.h"
+
+#define WAL_SEGMENT_SIZE (64ul << 20) //Default size a segment is closed at
+#define WAL_BUFFER_MAX (1 << 20)      //Records buffered before a write, the sync still waits for the commit
+
+/*! \var typedef struct _wal *wal
+    \brief Log directory, its segments and the records not synced yet.
+*/
+typedef struct _wal *wal;
+
+/*! \fn wal create_wal(const char *dir, size_t segment_bytes, size_t keep, uint64_t window_us)
+    \brief Opens the log in dir, made if missing, and starts a new segment after the last one.
+    Returns NULL if dir cannot be used, or holds a segment file that is not a log segment (it is left untouched).
+    \param dir Log directory.
+    \param segment_bytes Size a segment is closed at.
+    \param keep Messages the segments must still hold before the oldest is deleted, the matrix capacity.
+    \param window_us Longest a record waits for its sync, 0 to sync on every commit_wal.
+*/
+wal create_wal(const char *dir, size_t segment_bytes, size_t keep, uint64_t window_us);
+
+/*! \fn uint64_t replay_wal(wal this, void (*apply)(uint64_t lc, char *content, void *arg), void *arg)
+    \brief Calls apply with every record of the older segments, oldest first. Once, before any append.
+    Segments left without a record are deleted. Returns the number of records.
+    \param this Log selected.
+    \param apply Called with the clock and NUL terminated content of each record.
+    \param arg Given to apply.
+*/
+uint64_t replay_wal(wal this, void (*apply)(uint64_t lc, char *content, void *arg), void *arg);
+
+/*! \fn void append_wal(wal this, uint64_t lc, const char *content)
+    \brief Adds a record, durable after the next commit_wal that syncs.
+    \param this Log selected.
+    \param lc Clock of the message.
+    \param content Message, shorter than STRING_SIZE.
+*/
+void append_wal(wal this, uint64_t lc, const char *content);
+
+/*! \fn uint_fast8_t commit_wal(wal this)
+    \brief Writes and syncs the records appended, unless the oldest of them is younger than the window.
+    Rotates the segment once it is full. Returns 0 on success, 1 if the records were lost.
+    \param this Log selected.
+*/
+uint_fast8_t commit_wal(wal this);
+
+/*! \fn int get_wal_wait(wal this)
+    \brief Milliseconds until commit_wal syncs, -1 if nothing waits for it. For the event loop timeout.
+    \param this Log selected.
+*/
+int get_wal_wait(wal this);
+
+/*! \fn void set_wal_keep(wal this, size_t keep)
+    \brief Changes the messages kept, after a resize of the matrix.
+    \param this Log selected.
+    \param keep Matrix capacity.
+*/
+void set_wal_keep(wal this, size_t keep);
+
+/*! \fn void print_wal_stats(wal this)
+    \brief Prints the records logged, the syncs and the segments.
+    \param this Log selected.
+*/
+void print_wal_stats(wal this);
+
+/*! \fn void free_wal(wal this)
+    \brief Syncs the records still waiting, without the window, and closes the log.
+    \param this Log selected, may be NULL.
+*/
+void free_wal(wal this);
@@ -0,0 +1,235 @@
+#include <string.h>
+#include "util_wire.h"
+#include "util_slab.h"
+
+struct _wire_ring {
+    char     *bytes;
+    size_t   size;     //Ring bytes
+    size_t   records;  //Records that can be asked for
+    size_t   max_record;
+    size_t   budget;   //Bytes the records that can be asked for may take, padding included
+    uint64_t *start;   //Absolute start of each of the last records, by record number & mask
+    size_t   mask;     //Start slots minus one, a power of two of at least records
+    uint64_t head;     //Absolute write position, padding included
+    uint64_t count;    //Records appended
+    uint64_t first;    //Number of the oldest record that can be asked for, see seek_wire and drop_wire
+    size_t   wrap_at[2]; //Where the data of each of the last two laps ends, by lap parity
+    bool     own_bytes;  //False if given to create_wire_ring_on
+};
+
+// wrap_of returns where the data of the lap of the absolute position ends
+static inline size_t wrap_of(wire_ring this, uint64_t position) {
+    return this->wrap_at[(position / this->size) & 1];
+}
+
+// start_slots returns the start slots for records, a power of two so a mask finds the slot
+static inline size_t start_slots(size_t records) {
+    size_t slots = 1;
+    while (slots < records) {
+        slots *= 2;
+    }
+    return slots;
+}
+
+// ring_size returns the ring bytes: the budget plus the slack always fit, even with a padded tail
+static inline size_t ring_size(size_t budget, size_t max_record) {
+    return budget + (WIRE_SLACK + 1) * max_record;
+}
+
+wire_ring create_wire_ring_on(size_t records, size_t max_record, size_t budget, char *bytes) {
+    wire_ring new_ring = (wire_ring)calloc(1, sizeof(struct _wire_ring));
+    if (!new_ring) {
+        memory_error("Unable to reserve wire ring memory");
+    }
+
+    new_ring->size = ring_size(budget, max_record);
+    new_ring->records = records;
+    new_ring->max_record = max_record;
+    new_ring->budget = budget;
+    new_ring->mask = start_slots(records) - 1;
+    new_ring->bytes = bytes;
+    new_ring->start = (uint64_t *)create_slab((new_ring->mask + 1) * sizeof(uint64_t));
+    new_ring->wrap_at[0] = new_ring->wrap_at[1] = new_ring->size;
+
+    return new_ring;
+}
+
+wire_ring create_wire_ring(size_t records, size_t max_record, size_t budget) {
+    wire_ring new_ring = create_wire_ring_on(records, max_record, budget, (char *)create_slab(ring_size(budget, max_record)));
+    new_ring->own_bytes = true;
+    return new_ring;
+}
+
+size_t wire_bytes_for(size_t budget, size_t max_record) {
+    return ring_size(budget, max_record);
+}
+
+bool wire_fits(wire_ring this, size_t len) {
+    size_t offset = this->head % this->size;
+    size_t padding = offset + len > this->size ? this->size - offset : 0;
+
+    if (this->count == this->first) { //Empty, any record fits
+        return true;
+    }
+    return this->count - this->first < this->records
+        && this->head + padding + len - this->start[this->first & this->mask] <= this->budget;
+}
+
+void drop_wire(wire_ring this, uint64_t first) {
+    if (first > this->first && first <= this->count) {
+        this->first = first;
+    }
+}
+
+void append_wire(wire_ring this, const char *record, size_t len) {
+    size_t offset = this->head % this->size;
+
+    if (offset + len > this->size) { //Leave the tail as padding
+        this->wrap_at[(this->head / this->size) & 1] = offset;
+        this->head += this->size - offset;
+        offset = 0;
+    }
+
+    memcpy(this->bytes + offset, record, len);
+    this->start[this->count & this->mask] = this->head;
+    this->head += len;
+    this->count++;
+
+    if (0 == this->head % this->size) { //Lap filled to the last byte
+        this->wrap_at[(this->head / this->size - 1) & 1] = this->size;
+    }
+}
+
+void seek_wire(wire_ring this, uint64_t count) {
+    this->count = this->first = count;
+}
+
+void get_wire_mark(wire_ring this, struct wire_mark *mark) {
+    mark->head = this->head;
+    mark->count = this->count;
+    mark->oldest = this->count - this->first > this->records ? this->count - this->records : this->first;
+    mark->oldest_at = mark->oldest < this->count ? this->start[mark->oldest & this->mask] : this->head;
+    mark->wrap_at[0] = this->wrap_at[0];
+    mark->wrap_at[1] = this->wrap_at[1];
+}
+
+uint64_t restore_wire(wire_ring this, const struct wire_mark *mark, size_t (*record_len)(const char *record, size_t room)) {
+    uint64_t position = mark->oldest_at, number = mark->oldest;
+
+    this->wrap_at[0] = mark->wrap_at[0] < this->size ? mark->wrap_at[0] : this->size;
+    this->wrap_at[1] = mark->wrap_at[1] < this->size ? mark->wrap_at[1] : this->size;
+    if (mark->head < position || mark->head - position > this->size || mark->count < number
+            || mark->count - number > this->records) {
+        return 0; //Not a mark of this ring, it stays empty
+    }
+
+    while (number < mark->count && position < mark->head) {
+        size_t offset = position % this->size;
+        //The wrap of a lap is known once the head left it, before it is the one of two laps ago
+        size_t end = position / this->size == mark->head / this->size ? mark->head % this->size : wrap_of(this, position);
+        if (offset >= end) { //Padding at the end of the lap
+            position += this->size - offset;
+            continue;
+        }
+        size_t len = record_len(this->bytes + offset, end - offset);
+        if (0 == len || len > this->max_record) {
+            break;
+        }
+        this->start[number & this->mask] = position;
+        position += len;
+        number++;
+    }
+
+    this->head = position;
+    this->first = mark->oldest;
+    this->count = number;
+    return number;
+}
+
+void truncate_wire(wire_ring this, uint64_t count) {
+    if (count >= this->count || count < this->first || this->count - count > this->records) {
+        return;
+    }
+    //The lap of the new head keeps its wrap, the one before too: only the next wrap overwrites it
+    this->head = this->start[count & this->mask];
+    this->count = count;
+}
+
+// get_slices points slices at the n records between the absolute positions begin and finish
+static int get_slices(wire_ring this, uint64_t begin, uint64_t finish, size_t n, struct iovec slices[2]) {
+    size_t offset = begin % this->size;
+
+    //A reader racing the writer may see a torn window, never point outside of it
+    if (finish <= begin || finish - begin > this->size) {
+        return 0;
+    }
+
+    slices[0].iov_base = this->bytes + offset;
+    if (begin / this->size == (finish - 1) / this->size) { //Same lap
+        slices[0].iov_len = finish - begin;
+        if (0 == finish % this->size) { //Ends where the lap ends, without the padding
+            if (wrap_of(this, begin) < offset) {
+                return 0;
+            }
+            slices[0].iov_len = wrap_of(this, begin) - offset;
+        }
+        return n * this->max_record < slices[0].iov_len ? 0 : 1;
+    }
+
+    if (wrap_of(this, begin) < offset) {
+        return 0;
+    }
+    slices[0].iov_len = wrap_of(this, begin) - offset;
+    slices[1].iov_base = this->bytes;
+    slices[1].iov_len = finish - (finish - 1) / this->size * this->size;
+    return n * this->max_record < slices[0].iov_len + slices[1].iov_len ? 0 : 2;
+}
+
+int get_last_wire(wire_ring this, size_t n, struct iovec slices[2]) {
+    n = n < this->count - this->first ? n : this->count - this->first;
+    n = n < this->records ? n : this->records;
+    if (0 == n) {
+        return 0;
+    }
+    return get_slices(this, this->start[(this->count - n) & this->mask], this->head, n, slices);
+}
+
+int get_wire_range(wire_ring this, uint64_t first, size_t n, struct iovec slices[2]) {
+    if (0 == n || first < this->first || first + n > this->count || this->count - first > this->records) {
+        return 0;
+    }
+    uint64_t finish = first + n == this->count ? this->head : this->start[(first + n) & this->mask];
+    return get_slices(this, this->start[first & this->mask], finish, n, slices);
+}
+
+char *get_wire_record(wire_ring this, uint64_t number) {
+    if (number >= this->count || number < this->first || this->count - number > this->records) {
+        return NULL;
+    }
+    return this->bytes + this->start[number & this->mask] % this->size;
+}
+
+size_t get_wire_memory(wire_ring this) {
+    return wire_memory_for(this->records, this->max_record, this->budget);
+}
+
+size_t wire_memory_for(size_t records, size_t max_record, size_t budget) {
+    return sizeof(struct _wire_ring) + ring_size(budget, max_record) + start_slots(records) * sizeof(uint64_t);
+}
+
+size_t get_wire_used(wire_ring this, size_t n) {
+    n = n < this->count - this->first ? n : this->count - this->first;
+    n = n < this->records ? n : this->records;
+    return n ? this->head - this->start[(this->count - n) & this->mask] : 0;
+}
+
+void free_wire_ring(wire_ring this) {
+    if (!this) {
+        return;
+    }
+    free_slab(this->start, (this->mask + 1) * sizeof(uint64_t));
+    if (this->own_bytes) {
+        free_slab(this->bytes, this->size);
+    }
+    free(this);
+}
@@ -0,0 +1,169 @@
+#pragma once
+/*! \file util_wire.h
+ * \brief Contiguous ring with the reply bytes of the last messages.
+ */
+#include <sys/uio.h>
+#include "utils.h"
+
+#define WIRE_SLACK 64 //Records the writer may add while a reply still points at the ring
+#define WIRE_RECORD_SIZE (STRING_SIZE + 27) //A message record, longer than "lc;content\n" with a 64 bit lc
+
+/*! \var typedef struct _wire_ring *wire_ring
+    \brief Byte ring that keeps one record per message, already in wire format.
+    A record is never split: when it does not fit before the end of the ring
+    the tail is left as padding and the record starts again at offset 0.
+    So the last n records are always at most two contiguous slices.
+    The ring is sized by bytes, not for records of the longest length: the writer drops
+    the oldest records when a new one does not fit the budget, see wire_fits.
+*/
+typedef struct _wire_ring *wire_ring;
+
+/*! \struct wire_mark
+    \brief Where the records of a ring are, enough to find them again in its bytes.
+    Fixed width fields, it is kept in the storage file next to the bytes.
+*/
+struct wire_mark {
+    uint64_t head;      //!< Absolute write position
+    uint64_t count;     //!< Records appended
+    uint64_t oldest;    //!< Number of the oldest record that can be asked for
+    uint64_t oldest_at; //!< Absolute start of that record, head if there is none
+    uint64_t wrap_at[2];
+};
+
+/*! \fn wire_ring create_wire_ring(size_t records, size_t max_record, size_t budget)
+    \brief Initializes the ring, big enough for budget bytes of records plus WIRE_SLACK records of max_record bytes.
+    \param records Number of records that can be asked for.
+    \param max_record Longest record in bytes.
+    \param budget Bytes the records that can be asked for may take, see wire_fits.
+*/
+wire_ring create_wire_ring(size_t records, size_t max_record, size_t budget);
+
+/*! \fn wire_ring create_wire_ring_on(size_t records, size_t max_record, size_t budget, char *bytes)
+    \brief Initializes a ring on bytes given by the caller, wire_bytes_for long, which it does not free.
+    \param records Number of records that can be asked for.
+    \param max_record Longest record in bytes.
+    \param budget Bytes the records that can be asked for may take.
+    \param bytes Ring bytes, as a mapped file.
+*/
+wire_ring create_wire_ring_on(size_t records, size_t max_record, size_t budget, char *bytes);
+
+/*! \fn size_t wire_bytes_for(size_t budget, size_t max_record)
+    \brief Bytes of the ring itself, without its index, for create_wire_ring_on.
+    \param budget Bytes the records that can be asked for may take.
+    \param max_record Longest record in bytes.
+*/
+size_t wire_bytes_for(size_t budget, size_t max_record);
+
+/*! \fn bool wire_fits(wire_ring this, size_t len)
+    \brief True if a record of len bytes can be appended while every record that can be asked for
+    stays one: they are fewer than records, and with it and its padding take at most the budget.
+    Otherwise the writer drops the oldest one first, see drop_wire. Always true for an empty ring.
+    \param this Ring selected.
+    \param len Record length, at most max_record.
+*/
+bool wire_fits(wire_ring this, size_t len);
+
+/*! \fn void drop_wire(wire_ring this, uint64_t first)
+    \brief Makes the records before the record number first no longer asked for, so their bytes
+    can be written again. Writer thread only, inside its write section.
+    \param this Ring selected.
+    \param first Number of the oldest record kept, at most the records appended.
+*/
+void drop_wire(wire_ring this, uint64_t first);
+
+/*! \fn void append_wire(wire_ring this, const char *record, size_t len)
+    \brief Appends one record after the last one. Writer thread only.
+    \param this Ring selected.
+    \param record Record bytes.
+    \param len Record length, at most max_record.
+*/
+void append_wire(wire_ring this, const char *record, size_t len);
+
+/*! \fn int get_last_wire(wire_ring this, size_t n, struct iovec slices[2])
+    \brief Points slices at the last n records, oldest first.
+    Returns the number of slices used, 0 if the ring is empty.
+    The slices stay valid until WIRE_SLACK more records are appended.
+    \param this Ring selected.
+    \param n Number of records, at most the records given to create_wire_ring.
+    \param slices Filled with the bytes to send.
+*/
+int get_last_wire(wire_ring this, size_t n, struct iovec slices[2]);
+
+/*! \fn int get_wire_range(wire_ring this, uint64_t first, size_t n, struct iovec slices[2])
+    \brief Points slices at n records starting at the record number first (0 is the first appended).
+    Returns the number of slices used, 0 if any of them is not in the ring any more.
+    The slices stay valid as for get_last_wire.
+    \param this Ring selected.
+    \param first Number of the first record.
+    \param n Number of records.
+    \param slices Filled with the bytes to send.
+*/
+int get_wire_range(wire_ring this, uint64_t first, size_t n, struct iovec slices[2]);
+
+/*! \fn char *get_wire_record(wire_ring this, uint64_t number)
+    \brief Returns the first byte of the record number (0 is the first appended),
+    NULL if it was not appended or is not in the ring any more. Valid as for get_last_wire.
+    \param this Ring selected.
+    \param number Number of the record.
+*/
+char *get_wire_record(wire_ring this, uint64_t number);
+
+/*! \fn size_t get_wire_memory(wire_ring this)
+    \brief Bytes reserved by the ring, its index included.
+    \param this Ring selected.
+*/
+size_t get_wire_memory(wire_ring this);
+
+/*! \fn size_t wire_memory_for(size_t records, size_t max_record, size_t budget)
+    \brief Bytes get_wire_memory would report for a ring made by create_wire_ring(records, max_record, budget).
+    \param records Number of records that can be asked for.
+    \param max_record Longest record in bytes.
+    \param budget Bytes the records that can be asked for may take.
+*/
+size_t wire_memory_for(size_t records, size_t max_record, size_t budget);
+
+/*! \fn size_t get_wire_used(wire_ring this, size_t n)
+    \brief Bytes the last n records take in the ring, padding included.
+    \param this Ring selected.
+    \param n Number of records.
+*/
+size_t get_wire_used(wire_ring this, size_t n);
+
+/*! \fn void seek_wire(wire_ring this, uint64_t count)
+    \brief Makes an empty ring start at the record number count, as if count records had been
+    appended and dropped. Used to fill a ring with the records of another from the middle on.
+    \param this Ring selected, nothing appended yet.
+    \param count Number of the next record appended.
+*/
+void seek_wire(wire_ring this, uint64_t count);
+
+/*! \fn void get_wire_mark(wire_ring this, struct wire_mark *mark)
+    \brief Fills mark with where the records that can be asked for are.
+    \param this Ring selected.
+    \param mark Filled.
+*/
+void get_wire_mark(wire_ring this, struct wire_mark *mark);
+
+/*! \fn uint64_t restore_wire(wire_ring this, const struct wire_mark *mark, size_t (*record_len)(const char *record, size_t room))
+    \brief Finds the records of mark again in the bytes of an empty ring, from the oldest on,
+    and makes them the ring. Stops at the first record record_len returns 0 for, as one torn
+    by a crash. Returns the number of the record after the last one found.
+    \param this Ring selected, made by create_wire_ring_on on the bytes mark was taken from.
+    \param mark Saved by get_wire_mark.
+    \param record_len Length of a valid record, 0 if it is not one. room is the most it can take.
+*/
+uint64_t restore_wire(wire_ring this, const struct wire_mark *mark, size_t (*record_len)(const char *record, size_t room));
+
+/*! \fn void truncate_wire(wire_ring this, uint64_t count)
+    \brief Drops the records from the record number count on, so they can be appended again
+    in another order. Writer thread only, count must be one of the records that can be asked for.
+    \param this Ring selected.
+    \param count Records kept.
+*/
+void truncate_wire(wire_ring this, uint64_t count);
+
+/*! \fn void free_wire_ring(wire_ring this)
+    \brief Frees the ring.
+    \param this Ring selected.
+*/
+void free_wire_ring(wire_ring this);